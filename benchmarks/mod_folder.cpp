@@ -0,0 +1,562 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+/// Measures ModFolder::transform and ModFolder::iterate on synthetic mod folders, for several thread counts.
+/// Results are printed as JSON, so that runs can be compared to spot scaling regressions. The encoding rates
+/// of each encoder profile are measured as well.
+///
+/// Usage: benchmarks [--textures N] [--texture-size PIXELS] [--meshes N] [--mesh-vertices N]
+///                   [--archives N] [--archive-entries N] [--threads 1,2,4] [--repeat N]
+///                   [--texture-memory-cap BYTES] [--work-dir DIR] [--output FILE]
+
+#include <btu/bsa/archive.hpp>
+#include <btu/common/filesystem.hpp>
+#include <btu/common/json.hpp>
+#include <btu/modmanager/estimate.hpp>
+#include <btu/modmanager/mod_folder.hpp>
+#include <btu/nif/mesh.hpp>
+#include <btu/nif/optimize.hpp>
+#include <btu/tex/compression_device.hpp>
+#include <btu/tex/dxtex.hpp>
+#include <btu/tex/header.hpp>
+#include <btu/tex/optimize.hpp>
+#include <btu/tex/texture.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string_view>
+
+#ifdef _WIN32
+#include <windows.h>
+
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace fs = btu::fs;
+using btu::Path;
+
+struct Config
+{
+    size_t textures             = 64;
+    size_t texture_size         = 1024;
+    size_t meshes               = 64;
+    size_t mesh_vertices        = 4096;
+    size_t archives             = 2;
+    size_t archive_entries      = 64;
+    std::vector<size_t> threads = {1, 2, 4, 8};
+    size_t repeat               = 3;
+    Path work_dir               = fs::temp_directory_path() / "btu_benchmarks";
+    Path output;
+    /// See CompressionDevice::set_memory_cap. 0 decodes every texture at once
+    size_t texture_memory_cap = 64ULL * 1024 * 1024;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Config,
+                                   textures,
+                                   texture_size,
+                                   meshes,
+                                   mesh_vertices,
+                                   archives,
+                                   archive_entries,
+                                   threads,
+                                   repeat,
+                                   texture_memory_cap)
+
+struct Latencies
+{
+    double p50_ms = 0;
+    double p90_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Latencies, p50_ms, p90_ms, p99_ms, max_ms)
+
+struct Run
+{
+    std::string operation;
+    size_t threads = 0;
+    btu::modmanager::TransformThreads transform_threads{};
+    double seconds              = 0;
+    size_t files                = 0;
+    uintmax_t bytes             = 0;
+    double files_per_second     = 0;
+    double megabytes_per_second = 0;
+    /// Time spent on each file by the transformer or iterator
+    Latencies latencies;
+    /// Peak resident memory of the process so far. It never decreases, runs are ordered by thread count
+    uintmax_t peak_rss_bytes = 0;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Run,
+                                   operation,
+                                   threads,
+                                   transform_threads,
+                                   seconds,
+                                   files,
+                                   bytes,
+                                   files_per_second,
+                                   megabytes_per_second,
+                                   latencies,
+                                   peak_rss_bytes)
+
+[[nodiscard]] auto peak_rss() noexcept -> uintmax_t
+{
+#ifdef _WIN32
+    auto counters = PROCESS_MEMORY_COUNTERS{};
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) == 0)
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    auto usage = rusage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    // Kilobytes on Linux
+    return static_cast<uintmax_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+
+/// Records the time spent on each file. Thread-safe
+class LatencyRecorder
+{
+public:
+    void add(std::chrono::steady_clock::duration duration)
+    {
+        auto lock = std::lock_guard{mutex_};
+        samples_.push_back(std::chrono::duration<double, std::milli>(duration).count());
+    }
+
+    [[nodiscard]] auto compute() -> Latencies
+    {
+        auto lock = std::lock_guard{mutex_};
+        if (samples_.empty())
+            return {};
+
+        std::ranges::sort(samples_);
+        const auto at = [this](double percentile) {
+            const auto idx = static_cast<size_t>(percentile * static_cast<double>(samples_.size() - 1));
+            return samples_[idx];
+        };
+        return Latencies{.p50_ms = at(0.5), .p90_ms = at(0.9), .p99_ms = at(0.99), .max_ms = samples_.back()};
+    }
+
+private:
+    std::mutex mutex_;
+    std::vector<double> samples_;
+};
+
+/// Optimizes textures and meshes as a mod manager would, with the settings of Skyrim SE
+class OptimizingTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    OptimizingTransformer(LatencyRecorder &latencies, size_t memory_cap)
+        : latencies_(latencies)
+    {
+        device().set_memory_cap(memory_cap);
+    }
+
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile file) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        const auto start = std::chrono::steady_clock::now();
+        auto res         = transform(file);
+        latencies_.get().add(std::chrono::steady_clock::now() - start);
+        return res;
+    }
+
+    /// Encoders split textures in tiles, which must run on the texture threads of the mod folder
+    void set_executor(btu::common::Executor executor, size_t threads) noexcept override
+    {
+        device().set_executor(std::move(executor), threads);
+    }
+
+private:
+    [[nodiscard]] static auto device() -> btu::tex::CompressionDevice &
+    {
+        static auto dev = btu::tex::CompressionDevice{};
+        return dev;
+    }
+
+    [[nodiscard]] auto transform(btu::modmanager::ModFile &file) const noexcept
+        -> std::optional<std::vector<std::byte>>
+    {
+        auto &dev = device();
+
+        auto &content = *file.content;
+        if (!content)
+            return std::nullopt;
+
+        const auto ext = file.relative_path.extension();
+        if (ext == ".dds")
+        {
+            const auto &sets = btu::tex::Settings::get(btu::Game::SSE);
+            auto probed      = btu::tex::probe(file.relative_path, *content, sets);
+            if (!probed || probed->unchanged())
+                return std::nullopt;
+
+            // Streamed within the memory cap when supported
+            return btu::tex::optimize_probed(file.relative_path,
+                                             *content,
+                                             std::move(*probed),
+                                             dev,
+                                             stop_token())
+                .and_then([](btu::tex::Texture &&tex) { return btu::tex::save(tex); })
+                .map([](std::vector<std::byte> &&bytes) { return std::optional(std::move(bytes)); })
+                .value_or(std::nullopt);
+        }
+        if (ext == ".nif")
+        {
+            const auto &sets = btu::nif::Settings::get(btu::Game::SSE);
+            return btu::nif::load(file.relative_path, *content)
+                .and_then([&](btu::nif::Mesh &&mesh) {
+                    const auto steps = btu::nif::compute_optimization_steps(mesh, sets);
+                    return btu::nif::optimize(std::move(mesh), steps);
+                })
+                .and_then([](btu::nif::Mesh &&mesh) { return btu::nif::save(std::move(mesh)); })
+                .map([](std::vector<std::byte> &&bytes) { return std::optional(std::move(bytes)); })
+                .value_or(std::nullopt);
+        }
+        return std::nullopt;
+    }
+
+    std::reference_wrapper<LatencyRecorder> latencies_;
+};
+
+/// Reads every file, without changing anything
+class ReadingIterator final : public btu::modmanager::ModFolderIterator
+{
+public:
+    explicit ReadingIterator(LatencyRecorder &latencies)
+        : latencies_(latencies)
+    {
+    }
+
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    void process_file(btu::modmanager::ModFile file) noexcept override
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::ignore      = *file.content;
+        latencies_.get().add(std::chrono::steady_clock::now() - start);
+    }
+
+private:
+    std::reference_wrapper<LatencyRecorder> latencies_;
+};
+
+/// Uncompressed, without mipmaps: optimizing it generates mipmaps and encodes it to BC7
+[[nodiscard]] auto make_texture(size_t size, uint32_t seed) -> std::vector<std::byte>
+{
+    auto image = btu::tex::ScratchImage{};
+    if (FAILED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, size, size, 1, 1)))
+        throw std::runtime_error("failed to create a texture");
+
+    // Noise over a gradient. Encoders are much faster on flat colors, which would not be representative
+    auto state   = seed;
+    auto *pixels = image.GetPixels();
+    for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+    {
+        state = state * 1664525U + 1013904223U;
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        pixels[i] = static_cast<uint8_t>(i / 4 % size + (state >> 28U));
+    }
+
+    auto tex = btu::tex::Texture{};
+    tex.set(std::move(image));
+    auto bytes = btu::tex::save(tex);
+    if (!bytes)
+        throw std::runtime_error("failed to save a texture");
+    return std::move(*bytes);
+}
+
+/// A single shape shaped as a grid of about `vertices` vertices
+[[nodiscard]] auto make_mesh(size_t vertices) -> std::vector<std::byte>
+{
+    const auto side = std::max<size_t>(static_cast<size_t>(std::sqrt(static_cast<double>(vertices))), 2);
+
+    auto verts = std::vector<nifly::Vector3>{};
+    auto uvs   = std::vector<nifly::Vector2>{};
+    auto tris  = std::vector<nifly::Triangle>{};
+    for (size_t y = 0; y < side; ++y)
+    {
+        for (size_t x = 0; x < side; ++x)
+        {
+            const auto fx = static_cast<float>(x);
+            const auto fy = static_cast<float>(y);
+            verts.emplace_back(fx, fy, std::sin(fx) * std::cos(fy));
+            uvs.emplace_back(fx / static_cast<float>(side), fy / static_cast<float>(side));
+
+            if (x + 1 < side && y + 1 < side)
+            {
+                const auto idx = static_cast<uint16_t>(y * side + x);
+                const auto w   = static_cast<uint16_t>(side);
+                tris.emplace_back(idx, static_cast<uint16_t>(idx + 1), static_cast<uint16_t>(idx + w));
+                tris.emplace_back(static_cast<uint16_t>(idx + 1),
+                                  static_cast<uint16_t>(idx + w + 1),
+                                  static_cast<uint16_t>(idx + w));
+            }
+        }
+    }
+
+    auto mesh = btu::nif::Mesh{};
+    mesh.get().Create(nifly::NiVersion::getSSE());
+    mesh.get().CreateShapeFromData(&verts, &tris, &uvs);
+
+    auto bytes = btu::nif::save(std::move(mesh));
+    if (!bytes)
+        throw std::runtime_error("failed to save a mesh");
+    return std::move(*bytes);
+}
+
+/// Creates the mod folder every run starts from
+void synthesize_mod(const Config &config, const Path &dir)
+{
+    fs::remove_all(dir);
+    fs::create_directories(dir / "textures" / "bench");
+    fs::create_directories(dir / "meshes" / "bench");
+
+    // Generating textures is slow. Only a few distinct ones, the encoders cannot tell
+    constexpr uint32_t k_distinct_textures = 4;
+    auto textures                          = std::vector<std::vector<std::byte>>{};
+    for (uint32_t i = 0; i < k_distinct_textures; ++i)
+        textures.push_back(make_texture(config.texture_size, i + 1));
+    const auto mesh = make_mesh(config.mesh_vertices);
+
+    const auto write = [](const Path &path, std::span<const std::byte> content) {
+        if (!btu::common::write_file(path, content))
+            throw std::runtime_error("failed to write " + path.string());
+    };
+
+    for (size_t i = 0; i < config.textures; ++i)
+        write(dir / "textures" / "bench" / (std::to_string(i) + ".dds"), textures[i % textures.size()]);
+    for (size_t i = 0; i < config.meshes; ++i)
+        write(dir / "meshes" / "bench" / (std::to_string(i) + ".nif"), mesh);
+
+    // Half textures, half meshes
+    for (size_t a = 0; a < config.archives; ++a)
+    {
+        auto arch = btu::bsa::Archive{btu::bsa::ArchiveVersion::sse, btu::bsa::ArchiveType::Standard};
+        for (size_t i = 0; i < config.archive_entries; ++i)
+        {
+            const bool is_texture = i % 2 == 0;
+            const auto name       = is_texture ? "textures/archived/" + std::to_string(i) + ".dds"
+                                               : "meshes/archived/" + std::to_string(i) + ".nif";
+            // Copied by the archive
+            auto content = is_texture ? textures[i % textures.size()] : mesh;
+            if (!arch.get(name).read(content))
+                throw std::runtime_error("failed to add " + name + " to an archive");
+        }
+        const auto path = dir / ("bench" + std::to_string(a) + ".bsa");
+        if (!std::move(arch).write(path))
+            throw std::runtime_error("failed to write " + path.string());
+    }
+}
+
+/// Splits exactly `threads` between the categories. The synthesized mod only has textures and meshes: the
+/// other categories get no threads, and borrow them if needed, see common::WorkerPools
+[[nodiscard]] auto thread_split(size_t threads) -> btu::modmanager::TransformThreads
+{
+    // Same ratio as PipelineSettings::get. A single thread is shared by textures and meshes
+    const auto meshes = threads > 1 ? std::max<size_t>(threads / 4, 1) : 0;
+    return btu::modmanager::TransformThreads{
+        .textures   = threads - meshes,
+        .meshes     = meshes,
+        .animations = 0,
+        .other      = 0,
+    };
+}
+
+[[nodiscard]] auto folder_size(const Path &dir) -> std::pair<size_t, uintmax_t>
+{
+    auto files = size_t{0};
+    auto bytes = uintmax_t{0};
+    for (const auto &entry : fs::recursive_directory_iterator(dir))
+    {
+        if (!entry.is_regular_file())
+            continue;
+        ++files;
+        bytes += entry.file_size();
+    }
+    return {files, bytes};
+}
+
+template<class F>
+[[nodiscard]] auto measure(std::string operation,
+                           size_t threads,
+                           const Path &template_dir,
+                           const Path &run_dir,
+                           F &&run) -> Run
+{
+    fs::remove_all(run_dir);
+    fs::copy(template_dir, run_dir, fs::copy_options::recursive);
+
+    auto pipeline              = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.transform_threads = thread_split(threads);
+
+    // ModFolder would give at least one thread to each category
+    auto pools = std::make_shared<btu::common::WorkerPools>(pipeline.transform_threads.per_category());
+
+    const auto sets  = btu::bsa::Settings::get(btu::Game::SSE);
+    const auto bytes = folder_size(run_dir).second;
+    auto mod         = btu::modmanager::ModFolder(run_dir, sets, std::move(pools), false, pipeline);
+    const auto files = mod.size();
+
+    auto latencies   = LatencyRecorder{};
+    const auto start = std::chrono::steady_clock::now();
+    std::forward<F>(run)(mod, latencies);
+    const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    constexpr double k_megabyte = 1024.0 * 1024.0;
+    return Run{
+        .operation            = std::move(operation),
+        .threads              = threads,
+        .transform_threads    = pipeline.transform_threads,
+        .seconds              = seconds,
+        .files                = files,
+        .bytes                = bytes,
+        .files_per_second     = static_cast<double>(files) / seconds,
+        .megabytes_per_second = static_cast<double>(bytes) / k_megabyte / seconds,
+        .latencies            = latencies.compute(),
+        .peak_rss_bytes       = peak_rss(),
+    };
+}
+
+[[nodiscard]] auto parse_number(std::string_view arg) -> size_t
+{
+    auto value           = size_t{0};
+    const auto *end      = arg.data() + arg.size();
+    const auto [ptr, ec] = std::from_chars(arg.data(), end, value);
+    if (ec != std::errc{} || ptr != end)
+        throw std::invalid_argument("invalid number: " + std::string(arg));
+    return value;
+}
+
+[[nodiscard]] auto parse_args(std::span<char *> args) -> Config
+{
+    auto config = Config{};
+    for (size_t i = 1; i < args.size(); ++i)
+    {
+        const auto arg = std::string_view(args[i]);
+        if (i + 1 >= args.size())
+            throw std::invalid_argument("missing value for " + std::string(arg));
+        const auto value = std::string_view(args[++i]);
+
+        if (arg == "--textures")
+            config.textures = parse_number(value);
+        else if (arg == "--texture-size")
+            config.texture_size = parse_number(value);
+        else if (arg == "--meshes")
+            config.meshes = parse_number(value);
+        else if (arg == "--mesh-vertices")
+            config.mesh_vertices = parse_number(value);
+        else if (arg == "--archives")
+            config.archives = parse_number(value);
+        else if (arg == "--archive-entries")
+            config.archive_entries = parse_number(value);
+        else if (arg == "--repeat")
+            config.repeat = parse_number(value);
+        else if (arg == "--texture-memory-cap")
+            config.texture_memory_cap = parse_number(value);
+        else if (arg == "--work-dir")
+            config.work_dir = Path(value);
+        else if (arg == "--output")
+            config.output = Path(value);
+        else if (arg == "--threads")
+        {
+            config.threads.clear();
+            for (size_t pos = 0; pos <= value.size();)
+            {
+                const auto comma = std::min(value.find(',', pos), value.size());
+                config.threads.push_back(std::max<size_t>(parse_number(value.substr(pos, comma - pos)), 1));
+                pos = comma + 1;
+            }
+        }
+        else
+            throw std::invalid_argument("unknown argument: " + std::string(arg));
+    }
+    return config;
+}
+
+auto main(int argc, char *argv[]) -> int
+try
+{
+    const auto config = parse_args(std::span(argv, static_cast<size_t>(argc)));
+
+    const auto template_dir = config.work_dir / "template";
+    const auto run_dir      = config.work_dir / "run";
+    synthesize_mod(config, template_dir);
+
+    auto runs = std::vector<Run>{};
+    for (const auto threads : config.threads)
+    {
+        for (size_t i = 0; i < config.repeat; ++i)
+        {
+            runs.push_back(measure("iterate",
+                                   threads,
+                                   template_dir,
+                                   run_dir,
+                                   [](btu::modmanager::ModFolder &mod, LatencyRecorder &latencies) {
+                                       auto iterator = ReadingIterator(latencies);
+                                       mod.iterate(iterator);
+                                   }));
+            runs.push_back(measure("transform",
+                                   threads,
+                                   template_dir,
+                                   run_dir,
+                                   [&](btu::modmanager::ModFolder &mod, LatencyRecorder &latencies) {
+                                       auto transformer = OptimizingTransformer(latencies,
+                                                                                config.texture_memory_cap);
+                                       mod.transform(transformer);
+                                   }));
+            std::cerr << "threads: " << threads << ", run " << i + 1 << '/' << config.repeat << '\n';
+        }
+    }
+
+    auto dev      = btu::tex::CompressionDevice{};
+    auto profiles = nlohmann::json::object();
+    for (const auto profile : {btu::tex::EncoderProfile::Fast,
+                               btu::tex::EncoderProfile::Balanced,
+                               btu::tex::EncoderProfile::MaxQuality,
+                               btu::tex::EncoderProfile::SizeOptimized})
+    {
+        const auto encoder = btu::tex::EncoderOptions{.profile = profile};
+        const auto name    = nlohmann::json(profile).get<std::string>();
+        profiles[name]     = btu::modmanager::EncodeRates::measure(dev, config.work_dir, encoder);
+        std::cerr << "profile: " << name << '\n';
+    }
+    fs::remove_all(config.work_dir);
+
+    const auto result = nlohmann::json{{"config", config}, {"runs", runs}, {"profiles", profiles}}.dump(2);
+    if (config.output.empty())
+        std::cout << result << '\n';
+    else
+        std::ofstream(config.output) << result << '\n';
+    return 0;
+}
+catch (const std::exception &e)
+{
+    std::cerr << "error: " << e.what() << '\n';
+    return 1;
+}
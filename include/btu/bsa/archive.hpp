@@ -6,7 +6,11 @@
 #include <bsa/bsa.hpp>
 #include <nlohmann/json.hpp>
 
+#include <functional>
+#include <span>
+#include <stop_token>
 #include <variant>
+#include <vector>
 
 namespace btu::bsa {
 enum class Compression : std::uint8_t
@@ -122,8 +126,11 @@ public:
 
     ~Archive() = default;
 
-    static auto read(Path path) -> std::optional<Archive>;
-    [[nodiscard]] auto write(Path path) && -> bool;
+    /// \param stop Checked between entries. When a stop is requested, std::nullopt is returned
+    static auto read(Path path, std::stop_token stop = {}) -> std::optional<Archive>;
+    /// \param stop Checked between entries, until the archive starts being written to disk. When a stop is
+    /// requested, nothing is written and false is returned
+    [[nodiscard]] auto write(Path path, std::stop_token stop = {}) && -> bool;
 
     [[nodiscard]] auto emplace(std::string name, File file) -> bool;
     [[nodiscard]] auto get(const std::string &name) -> File &;
@@ -149,4 +156,84 @@ private:
     ArchiveType type_;
 };
 
+/// Reads the number of files of an archive from its header, without loading the archive.
+/// \return std::nullopt if the file cannot be read or is not a known archive format.
+[[nodiscard]] auto read_file_count(const Path &path) noexcept -> std::optional<size_t>;
+
+/// How the content of an archived file is stored
+enum class EntryEncoding : std::uint8_t
+{
+    Raw,
+    /// FO4 general archives
+    Zlib,
+    /// Starfield archives using LZ4
+    Lz4Block,
+    /// TES4 to TES5 archives: the decompressed size, then zlib
+    SizedZlib,
+    /// SSE archives: the decompressed size, then an LZ4 frame
+    SizedLz4Frame,
+};
+
+/// Header of a texture of a FO4 texture archive. These archives store it in the record of the file, instead
+/// of its content
+struct TextureRecord
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t mip_count;
+    /// DXGI_FORMAT
+    uint32_t format;
+    bool cubemap;
+};
+
+/// A file of an archive, as listed by read_file_list
+struct FileEntry
+{
+    /// Path relative to the root of the archive, in its original case
+    std::string name;
+    /// Size of the file inside the archive, compressed if the file is compressed
+    uintmax_t size;
+    /// Position of the content in the archive. Textures of FO4 texture archives are split in chunks, this is
+    /// the first one
+    uint64_t offset        = 0;
+    EntryEncoding encoding = EntryEncoding::Raw;
+    /// Some TES4 archives store the path of the file before its content
+    bool embedded_name = false;
+    /// Only for textures of FO4 texture archives
+    std::optional<TextureRecord> texture;
+};
+
+/// Lists the files of an archive from its header and file tables, without loading the archive.
+/// Much cheaper than Archive::read, as only the start of the archive is read.
+/// \return std::nullopt if the file cannot be read or is not a known archive format.
+[[nodiscard]] auto read_file_list(const Path &path) noexcept -> std::optional<std::vector<FileEntry>>;
+
+/// Reads the first `count` bytes of an archived file listed by read_file_list, decompressing no more than
+/// needed: enough to read the header of a file without extracting it. Textures of FO4 texture archives are
+/// not supported, their header is in FileEntry::texture.
+/// \return Fewer bytes if the file is smaller. std::nullopt if it cannot be read
+[[nodiscard]] auto read_file_start(const Path &archive_path, const FileEntry &entry, size_t count) noexcept
+    -> std::optional<std::vector<std::byte>>;
+
+/// New content of an entry, for rewrite_archive
+struct ReplacedEntry
+{
+    /// Name of the entry in the archive, as in Archive or FileEntry. Compared without case
+    std::string name;
+    /// Called once, when the entry is written. std::nullopt fails the rewrite
+    std::function<std::optional<std::vector<std::byte>>()> content;
+};
+
+/// Copies the archive at `source` to `dest` entry by entry, with the content of the `replaced` entries
+/// changed. The other entries are copied as they are stored, without being decompressed, and replaced entries
+/// are compressed like the entries they replace: only one entry is in memory at a time. The tables are
+/// copied too, so the version of the archive and its list of files do not change.
+/// Texture archives of FO4 and Starfield are not supported, their entries are split in chunks.
+/// \return false if the archive is not supported, a replaced entry is not in it, or a stop is requested.
+/// `dest` may then be incomplete
+[[nodiscard]] auto rewrite_archive(const Path &source,
+                                   const Path &dest,
+                                   std::span<const ReplacedEntry> replaced,
+                                   std::stop_token stop = {}) noexcept -> bool;
+
 } // namespace btu::bsa
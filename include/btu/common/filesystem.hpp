@@ -9,6 +9,7 @@
 #include <btu/common/path.hpp>
 #include <tl/expected.hpp>
 
+#include <cstdint>
 #include <span>
 #include <vector>
 
@@ -21,12 +22,32 @@ namespace btu::common {
 [[nodiscard]] auto write_file_new(const Path &a_path,
                                   std::span<const std::byte> data) noexcept -> tl::expected<void, Error>;
 
+/// Writes to a temporary file next to `a_path`, then renames it over `a_path`. The file is either fully
+/// replaced or left untouched, and other hard links to the old file keep the old content. The permissions of
+/// the old file are kept.
+[[nodiscard]] auto replace_file(const Path &a_path,
+                                std::span<const std::byte> data) noexcept -> tl::expected<void, Error>;
+
 [[nodiscard]] auto compare_files(const Path &filename1, const Path &filename2) noexcept -> bool;
 
 [[nodiscard]] auto compare_directories(const Path &dir1, const Path &dir2) noexcept -> bool;
 
 [[nodiscard]] auto hard_link(const Path &from, const Path &to) noexcept -> tl::expected<void, Error>;
 
+/// How clone_file duplicated a file, from the cheapest to the most expensive
+enum class CloneMethod : std::uint8_t
+{
+    /// The copy shares the data blocks of the source until either is modified. Linux only, on filesystems
+    /// supporting it, such as Btrfs or XFS
+    Reflink,
+    /// The copy is the same file as the source. It must be replaced, not modified in place, see replace_file
+    HardLink,
+    Copy,
+};
+
+/// Duplicates a regular file as cheaply as the filesystem allows, see CloneMethod. `to` must not exist
+[[nodiscard]] auto clone_file(const Path &from, const Path &to) noexcept -> tl::expected<CloneMethod, Error>;
+
 [[nodiscard]] auto find_matching_paths_icase(const btu::Path &directory,
                                              std::span<const btu::Path> relative_lowercase_paths) noexcept
     -> std::vector<btu::Path>;
@@ -4,7 +4,19 @@
 #include <btu/common/functional.hpp>
 #include <btu/common/metaprogramming.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <span>
+#include <thread>
+#include <tuple>
+#include <vector>
 
 namespace btu::common {
 using ThreadPool = BS::thread_pool;
@@ -129,6 +141,389 @@ public:
     return ThreadPool{num_threads};
 }
 
+/**
+ * \brief A blocking multi-producer multi-consumer queue with a fixed capacity.
+ *
+ * `push` blocks while the queue is full and `pop` blocks while it is empty. This is used to connect the
+ * stages of a pipeline, so that a fast producer cannot get arbitrarily far ahead of a slow consumer.
+ *
+ * Once `close` has been called, `push` fails and `pop` returns the remaining elements, then std::nullopt.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(std::max<size_t>(capacity, 1))
+    {
+    }
+
+    /// \return false if the queue has been closed. The value is dropped in that case.
+    auto push(T value) -> bool
+    {
+        auto lock = std::unique_lock{mutex_};
+        not_full_.wait(lock, [this] { return closed_ || queue_.size() < capacity_; });
+        if (closed_)
+            return false;
+
+        queue_.push_back(std::move(value));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /// \return std::nullopt if the queue has been closed and is empty.
+    [[nodiscard]] auto pop() -> std::optional<T>
+    {
+        auto lock = std::unique_lock{mutex_};
+        not_empty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+        if (queue_.empty())
+            return std::nullopt;
+
+        auto value = std::optional<T>(std::move(queue_.front()));
+        queue_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return value;
+    }
+
+    void close()
+    {
+        {
+            auto lock = std::lock_guard{mutex_};
+            closed_   = true;
+        }
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    std::deque<T> queue_;
+    size_t capacity_;
+    bool closed_ = false;
+};
+
+/**
+ * \brief A shared amount of memory, in bytes, that tasks reserve before starting.
+ *
+ * `acquire` blocks until the requested amount fits in the budget. A request larger than the whole budget is
+ * granted once nothing else is reserved, so that it cannot wait forever.
+ */
+class MemoryBudget
+{
+public:
+    explicit MemoryBudget(uintmax_t budget) noexcept
+        : budget_(budget)
+    {
+    }
+
+    void acquire(uintmax_t bytes)
+    {
+        auto lock = std::unique_lock{mutex_};
+        released_.wait(lock, [this, bytes] { return used_ == 0 || used_ + bytes <= budget_; });
+        used_ += bytes;
+    }
+
+    void release(uintmax_t bytes)
+    {
+        {
+            auto lock = std::lock_guard{mutex_};
+            used_ -= std::min(bytes, used_);
+        }
+        released_.notify_all();
+    }
+
+    [[nodiscard]] auto used() const -> uintmax_t
+    {
+        auto lock = std::lock_guard{mutex_};
+        return used_;
+    }
+
+    [[nodiscard]] auto budget() const noexcept -> uintmax_t { return budget_; }
+
+private:
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+    uintmax_t budget_;
+    uintmax_t used_ = 0;
+};
+
+/// Activity of a category of WorkerPools, see WorkerPools::utilization
+struct PoolUtilization
+{
+    /// Threads reserved for the category
+    size_t threads = 0;
+    /// Tasks running, on reserved or borrowed threads
+    size_t running = 0;
+    /// Tasks running on threads borrowed from other categories
+    size_t borrowed = 0;
+    /// Tasks waiting for a thread
+    size_t queued       = 0;
+    uintmax_t completed = 0;
+    /// Time spent running tasks, summed over all threads
+    std::chrono::nanoseconds busy{};
+    /// Time since the pools were created
+    std::chrono::nanoseconds elapsed{};
+
+    /// Average fraction of the reserved threads that were busy. Above 1 if threads were borrowed
+    [[nodiscard]] auto ratio() const noexcept -> double
+    {
+        if (threads == 0 || elapsed.count() == 0)
+            return 0;
+        return static_cast<double>(busy.count()) / static_cast<double>(elapsed.count())
+               / static_cast<double>(threads);
+    }
+};
+
+/**
+ * \brief Threads shared by several categories of tasks, each with its own number of reserved threads.
+ *
+ * A category runs as many tasks as it has threads, so that a burst of slow tasks of one category cannot
+ * starve the others. Threads of a category with nothing queued are lent: a task may start on a borrowed thread
+ * as long as every category below its own thread count has nothing queued. A thread is always kept free for
+ * each category running nothing, so that its next task starts at once however many tasks the others borrowed.
+ * A category without threads only runs on borrowed ones, one task at a time when none can be spared.
+ * A borrowed thread is given back when its task ends, tasks are never preempted.
+ *
+ * Queued tasks are still run when the pools are destroyed.
+ */
+class WorkerPools
+{
+public:
+    explicit WorkerPools(std::span<const size_t> threads_per_category)
+        : start_(std::chrono::steady_clock::now())
+    {
+        size_t total = 0;
+        for (const auto threads : threads_per_category)
+        {
+            categories_.push_back(Category{.threads = threads});
+            total += threads;
+        }
+
+        thread_count_ = std::max<size_t>(total, 1);
+        for (size_t i = 0; i < thread_count_; ++i)
+            workers_.emplace_back([this] { work(); });
+    }
+
+    WorkerPools(const WorkerPools &)                     = delete;
+    auto operator=(const WorkerPools &) -> WorkerPools & = delete;
+
+    ~WorkerPools()
+    {
+        {
+            auto lock = std::lock_guard{mutex_};
+            stopping_ = true;
+        }
+        available_.notify_all();
+        workers_.clear(); // joined here, while the members they use are alive
+    }
+
+    template<typename F>
+    [[nodiscard]] auto submit_task(size_t category, F &&task)
+        -> std::future<std::invoke_result_t<std::decay_t<F>>>
+    {
+        using Result = std::invoke_result_t<std::decay_t<F>>;
+
+        // std::function must be copyable, but packaged_task is move-only
+        auto packaged = std::make_shared<std::packaged_task<Result()>>(std::forward<F>(task));
+        auto fut      = packaged->get_future();
+        {
+            auto lock = std::lock_guard{mutex_};
+            categories_.at(category).queue.emplace_back([packaged] { (*packaged)(); });
+        }
+        available_.notify_one();
+        return fut;
+    }
+
+    [[nodiscard]] auto categories() const noexcept -> size_t { return categories_.size(); }
+
+    /// Total number of threads
+    [[nodiscard]] auto thread_count() const noexcept -> size_t { return thread_count_; }
+
+    [[nodiscard]] auto utilization(size_t category) const -> PoolUtilization
+    {
+        auto lock       = std::lock_guard{mutex_};
+        const auto &cat = categories_.at(category);
+        return PoolUtilization{
+            .threads   = cat.threads,
+            .running   = cat.running,
+            .borrowed  = cat.running > cat.threads ? cat.running - cat.threads : 0,
+            .queued    = cat.queue.size(),
+            .completed = cat.completed,
+            .busy      = cat.busy,
+            .elapsed   = std::chrono::steady_clock::now() - start_,
+        };
+    }
+
+private:
+    struct Category
+    {
+        size_t threads = 0;
+        size_t running = 0;
+        std::deque<std::function<void()>> queue;
+        uintmax_t completed = 0;
+        std::chrono::nanoseconds busy{};
+    };
+
+    /// \return The category of the next task to run. Called with the mutex held
+    [[nodiscard]] auto pick() noexcept -> std::optional<size_t>
+    {
+        const auto count = categories_.size();
+
+        // Rotate the first category looked at, so that borrowing is not always done by the same one
+        const auto first = next_++;
+        for (size_t i = 0; i < count; ++i)
+        {
+            const auto &cat = categories_[(first + i) % count];
+            if (!cat.queue.empty() && cat.running < cat.threads)
+                return (first + i) % count;
+        }
+
+        // Every category with free threads has nothing queued: lend them, but keep one per idle category
+        size_t running = 0;
+        size_t idle    = 0;
+        for (const auto &cat : categories_)
+        {
+            running += cat.running;
+            idle += cat.threads > 0 && cat.running == 0 ? 1 : 0;
+        }
+        const bool spare = thread_count_ - running > idle;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            // Categories with threads of their own were served above. Those without must not wait forever
+            const auto &cat = categories_[(first + i) % count];
+            if (!cat.queue.empty() && (spare || cat.running == 0))
+                return (first + i) % count;
+        }
+
+        return std::nullopt;
+    }
+
+    void work()
+    {
+        auto lock = std::unique_lock{mutex_};
+        while (true)
+        {
+            auto next = std::optional<size_t>{};
+            available_.wait(lock, [&] {
+                next = pick();
+                return next || stopping_;
+            });
+            if (!next)
+                return;
+
+            auto &cat = categories_[*next];
+            auto task = std::move(cat.queue.front());
+            cat.queue.pop_front();
+            ++cat.running;
+            lock.unlock();
+
+            const auto begin = std::chrono::steady_clock::now();
+            task();
+            const auto end = std::chrono::steady_clock::now();
+
+            lock.lock();
+            --cat.running;
+            ++cat.completed;
+            cat.busy += end - begin;
+        }
+    }
+
+    mutable std::mutex mutex_;
+    std::condition_variable available_;
+    std::vector<Category> categories_;
+    size_t next_         = 0;
+    size_t thread_count_ = 0;
+    bool stopping_       = false;
+    std::chrono::steady_clock::time_point start_;
+    /// Declared last, so that the threads are joined before the other members are destroyed
+    std::vector<std::jthread> workers_;
+};
+
+/// Runs tasks in the background. Lets code that splits its own work, such as texture encoders, borrow the
+/// threads of the pool the application already has instead of starting new ones
+using Executor = std::function<void(std::function<void()>)>;
+
+[[nodiscard]] inline auto make_executor(std::shared_ptr<ThreadPool> pool) -> Executor
+{
+    return [pool = std::move(pool)](std::function<void()> task) { pool->detach_task(std::move(task)); };
+}
+
+[[nodiscard]] inline auto make_executor(std::shared_ptr<WorkerPools> pools, size_t category) -> Executor
+{
+    return [pools = std::move(pools), category](std::function<void()> task) {
+        std::ignore = pools->submit_task(category, std::move(task));
+    };
+}
+
+/**
+ * \brief Calls `task(i)` for every i in [0, count), on the calling thread and on up to `helpers` tasks given
+ * to `executor`.
+ *
+ * Indices are taken from a shared counter: threads that are done take over the remaining work, and helpers
+ * that start late find nothing left. This never waits for a busy executor, so it can be called from a task
+ * of the same pool.
+ *
+ * \return false if a call to `task` returned false or threw. The remaining calls are then skipped
+ */
+template<typename F>
+[[nodiscard]] auto parallel_for(size_t count, size_t helpers, const Executor &executor, F task) -> bool
+{
+    struct State
+    {
+        explicit State(size_t count, F task)
+            : count(count)
+            , task(std::move(task))
+        {
+        }
+
+        std::atomic_size_t next = 0;
+        std::atomic_size_t done = 0;
+        std::atomic_bool failed = false;
+        size_t count;
+        // Never called by helpers starting after the last index is taken, it can refer to the caller's stack
+        F task;
+    };
+
+    if (count == 0)
+        return true;
+
+    auto state = std::make_shared<State>(count, std::move(task));
+
+    const auto work = [](State &s) noexcept {
+        for (size_t i = s.next++; i < s.count; i = s.next++)
+        {
+            try
+            {
+                if (!s.failed && !s.task(i))
+                    s.failed = true;
+            }
+            catch (const std::exception &)
+            {
+                s.failed = true;
+            }
+
+            if (++s.done == s.count)
+                s.done.notify_all();
+        }
+    };
+
+    if (executor)
+        for (size_t i = 0; i < std::min(helpers, count - 1); ++i)
+            executor([state, work] { work(*state); });
+
+    work(*state);
+
+    for (auto done = state->done.load(); done < count; done = state->done.load())
+        state->done.wait(done);
+
+    return !state->failed;
+}
+
 template<typename Range, typename Func>
     requires std::ranges::input_range<Range> && invocable_l_or_r<Func, std::ranges::range_value_t<Range>>
 auto for_each_mt(Range &&rng, Func &&func)
@@ -10,6 +10,8 @@
 #include <btu/common/path.hpp>
 #include <tl/expected.hpp>
 
+#include <stop_token>
+
 namespace btu::hkx {
 using common::Error;
 
@@ -49,9 +51,16 @@ class AnimExe
 public:
     [[nodiscard]] static auto make(Path exe_dir) noexcept -> tl::expected<AnimExe, Error>;
 
-    [[nodiscard]] auto convert(Game target_game, const Path &input, const Path &output) const -> ResultError;
+    /// The conversion process is killed when `stop` is requested, and the error is
+    /// std::errc::operation_canceled. `output` is only written once the conversion succeeded.
+    [[nodiscard]] auto convert(Game target_game,
+                               const Path &input,
+                               const Path &output,
+                               std::stop_token stop = {}) const -> ResultError;
 
-    [[nodiscard]] auto convert(Game target_game, std::span<const std::byte> input) const
+    [[nodiscard]] auto convert(Game target_game,
+                               std::span<const std::byte> input,
+                               std::stop_token stop = {}) const
         -> tl::expected<std::vector<std::byte>, Error>;
 
 private:
@@ -61,7 +70,8 @@ private:
     using CopyInput = std::function<ResultError(const Path &input_path)>;
 
     [[nodiscard]] auto convert_impl(Game target_game,
-                                    const CopyInput &copy_input) const noexcept -> tl::expected<Path, Error>;
+                                    const CopyInput &copy_input,
+                                    const std::stop_token &stop) const noexcept -> tl::expected<Path, Error>;
 
     AnimExe(Path exe_dir, std::vector<detail::AnimExeRef> detected) noexcept;
 };
@@ -0,0 +1,83 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <btu/common/error.hpp>
+#include <btu/common/path.hpp>
+#include <tl/expected.hpp>
+
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace btu::modmanager {
+/// Reads the `modlist.txt` of a MO2 profile and returns the enabled mods found in `mods_dir`.
+/// \return Mod directories, lowest priority first. MO2 lists them highest priority first.
+[[nodiscard]] auto read_mo2_load_order(const Path &mods_dir, const Path &modlist)
+    -> tl::expected<std::vector<Path>, common::Error>;
+
+/// A file provided by several mods. The game only loads the winner.
+struct Conflict
+{
+    /// Lowercase, with forward slashes
+    std::u8string relative_path;
+    Path winner;
+    /// Includes the winner if its archived copy is overridden by its loose file
+    std::vector<Path> losers;
+};
+
+/// Orders the providers of a file, the highest wins. Like the game, a loose file always overrides a file in
+/// an archive. Otherwise, the mod with the highest priority wins. Shared by FileConflicts and VfsIndex
+[[nodiscard]] constexpr auto provider_rank(size_t mod, bool in_archive) noexcept -> std::pair<bool, size_t>
+{
+    return {!in_archive, mod};
+}
+
+/// The winning provider of every file across a load order, including the files in archives.
+/// Like the game, a loose file always overrides a file in an archive. Otherwise, the mod with the highest
+/// priority wins.
+class FileConflicts
+{
+public:
+    /// Lists the files of every mod. Only the file tables of archives are read.
+    /// \param mods_by_priority Mod directories, lowest priority first, see read_mo2_load_order
+    explicit FileConflicts(std::span<const Path> mods_by_priority);
+
+    /// \return true if the game loads the file `relative_path` from `mod_dir`, or if no other mod provides
+    /// it. `in_archive` tells which copy is meant: a loose file also overrides the archived copy of its own
+    /// mod. An error if `mod_dir` is not one of the mods
+    [[nodiscard]] auto is_winner(const Path &mod_dir,
+                                 const Path &relative_path,
+                                 bool in_archive) const noexcept -> tl::expected<bool, common::Error>;
+
+    /// \return true if `mod_dir` is one of the mods. Directories are compared once made canonical
+    [[nodiscard]] auto contains(const Path &mod_dir) const noexcept -> bool;
+
+    /// Files provided by more than one mod
+    [[nodiscard]] auto conflicts() const -> std::vector<Conflict>;
+
+private:
+    struct Provider
+    {
+        size_t mod;
+        bool in_archive;
+
+        [[nodiscard]] auto rank() const noexcept { return provider_rank(mod, in_archive); }
+    };
+
+    [[nodiscard]] auto find_mod(const Path &mod_dir) const noexcept -> std::optional<size_t>;
+
+    std::vector<Path> mods_;
+    /// Indexed by their canonical directory, and by the directory given to the constructor
+    std::map<Path, size_t> mod_indices_;
+    /// All the providers of a file. The first one is the winner
+    std::unordered_map<std::u8string, std::vector<Provider>> providers_;
+};
+} // namespace btu::modmanager
@@ -0,0 +1,145 @@
+/* Copyright (C) 2020 G'k
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/modmanager/mod_folder.hpp"
+
+#include <array>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+/// Building blocks of ModFolder::transform, shared with ModLibrary.
+namespace btu::modmanager::detail {
+/// Rough estimation of the time needed to process a file, in arbitrary units.
+/// Used to start the longest jobs first.
+[[nodiscard]] auto estimate_cost(const Path &path, uintmax_t size) noexcept -> uintmax_t;
+
+/// Same as estimate_cost, for a whole archive. Reads the archive header to get the number of files.
+[[nodiscard]] auto estimate_archive_cost(const Path &archive_path, uintmax_t size) noexcept -> uintmax_t;
+
+/// Rough estimation of the peak memory needed to transform a file, in bytes.
+/// Textures are decompressed while processed: if `header` holds the start of a DDS file, its dimensions are
+/// used, otherwise the decompressed size is guessed from the file size.
+[[nodiscard]] auto estimate_memory(const Path &path,
+                                   uintmax_t size,
+                                   std::span<const std::byte> header = {}) noexcept -> uintmax_t;
+
+/// Suffixes of the temporary files and directories written while a mod is transformed, see
+/// common::replace_file and ModFolder::transform_staged. They are never part of the mod
+constexpr auto k_temporary_suffixes = std::to_array<std::u8string_view>(
+    {u8".btu-scratch", u8".btu-tmp", u8".btu-staging", u8".btu-old"});
+
+/// \return true if a component of `relative_path`, relative to the directory of a mod, is temporary
+[[nodiscard]] auto is_temporary_path(const Path &relative_path) noexcept -> bool;
+
+/// Removes the temporary files of `dir`, and the staging and moved aside siblings of `dir`, left over by a
+/// transform that crashed. If `dir` itself was moved aside and not replaced, it is restored
+void remove_leftovers(const Path &dir) noexcept;
+
+/// The same directory for every way of naming a mod: relative, absolute, or with a trailing separator
+[[nodiscard]] auto canonical_mod_dir(const Path &dir) noexcept -> Path;
+
+/// Category of the task transforming a file, chosen from its extension
+[[nodiscard]] auto task_category(const Path &path) noexcept -> TaskCategory;
+
+/// Worker pools with the threads of each TaskCategory
+[[nodiscard]] auto make_worker_pools(const TransformThreads &threads) -> std::shared_ptr<common::WorkerPools>;
+
+struct LooseFile
+{
+    Path absolute_path;
+    /// Directory of the mod the file belongs to. The transformer receives paths relative to it
+    Path mod_dir;
+    uintmax_t size = 0;
+    uintmax_t cost = 0;
+};
+
+struct ArchiveFile
+{
+    Path path;
+    Path mod_dir;
+    std::reference_wrapper<const bsa::Settings> bsa_settings;
+    uintmax_t size = 0;
+    uintmax_t cost = 0;
+};
+
+struct ModFiles
+{
+    std::vector<LooseFile> loose_files;
+    std::vector<ArchiveFile> archives;
+};
+
+/// Adds a file of a mod folder to `files`, as a loose file or as an archive. Archives are skipped if
+/// `ignore_existing_archives` is true
+void add_file(ModFiles &files,
+              const Path &mod_dir,
+              const Path &path,
+              uintmax_t size,
+              const bsa::Settings &bsa_settings,
+              bool ignore_existing_archives);
+
+/// Lists the files of a mod folder. Archives are not listed if `ignore_existing_archives` is true
+[[nodiscard]] auto list_files(const Path &dir,
+                              const bsa::Settings &bsa_settings,
+                              bool ignore_existing_archives) -> ModFiles;
+
+/// Called with the directory of the mod once a loose file or an archive has been fully processed, whether it
+/// was changed or not. May be called from any thread.
+using DoneCallback = std::function<void(const Path &mod_dir)>;
+
+/// Decides if a file, loose or in an archive, has to be processed. `relative_path` is relative to `mod_dir`,
+/// or to the root of the archive.
+using FileFilter = std::function<bool(const Path &mod_dir, const Path &relative_path, bool in_archive)>;
+
+/// Transforms loose files and archives concurrently on the worker pools, most expensive first.
+/// Files rejected by `filter` are left untouched, but still reported to `on_done`.
+/// Blocks until everything is processed, so it must not be called from a thread of the pool.
+/// The transformer is given an executor on the texture threads, see ModFolderTransformer::set_executor.
+void transform_files(ModFiles files,
+                     ModFolderTransformer &transformer,
+                     const PipelineSettings &pipeline,
+                     const std::shared_ptr<common::WorkerPools> &worker_pools,
+                     const DoneCallback &on_done = {},
+                     const FileFilter &filter    = {}) noexcept;
+
+/// Creates a ModFolderTransformer based on a user-provided ModFolderIterator
+class ReadOnlyTransformer final : public ModFolderTransformer
+{
+public:
+    explicit ReadOnlyTransformer(ModFolderIterator &iterator) noexcept
+        : iterator_(iterator)
+    {
+    }
+
+    [[nodiscard]] auto archive_too_large(const Path &archive_path, ArchiveTooLargeState state) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return iterator_.get().archive_too_large(archive_path, state);
+    }
+
+    [[nodiscard]] auto transform_file(ModFile file) noexcept -> std::optional<std::vector<std::byte>> override
+    {
+        iterator_.get().process_file(file);
+        return std::nullopt;
+    }
+
+    [[nodiscard]] auto stop_requested() const noexcept -> bool override
+    {
+        return iterator_.get().stop_requested();
+    }
+
+    [[nodiscard]] auto stop_token() const noexcept -> std::stop_token override
+    {
+        return iterator_.get().stop_token();
+    }
+
+private:
+    std::reference_wrapper<ModFolderIterator> iterator_;
+};
+} // namespace btu::modmanager::detail
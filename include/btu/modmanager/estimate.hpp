@@ -0,0 +1,87 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/modmanager/mod_folder.hpp"
+
+#include <btu/common/json.hpp>
+#include <btu/common/path.hpp>
+#include <btu/tex/compression_device.hpp>
+#include <btu/tex/optimize.hpp>
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace btu::modmanager {
+/// Throughput of this machine, used by estimate. Measuring it takes about a second, so it is worth saving.
+struct EncodeRates
+{
+    /// Pixels per second encoded to BC7
+    double bc7_pixels_per_second;
+    /// Pixels per second encoded to BC1 to BC5
+    double bc_pixels_per_second;
+    /// Pixels per second through the other steps: decompression, resizing, mipmaps, uncompressed conversion
+    double process_pixels_per_second;
+    /// Bytes per second of mesh optimization. Not measured: there is no sample mesh to run
+    double mesh_bytes_per_second;
+    /// Bytes per second read from the disk. Writes are assumed to be as fast
+    double io_bytes_per_second;
+
+    /// Runs a micro-benchmark on a synthetic texture, and reads the files already in `dir`, which should be
+    /// a mod that was not opened recently. Nothing is written to the disk. Encoding rates depend on the
+    /// profile: measure with the `encoder` of the settings given to estimate
+    [[nodiscard]] static auto measure(tex::CompressionDevice &dev,
+                                      const Path &dir,
+                                      const tex::EncoderOptions &encoder = {}) noexcept -> EncodeRates;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(EncodeRates,
+                                   bc7_pixels_per_second,
+                                   bc_pixels_per_second,
+                                   process_pixels_per_second,
+                                   mesh_bytes_per_second,
+                                   io_bytes_per_second)
+
+/// Expected cost and gains of transforming a mod, see estimate
+struct ModEstimate
+{
+    Path mod_dir;
+    /// Files of the mod, including files in archives
+    size_t files = 0;
+    /// Files expected to be rewritten
+    size_t changed_files = 0;
+    /// CPU time, summed over all threads
+    double cpu_seconds = 0;
+    /// Time spent reading and writing, if done sequentially
+    double io_seconds       = 0;
+    uintmax_t bytes_read    = 0;
+    uintmax_t bytes_written = 0;
+    /// Expected change of the size of the mod on disk. Negative when the mod shrinks
+    intmax_t disk_delta = 0;
+    /// Expected change of the video memory used by the textures of the mod
+    intmax_t vram_delta = 0;
+};
+
+/**
+ * \brief Estimates the cost of optimizing the textures and meshes of a mod, without transforming anything.
+ *
+ * Textures are estimated from their header, with compute_optimization_steps. Meshes are assumed to be
+ * rewritten with the same size. Archives are not extracted: files are listed from their tables, FO4 texture
+ * archives store the header of their textures in them, and other archives only have the start of their
+ * textures decompressed. Archived meshes are estimated from their stored size, which is smaller than their
+ * real size when compressed. An archive with changed files is assumed to be rewritten, and its size change
+ * to be the change of its decompressed textures.
+ */
+[[nodiscard]] auto estimate(const ModFolder &mod,
+                            const tex::Settings &sets,
+                            const EncodeRates &rates) noexcept -> ModEstimate;
+
+/// One estimate per mod, in the same order
+[[nodiscard]] auto estimate(std::span<const ModFolder> mods,
+                            const tex::Settings &sets,
+                            const EncodeRates &rates) noexcept -> std::vector<ModEstimate>;
+} // namespace btu::modmanager
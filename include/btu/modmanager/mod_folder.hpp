@@ -9,10 +9,17 @@
 #include <btu/bsa/settings.hpp>
 #include <btu/common/error.hpp>
 #include <btu/common/functional.hpp>
+#include <btu/common/json.hpp>
 #include <btu/common/path.hpp>
 #include <btu/common/threading.hpp>
 #include <tl/expected.hpp>
 
+#include <chrono>
+#include <functional>
+#include <map>
+#include <stop_token>
+#include <vector>
+
 namespace btu::modmanager {
 
 struct ModFile
@@ -44,6 +51,16 @@ public:
     virtual void failed_to_read_archive(const Path &archive_path) noexcept {}
 
     [[nodiscard]] virtual auto stop_requested() const noexcept -> bool { return false; }
+
+    /// Forwarded to long operations, such as reading or writing an archive, so that they stop early.
+    /// Transformers should also pass it to their own long operations, such as tex::optimize
+    [[nodiscard]] virtual auto stop_token() const noexcept -> std::stop_token { return {}; }
+
+    /// Checked between files: once true, the files that are not being processed yet are left untouched
+    [[nodiscard]] auto stopped() const noexcept -> bool
+    {
+        return stop_requested() || stop_token().stop_requested();
+    }
 };
 
 class ModFolderTransformer : public ModFolderIteratorBase
@@ -55,6 +72,24 @@ public:
     [[nodiscard]] virtual auto transform_file(ModFile file) noexcept -> std::optional<std::vector<std::byte>>
                                                                         = 0;
 
+    /// \brief Transforms several files of the same type at once, to share an expensive setup (encoder
+    /// state, external process...) between them. Only called when PipelineSettings allows batches.
+    /// \return One result per file, in the same order. The default implementation calls transform_file.
+    [[nodiscard]] virtual auto transform_batch(std::span<ModFile> files) noexcept
+        -> std::vector<std::optional<std::vector<std::byte>>>
+    {
+        auto res = std::vector<std::optional<std::vector<std::byte>>>{};
+        res.reserve(files.size());
+        for (auto &file : files)
+        {
+            if (stopped())
+                res.emplace_back();
+            else
+                res.push_back(transform_file(std::move(file)));
+        }
+        return res;
+    }
+
     virtual void failed_to_write_transformed_file(const Path &relative_path,
                                                   std::span<const std::byte> content) noexcept
     {
@@ -68,6 +103,12 @@ public:
     virtual void failed_to_write_archive(const Path &old_archive_path, const Path &new_archive_path) noexcept
     {
     }
+
+    /// Called before transforming, with an executor running tasks on the `threads` texture threads of the
+    /// worker pools. Transformers splitting their own work should use it rather than other threads, which
+    /// would compete with the pools for the cores. Texture encoders should give it to their
+    /// tex::CompressionDevice, see CompressionDevice::set_executor
+    virtual void set_executor(common::Executor executor, size_t threads) noexcept {}
 };
 
 class ModFolderIterator : public ModFolderIteratorBase
@@ -76,33 +117,173 @@ public:
     virtual void process_file(ModFile file) noexcept = 0;
 };
 
+/// Content of a mod folder, see ModFolder::stats
+struct ModFolderStats
+{
+    /// Number of loose files, archives excluded
+    size_t loose_files = 0;
+    /// Number of archives that could be read
+    size_t archives = 0;
+    /// Number of files in these archives
+    size_t archived_files = 0;
+    /// Total size of the files of each type, in bytes. Files in archives count with their size in the archive
+    std::map<bsa::FileTypes, uintmax_t> bytes_by_type;
+
+    [[nodiscard]] auto files() const noexcept -> size_t { return loose_files + archived_files; }
+};
+
+/// Kind of storage a mod folder lives on. Used to tune the I/O stages of ModFolder::transform.
+enum class StorageType : std::uint8_t
+{
+    SSD,
+    HDD,
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(StorageType, {{StorageType::SSD, "ssd"}, {StorageType::HDD, "hdd"}})
+
+/// Kinds of transform tasks. Each kind has its own threads, so that slow tasks of one kind, such as
+/// animations waiting for an external process, cannot starve the others. See TransformThreads
+enum class TaskCategory : std::uint8_t
+{
+    Texture,
+    Mesh,
+    Animation,
+    Other,
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(TaskCategory,
+                             {{TaskCategory::Texture, "texture"},
+                              {TaskCategory::Mesh, "mesh"},
+                              {TaskCategory::Animation, "animation"},
+                              {TaskCategory::Other, "other"}})
+
+/// Threads reserved for each TaskCategory. A category may borrow the threads of another one that is idle,
+/// see common::WorkerPools
+struct TransformThreads
+{
+    size_t textures;
+    size_t meshes;
+    size_t animations;
+    size_t other;
+
+    [[nodiscard]] auto total() const noexcept -> size_t { return textures + meshes + animations + other; }
+
+    /// Thread counts indexed by TaskCategory
+    [[nodiscard]] auto per_category() const -> std::vector<size_t>
+    {
+        return {textures, meshes, animations, other};
+    }
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(TransformThreads, textures, meshes, animations, other)
+
+/// Concurrency of the stages of ModFolder::transform. Loose files are read, transformed and written back
+/// by different threads, connected by bounded queues.
+struct PipelineSettings
+{
+    /// Threads reading loose files. The memory of a task is estimated from the headers of its files, and
+    /// reserved before their content is read
+    size_t reader_threads;
+    /// Threads calling the transformer, per category of file. Also used for files in archives
+    TransformThreads transform_threads;
+    /// Threads writing transformed loose files
+    size_t writer_threads;
+    /// Maximum number of files, or batches of files, waiting between two stages
+    size_t queue_capacity;
+    /// Maximum number of files of the same type given to ModFolderTransformer::transform_batch.
+    /// 1 disables batching
+    size_t batch_max_files;
+    /// Maximum total size of a batch, in bytes. A file larger than this is processed alone
+    uintmax_t batch_max_bytes;
+    /// Estimated memory, in bytes, that transform tasks may use at the same time. Tasks are held back
+    /// until enough memory is released by the running ones
+    uintmax_t memory_budget;
+
+    [[nodiscard]] static auto get(StorageType storage) noexcept -> PipelineSettings;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(PipelineSettings,
+                                   reader_threads,
+                                   transform_threads,
+                                   writer_threads,
+                                   queue_capacity,
+                                   batch_max_files,
+                                   batch_max_bytes,
+                                   memory_budget)
+
 class ModFolder
 {
 public:
     using enum ModFolderIteratorBase::ArchiveTooLargeAction;
     using enum ModFolderIteratorBase::ArchiveTooLargeState;
 
-    explicit ModFolder(Path directory, bsa::Settings bsa_settings, bool ignore_existing_archives = false);
+    explicit ModFolder(Path directory,
+                       bsa::Settings bsa_settings,
+                       bool ignore_existing_archives = false,
+                       PipelineSettings pipeline     = PipelineSettings::get(StorageType::SSD));
+
+    /// Uses existing worker pools instead of creating them. Useful to process multiple mods at once, see
+    /// ModLibrary. `pipeline.transform_threads` is ignored, the threads of the pools are used instead.
+    ModFolder(Path directory,
+              bsa::Settings bsa_settings,
+              std::shared_ptr<common::WorkerPools> worker_pools,
+              bool ignore_existing_archives = false,
+              PipelineSettings pipeline     = PipelineSettings::get(StorageType::SSD));
+
+    /// Get the number of files in the folder, including files in archives. Like `stats().files()`, but
+    /// archives larger than `bsa_settings().max_size` are skipped, as they would be when iterated.
+    [[nodiscard]] auto size() const noexcept -> size_t;
 
-    /// Get the size of the folder, including files in archives.
-    /// Utility function, equivalent to iterate() and counting the files.
-    [[nodiscard]] auto size() noexcept -> size_t;
+    /// Counts the files of the folder, without reading them: loose files are listed with one directory scan,
+    /// and only the file tables of archives are read. Archives that cannot be read are not counted, but
+    /// archives larger than `bsa_settings().max_size` are.
+    [[nodiscard]] auto stats() const noexcept -> ModFolderStats;
 
     /// Transform all files in the folder, including files in archives.
-    /// Multithreaded.
+    /// Multithreaded. Loose files go through a read -> transform -> write pipeline, see PipelineSettings.
     void transform(ModFolderTransformer &transformer) noexcept;
 
+    /// Same as transform, but the folder is left untouched until every file has been processed. The files are
+    /// cloned to a staging directory next to the folder, with reflinks or hard links when the filesystem
+    /// supports them, see common::clone_file, and transformed there. On success the staging directory
+    /// replaces the folder, otherwise it is removed.
+    /// \return operation_canceled if the transformer was stopped, io_error if a file could not be written
+    [[nodiscard]] auto transform_staged(ModFolderTransformer &transformer) noexcept
+        -> tl::expected<void, common::Error>;
+
     /// Iterate over all files in the folder, including files in archives.
     /// Multithreaded.
     void iterate(ModFolderIterator &iterator) noexcept;
 
+    /// Called after each round of watch(), with the files that were processed
+    using WatchCallback = std::function<void(std::span<const Path> processed)>;
+
+    static constexpr auto k_default_debounce = std::chrono::milliseconds(300);
+
+    /// Transform files as they are created or modified, until `stop` is requested or the transformer stops.
+    /// Changes are debounced: they are processed once no new change happened for `debounce`. The worker pools
+    /// are kept between rounds. Only supported on Linux, where it uses inotify.
+    [[nodiscard]] auto watch(ModFolderTransformer &transformer,
+                             std::stop_token stop,
+                             std::chrono::milliseconds debounce = k_default_debounce,
+                             const WatchCallback &on_processed  = {}) noexcept
+        -> tl::expected<void, common::Error>;
+
+    /// Activity of the threads of a category since the folder was created. Shared with the other mods of a
+    /// ModLibrary
+    [[nodiscard]] auto utilization(TaskCategory category) const -> common::PoolUtilization;
+
     [[nodiscard]] auto name() const noexcept -> std::u8string { return dir_.filename().u8string(); }
     [[nodiscard]] auto path() const noexcept -> const Path & { return dir_; }
 
+    [[nodiscard]] auto bsa_settings() const noexcept -> const bsa::Settings & { return bsa_settings_; }
+    [[nodiscard]] auto ignore_existing_archives() const noexcept -> bool { return ignore_existing_archives_; }
+
 private:
     Path dir_;
     bsa::Settings bsa_settings_;
     bool ignore_existing_archives_;
-    common::ThreadPool thread_pool_;
+    PipelineSettings pipeline_;
+    std::shared_ptr<common::WorkerPools> worker_pools_;
 };
 } // namespace btu::modmanager
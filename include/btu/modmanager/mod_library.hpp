@@ -0,0 +1,61 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/modmanager/conflicts.hpp"
+#include "btu/modmanager/detail/transform.hpp"
+#include "btu/modmanager/mod_folder.hpp"
+
+#include <functional>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace btu::modmanager {
+/// A set of mod folders processed together, for example every mod of a MO2 instance (see list_mods).
+/// All the files of all the mods are scheduled on the same worker pools, largest first.
+class ModLibrary
+{
+public:
+    /// Called once all the files of a mod have been processed. May be called from any thread.
+    using ModCallback = std::function<void(const ModFolder &mod)>;
+
+    /// A directory given several times, possibly spelled differently, is only added once
+    explicit ModLibrary(std::span<const Path> mod_directories,
+                        const bsa::Settings &bsa_settings,
+                        bool ignore_existing_archives = false,
+                        PipelineSettings pipeline     = PipelineSettings::get(StorageType::SSD));
+
+    /// Transform all files of all mods, including files in archives.
+    void transform(ModFolderTransformer &transformer, const ModCallback &on_mod_done = {}) noexcept;
+
+    /// Transform only the files the game loads: files overridden by a mod with a higher priority are skipped.
+    /// See FileConflicts::conflicts to report them.
+    /// \return An error, before anything is transformed, if `conflicts` does not know one of the mods
+    [[nodiscard]] auto transform(ModFolderTransformer &transformer,
+                                 const FileConflicts &conflicts,
+                                 const ModCallback &on_mod_done = {}) noexcept
+        -> tl::expected<void, common::Error>;
+
+    /// Iterate over all files of all mods, including files in archives.
+    void iterate(ModFolderIterator &iterator, const ModCallback &on_mod_done = {}) noexcept;
+
+    /// Activity of the threads of a category, shared by all the mods
+    [[nodiscard]] auto utilization(TaskCategory category) const -> common::PoolUtilization;
+
+    [[nodiscard]] auto mods() noexcept -> std::span<ModFolder> { return mods_; }
+    [[nodiscard]] auto mods() const noexcept -> std::span<const ModFolder> { return mods_; }
+
+private:
+    void transform_impl(ModFolderTransformer &transformer,
+                        const detail::FileFilter &filter,
+                        const ModCallback &on_mod_done) noexcept;
+
+    PipelineSettings pipeline_;
+    std::shared_ptr<common::WorkerPools> worker_pools_;
+    std::vector<ModFolder> mods_;
+};
+} // namespace btu::modmanager
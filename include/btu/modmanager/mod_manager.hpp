@@ -18,4 +18,8 @@ enum class ModManager : std::uint8_t
 };
 auto find_manager(const Path &dir) -> ModManager;
 
+/// Lists the mod folders managed in `dir`. For MO2 and Vortex, every subdirectory is a mod.
+/// Otherwise, `dir` is considered to be a single mod.
+auto list_mods(const Path &dir) -> std::vector<Path>;
+
 } // namespace btu::modmanager
@@ -0,0 +1,149 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <btu/common/error.hpp>
+#include <btu/common/path.hpp>
+#include <tl/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace btu::modmanager {
+/// Where the game loads a file from
+struct VfsFile
+{
+    Path mod_dir;
+    /// The loose file itself, or the archive containing the file
+    Path source;
+    /// Path of the file, relative to the mod directory or to the root of the archive. Original case
+    std::u8string relative_path;
+    bool in_archive;
+    /// Size of the loose file, or of the file in its archive, compressed if it is compressed
+    uintmax_t size;
+};
+
+namespace detail {
+/// Start of a file written by VfsIndex::save. The offsets are from the start of the file
+struct VfsHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mod_count;
+    uint32_t source_count;
+    uint32_t entry_count;
+    uint32_t bucket_count;
+    uint32_t path_count;
+    uint32_t reserved;
+    uint64_t mods_offset;
+    uint64_t sources_offset;
+    uint64_t entries_offset;
+    uint64_t buckets_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+};
+} // namespace detail
+
+/**
+ * \brief Index of the loose files and archive entries of a load order.
+ *
+ * Lookups are case-insensitive, and return the file the game loads: a loose file always overrides a file in
+ * an archive, otherwise the mod with the highest priority wins. Losing providers are kept, so that the index
+ * can be updated when a file or an archive changes.
+ *
+ * The index can be saved to a file, and queried in place with VfsIndexView, without parsing it.
+ */
+class VfsIndex
+{
+public:
+    VfsIndex() = default;
+
+    /// Lists the files of every mod. Only the file tables of archives are read.
+    /// \param mods_by_priority Mod directories, lowest priority first, see read_mo2_load_order
+    explicit VfsIndex(std::span<const Path> mods_by_priority);
+
+    [[nodiscard]] auto find(std::u8string_view relative_path) const -> std::optional<VfsFile>;
+
+    /// Number of distinct paths
+    [[nodiscard]] auto size() const noexcept -> size_t { return files_.size(); }
+
+    /// Indexes again a loose file or an archive that was created, modified or removed.
+    /// Paths outside of the mods of the index are ignored. The path may be relative to the working directory,
+    /// and the mods given as absolute paths, or the other way around.
+    void update(const Path &absolute_path);
+
+    [[nodiscard]] auto save(const Path &path) const -> tl::expected<void, common::Error>;
+    [[nodiscard]] static auto load(const Path &path) -> tl::expected<VfsIndex, common::Error>;
+
+private:
+    struct Source
+    {
+        size_t mod;
+        /// Archive path relative to the mod directory, empty for loose files
+        std::u8string archive;
+        /// Keys of the files of the archive. Not tracked for loose files
+        std::vector<std::u8string> files;
+    };
+
+    struct Provider
+    {
+        uint32_t source;
+        std::u8string relative_path;
+        uintmax_t size;
+    };
+
+    [[nodiscard]] auto is_archive(uint32_t source) const noexcept -> bool;
+    [[nodiscard]] auto make_file(const Provider &provider) const -> VfsFile;
+
+    void add(uint32_t source, std::u8string relative_path, uintmax_t size);
+    void remove(uint32_t source, const std::u8string &key);
+    void add_archive(size_t mod, const Path &archive_path);
+    void remove_archive(uint32_t source);
+    void sort_providers(std::vector<Provider> &providers) const;
+    /// \return The index of the mod containing `path`, and the path relative to it
+    [[nodiscard]] auto find_mod(const Path &path) -> std::optional<std::pair<size_t, Path>>;
+
+    std::vector<Path> mods_;
+    /// `mods_`, absolute and canonical, to compare them with the paths given to update. Computed on demand
+    std::vector<Path> canonical_mods_;
+    /// The first `mods_.size()` sources are the loose files of each mod
+    std::vector<Source> sources_;
+    std::unordered_map<std::u8string, uint32_t> archive_sources_;
+    /// All the providers of a path, winner first
+    std::unordered_map<std::u8string, std::vector<Provider>> files_;
+};
+
+/// Read-only view of an index saved with VfsIndex::save. The file is memory-mapped and queried in place, so
+/// opening it is cheap and the pages are shared between processes.
+class VfsIndexView
+{
+public:
+    [[nodiscard]] static auto open(const Path &path) -> tl::expected<VfsIndexView, common::Error>;
+
+    [[nodiscard]] auto find(std::u8string_view relative_path) const -> std::optional<VfsFile>;
+
+    /// Number of distinct paths
+    [[nodiscard]] auto size() const noexcept -> size_t;
+
+private:
+    VfsIndexView(std::shared_ptr<const void> storage,
+                 std::span<const std::byte> data,
+                 const detail::VfsHeader &header) noexcept;
+
+    std::shared_ptr<const void> storage_;
+    std::span<const std::byte> data_;
+    /// Parsed and validated when opened
+    detail::VfsHeader header_;
+};
+} // namespace btu::modmanager
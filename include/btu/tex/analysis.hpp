@@ -0,0 +1,38 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <array>
+#include <compare>
+#include <cstddef>
+#include <cstdint>
+
+namespace DirectX { // NOLINT(readability-identifier-naming)
+class ScratchImage;
+} // namespace DirectX
+
+namespace btu::tex {
+/// What the pixels of a texture contain, computed in a single pass over all its images
+struct PixelAnalysis
+{
+    static constexpr size_t k_alpha = 3;
+
+    /// Smallest and largest value of each channel, in RGBA order, from 0 to 255
+    std::array<uint8_t, 4> min = {0, 0, 0, 0};
+    std::array<uint8_t, 4> max = {255, 255, 255, 255};
+    /// Every alpha value is either 0 or 255, as with 1-bit alpha
+    bool alpha_binary = false;
+
+    [[nodiscard]] constexpr auto alpha_all_opaque() const noexcept -> bool { return min[k_alpha] == 255; }
+    [[nodiscard]] constexpr auto alpha_all_transparent() const noexcept -> bool { return max[k_alpha] == 0; }
+
+    auto operator<=>(const PixelAnalysis &) const noexcept = default;
+};
+
+/// Scans every image of `image`. Compressed and non 8-bit formats are first converted to R8G8B8A8. When
+/// that fails, the result is the default one, which assumes that every channel is used
+[[nodiscard]] auto analyze(const DirectX::ScratchImage &image) noexcept -> PixelAnalysis;
+} // namespace btu::tex
@@ -0,0 +1,88 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/common/path.hpp"
+#include "btu/tex/detail/common.hpp"
+#include "btu/tex/optimize.hpp"
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace btu::tex {
+/**
+ * \brief On-disk cache of optimized textures, keyed by their content.
+ *
+ * The same texture is often shipped by many mods. The key is a hash of the input file, of the serialized
+ * OptimizationSteps and of the encoder version: a texture optimized once is then read back from the cache
+ * instead of being encoded again.
+ *
+ * The total size of the entries is bounded, the least recently used entries are removed first. Recency is
+ * kept in the modification time of the entries, so that it survives between runs. All functions are
+ * thread-safe, and entries are written atomically, so that several processes can share a cache directory.
+ */
+class OptimizationCache
+{
+public:
+    /// Part of the key. Increment it when optimize can produce different bytes for the same input and steps
+    static constexpr uint32_t k_encoder_version = 4;
+
+    /// Existing entries of `dir` are kept, the least recently used are removed if they exceed `max_size`
+    OptimizationCache(Path dir, uintmax_t max_size);
+
+    [[nodiscard]] static auto make_key(std::span<const std::byte> input, const OptimizationSteps &steps)
+        -> std::string;
+
+    /// \return The optimized texture stored with `key`, as a DDS file
+    [[nodiscard]] auto find(const std::string &key) -> std::optional<std::vector<std::byte>>;
+
+    /// Stores an optimized texture. Does nothing if `output` alone is larger than the cache
+    void insert(const std::string &key, std::span<const std::byte> output);
+
+    /// Total size of the entries, in bytes
+    [[nodiscard]] auto size() const -> uintmax_t;
+    [[nodiscard]] auto max_size() const noexcept -> uintmax_t { return max_size_; }
+
+private:
+    struct Entry
+    {
+        std::list<std::string>::iterator recency;
+        uintmax_t size;
+    };
+
+    [[nodiscard]] auto entry_path(const std::string &key) const -> Path;
+    /// Removes the least recently used entries until the cache fits in `max_size_`.
+    /// Called with the mutex held
+    void evict();
+
+    Path dir_;
+    uintmax_t max_size_;
+
+    mutable std::mutex mutex_;
+    /// Most recently used first
+    std::list<std::string> recency_;
+    std::unordered_map<std::string, Entry> entries_;
+    uintmax_t size_ = 0;
+};
+
+/// Same as loading `data`, optimizing it with the steps computed from `sets` and saving it, but the result is
+/// read from `cache` when the same texture was already optimized with the same steps. New results are stored.
+/// \return The optimized texture, as a DDS file
+[[nodiscard]] auto optimize_cached(Path relative_path,
+                                   std::span<std::byte> data,
+                                   const Settings &sets,
+                                   CompressionDevice &dev,
+                                   OptimizationCache &cache,
+                                   std::stop_token stop = {}) noexcept
+    -> tl::expected<std::vector<std::byte>, Error>;
+} // namespace btu::tex
@@ -40,11 +40,31 @@ public:
     // This one will always return false on non-windows platforms
     [[nodiscard]] auto try_apply(const Callback &callback) noexcept(noexcept(callback)) -> bool;
 
+    /// CPU encoders split a texture in tiles, encoded by the calling thread and by up to `threads` tasks given
+    /// to `executor`. Pass the pool of the application, so that encoding does not compete with it for cores.
+    /// By default, a pool shared by all devices is used. ModFolder gives its texture threads to transformers,
+    /// see modmanager::ModFolderTransformer::set_executor. Not thread-safe: call it before encoding
+    void set_executor(common::Executor executor, size_t threads) noexcept;
+
+    [[nodiscard]] auto executor() const noexcept -> const common::Executor &;
+    [[nodiscard]] auto executor_threads() const noexcept -> size_t;
+
+    /// Most bytes allocated to optimize a single texture, its output included. The input file is not counted:
+    /// callers already hold it in memory, and it is read in place. When set, optimize_probed and
+    /// optimize_cached stream the textures that optimize_streamed supports. 0, the default, means no limit.
+    /// Not thread-safe: call it before encoding
+    void set_memory_cap(size_t bytes) noexcept;
+    [[nodiscard]] auto memory_cap() const noexcept -> size_t;
+
 private:
     std::vector<std::unique_ptr<common::synchronized<detail::DxAdapter>>> devices_;
     std::vector<AdapterInfo> cached_info_;
 
     std::mutex apply_mutex_;
     std::condition_variable cv_;
+
+    common::Executor executor_;
+    size_t executor_threads_ = 0;
+    size_t memory_cap_       = 0;
 };
 } // namespace btu::tex
@@ -4,6 +4,7 @@
 #include "btu/tex/detail/common.hpp"
 #include "btu/tex/detail/formats_string.hpp"
 #include "btu/tex/dimension.hpp"
+#include "btu/tex/encoder_options.hpp"
 
 #include <crunch/crn_dxt_image.h>
 #include <crunch/crn_texture_conversion.h>
@@ -13,5 +14,7 @@ namespace btu::tex {
 using crnlib::texture_conversion::convert_params;
 [[nodiscard]] auto resize(CrunchTexture &&file, Dimension dim) -> ResultCrunch;
 [[nodiscard]] auto generate_mipmaps(CrunchTexture &&file) -> ResultCrunch;
-[[nodiscard]] auto convert(CrunchTexture &&file, DXGI_FORMAT format) -> ResultCrunch;
+/// Crunch only has a faster mode: all profiles but EncoderProfile::Fast use its best quality
+[[nodiscard]] auto convert(CrunchTexture &&file, DXGI_FORMAT format, const EncoderOptions &encoder = {})
+    -> ResultCrunch;
 } // namespace btu::tex
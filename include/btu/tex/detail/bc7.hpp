@@ -0,0 +1,48 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/tex/compression_device.hpp"
+#include "btu/tex/detail/common.hpp"
+#include "btu/tex/encoder_options.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stop_token>
+
+// bc7enc and DirectXTex both define DXGI_FORMAT, so the encoder lives in its own translation unit and only
+// sees plain pointers
+namespace btu::tex::detail {
+/// An R8G8B8A8 image to encode, and the BC7 image its blocks are written to
+struct Bc7Surface
+{
+    const uint8_t *source;
+    size_t source_row_pitch;
+    uint8_t *dest;
+    size_t dest_row_pitch;
+    uint32_t width;
+    uint32_t height;
+};
+
+/// \return The number of block rows of a surface `width` pixels wide encoded together by convert_bc7.
+/// Encoding the same tiles with encode_bc7_rows gives the same blocks, even with rate-distortion optimization
+[[nodiscard]] auto bc7_tile_rows(uint32_t width, const EncoderOptions &encoder) noexcept -> uint32_t;
+
+/// Encodes the block rows [`first_row`, `first_row` + `rows`) of `surface` on the calling thread
+[[nodiscard]] auto encode_bc7_rows(const Bc7Surface &surface,
+                                   uint32_t first_row,
+                                   uint32_t rows,
+                                   const EncoderOptions &encoder) -> bool;
+
+/// Encodes all `surfaces` at once. They are split in tiles of blocks, shared by the calling thread and the
+/// executor of `dev`, so that a single large texture still uses every thread. Fails with
+/// std::errc::operation_canceled when a stop is requested
+[[nodiscard]] auto convert_bc7(std::span<const Bc7Surface> surfaces,
+                               CompressionDevice &dev,
+                               const EncoderOptions &encoder,
+                               const std::stop_token &stop) -> ResultError;
+} // namespace btu::tex::detail
@@ -0,0 +1,28 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/tex/dxtex.hpp"
+#include "btu/tex/encoder_options.hpp"
+#include "btu/tex/texture.hpp"
+
+#include <cstddef>
+
+// Building blocks of convert, for functions encoding images part by part
+namespace btu::tex::detail {
+/// \return The number of block rows of an image `width` pixels wide encoded together by convert. Encoding the
+/// same tiles with encode_block_rows gives the same blocks
+[[nodiscard]] auto encode_tile_rows(DXGI_FORMAT format, size_t width, const EncoderOptions &encoder) noexcept
+    -> size_t;
+
+/// Encodes the block rows [`first_row`, `first_row` + `rows`) of `source` to `dest`, which has the same
+/// dimensions and a compressed format, on the calling thread. BC7 sources must be R8G8B8A8_UNORM
+[[nodiscard]] auto encode_block_rows(const Image &source,
+                                     const Image &dest,
+                                     size_t first_row,
+                                     size_t rows,
+                                     const EncoderOptions &encoder) -> bool;
+} // namespace btu::tex::detail
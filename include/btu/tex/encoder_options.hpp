@@ -0,0 +1,43 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <btu/common/json.hpp>
+
+#include <compare>
+#include <cstdint>
+
+namespace btu::tex {
+/// Trade-off between encoding time, quality and size of compressed textures
+enum class EncoderProfile : std::uint8_t
+{
+    /// For previews. Several times faster than Balanced, at a visible loss of quality
+    Fast,
+    Balanced,
+    /// Slowest, for the best quality
+    MaxQuality,
+    /// Balanced, then BC7 blocks are altered so that archives compress better, see EncoderOptions::rdo_lambda
+    SizeOptimized,
+};
+
+NLOHMANN_JSON_SERIALIZE_ENUM(EncoderProfile,
+                             {{EncoderProfile::Fast, "fast"},
+                              {EncoderProfile::Balanced, "balanced"},
+                              {EncoderProfile::MaxQuality, "max_quality"},
+                              {EncoderProfile::SizeOptimized, "size_optimized"}})
+
+struct EncoderOptions
+{
+    EncoderProfile profile = EncoderProfile::Balanced;
+    /// Rate-distortion trade-off of SizeOptimized. Higher values give smaller archives and lower quality,
+    /// usual values are between 0.5 and 3
+    float rdo_lambda = 1.0F;
+
+    auto operator<=>(const EncoderOptions &) const noexcept = default;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(EncoderOptions, profile, rdo_lambda)
+} // namespace btu::tex
@@ -3,14 +3,25 @@
 #include "btu/tex/detail/common.hpp"
 #include "btu/tex/detail/formats_string.hpp"
 #include "btu/tex/dimension.hpp"
+#include "btu/tex/encoder_options.hpp"
 #include "btu/tex/texture.hpp"
 
 #include <btu/tex/compression_device.hpp>
 
+#include <optional>
+#include <span>
+#include <stop_token>
+
 namespace btu::tex {
 [[nodiscard]] auto decompress(Texture &&file) -> Result;
 [[nodiscard]] auto make_transparent_alpha(Texture &&file) -> Result;
-[[nodiscard]] auto convert(Texture &&file, DXGI_FORMAT format, CompressionDevice &dev) -> Result;
+/// `encoder` trades encoding speed for quality or size, when compressing.
+/// BC7 encoding checks `stop` regularly, and fails with std::errc::operation_canceled when it is requested
+[[nodiscard]] auto convert(Texture &&file,
+                           DXGI_FORMAT format,
+                           CompressionDevice &dev,
+                           const EncoderOptions &encoder = {},
+                           std::stop_token stop          = {}) -> Result;
 
 [[nodiscard]] constexpr auto optimal_mip_count(Dimension dim) noexcept -> size_t
 {
@@ -26,5 +37,65 @@ namespace btu::tex {
 }
 
 [[nodiscard]] auto generate_mipmaps(Texture &&file) -> Result;
+/// Completes the mip chain of a 2D texture or cubemap. Unlike generate_mipmaps, existing levels are kept byte
+/// for byte: only the missing ones are generated, from the smallest existing level, and encoded to the format
+/// of the texture. Compressed textures do not have to be decompressed
+[[nodiscard]] auto generate_missing_mipmaps(Texture &&file,
+                                            CompressionDevice &dev,
+                                            const EncoderOptions &encoder = {},
+                                            std::stop_token stop          = {}) -> Result;
 [[nodiscard]] auto resize(Texture &&file, Dimension dim) -> Result;
+
+/// \return The number of top levels to drop so that the texture has the dimensions `target`, if one of its
+/// mip levels already has them. Only 2D textures and cubemaps are supported
+[[nodiscard]] auto mips_to_drop(const TexMetadata &info, Dimension target) noexcept -> std::optional<size_t>;
+/// Removes the `count` top mip levels. The other levels are copied as is, even if compressed: this is a
+/// lossless and much faster alternative to resize when the target dimensions are a mip level
+[[nodiscard]] auto drop_mips(Texture &&file, size_t count) -> Result;
+
+/// Steps done by process_fused, in this order
+struct FusedSteps
+{
+    std::optional<Dimension> resize;
+    bool add_transparent_alpha = false;
+    bool mipmaps               = false;
+};
+
+/// \return Whether process_fused supports the texture: 2D textures and cubemaps in 8-bit RGBA, BC1-BC3 or
+/// BC7, but not sRGB, downscaled by a power of two. Existing mip levels must be regenerated
+[[nodiscard]] auto can_process_fused(const TexMetadata &info, const FusedSteps &steps) noexcept -> bool;
+/// Same as decompress, resize, make_transparent_alpha and generate_mipmaps in a row. Decoding, downscaling
+/// with a box filter and alpha are a single pass over bands of rows, written to the top level of the output.
+/// Each mip level is then one more pass, over the whole previous level once it is complete. The output is the
+/// only full size allocation, and stays in 8-bit RGBA instead of floats. Bands of every pass are shared with
+/// the executor of `dev`
+[[nodiscard]] auto process_fused(Texture &&file,
+                                 const FusedSteps &steps,
+                                 CompressionDevice &dev,
+                                 std::stop_token stop = {}) -> Result;
+
+/// Steps done by process_streamed: those of process_fused, then an encoding to `format`
+struct StreamedSteps
+{
+    FusedSteps fused;
+    DXGI_FORMAT format = DXGI_FORMAT_UNKNOWN;
+    EncoderOptions encoder;
+};
+
+/// \return Whether process_streamed supports the texture: as process_fused, to BC1-BC3 or BC7 and with power
+/// of two dimensions once resized
+[[nodiscard]] auto can_process_streamed(const TexMetadata &info, const StreamedSteps &steps) noexcept -> bool;
+/// Same as process_fused followed by convert, for textures too large to be decoded at once. `images` are the
+/// top levels of the array items of a texture described by `info`, and may point into the file being read.
+///
+/// Rows are decoded and downscaled band by band, and each level only keeps the rows not encoded yet: blocks
+/// are encoded as soon as their rows are complete, and halved into the next level. At most `memory_cap`
+/// bytes are allocated, the result included: bands and threads are reduced to fit, and if even a single row
+/// of blocks does not, fails with std::errc::not_enough_memory. The blocks are the same as with convert
+[[nodiscard]] auto process_streamed(const TexMetadata &info,
+                                    std::span<const Image> images,
+                                    const StreamedSteps &steps,
+                                    size_t memory_cap,
+                                    CompressionDevice &dev,
+                                    std::stop_token stop = {}) -> Result;
 } // namespace btu::tex
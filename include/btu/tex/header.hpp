@@ -0,0 +1,84 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include "btu/common/path.hpp"
+#include "btu/tex/detail/common.hpp"
+#include "btu/tex/dimension.hpp"
+#include "btu/tex/dxtex.hpp"
+#include "btu/tex/optimize.hpp"
+#include "btu/tex/texture.hpp"
+
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <stop_token>
+
+namespace btu::tex {
+/// What the header of a texture tells, without decoding its pixels
+struct TextureHeader
+{
+    TexMetadata info;
+    Path load_path;
+
+    [[nodiscard]] auto get_dimension() const noexcept -> Dimension
+    {
+        return Dimension{.w = info.width, .h = info.height};
+    }
+    [[nodiscard]] auto get_load_path() const noexcept -> const Path & { return load_path; }
+};
+
+/// Magic number, DDS_HEADER and DDS_HEADER_DXT10. Reading this many bytes is enough for read_header
+constexpr size_t k_max_header_size = 148;
+
+/// Parses the header of a DDS or TGA texture. `data` may stop right after the header.
+[[nodiscard]] auto read_header(Path load_path, std::span<const std::byte> data) noexcept
+    -> tl::expected<TextureHeader, Error>;
+
+/// Optimization steps of a texture, computed by probe
+struct TextureProbe
+{
+    TextureHeader header;
+    OptimizationSteps steps;
+    /// The decoded texture, if a step depended on its pixels. Reuse it rather than loading it again
+    std::optional<Texture> texture;
+
+    /// \return Whether optimize would leave the texture as it is, so that it can be skipped
+    [[nodiscard]] auto unchanged() const noexcept -> bool;
+};
+
+/// Computes the optimization steps of the texture in `data` from its header. Format, dimensions, mip count
+/// and cubemap checks do not need the pixels: they are only decoded, once, when a step depends on them, such
+/// as whether the alpha channel is opaque. Most textures of an already optimized mod are skipped without
+/// decoding anything
+[[nodiscard]] auto probe(Path relative_path, std::span<std::byte> data, const Settings &sets) noexcept
+    -> tl::expected<TextureProbe, Error>;
+
+/// \return Whether optimize_streamed supports the texture: DDS files that process_streamed supports, when
+/// optimize would not keep some of their levels as they are
+[[nodiscard]] auto can_optimize_streamed(const TextureHeader &header, const OptimizationSteps &steps) noexcept
+    -> bool;
+/// Same as loading `data` and optimizing it with `steps`, but the pixels are read in place and processed band
+/// by band, see process_streamed. At most `dev.memory_cap()` bytes are allocated, besides `data`. Fails with
+/// TextureErr::BadInput if the texture is not supported, and with std::errc::not_enough_memory if it does not
+/// fit
+[[nodiscard]] auto optimize_streamed(Path relative_path,
+                                     std::span<std::byte> data,
+                                     const OptimizationSteps &steps,
+                                     CompressionDevice &dev,
+                                     std::stop_token stop = {}) noexcept -> Result;
+/// Optimizes the texture in `data` with the steps `probed` from it. When `dev` has a memory cap, the textures
+/// that optimize_streamed supports are streamed, the others are decoded at once, reusing `probed.texture`.
+/// This is how transformers should optimize the files of a mod
+[[nodiscard]] auto optimize_probed(Path relative_path,
+                                   std::span<std::byte> data,
+                                   TextureProbe &&probed,
+                                   CompressionDevice &dev,
+                                   std::stop_token stop = {}) noexcept -> Result;
+
+/// Size in bytes of the pixels of a texture, all mips and array slices included
+[[nodiscard]] auto compute_data_size(const TexMetadata &info) noexcept -> size_t;
+} // namespace btu::tex
@@ -7,17 +7,20 @@
 
 #include "btu/tex/detail/common.hpp"
 #include "btu/tex/dimension.hpp"
+#include "btu/tex/encoder_options.hpp"
 #include "btu/tex/formats.hpp"
 #include "compression_device.hpp"
 
 #include <btu/common/games.hpp>
 #include <btu/common/json.hpp>
 
+#include <stop_token>
 #include <variant>
 
 namespace btu::tex {
 class Texture;
 class CrunchTexture;
+struct TextureHeader;
 
 struct Settings
 {
@@ -35,17 +38,36 @@ struct Settings
     BestFormatFor output_format;
 
     std::vector<std::u8string> landscape_textures;
+
+    EncoderOptions encoder;
 };
 
-NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(Settings,
-                                   game,
-                                   compress,
-                                   resize,
-                                   mipmaps,
-                                   use_format_whitelist,
-                                   allowed_formats,
-                                   output_format,
-                                   landscape_textures)
+inline void to_json(nlohmann::json &j, const Settings &sets)
+{
+    j = nlohmann::json{{"game", sets.game},
+                       {"compress", sets.compress},
+                       {"resize", sets.resize},
+                       {"mipmaps", sets.mipmaps},
+                       {"use_format_whitelist", sets.use_format_whitelist},
+                       {"allowed_formats", sets.allowed_formats},
+                       {"output_format", sets.output_format},
+                       {"landscape_textures", sets.landscape_textures},
+                       {"encoder", sets.encoder}};
+}
+
+/// `encoder` is optional, settings saved before it existed use the default EncoderOptions
+inline void from_json(const nlohmann::json &j, Settings &sets)
+{
+    j.at("game").get_to(sets.game);
+    j.at("compress").get_to(sets.compress);
+    j.at("resize").get_to(sets.resize);
+    j.at("mipmaps").get_to(sets.mipmaps);
+    j.at("use_format_whitelist").get_to(sets.use_format_whitelist);
+    j.at("allowed_formats").get_to(sets.allowed_formats);
+    j.at("output_format").get_to(sets.output_format);
+    j.at("landscape_textures").get_to(sets.landscape_textures);
+    sets.encoder = j.value("encoder", EncoderOptions{});
+}
 
 struct OptimizationSteps
 {
@@ -54,16 +76,49 @@ struct OptimizationSteps
     bool mipmaps               = false;
     DXGI_FORMAT best_format    = DXGI_FORMAT_UNKNOWN;
     bool convert               = false;
+    /// Copied from Settings. Part of the steps, as it changes the result
+    EncoderOptions encoder;
 
     auto operator<=>(const OptimizationSteps &) const noexcept = default;
 };
 
-[[nodiscard]] auto optimize(Texture &&file, OptimizationSteps sets, CompressionDevice &dev) noexcept -> Result;
+inline void to_json(nlohmann::json &j, const OptimizationSteps &steps)
+{
+    j = nlohmann::json{{"resize", steps.resize},
+                       {"add_transparent_alpha", steps.add_transparent_alpha},
+                       {"mipmaps", steps.mipmaps},
+                       {"best_format", steps.best_format},
+                       {"convert", steps.convert},
+                       {"encoder", steps.encoder}};
+}
+
+/// `encoder` is optional, steps saved before it existed use the default EncoderOptions
+inline void from_json(const nlohmann::json &j, OptimizationSteps &steps)
+{
+    j.at("resize").get_to(steps.resize);
+    j.at("add_transparent_alpha").get_to(steps.add_transparent_alpha);
+    j.at("mipmaps").get_to(steps.mipmaps);
+    j.at("best_format").get_to(steps.best_format);
+    j.at("convert").get_to(steps.convert);
+    steps.encoder = j.value("encoder", EncoderOptions{});
+}
+
+/// Applies `sets` to the texture. `stop` is checked between steps, and while encoding BC7. When a stop is
+/// requested, fails with std::errc::operation_canceled
+[[nodiscard]] auto optimize(Texture &&file,
+                            OptimizationSteps sets,
+                            CompressionDevice &dev,
+                            std::stop_token stop = {}) noexcept -> Result;
 [[nodiscard]] auto optimize(CrunchTexture &&file,
                             OptimizationSteps sets,
-                            CompressionDevice &dev) noexcept -> ResultCrunch;
+                            CompressionDevice &dev,
+                            std::stop_token stop = {}) noexcept -> ResultCrunch;
 [[nodiscard]] auto compute_optimization_steps(const Texture &file,
                                               const Settings &sets) noexcept -> OptimizationSteps;
 [[nodiscard]] auto compute_optimization_steps(const CrunchTexture &file,
                                               const Settings &sets) noexcept -> OptimizationSteps;
+/// Same as for a Texture, from its header only. The pixels are unknown, so the alpha channel is assumed to be
+/// used unless the format or the alpha mode say otherwise.
+[[nodiscard]] auto compute_optimization_steps(const TextureHeader &header,
+                                              const Settings &sets) noexcept -> OptimizationSteps;
 } // namespace btu::tex
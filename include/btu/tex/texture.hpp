@@ -6,9 +6,11 @@
 #pragma once
 
 #include "btu/common/path.hpp"
+#include "btu/tex/analysis.hpp"
 #include "btu/tex/detail/common.hpp"
 
 #include <filesystem>
+#include <optional>
 #include <span>
 #include <type_traits>
 
@@ -37,9 +39,14 @@ public:
 
     void set(ScratchImage &&tex) noexcept;
 
+    /// Forgets the cached analysis, as the pixels may be modified through the result. Prefer the const
+    /// overload to read them
     [[nodiscard]] auto get() noexcept -> ScratchImage &;
     [[nodiscard]] auto get() const noexcept -> const ScratchImage &;
 
+    /// Computed on first use, and cached until the pixels change. Not thread-safe
+    [[nodiscard]] auto analysis() const noexcept -> const PixelAnalysis &;
+
     [[nodiscard]] auto get_images() const noexcept -> std::span<const Image>;
 
     [[nodiscard]] auto get_dimension() const noexcept -> Dimension;
@@ -47,11 +54,13 @@ public:
     [[nodiscard]] auto get_load_path() const noexcept -> const Path &;
     void set_load_path(Path path) noexcept;
 
-    [[nodiscard]] auto operator==(const Texture &) const noexcept -> bool = default;
+    /// The cached analysis is ignored
+    [[nodiscard]] auto operator==(const Texture &other) const noexcept -> bool;
 
 private:
     Path load_path_;
     ScratchImage tex_;
+    mutable std::optional<PixelAnalysis> analysis_;
 };
 
 [[nodiscard]] auto load(Path path) noexcept -> tl::expected<Texture, Error>;
@@ -6,8 +6,21 @@
 #include <bsa/bsa.hpp>
 #include <btu/common/threading.hpp>
 #include <flux.hpp>
-
+#include <lz4.h>
+#include <lz4frame.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <concepts>
 #include <filesystem>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <stop_token>
+#include <string>
+#include <unordered_map>
 #include <utility>
 
 namespace btu::bsa {
@@ -258,7 +271,7 @@ Archive::Archive(const ArchiveVersion ver, const ArchiveType type)
 {
 }
 
-auto Archive::read(Path path) -> std::optional<Archive>
+auto Archive::read(Path path, std::stop_token stop) -> std::optional<Archive>
 {
     if (!exists(path))
         return {};
@@ -281,6 +294,9 @@ auto Archive::read(Path path) -> std::optional<Archive>
 
             for (auto &&[key, file] : std::move(arch))
             {
+                if (stop.stop_requested())
+                    return std::nullopt;
+
                 auto relative_file_path = virtual_to_local_path(key);
 
                 const bool success = res.emplace(common::as_ascii_string(std::move(relative_file_path)),
@@ -308,6 +324,9 @@ auto Archive::read(Path path) -> std::optional<Archive>
             {
                 for (auto &[file_path, file] : std::move(dir))
                 {
+                    if (stop.stop_requested())
+                        return std::nullopt;
+
                     const auto u8str = virtual_to_local_path(dir_path, file_path);
                     const auto str   = common::as_ascii_string(u8str);
 
@@ -339,6 +358,9 @@ auto Archive::read(Path path) -> std::optional<Archive>
 
             for (auto &&[key, file] : std::move(arch))
             {
+                if (stop.stop_requested())
+                    return std::nullopt;
+
                 auto relative_file_path = virtual_to_local_path(key);
                 const bool success      = res.emplace(common::as_ascii_string(std::move(relative_file_path)),
                                                  File(std::move(file), res.ver_, res.type_));
@@ -385,9 +407,9 @@ template<typename Archive, typename WriteFunc>
     return write_and_check(path);
 }
 
-auto Archive::write(Path path) && -> bool
+auto Archive::write(Path path, std::stop_token stop) && -> bool
 {
-    if (files_.empty())
+    if (files_.empty() || stop.stop_requested())
         return false;
 
     create_directories(path.parent_path());
@@ -399,6 +421,8 @@ auto Archive::write(Path path) && -> bool
             libbsa::tes3::archive bsa;
             for (auto &&elem : std::move(files_))
             {
+                if (stop.stop_requested())
+                    return false;
                 bsa.insert(elem.first, std::move(elem.second).as_raw_file<libbsa::tes3::file>());
             }
             return do_write(
@@ -413,6 +437,9 @@ auto Archive::write(Path path) && -> bool
 
             for (auto &&elem : std::move(files_))
             {
+                if (stop.stop_requested())
+                    return false;
+
                 auto elem_path = Path(elem.first);
                 const auto d   = [&] {
                     const auto key = elem_path.parent_path().lexically_normal().generic_string();
@@ -444,6 +471,9 @@ auto Archive::write(Path path) && -> bool
             if (bsa.sounds())
                 bsa.archive_flags(bsa.archive_flags() | libbsa::tes4::archive_flag::retain_file_names);
 
+            if (stop.stop_requested())
+                return false;
+
             return do_write(
                 BTU_MOV(bsa),
                 [this](auto &&bsa, auto &&path) { bsa.write(BTU_FWD(path), *to_tes4_version(ver_)); },
@@ -455,6 +485,8 @@ auto Archive::write(Path path) && -> bool
             libbsa::fo4::archive ba2;
             for (auto &&elem : std::move(files_))
             {
+                if (stop.stop_requested())
+                    return false;
                 ba2.insert(elem.first, std::move(elem.second).as_raw_file<libbsa::fo4::file>());
             }
             return do_write(
@@ -527,4 +559,777 @@ auto Archive::size() const noexcept -> size_t
     return files_.size();
 }
 
+constexpr uint32_t k_tes3_magic = 0x100;
+constexpr uint32_t k_tes4_magic = 0x00415342; // "BSA\0"
+constexpr uint32_t k_fo4_magic  = 0x58445442; // "BTDX"
+
+auto read_file_count(const Path &path) noexcept -> std::optional<size_t>
+{
+    // Only the start of the header is needed. All formats store the file count in the first 24 bytes
+    constexpr size_t k_header_size = 24;
+    auto header                    = std::array<std::byte, k_header_size>{};
+
+    auto in = std::ifstream{path, std::ios_base::in | std::ios_base::binary};
+    in.read(reinterpret_cast<char *>(header.data()), static_cast<std::streamsize>(header.size()));
+    if (!in)
+        return std::nullopt;
+
+    const auto read_u32 = [&header](size_t offset) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < sizeof(value); ++i)
+            value |= std::to_integer<uint32_t>(header.at(offset + i)) << (8 * i);
+        return value;
+    };
+
+    switch (read_u32(0))
+    {
+        case k_tes3_magic: return read_u32(8);
+        case k_tes4_magic: return read_u32(20);
+        case k_fo4_magic: return read_u32(12);
+        default: return std::nullopt;
+    }
+}
+
+/// Reads little-endian values from the tables of an archive. Errors are sticky, check good() at the end
+class TableReader
+{
+public:
+    explicit TableReader(const Path &path)
+        : in_(path, std::ios_base::in | std::ios_base::binary)
+    {
+    }
+
+    template<std::unsigned_integral T>
+    [[nodiscard]] auto read() -> T
+    {
+        auto bytes = std::array<std::byte, sizeof(T)>{};
+        in_.read(reinterpret_cast<char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+
+        T value = 0;
+        for (size_t i = 0; i < sizeof(T); ++i)
+            value |= static_cast<T>(std::to_integer<T>(bytes[i]) << (8 * i));
+        return value;
+    }
+
+    [[nodiscard]] auto read_string(size_t length) -> std::string
+    {
+        auto res = std::string(length, '\0');
+        in_.read(res.data(), static_cast<std::streamsize>(length));
+        return res;
+    }
+
+    /// Reads a null-terminated string
+    [[nodiscard]] auto read_zstring() -> std::string
+    {
+        auto res = std::string{};
+        std::getline(in_, res, '\0');
+        return res;
+    }
+
+    void skip(uint64_t count) { in_.seekg(static_cast<std::streamoff>(count), std::ios_base::cur); }
+    void seek(uint64_t offset) { in_.seekg(static_cast<std::streamoff>(offset)); }
+    [[nodiscard]] auto tell() -> uint64_t { return static_cast<uint64_t>(in_.tellg()); }
+
+    [[nodiscard]] auto good() const noexcept -> bool { return in_.good(); }
+
+private:
+    std::ifstream in_;
+};
+
+/// Counts read from headers are not trusted to reserve memory
+constexpr size_t k_max_reserved_entries = 1ULL << 16;
+
+/// The size of a TES4 file record. The other bits are flags
+constexpr uint32_t k_tes4_size_mask = 0x3FFFFFFF;
+/// Position of the offset of the name table in the header of a FO4 archive
+constexpr uint64_t k_fo4_names_pos_offset = 16;
+
+/// The files of an archive, and where its tables are
+struct ArchiveLayout
+{
+    uint32_t magic = 0;
+    std::vector<FileEntry> entries;
+    /// Position of the record of each entry: the size then the offset, or the offset then the sizes for FO4
+    std::vector<uint64_t> records;
+    /// End of the tables stored before the data
+    uint64_t data_start = 0;
+    /// Start of the tables stored after the data, the names of FO4 archives. 0 if there are none
+    uint64_t trailer_start = 0;
+    /// FO4 and Starfield textures are split in chunks, each with its own record
+    bool chunked = false;
+};
+
+[[nodiscard]] auto entry_name(std::string name) -> std::string
+{
+    std::ranges::replace(name, '\\', '/');
+    return Path(std::move(name)).make_preferred().string();
+}
+
+[[nodiscard]] auto read_tes3_layout(TableReader &in) -> ArchiveLayout
+{
+    constexpr uint64_t k_header_size = 12;
+
+    const auto hash_offset = in.read<uint32_t>();
+    const auto count       = in.read<uint32_t>();
+
+    // Offsets are relative to the data, which follows the hash table
+    auto res       = ArchiveLayout{.magic = k_tes3_magic};
+    res.data_start = k_header_size + hash_offset + uint64_t{count} * sizeof(uint64_t);
+
+    res.entries.reserve(std::min<size_t>(count, k_max_reserved_entries));
+    for (uint32_t i = 0; i < count && in.good(); ++i)
+    {
+        res.records.push_back(in.tell());
+        const auto size   = in.read<uint32_t>();
+        const auto offset = in.read<uint32_t>();
+        res.entries.push_back(FileEntry{.name = {}, .size = size, .offset = res.data_start + offset});
+    }
+
+    // Names are stored in the same order as the files, after the table of their offsets
+    in.skip(uint64_t{count} * sizeof(uint32_t));
+
+    for (auto &entry : res.entries)
+        entry.name = entry_name(in.read_zstring());
+    return res;
+}
+
+[[nodiscard]] auto read_tes4_layout(TableReader &in) -> ArchiveLayout
+{
+    constexpr uint32_t k_fo3_version          = 104;
+    constexpr uint32_t k_sse_version          = 105;
+    constexpr uint32_t k_directory_strings    = 1U << 0;
+    constexpr uint32_t k_file_strings         = 1U << 1;
+    constexpr uint32_t k_compressed           = 1U << 2;
+    constexpr uint32_t k_embedded_names       = 1U << 8;
+    constexpr uint32_t k_compression_toggle   = 1U << 30;
+    constexpr size_t k_folder_record_size     = 16;
+    constexpr size_t k_sse_folder_record_size = 24;
+
+    const auto version      = in.read<uint32_t>();
+    const auto header_size  = in.read<uint32_t>();
+    const auto flags        = in.read<uint32_t>();
+    const auto folder_count = in.read<uint32_t>();
+    const auto file_count   = in.read<uint32_t>();
+
+    in.seek(header_size);
+
+    // Files are compressed by default if the archive is, the size of a file toggles it
+    const bool compressed     = (flags & k_compressed) != 0U;
+    const bool embedded_names = version >= k_fo3_version && (flags & k_embedded_names) != 0U;
+    const auto encoding = version == k_sse_version ? EntryEncoding::SizedLz4Frame : EntryEncoding::SizedZlib;
+
+    // Folder records: hash, file count, then an offset whose size depends on the version
+    auto folder_sizes = std::vector<uint32_t>{};
+    folder_sizes.reserve(std::min<size_t>(folder_count, k_max_reserved_entries));
+    const auto record_size = version == k_sse_version ? k_sse_folder_record_size : k_folder_record_size;
+    for (uint32_t i = 0; i < folder_count && in.good(); ++i)
+    {
+        in.skip(sizeof(uint64_t));
+        folder_sizes.push_back(in.read<uint32_t>());
+        in.skip(record_size - sizeof(uint64_t) - sizeof(uint32_t));
+    }
+
+    // File records, each block preceded by the name of its folder
+    auto folders = std::vector<std::string>{};
+    auto res     = ArchiveLayout{.magic = k_tes4_magic};
+    res.entries.reserve(std::min<size_t>(file_count, k_max_reserved_entries));
+    for (const auto folder_size : folder_sizes)
+    {
+        auto folder = std::string{};
+        if ((flags & k_directory_strings) != 0U)
+        {
+            folder = in.read_string(in.read<uint8_t>());
+            if (!folder.empty() && folder.back() == '\0')
+                folder.pop_back();
+        }
+
+        for (uint32_t i = 0; i < folder_size && in.good(); ++i)
+        {
+            in.skip(sizeof(uint64_t));
+            res.records.push_back(in.tell());
+            const auto size   = in.read<uint32_t>();
+            const auto offset = in.read<uint32_t>();
+            const bool packed = compressed != ((size & k_compression_toggle) != 0U);
+            res.entries.push_back(FileEntry{.name          = {},
+                                            .size          = size & k_tes4_size_mask,
+                                            .offset        = offset,
+                                            .encoding      = packed ? encoding : EntryEncoding::Raw,
+                                            .embedded_name = embedded_names});
+            folders.push_back(folder);
+        }
+    }
+
+    if ((flags & k_file_strings) != 0U)
+    {
+        for (size_t i = 0; i < res.entries.size(); ++i)
+        {
+            auto name = in.read_zstring();
+            if (!folders[i].empty() && folders[i] != ".")
+                name = folders[i] + '\\' + name;
+            res.entries[i].name = entry_name(std::move(name));
+        }
+    }
+    res.data_start = in.tell();
+    return res;
+}
+
+[[nodiscard]] auto read_fo4_layout(TableReader &in) -> ArchiveLayout
+{
+    constexpr uint32_t k_dx10_type       = 0x30315844; // "DX10"
+    constexpr uint32_t k_lz4_compression = 3;
+    constexpr uint8_t k_cubemap_flag     = 1U << 0;
+    constexpr size_t k_v2_extra_header   = 8;
+    constexpr size_t k_general_record    = 36;
+    constexpr size_t k_texture_chunk     = 24;
+    constexpr size_t k_chunk_count_index = 13;
+
+    const auto version   = in.read<uint32_t>();
+    const auto type      = in.read<uint32_t>();
+    const auto count     = in.read<uint32_t>();
+    const auto names_pos = in.read<uint64_t>();
+
+    // Starfield archives have a longer header, which may switch compression to LZ4
+    auto packed_encoding = EntryEncoding::Zlib;
+    if (version == 2)
+        in.skip(k_v2_extra_header);
+    else if (version == 3)
+    {
+        in.skip(sizeof(uint64_t));
+        if (in.read<uint32_t>() == k_lz4_compression)
+            packed_encoding = EntryEncoding::Lz4Block;
+    }
+
+    // \return The stored size, and whether the data is compressed
+    const auto read_size = [&in] {
+        const auto packed   = in.read<uint32_t>();
+        const auto unpacked = in.read<uint32_t>();
+        return std::pair(packed != 0 ? packed : unpacked, packed != 0);
+    };
+
+    auto res = ArchiveLayout{
+        .magic         = k_fo4_magic,
+        .trailer_start = names_pos,
+        .chunked       = type == k_dx10_type,
+    };
+    res.entries.reserve(std::min<size_t>(count, k_max_reserved_entries));
+    for (uint32_t i = 0; i < count && in.good(); ++i)
+    {
+        auto entry = FileEntry{.name = {}, .size = 0};
+        if (res.chunked)
+        {
+            in.skip(k_chunk_count_index);
+            const auto chunk_count = in.read<uint8_t>();
+            in.skip(sizeof(uint16_t)); // size of the chunk headers
+            const auto height    = in.read<uint16_t>();
+            const auto width     = in.read<uint16_t>();
+            const auto mip_count = in.read<uint8_t>();
+            const auto format    = in.read<uint8_t>();
+            const auto flags     = in.read<uint8_t>();
+            in.skip(sizeof(uint8_t)); // tile mode
+
+            entry.texture = TextureRecord{.width     = width,
+                                          .height    = height,
+                                          .mip_count = mip_count,
+                                          .format    = format,
+                                          .cubemap   = (flags & k_cubemap_flag) != 0U};
+            for (uint8_t chunk = 0; chunk < chunk_count; ++chunk)
+            {
+                const auto offset = in.read<uint64_t>();
+                if (chunk == 0)
+                    entry.offset = offset;
+                const auto [size, packed] = read_size();
+                entry.size += size;
+                if (packed)
+                    entry.encoding = packed_encoding;
+                in.skip(k_texture_chunk - sizeof(uint64_t) - 2 * sizeof(uint32_t));
+            }
+        }
+        else
+        {
+            // Hashes of the name, the extension and the folder, then flags
+            in.skip(k_general_record - sizeof(uint64_t) - 3 * sizeof(uint32_t));
+            res.records.push_back(in.tell());
+            entry.offset              = in.read<uint64_t>();
+            const auto [size, packed] = read_size();
+            entry.size                = size;
+            entry.encoding            = packed ? packed_encoding : EntryEncoding::Raw;
+            in.skip(sizeof(uint32_t)); // sentinel
+        }
+        res.entries.push_back(std::move(entry));
+    }
+    res.data_start = in.tell();
+
+    in.seek(names_pos);
+    for (auto &entry : res.entries)
+        entry.name = entry_name(in.read_string(in.read<uint16_t>()));
+    return res;
+}
+
+[[nodiscard]] auto read_layout(const Path &path) -> std::optional<ArchiveLayout>
+{
+    auto in     = TableReader(path);
+    auto layout = [&in]() -> std::optional<ArchiveLayout> {
+        switch (in.read<uint32_t>())
+        {
+            case k_tes3_magic: return read_tes3_layout(in);
+            case k_tes4_magic: return read_tes4_layout(in);
+            case k_fo4_magic: return read_fo4_layout(in);
+            default: return std::nullopt;
+        }
+    }();
+
+    // A truncated table means a corrupted archive
+    if (!in.good())
+        return std::nullopt;
+    return layout;
+}
+
+auto read_file_list(const Path &path) noexcept -> std::optional<std::vector<FileEntry>>
+{
+    try
+    {
+        auto layout = read_layout(path);
+        if (!layout)
+            return std::nullopt;
+        return std::move(layout->entries);
+    }
+    catch (const std::exception &)
+    {
+        return std::nullopt;
+    }
+}
+
+/// Compressed data is read by blocks of this size, until enough of it is decompressed
+constexpr size_t k_read_block_size = 16ULL * 1024;
+
+/// Decompresses the start of a zlib stream into `out`, shrunk if the stream ends earlier.
+/// `read` returns the next bytes of the stream, or nothing at its end
+template<class Read>
+[[nodiscard]] auto inflate_start(Read &&read, std::vector<std::byte> &out) -> bool
+{
+    auto stream = z_stream{};
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+
+    stream.next_out  = reinterpret_cast<Bytef *>(out.data());
+    stream.avail_out = static_cast<uInt>(out.size());
+
+    auto input = std::vector<std::byte>{};
+    int ret    = Z_OK;
+    while (stream.avail_out > 0 && ret == Z_OK)
+    {
+        if (stream.avail_in == 0)
+        {
+            input = read(k_read_block_size);
+            if (input.empty())
+                break;
+            stream.next_in  = reinterpret_cast<Bytef *>(input.data());
+            stream.avail_in = static_cast<uInt>(input.size());
+        }
+        ret = inflate(&stream, Z_NO_FLUSH);
+    }
+
+    out.resize(out.size() - stream.avail_out);
+    inflateEnd(&stream);
+    return ret == Z_OK || ret == Z_STREAM_END;
+}
+
+/// Same as inflate_start, for an LZ4 frame
+template<class Read>
+[[nodiscard]] auto lz4_frame_start(Read &&read, std::vector<std::byte> &out) -> bool
+{
+    LZ4F_dctx *ctx = nullptr;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+        return false;
+
+    size_t written = 0;
+    bool ok        = true;
+    bool finished  = false;
+    while (ok && !finished && written < out.size())
+    {
+        const auto input = read(k_read_block_size);
+        if (input.empty())
+            break;
+
+        size_t pos = 0;
+        while (pos < input.size() && written < out.size())
+        {
+            auto src_size  = input.size() - pos;
+            auto dest_size = out.size() - written;
+            // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            const auto hint = LZ4F_decompress(ctx,
+                                              out.data() + written,
+                                              &dest_size,
+                                              input.data() + pos,
+                                              &src_size,
+                                              nullptr);
+            // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            ok = !LZ4F_isError(hint);
+            if (!ok)
+                break;
+            pos += src_size;
+            written += dest_size;
+            // The end of the frame
+            finished = hint == 0;
+            if (finished)
+                break;
+        }
+    }
+
+    LZ4F_freeDecompressionContext(ctx);
+    out.resize(written);
+    return ok;
+}
+
+auto read_file_start(const Path &archive_path, const FileEntry &entry, size_t count) noexcept
+    -> std::optional<std::vector<std::byte>>
+{
+    if (entry.texture)
+        return std::nullopt;
+
+    try
+    {
+        auto in = std::ifstream(archive_path, std::ios_base::in | std::ios_base::binary);
+        in.seekg(static_cast<std::streamoff>(entry.offset));
+
+        // Bytes of the stored file left to read
+        auto remaining = entry.size;
+        const auto skip = [&](uintmax_t bytes) {
+            in.seekg(static_cast<std::streamoff>(bytes), std::ios_base::cur);
+            remaining -= std::min(remaining, bytes);
+        };
+
+        if (entry.embedded_name)
+        {
+            // The length of the path, then the path
+            const auto length = static_cast<uint8_t>(in.get());
+            remaining -= std::min<uintmax_t>(remaining, 1);
+            skip(length);
+        }
+        if (entry.encoding == EntryEncoding::SizedZlib || entry.encoding == EntryEncoding::SizedLz4Frame)
+            skip(sizeof(uint32_t)); // decompressed size
+        if (!in)
+            return std::nullopt;
+
+        const auto read = [&](uintmax_t max) {
+            auto res = std::vector<std::byte>(static_cast<size_t>(std::min(max, remaining)));
+            in.read(reinterpret_cast<char *>(res.data()), static_cast<std::streamsize>(res.size()));
+            res.resize(static_cast<size_t>(in.gcount()));
+            remaining -= res.size();
+            return res;
+        };
+
+        auto res = std::vector<std::byte>(count);
+        switch (entry.encoding)
+        {
+            case EntryEncoding::Raw: return read(count);
+            case EntryEncoding::Zlib:
+            case EntryEncoding::SizedZlib:
+                if (!inflate_start(read, res))
+                    return std::nullopt;
+                return res;
+            case EntryEncoding::SizedLz4Frame:
+                if (!lz4_frame_start(read, res))
+                    return std::nullopt;
+                return res;
+            case EntryEncoding::Lz4Block:
+            {
+                // Blocks cannot be decompressed in parts, but only the start is written
+                const auto input   = read(remaining);
+                const auto written = LZ4_decompress_safe_partial(reinterpret_cast<const char *>(input.data()),
+                                                                 reinterpret_cast<char *>(res.data()),
+                                                                 static_cast<int>(input.size()),
+                                                                 static_cast<int>(res.size()),
+                                                                 static_cast<int>(res.size()));
+                if (written < 0)
+                    return std::nullopt;
+                res.resize(static_cast<size_t>(written));
+                return res;
+            }
+        }
+        return std::nullopt;
+    }
+    catch (const std::exception &)
+    {
+        return std::nullopt;
+    }
+}
+
+/// Entries are copied by blocks of this size
+constexpr size_t k_copy_block_size = 1024ULL * 1024;
+
+/// Copies `count` bytes of `in`, from `offset`, to the end of `out`
+[[nodiscard]] auto copy_range(std::istream &in,
+                              std::ostream &out,
+                              uint64_t offset,
+                              uint64_t count,
+                              std::vector<char> &buffer) -> bool
+{
+    in.seekg(static_cast<std::streamoff>(offset));
+    while (count > 0 && in)
+    {
+        in.read(buffer.data(), static_cast<std::streamsize>(std::min<uint64_t>(count, buffer.size())));
+        const auto read = static_cast<uint64_t>(in.gcount());
+        out.write(buffer.data(), static_cast<std::streamsize>(read));
+        count -= read;
+    }
+    return count == 0 && out.good();
+}
+
+template<std::unsigned_integral T>
+void write_le(std::ostream &out, T value)
+{
+    auto bytes = std::array<char, sizeof(T)>{};
+    for (size_t i = 0; i < sizeof(T); ++i)
+        bytes.at(i) = static_cast<char>((value >> (8 * i)) & 0xFFU);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+template<std::unsigned_integral T>
+[[nodiscard]] auto read_le(std::istream &in, uint64_t offset) -> T
+{
+    auto bytes = std::array<char, sizeof(T)>{};
+    in.seekg(static_cast<std::streamoff>(offset));
+    in.read(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); ++i)
+        value |= static_cast<T>(static_cast<T>(static_cast<uint8_t>(bytes.at(i))) << (8 * i));
+    return value;
+}
+
+/// \return `content` stored as `encoding`, without the decompressed size of the sized encodings
+[[nodiscard]] auto encode_entry(std::span<const std::byte> content, EntryEncoding encoding)
+    -> std::optional<std::vector<std::byte>>
+{
+    switch (encoding)
+    {
+        case EntryEncoding::Raw: return std::vector(content.begin(), content.end());
+        case EntryEncoding::Zlib:
+        case EntryEncoding::SizedZlib:
+        {
+            auto size = compressBound(static_cast<uLong>(content.size()));
+            auto res  = std::vector<std::byte>(size);
+            if (compress2(reinterpret_cast<Bytef *>(res.data()),
+                          &size,
+                          reinterpret_cast<const Bytef *>(content.data()),
+                          static_cast<uLong>(content.size()),
+                          Z_DEFAULT_COMPRESSION)
+                != Z_OK)
+                return std::nullopt;
+            res.resize(size);
+            return res;
+        }
+        case EntryEncoding::SizedLz4Frame:
+        {
+            auto res        = std::vector<std::byte>(LZ4F_compressFrameBound(content.size(), nullptr));
+            const auto size = LZ4F_compressFrame(res.data(),
+                                                 res.size(),
+                                                 content.data(),
+                                                 content.size(),
+                                                 nullptr);
+            if (LZ4F_isError(size))
+                return std::nullopt;
+            res.resize(size);
+            return res;
+        }
+        case EntryEncoding::Lz4Block:
+        {
+            if (content.size() > LZ4_MAX_INPUT_SIZE)
+                return std::nullopt;
+            const auto src_size = static_cast<int>(content.size());
+            auto res            = std::vector<std::byte>(static_cast<size_t>(LZ4_compressBound(src_size)));
+            const auto size     = LZ4_compress_default(reinterpret_cast<const char *>(content.data()),
+                                                   reinterpret_cast<char *>(res.data()),
+                                                   src_size,
+                                                   static_cast<int>(res.size()));
+            if (size <= 0)
+                return std::nullopt;
+            res.resize(static_cast<size_t>(size));
+            return res;
+        }
+    }
+    return std::nullopt;
+}
+
+/// Names of entries differ in case and separators between Archive and read_file_list
+[[nodiscard]] auto entry_key(std::string_view name) -> std::string
+{
+    auto res = std::string(name);
+    for (auto &c : res)
+        c = c == '\\' ? '/' : static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return res;
+}
+
+/// Where an entry was written by rewrite_archive
+struct WrittenEntry
+{
+    uint64_t offset = 0;
+    uint64_t size   = 0;
+    /// Only for replaced entries, whose records change
+    std::optional<uint64_t> decompressed_size;
+};
+
+/// Writes the new position and size of the entries in the copied tables
+[[nodiscard]] auto patch_records(const ArchiveLayout &layout,
+                                 std::span<const WrittenEntry> written,
+                                 std::istream &in,
+                                 std::ostream &out) -> bool
+{
+    constexpr uint64_t k_max_u32 = std::numeric_limits<uint32_t>::max();
+
+    for (size_t i = 0; i < written.size(); ++i)
+    {
+        const auto &entry = written[i];
+        out.seekp(static_cast<std::streamoff>(layout.records[i]));
+        switch (layout.magic)
+        {
+            case k_tes3_magic:
+            {
+                // Offsets are relative to the data
+                const auto offset = entry.offset - layout.data_start;
+                if (entry.size > k_max_u32 || offset > k_max_u32)
+                    return false;
+                write_le(out, static_cast<uint32_t>(entry.size));
+                write_le(out, static_cast<uint32_t>(offset));
+                break;
+            }
+            case k_tes4_magic:
+            {
+                if (entry.size > k_tes4_size_mask || entry.offset > k_max_u32)
+                    return false;
+                // Keeps the flags, compression is not changed
+                const auto flags = read_le<uint32_t>(in, layout.records[i]) & ~k_tes4_size_mask;
+                write_le(out, static_cast<uint32_t>(entry.size) | flags);
+                write_le(out, static_cast<uint32_t>(entry.offset));
+                break;
+            }
+            case k_fo4_magic:
+            {
+                write_le(out, entry.offset);
+                if (!entry.decompressed_size)
+                    break;
+                if (entry.size > k_max_u32 || *entry.decompressed_size > k_max_u32)
+                    return false;
+                const bool packed = layout.entries[i].encoding != EntryEncoding::Raw;
+                write_le(out, packed ? static_cast<uint32_t>(entry.size) : uint32_t{0});
+                write_le(out, static_cast<uint32_t>(*entry.decompressed_size));
+                break;
+            }
+            default: return false;
+        }
+    }
+    return out.good();
+}
+
+auto rewrite_archive(const Path &source,
+                     const Path &dest,
+                     std::span<const ReplacedEntry> replaced,
+                     std::stop_token stop) noexcept -> bool
+{
+    try
+    {
+        const auto layout = read_layout(source);
+        if (!layout || layout->chunked || layout->records.size() != layout->entries.size())
+            return false;
+        const auto &entries = layout->entries;
+
+        auto by_name = std::unordered_map<std::string, const ReplacedEntry *>{};
+        for (const auto &entry : replaced)
+            by_name.emplace(entry_key(entry.name), &entry);
+
+        auto replacements = std::vector<const ReplacedEntry *>(entries.size(), nullptr);
+        size_t found      = 0;
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            if (const auto it = by_name.find(entry_key(entries[i].name)); it != by_name.end())
+            {
+                replacements[i] = it->second;
+                ++found;
+            }
+        }
+        // A replaced entry would be lost
+        if (found != by_name.size())
+            return false;
+
+        auto in     = std::ifstream(source, std::ios_base::in | std::ios_base::binary);
+        auto out    = std::ofstream(dest, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        auto buffer = std::vector<char>(k_copy_block_size);
+        if (!copy_range(in, out, 0, layout->data_start, buffer))
+            return false;
+
+        // The data is read in the order it is stored
+        auto order = std::vector<size_t>(entries.size());
+        std::iota(order.begin(), order.end(), size_t{0});
+        std::ranges::stable_sort(order, {}, [&entries](size_t i) { return entries[i].offset; });
+
+        auto written = std::vector<WrittenEntry>(entries.size());
+        for (const auto i : order)
+        {
+            if (stop.stop_requested())
+                return false;
+
+            const auto &entry = entries[i];
+            const auto start  = static_cast<uint64_t>(out.tellp());
+            if (replacements[i] == nullptr)
+            {
+                if (!copy_range(in, out, entry.offset, entry.size, buffer))
+                    return false;
+                written[i] = WrittenEntry{.offset = start, .size = entry.size};
+                continue;
+            }
+
+            const auto content = replacements[i]->content();
+            if (!content)
+                return false;
+
+            // The name stored before the content is kept: the length, then the name
+            if (entry.embedded_name)
+            {
+                const auto length = read_le<uint8_t>(in, entry.offset);
+                if (!copy_range(in, out, entry.offset, uint64_t{1} + length, buffer))
+                    return false;
+            }
+            if (entry.encoding == EntryEncoding::SizedZlib || entry.encoding == EntryEncoding::SizedLz4Frame)
+            {
+                if (content->size() > std::numeric_limits<uint32_t>::max())
+                    return false;
+                write_le(out, static_cast<uint32_t>(content->size()));
+            }
+
+            const auto stored = encode_entry(*content, entry.encoding);
+            if (!stored)
+                return false;
+            out.write(reinterpret_cast<const char *>(stored->data()),
+                      static_cast<std::streamsize>(stored->size()));
+
+            written[i] = WrittenEntry{
+                .offset            = start,
+                .size              = static_cast<uint64_t>(out.tellp()) - start,
+                .decompressed_size = content->size(),
+            };
+        }
+
+        if (layout->trailer_start != 0)
+        {
+            const auto trailer = static_cast<uint64_t>(out.tellp());
+            const auto size    = fs::file_size(source);
+            if (size < layout->trailer_start
+                || !copy_range(in, out, layout->trailer_start, size - layout->trailer_start, buffer))
+                return false;
+            out.seekp(static_cast<std::streamoff>(k_fo4_names_pos_offset));
+            write_le(out, trailer);
+        }
+
+        if (!patch_records(*layout, written, in, out))
+            return false;
+        out.close();
+        return !out.fail();
+    }
+    catch (const std::exception &)
+    {
+        return false;
+    }
+}
+
 } // namespace btu::bsa
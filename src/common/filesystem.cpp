@@ -4,6 +4,14 @@
 
 #include <fstream>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace btu::common {
 auto read_file(const Path &a_path) noexcept -> tl::expected<std::vector<std::byte>, Error>
 {
@@ -45,6 +53,36 @@ auto write_file_new(const Path &a_path, std::span<const std::byte> data) noexcep
     return write_file(a_path, data);
 }
 
+auto replace_file(const Path &a_path, std::span<const std::byte> data) noexcept -> tl::expected<void, Error>
+{
+    auto tmp_path = a_path;
+    tmp_path += u8".btu-tmp";
+
+    if (auto res = write_file(tmp_path, data); !res)
+    {
+        auto ec = std::error_code{};
+        fs::remove(tmp_path, ec);
+        return res;
+    }
+
+    // The new file is created with the default permissions, keep those of the replaced file instead
+    auto ec = std::error_code{};
+    if (const auto status = fs::status(a_path, ec); !ec)
+        fs::permissions(tmp_path, status.permissions(), ec);
+    else if (status.type() == fs::file_type::not_found)
+        ec.clear();
+
+    if (!ec)
+        fs::rename(tmp_path, a_path, ec);
+    if (ec)
+    {
+        auto remove_ec = std::error_code{};
+        fs::remove(tmp_path, remove_ec);
+        return tl::make_unexpected(Error(ec));
+    }
+    return {};
+}
+
 auto compare_files(const Path &filename1, const Path &filename2) noexcept -> bool
 {
     try
@@ -160,6 +198,57 @@ auto hard_link(const Path &from, const Path &to) noexcept -> tl::expected<void,
     }
 }
 
+#ifdef __linux__
+[[nodiscard]] auto reflink(const Path &from, const Path &to) noexcept -> bool
+{
+    const int src = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0)
+        return false;
+
+    struct stat st = {};
+    if (::fstat(src, &st) != 0)
+    {
+        ::close(src);
+        return false;
+    }
+
+    const int dst = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (dst < 0)
+    {
+        ::close(src);
+        return false;
+    }
+
+    const bool cloned = ::ioctl(dst, FICLONE, src) == 0;
+    ::close(dst);
+    ::close(src);
+
+    if (!cloned)
+        ::unlink(to.c_str());
+    return cloned;
+}
+#endif
+
+auto clone_file(const Path &from, const Path &to) noexcept -> tl::expected<CloneMethod, Error>
+{
+#ifdef __linux__
+    if (reflink(from, to))
+        return CloneMethod::Reflink;
+#endif
+
+    auto ec = std::error_code{};
+    create_hard_link(from, to, ec);
+    if (!ec)
+        return CloneMethod::HardLink;
+
+    // Different filesystems, or a filesystem without hard links
+    ec.clear();
+    fs::copy_file(from, to, ec);
+    if (ec)
+        return tl::make_unexpected(Error(ec));
+    return CloneMethod::Copy;
+}
+
 auto find_matching_paths_icase(const Path &directory,
                                std::span<const Path> relative_lowercase_paths) noexcept -> std::vector<Path>
 {
@@ -13,7 +13,10 @@
 #include <tl/expected.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <stop_token>
+#include <tuple>
 
 using namespace std::literals;
 
@@ -128,14 +131,38 @@ auto AnimExe::make(Path exe_dir) noexcept -> tl::expected<AnimExe, Error>
     return dir_path;
 }
 
+/// Runs the process until it exits, `options.deadline` passes or `stop` is requested.
+/// In the last two cases, the process is killed.
 [[nodiscard]] auto reproc(const std::vector<std::string> &args,
-                          const reproc::options &options) -> tl::expected<int, Error>
+                          const reproc::options &options,
+                          const std::stop_token &stop) -> tl::expected<int, Error>
 {
-    auto [result, ec] = run(args, options);
-    if (ec)
+    // How often the stop token is checked while the process runs
+    constexpr auto k_poll_interval = reproc::milliseconds(50);
+
+    auto process = reproc::process{};
+    if (const auto ec = process.start(args, options))
         return tl::make_unexpected(Error(ec));
 
-    return result;
+    const auto deadline = std::chrono::steady_clock::now() + options.deadline;
+    while (true)
+    {
+        auto [result, ec] = process.wait(k_poll_interval);
+        if (!ec)
+            return result;
+        if (ec != std::errc::timed_out)
+            return tl::make_unexpected(Error(ec));
+
+        const auto errc = stop.stop_requested() ? std::errc::operation_canceled
+                          : std::chrono::steady_clock::now() >= deadline ? std::errc::timed_out
+                                                                         : std::errc{};
+        if (errc != std::errc{})
+        {
+            std::ignore = process.kill();
+            std::ignore = process.wait(reproc::infinite);
+            return tl::make_unexpected(Error(std::make_error_code(errc)));
+        }
+    }
 }
 
 [[nodiscard]] auto find_appropriate_exe(const std::vector<detail::AnimExeRef> &detected,
@@ -245,7 +272,8 @@ AnimExe::AnimExe(Path exe_dir, std::vector<detail::AnimExeRef> detected) noexcep
 }
 
 auto AnimExe::convert_impl(const Game target_game,
-                           const CopyInput &copy_input) const noexcept -> tl::expected<Path, Error>
+                           const CopyInput &copy_input,
+                           const std::stop_token &stop) const noexcept -> tl::expected<Path, Error>
 {
     const auto working_dir = make_working_dir();
     auto options           = working_dir.map(make_reproc_options);
@@ -267,7 +295,16 @@ auto AnimExe::convert_impl(const Game target_game,
 
     const auto args = exe->get().get_full_args(exe_dir_);
 
-    return reproc(args, *options)
+    auto exit_code = reproc(args, *options, stop);
+    if (!exit_code && exit_code.error() == std::errc::operation_canceled)
+    {
+        // Nothing useful is left in the working directory
+        auto ec = std::error_code{};
+        fs::remove_all(*working_dir, ec);
+        return tl::make_unexpected(exit_code.error());
+    }
+
+    return std::move(exit_code)
         .and_then([](const int result) noexcept -> ResultError {
             return result == 0 ? ResultError{} : tl::make_unexpected(Error(AnimErr::ExeFailed));
         })
@@ -280,20 +317,26 @@ auto AnimExe::convert_impl(const Game target_game,
         });
 }
 
-auto AnimExe::convert(const Game target_game, const Path &input, const Path &output) const -> ResultError
+auto AnimExe::convert(const Game target_game,
+                      const Path &input,
+                      const Path &output,
+                      std::stop_token stop) const -> ResultError
 {
-    return convert_impl(target_game,
-                        [&](const Path &input_path) { return copy_input_file(input, input_path); })
+    return convert_impl(
+               target_game,
+               [&](const Path &input_path) { return copy_input_file(input, input_path); },
+               stop)
         .and_then([&](const Path &output_path) { return move_output_to_file(output_path, output); });
 }
 
-auto AnimExe::convert(const Game target_game, const std::span<const std::byte> input) const
-    -> tl::expected<std::vector<std::byte>, Error>
+auto AnimExe::convert(const Game target_game,
+                      const std::span<const std::byte> input,
+                      std::stop_token stop) const -> tl::expected<std::vector<std::byte>, Error>
 {
-    return convert_impl(target_game,
-                        [&](const Path &input_path) -> ResultError {
-                            return common::write_file(input_path, input);
-                        })
+    return convert_impl(
+               target_game,
+               [&](const Path &input_path) -> ResultError { return common::write_file(input_path, input); },
+               stop)
         .and_then(move_output_to_memory);
 }
 
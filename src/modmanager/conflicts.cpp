@@ -0,0 +1,147 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/conflicts.hpp"
+
+#include "btu/bsa/archive.hpp"
+#include "btu/bsa/settings.hpp"
+#include "btu/common/algorithms.hpp"
+#include "btu/common/string.hpp"
+#include "btu/modmanager/detail/transform.hpp"
+
+#include <algorithm>
+#include <fstream>
+
+namespace btu::modmanager {
+auto read_mo2_load_order(const Path &mods_dir, const Path &modlist)
+    -> tl::expected<std::vector<Path>, common::Error>
+{
+    auto in = std::ifstream{modlist};
+    if (!in)
+        return tl::make_unexpected(common::Error(std::error_code(errno, std::system_category())));
+
+    auto res  = std::vector<Path>{};
+    auto line = std::string{};
+    while (std::getline(in, line))
+    {
+        // Files written on Windows
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        // '+' is an enabled mod. '-' is disabled, '*' is managed outside of MO2 (DLCs), '#' is a comment
+        if (line.size() < 2 || line.front() != '+')
+            continue;
+
+        auto dir = mods_dir / common::as_utf8(std::string_view(line).substr(1));
+        if (fs::is_directory(dir))
+            res.emplace_back(std::move(dir));
+    }
+
+    std::ranges::reverse(res);
+    return res;
+}
+
+[[nodiscard]] auto canonize_relative_path(std::u8string_view path) -> std::u8string
+{
+    auto res = common::to_lower(path);
+    common::backslash_to_slash(res);
+    return res;
+}
+
+FileConflicts::FileConflicts(std::span<const Path> mods_by_priority)
+    : mods_(mods_by_priority.begin(), mods_by_priority.end())
+{
+    auto add = [this](std::u8string relative_path, Provider provider) {
+        providers_[canonize_relative_path(relative_path)].push_back(provider);
+    };
+
+    for (size_t i = 0; i < mods_.size(); ++i)
+    {
+        const auto &dir = mods_[i];
+        mod_indices_.emplace(dir, i);
+        mod_indices_.emplace(detail::canonical_mod_dir(dir), i);
+
+        for (const auto &entry : fs::recursive_directory_iterator(dir))
+        {
+            const auto &path = entry.path();
+            if (!entry.is_regular_file() || detail::is_temporary_path(path.lexically_relative(dir)))
+                continue;
+
+            const auto ext = common::to_lower(path.extension().u8string());
+            if (!common::contains(bsa::k_archive_extensions, ext))
+            {
+                add(path.lexically_relative(dir).generic_u8string(), Provider{.mod = i, .in_archive = false});
+                continue;
+            }
+
+            // Only the names are needed: the file table is enough, the content is not decompressed
+            if (const auto entries = bsa::read_file_list(path))
+                for (const auto &entry : *entries)
+                    add(common::as_utf8_string(entry.name), Provider{.mod = i, .in_archive = true});
+        }
+    }
+
+    for (auto &[path, providers] : providers_)
+        std::ranges::stable_sort(providers, std::greater{}, &Provider::rank);
+}
+
+auto FileConflicts::find_mod(const Path &mod_dir) const noexcept -> std::optional<size_t>
+{
+    // Most lookups use the directory given to the constructor, and do not touch the disk
+    auto it = mod_indices_.find(mod_dir);
+    if (it == mod_indices_.end())
+        it = mod_indices_.find(detail::canonical_mod_dir(mod_dir));
+    if (it == mod_indices_.end())
+        return std::nullopt;
+    return it->second;
+}
+
+auto FileConflicts::contains(const Path &mod_dir) const noexcept -> bool
+{
+    return find_mod(mod_dir).has_value();
+}
+
+auto FileConflicts::is_winner(const Path &mod_dir, const Path &relative_path, bool in_archive) const noexcept
+    -> tl::expected<bool, common::Error>
+{
+    const auto mod = find_mod(mod_dir);
+    if (!mod)
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::invalid_argument)));
+
+    const auto providers = providers_.find(canonize_relative_path(relative_path.generic_u8string()));
+    if (providers == providers_.end())
+        return true;
+
+    const auto &winner = providers->second.front();
+    return winner.mod == *mod && winner.in_archive == in_archive;
+}
+
+auto FileConflicts::conflicts() const -> std::vector<Conflict>
+{
+    auto res = std::vector<Conflict>{};
+    for (const auto &[path, providers] : providers_)
+    {
+        if (providers.size() < 2)
+            continue;
+
+        const auto &winner = providers.front();
+        auto conflict      = Conflict{.relative_path = path, .winner = mods_[winner.mod], .losers = {}};
+        for (const auto &loser : std::span(providers).subspan(1))
+        {
+            // The loose file of a mod overrides its archived copy, which loses too. Copies in several
+            // archives of the same mod are not told apart
+            if (loser.mod == winner.mod && loser.in_archive == winner.in_archive)
+                continue;
+            if (!common::contains(conflict.losers, mods_[loser.mod]))
+                conflict.losers.push_back(mods_[loser.mod]);
+        }
+
+        if (!conflict.losers.empty())
+            res.push_back(std::move(conflict));
+    }
+    std::ranges::sort(res, {}, &Conflict::relative_path);
+    return res;
+}
+} // namespace btu::modmanager
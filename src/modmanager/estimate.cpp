@@ -0,0 +1,396 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/estimate.hpp"
+
+#include "btu/bsa/archive.hpp"
+#include "btu/common/filesystem.hpp"
+#include "btu/common/string.hpp"
+#include "btu/modmanager/detail/transform.hpp"
+
+#include <btu/tex/dxtex.hpp>
+#include <btu/tex/functions.hpp>
+#include <btu/tex/header.hpp>
+#include <btu/tex/texture.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <tuple>
+#include <utility>
+
+namespace btu::modmanager {
+constexpr auto k_dds_ext = std::u8string_view(u8".dds");
+constexpr auto k_nif_ext = std::u8string_view(u8".nif");
+
+/// Width and height of the texture encoded by EncodeRates::measure
+constexpr size_t k_sample_dim = 256;
+
+[[nodiscard]] auto make_sample_texture() -> tex::Texture
+{
+    auto image = tex::ScratchImage{};
+    auto res   = tex::Texture{};
+    if (FAILED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, k_sample_dim, k_sample_dim, 1, 1)))
+        return res;
+
+    // Noise over a gradient. Encoders are much faster on flat colors, which would not be representative
+    uint32_t state = 0x12345678;
+    auto *pixels   = image.GetPixels();
+    for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+    {
+        state = state * 1664525U + 1013904223U;
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        pixels[i] = static_cast<uint8_t>(i / 4 % k_sample_dim + (state >> 28U));
+    }
+
+    res.set(std::move(image));
+    return res;
+}
+
+/// \return `amount` divided by the time taken by `f`, in seconds
+template<class F>
+[[nodiscard]] auto measure_rate(double amount, F &&f) -> double
+{
+    constexpr double k_min_seconds = 1e-6;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::forward<F>(f)();
+    const auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    return amount / std::max(elapsed.count(), k_min_seconds);
+}
+
+/// Reads up to 8 MB of the files already in `dir`. A file written for the benchmark would be read back from
+/// the page cache, and would have to be created among the mods. \return 0 if `dir` holds no file
+[[nodiscard]] auto measure_io_rate(const Path &dir) -> double
+{
+    constexpr uintmax_t k_sample_size = 8ULL * 1024 * 1024;
+    constexpr size_t k_block_size     = 256ULL * 1024;
+
+    auto samples = std::vector<std::pair<Path, uintmax_t>>{};
+    auto total   = uintmax_t{0};
+
+    auto ec = std::error_code{};
+    for (auto it = fs::recursive_directory_iterator(dir, ec);
+         !ec && it != fs::recursive_directory_iterator() && total < k_sample_size;
+         it.increment(ec))
+    {
+        auto size = it->is_regular_file(ec) ? it->file_size(ec) : 0;
+        if (ec)
+            size = 0;
+        ec.clear();
+        const auto count = std::min(size, k_sample_size - total);
+        if (count > 0)
+            samples.emplace_back(it->path(), count);
+        total += count;
+    }
+    if (total == 0)
+        return 0;
+
+    auto read       = uintmax_t{0};
+    const auto rate = measure_rate(1.0, [&] {
+        auto buffer = std::vector<char>(k_block_size);
+        for (const auto &[path, count] : samples)
+        {
+            auto in = std::ifstream(path, std::ios::binary);
+            for (auto left = count; in && left > 0;)
+            {
+                in.read(buffer.data(), static_cast<std::streamsize>(std::min<uintmax_t>(left, k_block_size)));
+                const auto got = static_cast<uintmax_t>(in.gcount());
+                read += got;
+                left -= got;
+            }
+        }
+    });
+    return rate * static_cast<double>(read);
+}
+
+auto EncodeRates::measure(tex::CompressionDevice &dev,
+                          const Path &dir,
+                          const tex::EncoderOptions &encoder) noexcept -> EncodeRates
+{
+    // Without a sample mesh, use a typical rate of nifly
+    constexpr double k_mesh_bytes_per_second = 32.0 * 1024 * 1024;
+    constexpr double k_pixels                = k_sample_dim * k_sample_dim;
+
+    auto res = EncodeRates{
+        .bc7_pixels_per_second     = 0,
+        .bc_pixels_per_second      = 0,
+        .process_pixels_per_second = 0,
+        .mesh_bytes_per_second     = k_mesh_bytes_per_second,
+        .io_bytes_per_second       = 0,
+    };
+
+    try
+    {
+        auto bc7 = make_sample_texture();
+        res.bc7_pixels_per_second = measure_rate(k_pixels, [&] {
+            std::ignore = tex::convert(std::move(bc7), DXGI_FORMAT_BC7_UNORM, dev, encoder);
+        });
+
+        auto bc1 = make_sample_texture();
+        res.bc_pixels_per_second = measure_rate(k_pixels, [&] {
+            std::ignore = tex::convert(std::move(bc1), DXGI_FORMAT_BC1_UNORM, dev, encoder);
+        });
+
+        // Resizing reads every pixel, then mipmaps are generated from the half-size result
+        constexpr double k_process_pixels = k_pixels + k_pixels / 4 * 4 / 3;
+        auto process                      = make_sample_texture();
+        res.process_pixels_per_second     = measure_rate(k_process_pixels, [&] {
+            const auto half = tex::Dimension{.w = k_sample_dim / 2, .h = k_sample_dim / 2};
+            std::ignore     = tex::resize(std::move(process), half).and_then([](tex::Texture &&tex) {
+                return tex::generate_mipmaps(std::move(tex));
+            });
+        });
+
+        res.io_bytes_per_second = measure_io_rate(dir);
+    }
+    catch (const std::exception &)
+    {
+        // Rates that could not be measured stay at 0, estimate ignores them
+    }
+    return res;
+}
+
+/// \return `amount` processed at `rate`, in seconds. 0 if the rate is unknown
+[[nodiscard]] auto seconds(double amount, double rate) noexcept -> double
+{
+    return rate > 0 ? amount / rate : 0;
+}
+
+[[nodiscard]] auto encode_rate(DXGI_FORMAT format, const EncodeRates &rates) noexcept -> double
+{
+    switch (format)
+    {
+        case DXGI_FORMAT_BC7_TYPELESS:
+        case DXGI_FORMAT_BC7_UNORM:
+        case DXGI_FORMAT_BC7_UNORM_SRGB: return rates.bc7_pixels_per_second;
+        default:
+        {
+            const bool compressed = DirectX::IsCompressed(format);
+            return compressed ? rates.bc_pixels_per_second : rates.process_pixels_per_second;
+        }
+    }
+}
+
+[[nodiscard]] auto read_texture_header(const Path &path, Path load_path)
+    -> tl::expected<tex::TextureHeader, common::Error>
+{
+    auto buffer = std::array<std::byte, tex::k_max_header_size>{};
+
+    auto in = std::ifstream(path, std::ios_base::in | std::ios_base::binary);
+    in.read(reinterpret_cast<char *>(buffer.data()), static_cast<std::streamsize>(buffer.size()));
+
+    const auto read = static_cast<size_t>(in.gcount());
+    return tex::read_header(std::move(load_path), std::span(buffer).first(read));
+}
+
+/// Follows the steps of tex::optimize
+void estimate_texture(ModEstimate &res,
+                      const tex::TextureHeader &header,
+                      const tex::Settings &sets,
+                      const EncodeRates &rates)
+{
+    const auto steps = tex::compute_optimization_steps(header, sets);
+    const auto &info = header.info;
+
+    const bool changed = steps.resize || steps.mipmaps || steps.add_transparent_alpha || steps.convert
+                         || steps.best_format != info.format;
+    if (!changed)
+        return;
+
+    // Resizing to one of the mip levels drops the levels above it, see tex::optimize
+    const auto dropped = steps.resize ? tex::mips_to_drop(info, *steps.resize) : std::nullopt;
+
+    auto out     = info;
+    auto mipmaps = steps.mipmaps;
+    auto src     = info;
+    if (dropped)
+    {
+        out.width     = steps.resize->w;
+        out.height    = steps.resize->h;
+        out.mipLevels = info.mipLevels - *dropped;
+        mipmaps       = mipmaps && tex::optimal_mip_count({.w = out.width, .h = out.height}) != out.mipLevels;
+        src           = out;
+    }
+    else if (steps.resize)
+    {
+        out.width     = steps.resize->w;
+        out.height    = steps.resize->h;
+        out.mipLevels = 1;
+    }
+    if (mipmaps)
+        out.mipLevels = tex::optimal_mip_count({.w = out.width, .h = out.height});
+    if (steps.best_format != DXGI_FORMAT_UNKNOWN)
+        out.format = steps.best_format;
+
+    // Mipmaps add a third to the pixels of the first level
+    const auto mips_factor = out.mipLevels > 1 ? 4.0 / 3.0 : 1.0;
+    const auto in_pixels   = static_cast<double>(src.width * src.height * src.arraySize);
+    const auto out_pixels  = static_cast<double>(out.width * out.height * out.arraySize) * mips_factor;
+
+    // Only the missing levels are generated, from the smallest existing one
+    const bool only_mipmaps = mipmaps && (!steps.resize || dropped) && !steps.add_transparent_alpha
+                              && !steps.convert && out.format == info.format
+                              && info.dimension == DirectX::TEX_DIMENSION_TEXTURE2D;
+
+    const bool encoded = !dropped || mipmaps || steps.add_transparent_alpha || steps.convert
+                         || out.format != info.format;
+    if (only_mipmaps)
+    {
+        const auto smallest    = std::max<size_t>(src.mipLevels, 1) - 1;
+        const auto tail_width  = std::max<size_t>(src.width >> smallest, 1);
+        const auto tail_height = std::max<size_t>(src.height >> smallest, 1);
+        const auto tail_pixels = static_cast<double>(tail_width * tail_height * src.arraySize) * mips_factor;
+
+        res.cpu_seconds += seconds(tail_pixels, rates.process_pixels_per_second);
+        res.cpu_seconds += seconds(tail_pixels, encode_rate(out.format, rates));
+    }
+    else if (encoded)
+    {
+        if (DirectX::IsCompressed(info.format))
+            res.cpu_seconds += seconds(in_pixels, rates.process_pixels_per_second);
+        if (steps.resize && !dropped)
+            res.cpu_seconds += seconds(in_pixels, rates.process_pixels_per_second);
+        if (mipmaps)
+            res.cpu_seconds += seconds(out_pixels, rates.process_pixels_per_second);
+        res.cpu_seconds += seconds(out_pixels, encode_rate(out.format, rates));
+    }
+
+    const auto in_size  = static_cast<intmax_t>(tex::compute_data_size(info));
+    const auto out_size = static_cast<intmax_t>(tex::compute_data_size(out));
+
+    res.changed_files += 1;
+    res.bytes_written += static_cast<uintmax_t>(out_size) + tex::k_max_header_size;
+    res.disk_delta += out_size - in_size;
+    res.vram_delta += out_size - in_size;
+}
+
+void estimate_loose_file(ModEstimate &res,
+                         const detail::LooseFile &file,
+                         const tex::Settings &sets,
+                         const EncodeRates &rates)
+{
+    const auto ext = common::to_lower(file.absolute_path.extension().u8string());
+
+    res.files += 1;
+    if (ext == k_dds_ext)
+    {
+        res.bytes_read += file.size;
+
+        const auto relative_path = file.absolute_path.lexically_relative(file.mod_dir);
+        if (const auto header = read_texture_header(file.absolute_path, relative_path))
+            estimate_texture(res, *header, sets, rates);
+    }
+    else if (ext == k_nif_ext)
+    {
+        res.changed_files += 1;
+        res.bytes_read += file.size;
+        res.bytes_written += file.size;
+        res.cpu_seconds += seconds(static_cast<double>(file.size), rates.mesh_bytes_per_second);
+    }
+}
+
+/// FO4 texture archives store the header of their textures in their records
+[[nodiscard]] auto record_header(const bsa::TextureRecord &record, Path load_path) -> tex::TextureHeader
+{
+    constexpr size_t k_cube_faces = 6;
+
+    auto info      = tex::TexMetadata{};
+    info.width     = record.width;
+    info.height    = record.height;
+    info.depth     = 1;
+    info.arraySize = record.cubemap ? k_cube_faces : 1;
+    info.mipLevels = std::max<size_t>(record.mip_count, 1);
+    info.miscFlags = record.cubemap ? DirectX::TEX_MISC_TEXTURECUBE : 0;
+    info.format    = static_cast<DXGI_FORMAT>(record.format);
+    info.dimension = DirectX::TEX_DIMENSION_TEXTURE2D;
+    return tex::TextureHeader{.info = info, .load_path = std::move(load_path)};
+}
+
+/// \return The header of an archived texture, from its record or from the first bytes of its content
+[[nodiscard]] auto read_archived_texture_header(const Path &archive_path, const bsa::FileEntry &entry)
+    -> tl::expected<tex::TextureHeader, common::Error>
+{
+    auto path = Path(entry.name);
+    if (entry.texture)
+        return record_header(*entry.texture, std::move(path));
+
+    const auto start = bsa::read_file_start(archive_path, entry, tex::k_max_header_size);
+    if (!start)
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::io_error)));
+    return tex::read_header(std::move(path), *start);
+}
+
+/// Archived files are estimated like loose files, from the tables of the archive and the headers of the
+/// textures. Nothing else is read, or decompressed
+void estimate_archive(ModEstimate &res,
+                      const detail::ArchiveFile &archive,
+                      const tex::Settings &sets,
+                      const EncodeRates &rates)
+{
+    const auto entries = bsa::read_file_list(archive.path);
+    if (!entries)
+        return;
+
+    res.files += entries->size();
+    res.bytes_read += archive.size;
+
+    const auto changed_before = res.changed_files;
+    const auto written_before = res.bytes_written;
+    for (const auto &entry : *entries)
+    {
+        const auto ext = common::to_lower(Path(entry.name).extension().u8string());
+        if (ext == k_dds_ext)
+        {
+            if (const auto header = read_archived_texture_header(archive.path, entry))
+                estimate_texture(res, *header, sets, rates);
+        }
+        else if (ext == k_nif_ext)
+        {
+            // The stored size, compressed or not: decompressing it would need the whole file
+            res.changed_files += 1;
+            res.cpu_seconds += seconds(static_cast<double>(entry.size), rates.mesh_bytes_per_second);
+        }
+    }
+
+    // The whole archive is written again, even if a single file changed, instead of the files themselves
+    res.bytes_written = written_before;
+    if (res.changed_files != changed_before)
+        res.bytes_written += archive.size;
+}
+
+auto estimate(const ModFolder &mod, const tex::Settings &sets, const EncodeRates &rates) noexcept
+    -> ModEstimate
+{
+    auto res = ModEstimate{.mod_dir = mod.path()};
+    try
+    {
+        const auto files = detail::list_files(mod.path(), mod.bsa_settings(), mod.ignore_existing_archives());
+        for (const auto &file : files.loose_files)
+            estimate_loose_file(res, file, sets, rates);
+        for (const auto &archive : files.archives)
+            estimate_archive(res, archive, sets, rates);
+    }
+    catch (const std::exception &)
+    {
+        // The folder could not be listed. Return what was estimated so far
+    }
+
+    const auto io_bytes = static_cast<double>(res.bytes_read + res.bytes_written);
+    res.io_seconds      = seconds(io_bytes, rates.io_bytes_per_second);
+    return res;
+}
+
+auto estimate(std::span<const ModFolder> mods, const tex::Settings &sets, const EncodeRates &rates) noexcept
+    -> std::vector<ModEstimate>
+{
+    auto res = std::vector<ModEstimate>{};
+    res.reserve(mods.size());
+    for (const auto &mod : mods)
+        res.push_back(estimate(mod, sets, rates));
+    return res;
+}
+} // namespace btu::modmanager
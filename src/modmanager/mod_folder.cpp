@@ -7,78 +7,153 @@
 
 #include "btu/bsa/archive.hpp"
 #include "btu/common/filesystem.hpp"
+#include "btu/modmanager/detail/transform.hpp"
 
 #include <binary_io/memory_stream.hpp>
 #include <flux.hpp>
 
+#include <algorithm>
 #include <atomic>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <semaphore>
+#include <span>
+#include <thread>
+#include <unordered_map>
 #include <utility>
+#include <variant>
 
 namespace btu::modmanager {
 
-ModFolder::ModFolder(Path directory, bsa::Settings bsa_settings, bool ignore_existing_archives)
+auto PipelineSettings::get(StorageType storage) noexcept -> PipelineSettings
+{
+    const auto cores               = size_t{std::max(common::hardware_concurrency() - 1, 1U)};
+    const auto mesh_threads        = std::max<size_t>(cores / 4, 1);
+    // Animations mostly wait for an external process, and other files for the disk: they need few threads,
+    // which do not take much CPU time from the others
+    const auto transform_threads = TransformThreads{
+        .textures   = std::max<size_t>(cores - mesh_threads, 1),
+        .meshes     = mesh_threads,
+        .animations = 2,
+        .other      = 1,
+    };
+    constexpr auto batch_max_bytes = 64ULL * 1024 * 1024;
+    // Leaves room for the rest of the system on a 16 GB machine
+    constexpr auto memory_budget = 6ULL * 1024 * 1024 * 1024;
+    switch (storage)
+    {
+        case StorageType::SSD:
+            return PipelineSettings{
+                .reader_threads    = 4,
+                .transform_threads = transform_threads,
+                .writer_threads    = 2,
+                .queue_capacity    = 2ULL * transform_threads.total(),
+                .batch_max_files   = 1,
+                .batch_max_bytes   = batch_max_bytes,
+                .memory_budget     = memory_budget,
+            };
+        case StorageType::HDD:
+            // Concurrent accesses make a spinning disk seek. Read and write sequentially, but keep a deep
+            // queue so that the transform threads always have something to work on
+            return PipelineSettings{
+                .reader_threads    = 1,
+                .transform_threads = transform_threads,
+                .writer_threads    = 1,
+                .queue_capacity    = 8ULL * transform_threads.total(),
+                .batch_max_files   = 1,
+                .batch_max_bytes   = batch_max_bytes,
+                .memory_budget     = memory_budget,
+            };
+    }
+    return get(StorageType::SSD);
+}
+
+ModFolder::ModFolder(Path directory,
+                     bsa::Settings bsa_settings,
+                     bool ignore_existing_archives,
+                     PipelineSettings pipeline)
     : dir_(std::move(directory))
     , bsa_settings_(BTU_MOV(bsa_settings))
     , ignore_existing_archives_(ignore_existing_archives)
-    , thread_pool_(common::make_thread_pool())
+    , pipeline_(pipeline)
+    , worker_pools_(detail::make_worker_pools(pipeline.transform_threads))
 {
 }
 
-auto ModFolder::size() noexcept -> size_t
+ModFolder::ModFolder(Path directory,
+                     bsa::Settings bsa_settings,
+                     std::shared_ptr<common::WorkerPools> worker_pools,
+                     bool ignore_existing_archives,
+                     PipelineSettings pipeline)
+    : dir_(std::move(directory))
+    , bsa_settings_(BTU_MOV(bsa_settings))
+    , ignore_existing_archives_(ignore_existing_archives)
+    , pipeline_(pipeline)
+    , worker_pools_(std::move(worker_pools))
 {
-    class SizeIterator final : public ModFolderIterator
-    {
-    public:
-        size_t size;
-
-        [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
-                                             ArchiveTooLargeState /*state*/) noexcept
-            -> ArchiveTooLargeAction override
-        {
-            return Skip;
-        }
-
-        void process_file(ModFile /*file*/) noexcept override { size += 1; }
-    };
+}
 
-    auto iterator = SizeIterator{};
-    iterate(iterator);
-    return iterator.size;
+auto ModFolder::utilization(TaskCategory category) const -> common::PoolUtilization
+{
+    return worker_pools_->utilization(static_cast<size_t>(category));
 }
 
-void ModFolder::iterate(ModFolderIterator &iterator) noexcept
+/// \param skip_too_large Archives larger than `bsa_settings.max_size` are not counted, as if iterated with
+/// ModFolderIteratorBase::ArchiveTooLargeAction::Skip
+[[nodiscard]] auto compute_stats(const Path &dir,
+                                 const bsa::Settings &bsa_settings,
+                                 bool ignore_existing_archives,
+                                 bool skip_too_large) noexcept -> ModFolderStats
 {
-    // creates a ModFolderTransformer based on the user-provided ModFolderIterator
-    class ModFolderProcessorReadOnly final : public ModFolderTransformer
+    auto res = ModFolderStats{};
+    try
     {
-    public:
-        explicit ModFolderProcessorReadOnly(ModFolderIterator &iterator) noexcept
-            : iterator_(iterator)
-        {
-        }
+        const auto files = detail::list_files(dir, bsa_settings, ignore_existing_archives);
 
-        [[nodiscard]] auto archive_too_large(const Path &archive_path, ArchiveTooLargeState state) noexcept
-            -> ArchiveTooLargeAction override
-        {
-            return iterator_.get().archive_too_large(archive_path, state);
-        }
+        res.loose_files = files.loose_files.size();
+        for (const auto &file : files.loose_files)
+            res.bytes_by_type[bsa::get_filetype(file.absolute_path, dir, bsa_settings)] += file.size;
 
-        [[nodiscard]] auto transform_file(ModFile file) noexcept
-            -> std::optional<std::vector<std::byte>> override
+        for (const auto &archive : files.archives)
         {
-            iterator_.get().process_file(file);
-            return std::nullopt;
-        }
+            if (skip_too_large && archive.size > bsa_settings.max_size)
+                continue;
 
-        [[nodiscard]] auto stop_requested() const noexcept -> bool override
-        {
-            return iterator_.get().stop_requested();
+            const auto entries = bsa::read_file_list(archive.path);
+            if (!entries)
+                continue;
+
+            res.archives += 1;
+            res.archived_files += entries->size();
+            for (const auto &entry : *entries)
+                res.bytes_by_type[bsa::get_filetype(dir / entry.name, dir, bsa_settings)] += entry.size;
         }
+    }
+    catch (const std::exception &)
+    {
+        // The folder could not be listed, for example because it was removed
+    }
+    return res;
+}
 
-    private:
-        std::reference_wrapper<ModFolderIterator> iterator_;
-    } transformer(iterator);
+auto ModFolder::size() const noexcept -> size_t
+{
+    return compute_stats(dir_, bsa_settings_, ignore_existing_archives_, true).files();
+}
 
+auto ModFolder::stats() const noexcept -> ModFolderStats
+{
+    return compute_stats(dir_, bsa_settings_, ignore_existing_archives_, false);
+}
+
+void ModFolder::iterate(ModFolderIterator &iterator) noexcept
+{
+    auto transformer = detail::ReadOnlyTransformer(iterator);
     transform(transformer);
 }
 
@@ -114,25 +189,364 @@ void reduce_cpu_usage() noexcept
     std::this_thread::sleep_for(std::chrono::nanoseconds(5));
 }
 
-void transform_loose_file(const Path &absolute_path,
-                          const Path &dir,
-                          ModFolderTransformer &transformer) noexcept
+auto detail::is_temporary_path(const Path &relative_path) noexcept -> bool
 {
-    if (transformer.stop_requested())
-        return;
+    return std::ranges::any_of(relative_path, [](const Path &component) {
+        const auto name = component.u8string();
+        return std::ranges::any_of(k_temporary_suffixes,
+                                   [&name](std::u8string_view suffix) { return name.ends_with(suffix); });
+    });
+}
 
-    reduce_cpu_usage();
+void detail::remove_leftovers(const Path &dir) noexcept
+{
+    auto ec = std::error_code{};
 
-    const auto relative_path = absolute_path.lexically_relative(dir);
+    auto aside = dir;
+    aside += u8".btu-old";
+    // Crashed between the two renames of a staged transform: the original files are still complete
+    if (!fs::exists(dir, ec) && fs::exists(aside, ec))
+        fs::rename(aside, dir, ec);
 
-    const auto file_data = common::Lazy<tl::expected<std::vector<std::byte>, common::Error>>(
-        [&absolute_path] { return common::read_file(absolute_path); });
+    for (const auto suffix : {u8".btu-old", u8".btu-staging"})
+    {
+        auto sibling = dir;
+        sibling += suffix;
+        fs::remove_all(sibling, ec);
+    }
 
-    if (const auto transformed = transformer.transform_file({relative_path, file_data}))
+    auto leftovers = std::vector<Path>{};
+    const auto end = fs::recursive_directory_iterator();
+    for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != end; it.increment(ec))
     {
-        if (!common::write_file(absolute_path, *transformed))
-            transformer.failed_to_write_transformed_file(relative_path, *transformed);
+        if (is_temporary_path(it->path().filename()))
+        {
+            leftovers.push_back(it->path());
+            it.disable_recursion_pending();
+        }
     }
+
+    for (const auto &path : leftovers)
+        fs::remove_all(path, ec);
+}
+
+auto detail::canonical_mod_dir(const Path &dir) noexcept -> Path
+{
+    auto ec  = std::error_code{};
+    auto res = fs::weakly_canonical(dir, ec);
+    if (ec)
+        res = dir.lexically_normal();
+    if (!res.has_filename())
+        res = res.parent_path();
+    return res;
+}
+
+auto detail::task_category(const Path &path) noexcept -> TaskCategory
+{
+    const auto ext = common::to_lower(path.extension().u8string());
+    if (ext == u8".dds" || ext == u8".tga" || ext == u8".png")
+        return TaskCategory::Texture;
+    if (ext == u8".nif")
+        return TaskCategory::Mesh;
+    if (ext == u8".hkx")
+        return TaskCategory::Animation;
+    return TaskCategory::Other;
+}
+
+auto detail::make_worker_pools(const TransformThreads &threads) -> std::shared_ptr<common::WorkerPools>
+{
+    auto per_category = threads.per_category();
+    // A category without threads could only borrow, and would wait forever if the others are always busy
+    for (auto &count : per_category)
+        count = std::max<size_t>(count, 1);
+    return std::make_shared<common::WorkerPools>(per_category);
+}
+
+auto detail::estimate_cost(const Path &path, uintmax_t size) noexcept -> uintmax_t
+{
+    // Relative cost of processing one byte. Textures are decoded and encoded, meshes are parsed and
+    // rewritten, everything else is only read
+    constexpr uintmax_t k_texture_weight = 8;
+    constexpr uintmax_t k_mesh_weight    = 4;
+    constexpr uintmax_t k_default_weight = 1;
+    // Animations are converted by an external process, starting it dominates the cost
+    constexpr uintmax_t k_process_startup = 4ULL * 1024 * 1024;
+
+    const auto ext = common::to_lower(path.extension().u8string());
+    if (ext == u8".dds" || ext == u8".tga" || ext == u8".png")
+        return size * k_texture_weight;
+    if (ext == u8".nif")
+        return size * k_mesh_weight;
+    if (ext == u8".hkx")
+        return size * k_default_weight + k_process_startup;
+    return size * k_default_weight;
+}
+
+auto detail::estimate_archive_cost(const Path &archive_path, uintmax_t size) noexcept -> uintmax_t
+{
+    // Archives mostly contain textures and meshes
+    constexpr uintmax_t k_archive_weight = 4;
+    // Each file of the archive is a task of its own, and may have to be decompressed and recompressed
+    constexpr uintmax_t k_entry_overhead = 64ULL * 1024;
+
+    const auto entries = bsa::read_file_count(archive_path).value_or(1);
+    return size * k_archive_weight + entries * k_entry_overhead;
+}
+
+/// Groups items of the same type, up to `batch_max_files` items and `batch_max_bytes` bytes per batch.
+/// A batch takes the place of its first item, so the order of `items` is mostly preserved.
+/// \return Indices in `items`
+template<typename T, typename PathProj, typename SizeProj>
+[[nodiscard]] auto make_batches(std::span<T> items,
+                                const PipelineSettings &pipeline,
+                                PathProj path_of,
+                                SizeProj size_of) -> std::vector<std::vector<size_t>>
+{
+    auto batches      = std::vector<std::vector<size_t>>{};
+    auto batch_bytes  = std::vector<uintmax_t>{};
+    auto open_batches = std::unordered_map<std::u8string, size_t>{};
+
+    for (size_t i = 0; i < items.size(); ++i)
+    {
+        const uintmax_t size = size_of(items[i]);
+        auto ext             = common::to_lower(Path(path_of(items[i])).extension().u8string());
+
+        if (const auto it = open_batches.find(ext); it != open_batches.end())
+        {
+            const auto idx = it->second;
+            if (batches[idx].size() < pipeline.batch_max_files
+                && batch_bytes[idx] + size <= pipeline.batch_max_bytes)
+            {
+                batches[idx].push_back(i);
+                batch_bytes[idx] += size;
+                continue;
+            }
+        }
+
+        open_batches[std::move(ext)] = batches.size();
+        batches.push_back({i});
+        batch_bytes.push_back(size);
+    }
+    return batches;
+}
+
+/// Batches of a single file go through transform_file, so transformers not implementing transform_batch
+/// behave as before
+[[nodiscard]] auto transform_mod_files(std::span<ModFile> files, ModFolderTransformer &transformer) noexcept
+    -> std::vector<std::optional<std::vector<std::byte>>>
+{
+    if (files.size() == 1)
+    {
+        auto res = std::vector<std::optional<std::vector<std::byte>>>{};
+        res.push_back(transformer.transform_file(std::move(files.front())));
+        return res;
+    }
+
+    auto res = transformer.transform_batch(files);
+    res.resize(files.size());
+    return res;
+}
+
+auto detail::estimate_memory(const Path &path, uintmax_t size, std::span<const std::byte> header) noexcept
+    -> uintmax_t
+{
+    // The decompressed image, its mipmaps and a working copy
+    constexpr uintmax_t k_rgba_bytes      = 4;
+    constexpr uintmax_t k_texture_copies  = 3;
+    // Without a header, assume the worst common case: BC1 decompresses to 8 times its size
+    constexpr uintmax_t k_texture_expansion = 8;
+    // Meshes are parsed into a much larger in-memory representation
+    constexpr uintmax_t k_mesh_expansion = 4;
+
+    const auto ext = common::to_lower(path.extension().u8string());
+    if (ext == u8".dds" || ext == u8".tga" || ext == u8".png")
+    {
+        // Magic, followed by DDS_HEADER. Height and width are at offsets 12 and 16
+        constexpr uint32_t k_dds_magic      = 0x20534444; // "DDS "
+        constexpr size_t k_dds_min_header   = 20;
+        const auto read_u32               = [&header](size_t offset) {
+            uint32_t value = 0;
+            for (size_t i = 0; i < sizeof(value); ++i)
+                value |= std::to_integer<uint32_t>(header[offset + i]) << (8 * i);
+            return value;
+        };
+
+        if (ext == u8".dds" && header.size() >= k_dds_min_header && read_u32(0) == k_dds_magic)
+        {
+            const uintmax_t pixels = uintmax_t{read_u32(12)} * read_u32(16);
+            // Mipmaps add a third to the size of the image
+            return size + pixels * k_rgba_bytes * 4 / 3 * k_texture_copies;
+        }
+        return size + size * k_texture_expansion * k_texture_copies;
+    }
+    if (ext == u8".nif")
+        return size + size * k_mesh_expansion;
+
+    // Input and output
+    return 2 * size;
+}
+
+struct TransformedFile
+{
+    detail::LooseFile source;
+    std::vector<std::byte> content;
+};
+
+/// Enough for detail::estimate_memory to read the dimensions of a DDS file
+constexpr size_t k_memory_header_size = 20;
+
+/// \return The first bytes of a file, fewer if it is smaller or could not be read
+[[nodiscard]] auto read_file_header(const Path &path) noexcept -> std::vector<std::byte>
+{
+    auto res = std::vector<std::byte>(k_memory_header_size);
+    auto in  = std::ifstream(path, std::ios_base::in | std::ios_base::binary);
+    in.read(reinterpret_cast<char *>(res.data()), static_cast<std::streamsize>(res.size()));
+    res.resize(static_cast<size_t>(in.gcount()));
+    return res;
+}
+
+using FileContent = tl::expected<std::vector<std::byte>, common::Error>;
+
+/// `contents` were read by the reader threads, in the same order as `files`
+[[nodiscard]] auto transform_loose_batch(std::span<const detail::LooseFile> files,
+                                         std::vector<FileContent> contents,
+                                         ModFolderTransformer &transformer) noexcept
+    -> std::vector<std::optional<std::vector<std::byte>>>
+{
+    reduce_cpu_usage();
+
+    auto mod_files = std::vector<ModFile>{};
+    mod_files.reserve(files.size());
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        auto relative_path = files[i].absolute_path.lexically_relative(files[i].mod_dir);
+        auto file_data     = common::Lazy<FileContent>(
+            [content = std::move(contents[i])]() mutable { return std::move(content); });
+        mod_files.push_back(ModFile{std::move(relative_path), std::move(file_data)});
+    }
+
+    return transform_mod_files(mod_files, transformer);
+}
+
+/// Reading, transforming and writing a file on the same thread leaves either the disk or the CPU idle.
+/// Instead, loose files go through three stages: reader threads, tasks on the thread pool and writer threads.
+/// Readers peek at the headers of the files to estimate their memory, wait for that memory, then read the
+/// files: tasks get their content in memory and never wait for the disk. At most `queue_capacity` batches are
+/// waiting between two stages.
+void transform_loose_files(std::span<const detail::LooseFile> files,
+                           ModFolderTransformer &transformer,
+                           const PipelineSettings &pipeline,
+                           common::WorkerPools &worker_pools,
+                           common::MemoryBudget &memory,
+                           const detail::DoneCallback &on_done) noexcept
+{
+    auto notify_done = [&on_done](const detail::LooseFile &file) {
+        if (on_done)
+            on_done(file.mod_dir);
+    };
+
+    const auto capacity     = static_cast<ptrdiff_t>(std::max<size_t>(pipeline.queue_capacity, 1));
+    const auto reader_count = std::max<size_t>(pipeline.reader_threads, 1);
+    const auto writer_count = std::max<size_t>(pipeline.writer_threads, 1);
+
+    const auto batches = make_batches(
+        files,
+        pipeline,
+        [](const detail::LooseFile &file) -> const Path & { return file.absolute_path; },
+        [](const detail::LooseFile &file) { return file.size; });
+
+    // Loaded batches waiting to be transformed, or being transformed
+    auto pending     = std::counting_semaphore<>(capacity);
+    auto transformed = common::BoundedQueue<TransformedFile>(pipeline.queue_capacity);
+
+    auto transform_stage = [&](std::vector<detail::LooseFile> batch,
+                               std::vector<FileContent> contents,
+                               uintmax_t reserved_memory) {
+        if (!transformer.stopped())
+        {
+            auto results = transform_loose_batch(batch, std::move(contents), transformer);
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                if (results[i])
+                    transformed.push(TransformedFile{std::move(batch[i]), std::move(*results[i])});
+                else
+                    notify_done(batch[i]);
+            }
+        }
+        memory.release(reserved_memory);
+        pending.release();
+    };
+
+    std::atomic_size_t next_batch = 0;
+    auto tasks                    = common::synchronized<std::vector<std::future<void>>>{};
+    auto read_stage               = [&] {
+        for (size_t i = next_batch++; i < batches.size(); i = next_batch++)
+        {
+            if (transformer.stopped())
+                break;
+
+            auto batch           = std::vector<detail::LooseFile>{};
+            auto reserved_memory = uintmax_t{0};
+            for (const auto idx : batches[i])
+            {
+                const auto &file = batch.emplace_back(files[idx]);
+                reserved_memory += detail::estimate_memory(file.absolute_path,
+                                                           file.size,
+                                                           read_file_header(file.absolute_path));
+            }
+
+            // Batches hold files of the same type
+            const auto &first_path = batch.front().absolute_path;
+            const auto category    = static_cast<size_t>(detail::task_category(first_path));
+
+            pending.acquire();
+            memory.acquire(reserved_memory);
+
+            // The content is only read once its memory is reserved
+            auto contents = std::vector<FileContent>{};
+            contents.reserve(batch.size());
+            for (const auto &file : batch)
+                contents.push_back(common::read_file(file.absolute_path));
+
+            auto fut = worker_pools.submit_task(
+                category,
+                [&transform_stage,
+                 batch    = std::move(batch),
+                 contents = std::move(contents),
+                 reserved_memory]() mutable {
+                    transform_stage(std::move(batch), std::move(contents), reserved_memory);
+                });
+            tasks.wlock()->push_back(std::move(fut));
+        }
+    };
+
+    auto write_stage = [&] {
+        while (auto file = transformed.pop())
+        {
+            const auto &path = file->source.absolute_path;
+            // The file may be hard linked to another, see ModFolder::transform_staged. Replace it, so that the
+            // other links keep the old content
+            if (!common::replace_file(path, file->content))
+                transformer.failed_to_write_transformed_file(path.lexically_relative(file->source.mod_dir),
+                                                             file->content);
+            notify_done(file->source);
+        }
+    };
+
+    auto writers = std::vector<std::jthread>{};
+    for (size_t i = 0; i < writer_count; ++i)
+        writers.emplace_back(write_stage);
+
+    {
+        auto readers = std::vector<std::jthread>{};
+        for (size_t i = 0; i < reader_count; ++i)
+            readers.emplace_back(read_stage);
+    } // readers are joined here
+
+    flux::for_each(*tasks.wlock(), [](auto &&fut) { fut.wait(); });
+
+    // All files have been transformed. Pending writes are flushed when the writers are joined
+    transformed.close();
 }
 
 [[nodiscard]] auto want_to_skip_archive(const Path &archive_path,
@@ -143,91 +557,357 @@ void transform_loose_file(const Path &absolute_path,
            == ModFolderIteratorBase::ArchiveTooLargeAction::Skip;
 }
 
-[[nodiscard]] auto transform_archive_file_inner(ModFolderTransformer &transformer,
-                                                std::atomic_bool &any_file_changed,
-                                                bsa::Archive::value_type &pair) noexcept
+[[nodiscard]] auto archive_file_content(const bsa::Archive::value_type &pair) noexcept
+    -> common::Lazy<tl::expected<std::vector<std::byte>, common::Error>>
 {
-    return [&transformer, &any_file_changed, &pair] {
-        if (transformer.stop_requested())
-            return;
+    return common::Lazy<tl::expected<std::vector<std::byte>, common::Error>>(
+        [&pair]() -> tl::expected<std::vector<std::byte>, common::Error> {
+            auto buffer = binary_io::any_ostream{binary_io::memory_ostream{}};
+            if (!pair.second.write(buffer))
+                // TODO: better error here?
+                return tl::make_unexpected(common::Error(std::error_code(errno, std::system_category())));
 
-        reduce_cpu_usage();
+            return buffer.get<binary_io::memory_ostream>().rdbuf();
+        });
+}
 
-        auto &[relative_path, file] = pair;
+/// \return A new directory name in the temporary directory of the system, unique to this process and call.
+/// Empty if there is no temporary directory
+[[nodiscard]] auto make_scratch_path() -> Path
+{
+    static const auto process_key = std::random_device{}();
+    static auto next_id           = std::atomic_size_t{0};
 
-        auto file_data = common::Lazy<tl::expected<std::vector<std::byte>, common::Error>>(
-            [&pair]() -> tl::expected<std::vector<std::byte>, common::Error> {
-                auto buffer = binary_io::any_ostream{binary_io::memory_ostream{}};
-                if (!pair.second.write(buffer))
-                    // TODO: better error here?
-                    return tl::make_unexpected(common::Error(std::error_code(errno, std::system_category())));
+    auto ec        = std::error_code{};
+    const auto tmp = fs::temp_directory_path(ec);
+    if (ec)
+        return {};
+    return tmp / "btu-scratch" / (std::to_string(process_key) + "-" + std::to_string(next_id++));
+}
 
-                return buffer.get<binary_io::memory_ostream>().rdbuf();
-            });
+/**
+ * \brief Temporary directory holding the transformed content of archive entries until the archive is written.
+ *
+ * The archive is rewritten entry by entry, see bsa::rewrite_archive, and each transformed entry is read back
+ * when it is written: the transformed content does not have to stay in memory. The directory is removed when
+ * this object is destroyed. It lives in the temporary directory of the system, so that a crash cannot leave
+ * it among the files of the mod.
+ */
+class ScratchDir
+{
+public:
+    ScratchDir()
+        : dir_(make_scratch_path())
+    {
+    }
 
-        auto transformed = transformer.transform_file({relative_path, file_data});
-        if (transformed)
-        {
-            const bool res = file.read(*transformed);
-            if (!res)
-                transformer.failed_to_read_transformed_file(relative_path, *transformed);
+    ~ScratchDir()
+    {
+        auto ec = std::error_code{};
+        if (!dir_.empty())
+            fs::remove_all(dir_, ec);
+    }
 
-            any_file_changed = any_file_changed || res;
-        }
+    ScratchDir(const ScratchDir &)                     = delete;
+    auto operator=(const ScratchDir &) -> ScratchDir & = delete;
+
+    /// \return The path of a new file holding `content`, or std::nullopt if it could not be written
+    [[nodiscard]] auto store(std::span<const std::byte> content) noexcept -> std::optional<Path>
+    {
+        if (dir_.empty())
+            return std::nullopt;
+
+        std::call_once(created_, [this] {
+            auto ec = std::error_code{};
+            fs::create_directories(dir_, ec);
+        });
+
+        auto path = dir_ / std::to_string(next_id_++);
+        if (!common::write_file(path, content))
+            return std::nullopt;
+        return path;
+    }
+
+private:
+    Path dir_;
+    std::once_flag created_;
+    std::atomic_size_t next_id_ = 0;
+};
+
+/// Transformed content of an archive entry, until the archive is written
+struct TransformedEntry
+{
+    bsa::Archive::value_type *entry;
+    /// A file of the scratch directory, or the content itself if it could not be stored there
+    std::variant<Path, std::vector<std::byte>> content;
+};
+
+using TransformedEntries = common::synchronized<std::vector<TransformedEntry>>;
+
+void transform_archive_batch(ModFolderTransformer &transformer,
+                             TransformedEntries &transformed,
+                             ScratchDir &scratch,
+                             std::span<bsa::Archive::value_type *const> batch) noexcept
+{
+    reduce_cpu_usage();
+
+    auto files = std::vector<ModFile>{};
+    files.reserve(batch.size());
+    for (const auto *pair : batch)
+        files.push_back(ModFile{pair->first, archive_file_content(*pair)});
+
+    auto results = transform_mod_files(files, transformer);
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        if (!results[i])
+            continue;
+
+        auto stored = scratch.store(*results[i]);
+        auto entry  = stored ? TransformedEntry{batch[i], std::move(*stored)}
+                             : TransformedEntry{batch[i], std::move(*results[i])};
+        transformed.wlock()->push_back(std::move(entry));
+    }
+}
+
+[[nodiscard]] auto transform_archive_file_inner(ModFolderTransformer &transformer,
+                                                TransformedEntries &transformed,
+                                                ScratchDir &scratch,
+                                                common::MemoryBudget &memory,
+                                                uintmax_t reserved_memory,
+                                                std::vector<bsa::Archive::value_type *> batch) noexcept
+{
+    return [&transformer, &transformed, &scratch, &memory, reserved_memory, batch = std::move(batch)] {
+        if (!transformer.stopped())
+            transform_archive_batch(transformer, transformed, scratch, batch);
+
+        memory.release(reserved_memory);
     };
 }
 
-[[nodiscard]] auto change_archive_version_if_needed(bsa::Archive &archive,
-                                                    const bsa::Settings &bsa_settings) noexcept -> bool
+/// An archive whose files have been submitted to the thread pool
+struct OpenArchive
 {
-    if (const auto target_version = guess_target_archive_version(archive, bsa_settings))
+    OpenArchive(const detail::ArchiveFile &source, bsa::Archive archive) noexcept
+        : source(&source)
+        , archive(std::move(archive))
     {
-        archive.set_version(*target_version);
-        return true;
     }
-    return false;
-}
 
-void transform_archive_file(const Path &archive_path,
-                            ModFolderTransformer &transformer,
-                            const bsa::Settings &bsa_settings,
-                            common::ThreadPool &thread_pool) noexcept
+    const detail::ArchiveFile *source;
+    /// Declared before the archive, which maps its files and must be destroyed first
+    ScratchDir scratch;
+    bsa::Archive archive;
+    TransformedEntries transformed;
+    std::vector<std::future<void>> futs;
+};
+
+/// Reads an archive and immediately submits its files to the thread pool, most expensive first.
+[[nodiscard]] auto open_archive(const detail::ArchiveFile &source,
+                                ModFolderTransformer &transformer,
+                                const PipelineSettings &pipeline,
+                                common::WorkerPools &worker_pools,
+                                common::MemoryBudget &memory,
+                                const detail::FileFilter &filter) noexcept -> std::unique_ptr<OpenArchive>
 {
-    if (const auto arch_size = file_size(archive_path); arch_size > bsa_settings.max_size)
+    if (source.size > source.bsa_settings.get().max_size)
     {
-        if (want_to_skip_archive(archive_path,
+        if (want_to_skip_archive(source.path,
                                  transformer,
                                  ModFolderIteratorBase::ArchiveTooLargeState::BeforeProcessing))
-            return;
+            return nullptr;
     }
 
-    auto opt_arch = bsa::Archive::read(archive_path);
+    auto opt_arch = bsa::Archive::read(source.path, transformer.stop_token());
     if (!opt_arch)
     {
-        transformer.failed_to_read_archive(archive_path);
-        return;
+        if (!transformer.stopped())
+            transformer.failed_to_read_archive(source.path);
+        return nullptr;
     }
 
-    auto archive                      = std::move(*opt_arch);
-    std::atomic_bool any_file_changed = false;
-    std::vector<std::future<void>> futs;
-    for (auto &pair : archive)
+    auto res = std::make_unique<OpenArchive>(source, std::move(*opt_arch));
+
+    auto entries = std::vector<bsa::Archive::value_type *>{};
+    for (auto &pair : res->archive)
+        if (!filter || filter(source.mod_dir, Path(pair.first), true))
+            entries.push_back(&pair);
+
+    std::ranges::stable_sort(entries, std::greater{}, [](const bsa::Archive::value_type *pair) {
+        return detail::estimate_cost(Path(pair->first), pair->second.size());
+    });
+
+    const auto batches = make_batches(
+        std::span(entries),
+        pipeline,
+        [](const bsa::Archive::value_type *pair) -> const std::string & { return pair->first; },
+        [](const bsa::Archive::value_type *pair) { return pair->second.size(); });
+
+    for (const auto &indices : batches)
     {
-        if (transformer.stop_requested())
-            return;
+        if (transformer.stopped())
+            break;
+
+        auto batch           = std::vector<bsa::Archive::value_type *>{};
+        auto reserved_memory = uintmax_t{0};
+        for (const auto idx : indices)
+        {
+            const auto &[relative_path, file] = *entries[idx];
+            batch.push_back(entries[idx]);
+            reserved_memory += detail::estimate_memory(Path(relative_path), file.size());
+        }
+
+        // Batches hold files of the same type
+        const auto category = static_cast<size_t>(detail::task_category(Path(batch.front()->first)));
 
-        auto fut = thread_pool.submit_task(transform_archive_file_inner(transformer, any_file_changed, pair));
-        futs.push_back(std::move(fut));
+        // Blocks this thread, not the pool, until enough memory is available
+        memory.acquire(reserved_memory);
+        auto task = transform_archive_file_inner(transformer,
+                                                 res->transformed,
+                                                 res->scratch,
+                                                 memory,
+                                                 reserved_memory,
+                                                 std::move(batch));
+        res->futs.push_back(worker_pools.submit_task(category, std::move(task)));
+    }
+    return res;
+}
+
+/// \return The size of the files of the archive once the transformed entries are written, uncompressed
+[[nodiscard]] auto transformed_archive_size(const bsa::Archive &archive,
+                                            std::span<const TransformedEntry> transformed) noexcept
+    -> uintmax_t
+{
+    const auto content_size = common::Overload{
+        [](const Path &path) {
+            auto ec         = std::error_code{};
+            const auto size = fs::file_size(path, ec);
+            return ec ? uintmax_t{0} : size;
+        },
+        [](const std::vector<std::byte> &bytes) { return uintmax_t{bytes.size()}; },
+    };
+
+    auto res = uintmax_t{archive.file_size()};
+    for (const auto &[entry, content] : transformed)
+    {
+        res -= std::min<uintmax_t>(res, entry->second.size());
+        res += std::visit(content_size, content);
+    }
+    return res;
+}
+
+/// Writes the archive entry by entry, see bsa::rewrite_archive. Unchanged entries are copied as they are
+/// stored, and transformed entries are read back from the scratch directory one at a time.
+/// \return Whether the archive was written, std::nullopt if it cannot be rewritten this way. It is then left
+/// untouched, and must be written whole
+[[nodiscard]] auto rewrite_entries(OpenArchive &open,
+                                   std::span<TransformedEntry> transformed,
+                                   const Path &path,
+                                   ModFolderTransformer &transformer) noexcept -> std::optional<bool>
+{
+    auto replaced = std::vector<bsa::ReplacedEntry>{};
+    replaced.reserve(transformed.size());
+    for (const auto &[entry, content] : transformed)
+    {
+        replaced.push_back(bsa::ReplacedEntry{
+            .name    = entry->first,
+            .content = [&content]() -> std::optional<std::vector<std::byte>> {
+                if (const auto *bytes = std::get_if<std::vector<std::byte>>(&content))
+                    return *bytes;
+                auto bytes = common::read_file(std::get<Path>(content));
+                if (!bytes)
+                    return std::nullopt;
+                return std::move(*bytes);
+            },
+        });
+    }
+
+    // Written next to the archive, then renamed over it once complete
+    auto tmp_path = path;
+    tmp_path += u8".btu-tmp";
+
+    auto ec = std::error_code{};
+    if (!bsa::rewrite_archive(open.source->path, tmp_path, replaced, transformer.stop_token()))
+    {
+        fs::remove(tmp_path, ec);
+        return std::nullopt;
     }
-    flux::for_each(futs, [](auto &&fut) { fut.wait(); });
+
+    // Unchanged entries are mapped from the old archive. On Windows, it cannot be replaced while it is mapped
+    open.archive = bsa::Archive(open.archive.version(), open.archive.type());
+
+    fs::rename(tmp_path, path, ec);
+    if (ec)
+    {
+        fs::remove(tmp_path, ec);
+        transformer.failed_to_write_archive(open.source->path, path);
+        return false;
+    }
+    return true;
+}
+
+/// Builds the whole archive with the transformed entries, converted to `target_version` if set, and writes
+/// it. Every entry is held by the archive until it is written
+[[nodiscard]] auto write_archive(OpenArchive &open,
+                                 std::span<TransformedEntry> transformed,
+                                 std::optional<bsa::ArchiveVersion> target_version,
+                                 const Path &path,
+                                 ModFolderTransformer &transformer) noexcept -> bool
+{
+    auto any_file_changed = false;
+    for (auto &[entry, content] : transformed)
+    {
+        auto &[relative_path, file] = *entry;
+
+        const auto read = common::Overload{
+            [&file](const Path &stored) { return file.read(stored); },
+            [&file](std::vector<std::byte> &bytes) { return file.read(bytes); },
+        };
+        if (std::visit(read, content))
+        {
+            any_file_changed = true;
+            continue;
+        }
+
+        const auto bytes = std::holds_alternative<Path>(content)
+                               ? common::read_file(std::get<Path>(content)).value_or(std::vector<std::byte>{})
+                               : std::get<std::vector<std::byte>>(content);
+        transformer.failed_to_read_transformed_file(relative_path, bytes);
+    }
+
+    if (!any_file_changed && !target_version)
+        return false;
+
+    auto &archive = open.archive;
+    if (target_version)
+        archive.set_version(*target_version);
+
+    if (!std::move(archive).write(path, transformer.stop_token()))
+    {
+        if (!transformer.stopped())
+            transformer.failed_to_write_archive(open.source->path, path);
+        return false;
+    }
+    return true;
+}
+
+/// Waits for the files of the archive to be transformed, then writes it back if needed.
+void close_archive(OpenArchive &open, ModFolderTransformer &transformer) noexcept
+{
+    flux::for_each(open.futs, [](auto &&fut) { fut.wait(); });
     // TODO: there might be an exception in fut. Should we ignore it?
 
-    if (transformer.stop_requested())
+    if (transformer.stopped())
         return;
 
-    const bool version_changed = change_archive_version_if_needed(archive, bsa_settings);
+    const auto &archive_path = open.source->path;
+    const auto &bsa_settings = open.source->bsa_settings.get();
+    auto transformed         = std::move(*open.transformed.wlock());
 
-    if (const auto arch_size = archive.file_size(); arch_size > bsa_settings.max_size)
+    const auto target_version = guess_target_archive_version(open.archive, bsa_settings);
+    if (transformed.empty() && !target_version)
+        return;
+
+    if (transformed_archive_size(open.archive, transformed) > bsa_settings.max_size)
     {
         if (want_to_skip_archive(archive_path,
                                  transformer,
@@ -235,57 +915,165 @@ void transform_archive_file(const Path &archive_path,
             return;
     }
 
-    if (transformer.stop_requested())
+    if (transformer.stopped())
         return;
 
-    if (any_file_changed || version_changed)
+    // Change the extension of the archive if needed
+    auto path = archive_path;
+    if (path.extension() != bsa_settings.extension)
+        path.replace_extension(bsa_settings.extension);
+
+    // A conversion changes the tables of the archive, which can then only be written whole
+    auto written = std::optional<bool>{};
+    if (!target_version)
+        written = rewrite_entries(open, transformed, path, transformer);
+
+    if (transformer.stopped())
+        return;
+
+    if (!written)
+        written = write_archive(open, transformed, target_version, path, transformer);
+
+    // Remove the old archive if the new one has a different name
+    if (*written && !equivalent(archive_path, path))
+        fs::remove(archive_path);
+}
+
+/// Archives are opened one after the other, and their files submitted to the thread pool as soon as possible.
+/// To bound memory usage, only a few archives are open at the same time.
+void transform_archives(std::span<const detail::ArchiveFile> archives,
+                        ModFolderTransformer &transformer,
+                        const PipelineSettings &pipeline,
+                        common::WorkerPools &worker_pools,
+                        common::MemoryBudget &memory,
+                        const detail::DoneCallback &on_done,
+                        const detail::FileFilter &filter) noexcept
+{
+    constexpr size_t k_max_open_archives = 2;
+
+    auto open_archives = std::deque<std::unique_ptr<OpenArchive>>{};
+    auto close_oldest  = [&] {
+        auto open = std::move(open_archives.front());
+        open_archives.pop_front();
+        close_archive(*open, transformer);
+        if (on_done)
+            on_done(open->source->mod_dir);
+    };
+
+    for (const auto &source : archives)
     {
-        // Change the extension of the archive if needed
-        auto path = archive_path;
-        if (path.extension() != bsa_settings.extension)
-            path.replace_extension(bsa_settings.extension);
+        if (transformer.stopped())
+            break;
 
-        if (!std::move(archive).write(path))
-        {
-            transformer.failed_to_write_archive(archive_path, path);
-            return;
-        }
+        if (auto open = open_archive(source, transformer, pipeline, worker_pools, memory, filter))
+            open_archives.push_back(std::move(open));
+        else if (on_done)
+            on_done(source.mod_dir);
 
-        // Remove the old archive if the new one has a different name
-        if (!equivalent(archive_path, path))
-            fs::remove(archive_path);
+        if (open_archives.size() >= k_max_open_archives)
+            close_oldest();
     }
+
+    while (!open_archives.empty())
+        close_oldest();
 }
 
-void ModFolder::transform(ModFolderTransformer &transformer) noexcept
+void detail::add_file(ModFiles &files,
+                      const Path &mod_dir,
+                      const Path &path,
+                      uintmax_t size,
+                      const bsa::Settings &bsa_settings,
+                      bool ignore_existing_archives)
 {
-    auto is_arch = [](const Path &file_name) {
-        const auto ext = common::to_lower(file_name.extension().u8string());
-        return common::contains(bsa::k_archive_extensions, ext);
-    };
+    const auto ext = common::to_lower(path.extension().u8string());
+    if (common::contains(bsa::k_archive_extensions, ext))
+    {
+        if (!ignore_existing_archives)
+            files.archives.push_back(ArchiveFile{
+                .path         = path,
+                .mod_dir      = mod_dir,
+                .bsa_settings = std::cref(bsa_settings),
+                .size         = size,
+                .cost         = estimate_archive_cost(path, size),
+            });
+        return;
+    }
 
-    auto files = flux::from_range(fs::recursive_directory_iterator(dir_))
-                     .filter([](auto &&e) { return e.is_regular_file(); })
-                     .map([](auto &&e) { return e.path(); })
-                     .to<std::vector>();
+    files.loose_files.push_back(LooseFile{
+        .absolute_path = path,
+        .mod_dir       = mod_dir,
+        .size          = size,
+        .cost          = estimate_cost(path, size),
+    });
+}
 
-    std::vector<std::future<void>> futs;
-    for (const auto &file_path : files)
+auto detail::list_files(const Path &dir, const bsa::Settings &bsa_settings, bool ignore_existing_archives)
+    -> ModFiles
+{
+    auto res       = ModFiles{};
+    const auto end = fs::recursive_directory_iterator();
+    for (auto it = fs::recursive_directory_iterator(dir); it != end; ++it)
     {
-        if (transformer.stop_requested())
-            return;
+        // Left over by a transform that crashed
+        if (is_temporary_path(it->path().lexically_relative(dir)))
+        {
+            it.disable_recursion_pending();
+            continue;
+        }
 
-        if (is_arch(file_path) && ignore_existing_archives_)
+        if (!it->is_regular_file())
             continue;
 
-        futs.push_back(thread_pool_.submit_task([this, &file_path, &is_arch, &transformer] {
-            if (is_arch(file_path)) [[unlikely]]
-                transform_archive_file(file_path, transformer, bsa_settings_, thread_pool_);
-            else [[likely]]
-                transform_loose_file(file_path, dir_, transformer);
-        }));
+        auto ec         = std::error_code{};
+        const auto size = it->file_size(ec);
+        add_file(res, dir, it->path(), size, bsa_settings, ignore_existing_archives);
     }
-    flux::for_each(futs, [](auto &&fut) { fut.wait(); });
-    // TODO: there might be an exception in fut. Should we ignore it?
-};
+    return res;
+}
+
+void detail::transform_files(ModFiles files,
+                             ModFolderTransformer &transformer,
+                             const PipelineSettings &pipeline,
+                             const std::shared_ptr<common::WorkerPools> &worker_pools,
+                             const DoneCallback &on_done,
+                             const FileFilter &filter) noexcept
+{
+    if (filter)
+    {
+        const auto rejected = std::ranges::partition(files.loose_files, [&filter](const LooseFile &file) {
+            return filter(file.mod_dir, file.absolute_path.lexically_relative(file.mod_dir), false);
+        });
+        if (on_done)
+            for (const auto &file : rejected)
+                on_done(file.mod_dir);
+        files.loose_files.erase(rejected.begin(), rejected.end());
+    }
+
+    // Most expensive first: a big file started last would keep a single core busy while the others idle
+    std::ranges::stable_sort(files.loose_files, std::greater{}, &LooseFile::cost);
+    std::ranges::stable_sort(files.archives, std::greater{}, &ArchiveFile::cost);
+
+    constexpr auto k_texture = static_cast<size_t>(TaskCategory::Texture);
+    transformer.set_executor(common::make_executor(worker_pools, k_texture),
+                             worker_pools->utilization(k_texture).threads);
+
+    // Shared by loose files and archives, so that they cannot both fill the memory
+    auto memory = common::MemoryBudget(pipeline.memory_budget);
+
+    // Archives are opened on their own thread, so that their files are queued while loose files are read
+    auto archive_thread = std::jthread([&] {
+        transform_archives(files.archives, transformer, pipeline, *worker_pools, memory, on_done, filter);
+    });
+
+    transform_loose_files(files.loose_files, transformer, pipeline, *worker_pools, memory, on_done);
+}
+
+void ModFolder::transform(ModFolderTransformer &transformer) noexcept
+{
+    detail::remove_leftovers(dir_);
+    detail::transform_files(detail::list_files(dir_, bsa_settings_, ignore_existing_archives_),
+                            transformer,
+                            pipeline_,
+                            worker_pools_);
+}
 } // namespace btu::modmanager
@@ -0,0 +1,206 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/mod_folder.hpp"
+
+#include "btu/common/filesystem.hpp"
+#include "btu/modmanager/detail/transform.hpp"
+
+#include <atomic>
+
+#ifdef __linux__
+#include <cstdio>
+#include <fcntl.h>
+#endif
+
+namespace btu::modmanager {
+/// Forwards everything to another transformer, and remembers if a transformed file could not be written
+class StagingTransformer final : public ModFolderTransformer
+{
+public:
+    explicit StagingTransformer(ModFolderTransformer &transformer) noexcept
+        : transformer_(transformer)
+    {
+    }
+
+    [[nodiscard]] auto archive_too_large(const Path &archive_path, ArchiveTooLargeState state) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return transformer_.get().archive_too_large(archive_path, state);
+    }
+
+    void failed_to_read_archive(const Path &archive_path) noexcept override
+    {
+        transformer_.get().failed_to_read_archive(archive_path);
+    }
+
+    [[nodiscard]] auto stop_requested() const noexcept -> bool override
+    {
+        return transformer_.get().stop_requested();
+    }
+
+    [[nodiscard]] auto stop_token() const noexcept -> std::stop_token override
+    {
+        return transformer_.get().stop_token();
+    }
+
+    [[nodiscard]] auto transform_file(ModFile file) noexcept -> std::optional<std::vector<std::byte>> override
+    {
+        return transformer_.get().transform_file(std::move(file));
+    }
+
+    [[nodiscard]] auto transform_batch(std::span<ModFile> files) noexcept
+        -> std::vector<std::optional<std::vector<std::byte>>> override
+    {
+        return transformer_.get().transform_batch(files);
+    }
+
+    void failed_to_write_transformed_file(const Path &relative_path,
+                                          std::span<const std::byte> content) noexcept override
+    {
+        failed_ = true;
+        transformer_.get().failed_to_write_transformed_file(relative_path, content);
+    }
+
+    void failed_to_read_transformed_file(const Path &relative_path,
+                                         std::span<const std::byte> content) noexcept override
+    {
+        transformer_.get().failed_to_read_transformed_file(relative_path, content);
+    }
+
+    void failed_to_write_archive(const Path &old_archive_path, const Path &new_archive_path) noexcept override
+    {
+        failed_ = true;
+        transformer_.get().failed_to_write_archive(old_archive_path, new_archive_path);
+    }
+
+    void set_executor(common::Executor executor, size_t threads) noexcept override
+    {
+        transformer_.get().set_executor(std::move(executor), threads);
+    }
+
+    [[nodiscard]] auto failed() const noexcept -> bool { return failed_; }
+
+private:
+    std::reference_wrapper<ModFolderTransformer> transformer_;
+    std::atomic_bool failed_ = false;
+};
+
+/// Clones every file of `from` to `to`. Directories are recreated, files are reflinked or hard linked when
+/// possible, so that staging a large mod is nearly free
+[[nodiscard]] auto clone_tree(const Path &from, const Path &to) noexcept -> tl::expected<void, common::Error>
+{
+    auto ec = std::error_code{};
+    fs::create_directories(to, ec);
+    if (ec)
+        return tl::make_unexpected(common::Error(ec));
+
+    const auto end = fs::recursive_directory_iterator();
+    for (auto it = fs::recursive_directory_iterator(from, ec); !ec && it != end; it.increment(ec))
+    {
+        const auto target = to / it->path().lexically_relative(from);
+        if (it->is_directory(ec))
+            fs::create_directories(target, ec);
+        else if (it->is_regular_file(ec))
+        {
+            if (auto res = common::clone_file(it->path(), target); !res)
+                return tl::make_unexpected(res.error());
+        }
+    }
+
+    if (ec)
+        return tl::make_unexpected(common::Error(ec));
+    return {};
+}
+
+/// Replaces `dir` by `staging`, and removes the original files. Atomic on Linux, where the directories are
+/// exchanged. Elsewhere, `dir` is moved aside for a moment
+[[nodiscard]] auto replace_directory(const Path &dir, const Path &staging) noexcept
+    -> tl::expected<void, common::Error>
+{
+    auto ec = std::error_code{};
+
+#ifdef __linux__
+    if (::renameat2(AT_FDCWD, dir.c_str(), AT_FDCWD, staging.c_str(), RENAME_EXCHANGE) == 0)
+    {
+        fs::remove_all(staging, ec);
+        return {};
+    }
+    // Not supported by every filesystem, fall back to renames
+#endif
+
+    auto aside = dir;
+    aside += u8".btu-old";
+
+    fs::rename(dir, aside, ec);
+    if (ec)
+        return tl::make_unexpected(common::Error(ec));
+
+    fs::rename(staging, dir, ec);
+    if (ec)
+    {
+        auto restore_ec = std::error_code{};
+        fs::rename(aside, dir, restore_ec);
+        return tl::make_unexpected(common::Error(ec));
+    }
+
+    fs::remove_all(aside, ec);
+    return {};
+}
+
+auto ModFolder::transform_staged(ModFolderTransformer &transformer) noexcept
+    -> tl::expected<void, common::Error>
+{
+    auto staging_dir = dir_;
+    staging_dir += u8".btu-staging";
+
+    auto remove_staging = [&staging_dir] {
+        auto ec = std::error_code{};
+        fs::remove_all(staging_dir, ec);
+    };
+
+    // Left over by a run that crashed
+    detail::remove_leftovers(dir_);
+
+    if (auto res = clone_tree(dir_, staging_dir); !res)
+    {
+        remove_staging();
+        return res;
+    }
+
+    auto staging = StagingTransformer(transformer);
+    try
+    {
+        detail::transform_files(detail::list_files(staging_dir, bsa_settings_, ignore_existing_archives_),
+                                staging,
+                                pipeline_,
+                                worker_pools_);
+    }
+    catch (const std::exception &)
+    {
+        remove_staging();
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::io_error)));
+    }
+
+    if (transformer.stopped())
+    {
+        remove_staging();
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::operation_canceled)));
+    }
+
+    if (staging.failed())
+    {
+        remove_staging();
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::io_error)));
+    }
+
+    if (auto res = replace_directory(dir_, staging_dir); !res)
+    {
+        remove_staging();
+        return res;
+    }
+    return {};
+}
+} // namespace btu::modmanager
@@ -0,0 +1,240 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/mod_folder.hpp"
+
+#include "btu/modmanager/detail/transform.hpp"
+
+#include <array>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+namespace btu::modmanager {
+#ifdef __linux__
+/// Adds the files of `dir` to `changed`. Stops at the first error, as a directory removed during the walk
+void add_files(const Path &dir, std::set<Path> &changed)
+{
+    auto ec        = std::error_code{};
+    const auto end = fs::recursive_directory_iterator();
+    for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != end; it.increment(ec))
+        if (it->is_regular_file(ec))
+            changed.insert(it->path());
+}
+
+/// Owns an inotify instance watching a directory tree. inotify is not recursive: every directory has its own
+/// watch, and directories created later are added as they appear.
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher() noexcept
+        : fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+    {
+    }
+
+    ~DirectoryWatcher()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    DirectoryWatcher(const DirectoryWatcher &)                     = delete;
+    auto operator=(const DirectoryWatcher &) -> DirectoryWatcher & = delete;
+
+    [[nodiscard]] auto valid() const noexcept -> bool { return fd_ >= 0; }
+
+    /// Watches `dir` and its subdirectories
+    [[nodiscard]] auto add_recursive(const Path &dir) -> tl::expected<void, common::Error>
+    {
+        if (auto res = add(dir); !res)
+            return res;
+
+        // Directories may disappear while they are walked, the throwing iterator would terminate the watch
+        auto ec        = std::error_code{};
+        const auto end = fs::recursive_directory_iterator();
+        for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != end; it.increment(ec))
+        {
+            if (!it->is_directory(ec))
+                continue;
+            if (auto res = add(it->path()); !res)
+                return res;
+        }
+        return {};
+    }
+
+    /// Waits up to `timeout` for events, and adds the files that were written or moved in to `changed`.
+    /// \return false if the kernel queue overflowed, meaning that some changes were lost
+    [[nodiscard]] auto read_events(std::chrono::milliseconds timeout, std::set<Path> &changed) -> bool
+    {
+        auto pfd = pollfd{.fd = fd_, .events = POLLIN, .revents = 0};
+        if (poll(&pfd, 1, static_cast<int>(timeout.count())) <= 0)
+            return true;
+
+        constexpr size_t k_buffer_size = 64ULL * 1024;
+        alignas(inotify_event) auto buffer = std::array<char, k_buffer_size>{};
+
+        bool complete = true;
+        for (auto len = read(fd_, buffer.data(), buffer.size()); len > 0;
+             len      = read(fd_, buffer.data(), buffer.size()))
+        {
+            for (ptrdiff_t offset = 0; offset < len;)
+            {
+                const auto *event = reinterpret_cast<const inotify_event *>(buffer.data() + offset);
+                offset += static_cast<ptrdiff_t>(sizeof(inotify_event) + event->len);
+
+                if ((event->mask & IN_Q_OVERFLOW) != 0U)
+                    complete = false;
+                else if (const auto it = dirs_.find(event->wd); it != dirs_.end() && event->len > 0)
+                    handle_event(*event, it->second / event->name, changed);
+            }
+        }
+        return complete;
+    }
+
+private:
+    void handle_event(const inotify_event &event, Path path, std::set<Path> &changed)
+    {
+        if ((event.mask & IN_ISDIR) == 0U)
+        {
+            // Files are handled once closed, not when created
+            if ((event.mask & IN_CREATE) == 0U)
+                changed.insert(std::move(path));
+            return;
+        }
+
+        // Scratch directories are written by the transform itself
+        if (detail::is_temporary_path(path.filename()))
+            return;
+
+        // Files may have been added to the directory before it was watched
+        if (!add_recursive(path))
+            return;
+
+        add_files(path, changed);
+    }
+
+    [[nodiscard]] auto add(const Path &dir) -> tl::expected<void, common::Error>
+    {
+        const int wd = inotify_add_watch(fd_, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (wd < 0)
+            return tl::make_unexpected(common::Error(std::error_code(errno, std::system_category())));
+
+        dirs_.insert_or_assign(wd, dir);
+        return {};
+    }
+
+    int fd_;
+    std::unordered_map<int, Path> dirs_;
+};
+
+
+auto ModFolder::watch(ModFolderTransformer &transformer,
+                      std::stop_token stop,
+                      std::chrono::milliseconds debounce,
+                      const WatchCallback &on_processed) noexcept -> tl::expected<void, common::Error>
+{
+    // How often the stop token is checked while idle
+    constexpr auto k_poll_interval = std::chrono::milliseconds(100);
+
+    detail::remove_leftovers(dir_);
+
+    auto watcher = DirectoryWatcher{};
+    if (!watcher.valid())
+        return tl::make_unexpected(common::Error(std::error_code(errno, std::system_category())));
+
+    if (auto res = watcher.add_recursive(dir_); !res)
+        return res;
+
+    // Writing a transformed file triggers an event too. Files whose modification time did not change since we
+    // processed them are ignored, otherwise every file would be processed twice
+    auto processed_times = std::map<Path, fs::file_time_type>{};
+    auto was_processed   = [&processed_times](const Path &path, fs::file_time_type time) {
+        const auto it = processed_times.find(path);
+        return it != processed_times.end() && it->second == time;
+    };
+    auto mark_processed = [&processed_times](const Path &path) {
+        auto ec          = std::error_code{};
+        const auto mtime = fs::last_write_time(path, ec);
+        if (!ec)
+            processed_times.insert_or_assign(path, mtime);
+    };
+
+    auto changed    = std::set<Path>{};
+    auto last_event = std::chrono::steady_clock::now();
+    while (!stop.stop_requested() && !transformer.stopped())
+    {
+        const auto count_before = changed.size();
+        if (!watcher.read_events(std::min(debounce, k_poll_interval), changed))
+        {
+            // Some events were lost, fall back to a full scan
+            add_files(dir_, changed);
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        if (changed.size() != count_before)
+            last_event = now;
+
+        if (changed.empty() || now - last_event < debounce)
+            continue;
+
+        auto files     = detail::ModFiles{};
+        auto processed = std::vector<Path>{};
+        for (const auto &path : changed)
+        {
+            // Temporary files of a transform, ours or of another process
+            if (detail::is_temporary_path(path.lexically_relative(dir_)))
+                continue;
+
+            auto ec         = std::error_code{};
+            const auto size = fs::file_size(path, ec);
+            if (ec) // Deleted since
+                continue;
+
+            const auto mtime = fs::last_write_time(path, ec);
+            if (ec || was_processed(path, mtime))
+                continue;
+
+            detail::add_file(files, dir_, path, size, bsa_settings_, ignore_existing_archives_);
+            processed.push_back(path);
+        }
+        changed.clear();
+
+        if (processed.empty())
+            continue;
+
+        detail::transform_files(std::move(files), transformer, pipeline_, worker_pools_);
+
+        for (const auto &path : processed)
+        {
+            mark_processed(path);
+
+            // Archives are rewritten with the extension of the settings, see ModFolder::transform
+            const auto ext     = common::to_lower(path.extension().u8string());
+            const bool archive = common::contains(bsa::k_archive_extensions, ext);
+            if (archive && path.extension() != bsa_settings_.extension)
+                mark_processed(Path(path).replace_extension(bsa_settings_.extension));
+        }
+
+        if (on_processed)
+            on_processed(processed);
+    }
+    return {};
+}
+#else
+auto ModFolder::watch(ModFolderTransformer & /*transformer*/,
+                      std::stop_token /*stop*/,
+                      std::chrono::milliseconds /*debounce*/,
+                      const WatchCallback & /*on_processed*/) noexcept -> tl::expected<void, common::Error>
+{
+    return tl::make_unexpected(common::Error(std::make_error_code(std::errc::function_not_supported)));
+}
+#endif
+} // namespace btu::modmanager
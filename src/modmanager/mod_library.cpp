@@ -0,0 +1,104 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/mod_library.hpp"
+
+#include "btu/modmanager/detail/transform.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <set>
+
+namespace btu::modmanager {
+ModLibrary::ModLibrary(std::span<const Path> mod_directories,
+                       const bsa::Settings &bsa_settings,
+                       bool ignore_existing_archives,
+                       PipelineSettings pipeline)
+    : pipeline_(pipeline)
+    , worker_pools_(detail::make_worker_pools(pipeline.transform_threads))
+{
+    // A mod listed twice would be transformed twice at the same time, and only reported done once
+    auto seen = std::set<Path>{};
+    mods_.reserve(mod_directories.size());
+    for (const auto &dir : mod_directories)
+        if (seen.insert(detail::canonical_mod_dir(dir)).second)
+            mods_.emplace_back(dir, bsa_settings, worker_pools_, ignore_existing_archives, pipeline);
+}
+
+void ModLibrary::transform(ModFolderTransformer &transformer, const ModCallback &on_mod_done) noexcept
+{
+    transform_impl(transformer, {}, on_mod_done);
+}
+
+auto ModLibrary::transform(ModFolderTransformer &transformer,
+                           const FileConflicts &conflicts,
+                           const ModCallback &on_mod_done) noexcept -> tl::expected<void, common::Error>
+{
+    // Conflicts computed for another set of mods would silently let every file of the missing mods win
+    const auto unknown = std::ranges::find_if_not(mods_, [&conflicts](const ModFolder &mod) {
+        return conflicts.contains(mod.path());
+    });
+    if (unknown != mods_.end())
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::invalid_argument)));
+
+    const auto is_winner = [&conflicts](const Path &mod_dir, const Path &relative_path, bool in_archive) {
+        return conflicts.is_winner(mod_dir, relative_path, in_archive).value_or(true);
+    };
+    transform_impl(transformer, is_winner, on_mod_done);
+    return {};
+}
+
+void ModLibrary::transform_impl(ModFolderTransformer &transformer,
+                                const detail::FileFilter &filter,
+                                const ModCallback &on_mod_done) noexcept
+{
+    auto remaining  = std::vector<std::atomic_size_t>(mods_.size());
+    auto mod_of_dir = std::map<Path, size_t>{};
+    auto all_files  = detail::ModFiles{};
+
+    for (size_t i = 0; i < mods_.size(); ++i)
+    {
+        const auto &mod = mods_[i];
+        detail::remove_leftovers(mod.path());
+        auto files = detail::list_files(mod.path(), mod.bsa_settings(), mod.ignore_existing_archives());
+
+        remaining[i] = files.loose_files.size() + files.archives.size();
+        mod_of_dir.emplace(mod.path(), i);
+
+        std::ranges::move(files.loose_files, std::back_inserter(all_files.loose_files));
+        std::ranges::move(files.archives, std::back_inserter(all_files.archives));
+    }
+
+    for (size_t i = 0; i < mods_.size(); ++i)
+        if (remaining[i] == 0 && on_mod_done)
+            on_mod_done(mods_[i]);
+
+    const auto on_file_done = [&](const Path &mod_dir) {
+        const auto mod = mod_of_dir.at(mod_dir);
+        if (--remaining[mod] == 0 && on_mod_done)
+            on_mod_done(mods_[mod]);
+    };
+    detail::transform_files(std::move(all_files),
+                            transformer,
+                            pipeline_,
+                            worker_pools_,
+                            on_file_done,
+                            filter);
+}
+
+auto ModLibrary::utilization(TaskCategory category) const -> common::PoolUtilization
+{
+    return worker_pools_->utilization(static_cast<size_t>(category));
+}
+
+void ModLibrary::iterate(ModFolderIterator &iterator, const ModCallback &on_mod_done) noexcept
+{
+    auto transformer = detail::ReadOnlyTransformer(iterator);
+    transform(transformer, on_mod_done);
+}
+} // namespace btu::modmanager
@@ -33,4 +33,20 @@ auto find_manager(const Path &dir) -> ModManager
 
     return ModManager::None;
 }
+
+auto list_mods(const Path &dir) -> std::vector<Path>
+{
+    switch (find_manager(dir))
+    {
+        case ModManager::Vortex:
+        case ModManager::MO2:
+            return flux::from_range(fs::directory_iterator(dir))
+                .filter([](auto &&entry) { return entry.is_directory(); })
+                .map([](auto &&entry) { return entry.path(); })
+                .to<std::vector>();
+        case ModManager::ManualForced:
+        case ModManager::None: return {dir};
+    }
+    return {dir};
+}
 } // namespace btu::modmanager
@@ -0,0 +1,603 @@
+/* Copyright (C) 2020 - 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/vfs_index.hpp"
+
+#include "btu/bsa/archive.hpp"
+#include "btu/bsa/settings.hpp"
+#include "btu/common/algorithms.hpp"
+#include "btu/common/filesystem.hpp"
+#include "btu/modmanager/conflicts.hpp"
+#include "btu/modmanager/detail/transform.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <limits>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace btu::modmanager {
+// On-disk format. Integers are stored in native (little-endian) order. Strings are stored in a single
+// table at the end of the file, and referenced by offset and size. Records are read with memcpy, so the
+// mapping does not need any particular alignment.
+//
+// header | mods | sources | entries | buckets | strings
+//
+// Providers of the same path are contiguous entries, winner first. The buckets form an open-addressing hash
+// table with linear probing, holding the index of the winner plus one, or 0 for an empty bucket.
+constexpr uint32_t k_vfs_magic   = 0x53465642; // "BVFS"
+constexpr uint32_t k_vfs_version = 1;
+
+using detail::VfsHeader;
+
+struct VfsString
+{
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct VfsSourceRecord
+{
+    uint32_t mod;
+    uint32_t reserved;
+    /// Empty for the loose files of a mod
+    VfsString archive;
+};
+
+struct VfsEntryRecord
+{
+    uint64_t hash;
+    uint64_t size;
+    VfsString key;
+    VfsString relative_path;
+    uint32_t source;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(VfsHeader) == 80);
+static_assert(sizeof(VfsString) == 8);
+static_assert(sizeof(VfsSourceRecord) == 16);
+static_assert(sizeof(VfsEntryRecord) == 40);
+
+[[nodiscard]] auto vfs_key(std::u8string_view relative_path) -> std::u8string
+{
+    static constexpr auto canonize = common::make_path_canonizer(u8"");
+    return canonize(Path(relative_path));
+}
+
+/// FNV-1a. Stable across runs and platforms, unlike std::hash
+[[nodiscard]] constexpr auto vfs_hash(std::u8string_view key) noexcept -> uint64_t
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char8_t c : key)
+    {
+        hash ^= static_cast<uint64_t>(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+[[nodiscard]] auto is_archive_path(const Path &path) -> bool
+{
+    const auto ext = common::to_lower(path.extension().u8string());
+    return common::contains(bsa::k_archive_extensions, ext);
+}
+
+VfsIndex::VfsIndex(std::span<const Path> mods_by_priority)
+    : mods_(mods_by_priority.begin(), mods_by_priority.end())
+{
+    for (size_t i = 0; i < mods_.size(); ++i)
+        sources_.push_back(Source{.mod = i, .archive = {}, .files = {}});
+
+    for (size_t i = 0; i < mods_.size(); ++i)
+    {
+        for (const auto &entry : fs::recursive_directory_iterator(mods_[i]))
+        {
+            const auto relative = entry.path().lexically_relative(mods_[i]);
+            if (!entry.is_regular_file() || detail::is_temporary_path(relative))
+                continue;
+
+            if (is_archive_path(entry.path()))
+                add_archive(i, entry.path());
+            else
+                add(static_cast<uint32_t>(i), relative.generic_u8string(), entry.file_size());
+        }
+    }
+}
+
+auto VfsIndex::find(std::u8string_view relative_path) const -> std::optional<VfsFile>
+{
+    const auto it = files_.find(vfs_key(relative_path));
+    if (it == files_.end())
+        return std::nullopt;
+
+    return make_file(it->second.front());
+}
+
+/// Absolute, without symbolic links, `.` or `..`. Works for paths that do not exist anymore
+[[nodiscard]] auto canonical_path(const Path &path) -> Path
+{
+    auto ec  = std::error_code{};
+    auto res = fs::weakly_canonical(path, ec);
+    return ec ? fs::absolute(path).lexically_normal() : res;
+}
+
+auto VfsIndex::find_mod(const Path &path) -> std::optional<std::pair<size_t, Path>>
+{
+    if (canonical_mods_.size() != mods_.size())
+    {
+        canonical_mods_.clear();
+        for (const auto &dir : mods_)
+            canonical_mods_.push_back(canonical_path(dir));
+    }
+
+    const auto canonical = canonical_path(path);
+    for (size_t i = 0; i < canonical_mods_.size(); ++i)
+    {
+        auto rel = canonical.lexically_relative(canonical_mods_[i]);
+        if (!rel.empty() && *rel.begin() != ".." && rel != ".")
+            return std::pair{i, std::move(rel)};
+    }
+    return std::nullopt;
+}
+
+void VfsIndex::update(const Path &absolute_path)
+{
+    const auto mod = find_mod(absolute_path);
+    if (!mod)
+        return;
+
+    const auto &[mod_idx, relative] = *mod;
+    // The path as it was listed when the index was built
+    const auto path   = mods_[mod_idx] / relative;
+    const bool exists = fs::is_regular_file(path);
+
+    if (is_archive_path(path))
+    {
+        if (exists)
+            add_archive(mod_idx, path);
+        else if (const auto it = archive_sources_.find(vfs_key(path.generic_u8string()));
+                 it != archive_sources_.end())
+            remove_archive(it->second);
+        return;
+    }
+
+    const auto relative_path = relative.generic_u8string();
+    if (exists)
+        add(static_cast<uint32_t>(mod_idx), relative_path, fs::file_size(path));
+    else
+        remove(static_cast<uint32_t>(mod_idx), vfs_key(relative_path));
+}
+
+auto VfsIndex::is_archive(uint32_t source) const noexcept -> bool
+{
+    return !sources_[source].archive.empty();
+}
+
+auto VfsIndex::make_file(const Provider &provider) const -> VfsFile
+{
+    const auto &source  = sources_[provider.source];
+    const auto &mod_dir = mods_[source.mod];
+    const bool archive  = is_archive(provider.source);
+
+    return VfsFile{
+        .mod_dir       = mod_dir,
+        .source        = archive ? mod_dir / source.archive : mod_dir / provider.relative_path,
+        .relative_path = provider.relative_path,
+        .in_archive    = archive,
+        .size          = provider.size,
+    };
+}
+
+void VfsIndex::add(uint32_t source, std::u8string relative_path, uintmax_t size)
+{
+    auto key        = vfs_key(relative_path);
+    auto &providers = files_[key];
+
+    std::erase_if(providers, [source](const Provider &p) { return p.source == source; });
+    providers.push_back(Provider{.source = source, .relative_path = std::move(relative_path), .size = size});
+    sort_providers(providers);
+
+    if (is_archive(source))
+        sources_[source].files.push_back(std::move(key));
+}
+
+void VfsIndex::remove(uint32_t source, const std::u8string &key)
+{
+    const auto it = files_.find(key);
+    if (it == files_.end())
+        return;
+
+    std::erase_if(it->second, [source](const Provider &p) { return p.source == source; });
+    if (it->second.empty())
+        files_.erase(it);
+}
+
+void VfsIndex::add_archive(size_t mod, const Path &archive_path)
+{
+    const auto source_key = vfs_key(archive_path.generic_u8string());
+
+    auto source = uint32_t{};
+    if (const auto it = archive_sources_.find(source_key); it != archive_sources_.end())
+    {
+        source = it->second;
+        remove_archive(source);
+    }
+    else
+    {
+        source = static_cast<uint32_t>(sources_.size());
+        sources_.push_back(Source{
+            .mod     = mod,
+            .archive = archive_path.lexically_relative(mods_[mod]).generic_u8string(),
+            .files   = {},
+        });
+        archive_sources_.emplace(source_key, source);
+    }
+
+    const auto entries = bsa::read_file_list(archive_path);
+    if (!entries)
+        return;
+
+    for (const auto &entry : *entries)
+        add(source, common::as_utf8_string(entry.name), entry.size);
+}
+
+void VfsIndex::remove_archive(uint32_t source)
+{
+    for (const auto &key : sources_[source].files)
+        remove(source, key);
+    sources_[source].files.clear();
+}
+
+void VfsIndex::sort_providers(std::vector<Provider> &providers) const
+{
+    std::ranges::stable_sort(providers, std::greater{}, [this](const Provider &p) {
+        return provider_rank(sources_[p.source].mod, is_archive(p.source));
+    });
+}
+
+template<typename T>
+void append_record(std::vector<std::byte> &out, const T &value)
+{
+    const auto *begin = reinterpret_cast<const std::byte *>(&value);
+    out.insert(out.end(), begin, begin + sizeof(T));
+}
+
+auto VfsIndex::save(const Path &path) const -> tl::expected<void, common::Error>
+{
+    auto strings    = std::vector<std::byte>{};
+    auto add_string = [&strings](std::u8string_view str) {
+        const auto res = VfsString{
+            .offset = static_cast<uint32_t>(strings.size()),
+            .size   = static_cast<uint32_t>(str.size()),
+        };
+        const auto *begin = reinterpret_cast<const std::byte *>(str.data());
+        strings.insert(strings.end(), begin, begin + str.size());
+        return res;
+    };
+
+    auto mods = std::vector<std::byte>{};
+    for (const auto &mod : mods_)
+        append_record(mods, add_string(mod.u8string()));
+
+    auto sources = std::vector<std::byte>{};
+    for (const auto &source : sources_)
+        append_record(sources,
+                      VfsSourceRecord{
+                          .mod      = static_cast<uint32_t>(source.mod),
+                          .reserved = 0,
+                          .archive  = add_string(source.archive),
+                      });
+
+    const auto bucket_count = std::bit_ceil(std::max<size_t>(2 * files_.size(), 1));
+    auto buckets            = std::vector<uint32_t>(bucket_count);
+
+    auto entries     = std::vector<std::byte>{};
+    auto entry_count = uint32_t{0};
+    for (const auto &[key, providers] : files_)
+    {
+        const auto hash       = vfs_hash(key);
+        const auto key_string = add_string(key);
+
+        auto bucket = hash & (bucket_count - 1);
+        while (buckets[bucket] != 0)
+            bucket = (bucket + 1) & (bucket_count - 1);
+        buckets[bucket] = entry_count + 1;
+
+        for (const auto &provider : providers)
+        {
+            append_record(entries,
+                          VfsEntryRecord{
+                              .hash          = hash,
+                              .size          = provider.size,
+                              .key           = key_string,
+                              .relative_path = add_string(provider.relative_path),
+                              .source        = provider.source,
+                              .reserved      = 0,
+                          });
+            ++entry_count;
+        }
+    }
+
+    if (strings.size() > std::numeric_limits<uint32_t>::max())
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::value_too_large)));
+
+    auto header = VfsHeader{
+        .magic          = k_vfs_magic,
+        .version        = k_vfs_version,
+        .mod_count      = static_cast<uint32_t>(mods_.size()),
+        .source_count   = static_cast<uint32_t>(sources_.size()),
+        .entry_count    = entry_count,
+        .bucket_count   = static_cast<uint32_t>(bucket_count),
+        .path_count     = static_cast<uint32_t>(files_.size()),
+        .reserved       = 0,
+        .mods_offset    = sizeof(VfsHeader),
+        .sources_offset = 0,
+        .entries_offset = 0,
+        .buckets_offset = 0,
+        .strings_offset = 0,
+        .strings_size   = strings.size(),
+    };
+    header.sources_offset = header.mods_offset + mods.size();
+    header.entries_offset = header.sources_offset + sources.size();
+    header.buckets_offset = header.entries_offset + entries.size();
+    header.strings_offset = header.buckets_offset + buckets.size() * sizeof(uint32_t);
+
+    auto out = std::vector<std::byte>{};
+    out.reserve(header.strings_offset + strings.size());
+    append_record(out, header);
+    out.insert(out.end(), mods.begin(), mods.end());
+    out.insert(out.end(), sources.begin(), sources.end());
+    out.insert(out.end(), entries.begin(), entries.end());
+    for (const auto bucket : buckets)
+        append_record(out, bucket);
+    out.insert(out.end(), strings.begin(), strings.end());
+
+    return common::write_file(path, out);
+}
+
+/// Reads a record of the file, or std::nullopt if it is out of bounds
+template<typename T>
+[[nodiscard]] auto read_record(std::span<const std::byte> data, uint64_t offset) noexcept -> std::optional<T>
+{
+    if (offset > data.size() || data.size() - offset < sizeof(T))
+        return std::nullopt;
+
+    auto res = T{};
+    std::memcpy(&res, data.data() + offset, sizeof(T));
+    return res;
+}
+
+[[nodiscard]] auto read_string(std::span<const std::byte> data,
+                               const VfsHeader &header,
+                               VfsString str) noexcept -> std::optional<std::u8string_view>
+{
+    if (uint64_t{str.offset} + str.size > header.strings_size)
+        return std::nullopt;
+
+    const auto *begin = reinterpret_cast<const char8_t *>(data.data() + header.strings_offset + str.offset);
+    return std::u8string_view(begin, str.size);
+}
+
+[[nodiscard]] auto read_header(std::span<const std::byte> data) noexcept -> std::optional<VfsHeader>
+{
+    const auto header = read_record<VfsHeader>(data, 0);
+    if (!header || header->magic != k_vfs_magic || header->version != k_vfs_version)
+        return std::nullopt;
+
+    const auto fits = [&data](uint64_t offset, uint64_t count, uint64_t size) {
+        return offset <= data.size() && count <= (data.size() - offset) / size;
+    };
+
+    const bool valid = fits(header->mods_offset, header->mod_count, sizeof(VfsString))
+                       && fits(header->sources_offset, header->source_count, sizeof(VfsSourceRecord))
+                       && fits(header->entries_offset, header->entry_count, sizeof(VfsEntryRecord))
+                       && fits(header->buckets_offset, header->bucket_count, sizeof(uint32_t))
+                       && fits(header->strings_offset, header->strings_size, 1)
+                       && std::has_single_bit(header->bucket_count);
+    if (!valid)
+        return std::nullopt;
+
+    return header;
+}
+
+/// Resolves an entry of the file. std::nullopt if the file is corrupted
+[[nodiscard]] auto read_vfs_file(std::span<const std::byte> data,
+                                 const VfsHeader &header,
+                                 const VfsEntryRecord &entry) -> std::optional<VfsFile>
+{
+    if (entry.source >= header.source_count)
+        return std::nullopt;
+
+    const auto source_offset = header.sources_offset + uint64_t{entry.source} * sizeof(VfsSourceRecord);
+    const auto source        = read_record<VfsSourceRecord>(data, source_offset);
+    if (!source || source->mod >= header.mod_count)
+        return std::nullopt;
+
+    const auto mod_offset = header.mods_offset + uint64_t{source->mod} * sizeof(VfsString);
+    const auto mod_string = read_record<VfsString>(data, mod_offset);
+    if (!mod_string)
+        return std::nullopt;
+
+    const auto mod_dir       = read_string(data, header, *mod_string);
+    const auto archive       = read_string(data, header, source->archive);
+    const auto relative_path = read_string(data, header, entry.relative_path);
+    if (!mod_dir || !archive || !relative_path)
+        return std::nullopt;
+
+    const auto mod_path = Path(*mod_dir);
+    const bool in_arch  = !archive->empty();
+    return VfsFile{
+        .mod_dir       = mod_path,
+        .source        = in_arch ? mod_path / *archive : mod_path / *relative_path,
+        .relative_path = std::u8string(*relative_path),
+        .in_archive    = in_arch,
+        .size          = entry.size,
+    };
+}
+
+/// Maps the whole file in memory. Falls back to reading it on platforms without mmap
+[[nodiscard]] auto map_file(const Path &path)
+    -> tl::expected<std::pair<std::shared_ptr<const void>, std::span<const std::byte>>, common::Error>
+{
+#ifdef _WIN32
+    auto content = common::read_file(path);
+    if (!content)
+        return tl::make_unexpected(content.error());
+
+    auto storage    = std::make_shared<const std::vector<std::byte>>(std::move(*content));
+    const auto data = std::span<const std::byte>(*storage);
+    return std::pair{std::shared_ptr<const void>(std::move(storage)), data};
+#else
+    const auto last_error = [] { return common::Error(std::error_code(errno, std::system_category())); };
+
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return tl::make_unexpected(last_error());
+
+    struct stat st = {};
+    if (::fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        const auto err = st.st_size == 0 ? common::Error(std::make_error_code(std::errc::invalid_argument))
+                                         : last_error();
+        ::close(fd);
+        return tl::make_unexpected(err);
+    }
+
+    const auto size = static_cast<size_t>(st.st_size);
+    void *mapping   = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid once the descriptor is closed
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+        return tl::make_unexpected(last_error());
+
+    auto storage = std::shared_ptr<const void>(mapping, [size](const void *ptr) {
+        ::munmap(const_cast<void *>(ptr), size);
+    });
+    return std::pair{std::move(storage), std::span(static_cast<const std::byte *>(mapping), size)};
+#endif
+}
+
+auto VfsIndex::load(const Path &path) -> tl::expected<VfsIndex, common::Error>
+{
+    const auto corrupted = [] {
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::bad_message)));
+    };
+
+    const auto mapping = map_file(path);
+    if (!mapping)
+        return tl::make_unexpected(mapping.error());
+
+    const auto data   = mapping->second;
+    const auto header = read_header(data);
+    if (!header)
+        return corrupted();
+
+    auto res = VfsIndex{};
+    for (uint64_t i = 0; i < header->mod_count; ++i)
+    {
+        const auto str = read_record<VfsString>(data, header->mods_offset + i * sizeof(VfsString));
+        const auto mod = str ? read_string(data, *header, *str) : std::nullopt;
+        if (!mod)
+            return corrupted();
+        res.mods_.emplace_back(*mod);
+    }
+
+    for (uint64_t i = 0; i < header->source_count; ++i)
+    {
+        const auto offset  = header->sources_offset + i * sizeof(VfsSourceRecord);
+        const auto record  = read_record<VfsSourceRecord>(data, offset);
+        const auto archive = record ? read_string(data, *header, record->archive) : std::nullopt;
+        if (!archive || record->mod >= res.mods_.size())
+            return corrupted();
+
+        res.sources_.push_back(Source{.mod = record->mod, .archive = std::u8string(*archive), .files = {}});
+        if (!archive->empty())
+            res.archive_sources_.emplace(vfs_key((res.mods_[record->mod] / *archive).generic_u8string()),
+                                         static_cast<uint32_t>(i));
+    }
+
+    for (uint64_t i = 0; i < header->entry_count; ++i)
+    {
+        const auto offset        = header->entries_offset + i * sizeof(VfsEntryRecord);
+        const auto entry         = read_record<VfsEntryRecord>(data, offset);
+        const auto key           = entry ? read_string(data, *header, entry->key) : std::nullopt;
+        const auto relative_path = entry ? read_string(data, *header, entry->relative_path) : std::nullopt;
+        if (!key || !relative_path || entry->source >= res.sources_.size())
+            return corrupted();
+
+        // Entries are already sorted, winner first
+        auto key_string = std::u8string(*key);
+        res.files_[key_string].push_back(Provider{
+            .source        = entry->source,
+            .relative_path = std::u8string(*relative_path),
+            .size          = entry->size,
+        });
+        if (res.is_archive(entry->source))
+            res.sources_[entry->source].files.push_back(std::move(key_string));
+    }
+
+    return res;
+}
+
+VfsIndexView::VfsIndexView(std::shared_ptr<const void> storage,
+                           std::span<const std::byte> data,
+                           const VfsHeader &header) noexcept
+    : storage_(std::move(storage))
+    , data_(data)
+    , header_(header)
+{
+}
+
+auto VfsIndexView::open(const Path &path) -> tl::expected<VfsIndexView, common::Error>
+{
+    auto mapping = map_file(path);
+    if (!mapping)
+        return tl::make_unexpected(mapping.error());
+
+    const auto header = read_header(mapping->second);
+    if (!header)
+        return tl::make_unexpected(common::Error(std::make_error_code(std::errc::bad_message)));
+
+    return VfsIndexView(std::move(mapping->first), mapping->second, *header);
+}
+
+auto VfsIndexView::find(std::u8string_view relative_path) const -> std::optional<VfsFile>
+{
+    const auto &header = header_;
+
+    const auto key  = vfs_key(relative_path);
+    const auto hash = vfs_hash(key);
+    const auto mask = uint64_t{header.bucket_count} - 1;
+
+    auto bucket = hash & mask;
+    for (uint64_t probe = 0; probe < header.bucket_count; ++probe, bucket = (bucket + 1) & mask)
+    {
+        const auto index = read_record<uint32_t>(data_, header.buckets_offset + bucket * sizeof(uint32_t));
+        if (!index || *index == 0 || *index > header.entry_count)
+            return std::nullopt;
+
+        const auto offset = header.entries_offset + uint64_t{*index - 1} * sizeof(VfsEntryRecord);
+        const auto entry  = read_record<VfsEntryRecord>(data_, offset);
+        if (!entry || entry->hash != hash)
+            continue;
+
+        if (read_string(data_, header, entry->key) == key)
+            return read_vfs_file(data_, header, *entry);
+    }
+    return std::nullopt;
+}
+
+auto VfsIndexView::size() const noexcept -> size_t
+{
+    return header_.path_count;
+}
+} // namespace btu::modmanager
@@ -0,0 +1,162 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/tex/analysis.hpp"
+
+#include "btu/tex/dxtex.hpp"
+#include "btu/tex/texture.hpp"
+
+#include <algorithm>
+#include <span>
+
+namespace btu::tex {
+constexpr size_t k_channels = 4;
+/// Pixels accumulated side by side. Lanes are independent, so that compilers turn the loop into a few
+/// vector min/max per chunk
+constexpr size_t k_lane_pixels = 16;
+constexpr size_t k_lane_bytes  = k_lane_pixels * k_channels;
+
+class ChannelAccumulator
+{
+public:
+    void add(std::span<const uint8_t> pixels) noexcept
+    {
+        size_t i = 0;
+        for (; i + k_lane_bytes <= pixels.size(); i += k_lane_bytes)
+            add_lanes(pixels.subspan(i, k_lane_bytes));
+        for (; i < pixels.size(); ++i)
+            add_byte(i % k_channels, pixels[i]);
+    }
+
+    [[nodiscard]] auto result() const noexcept -> PixelAnalysis
+    {
+        auto res = PixelAnalysis{.min = {255, 255, 255, 255}, .max = {0, 0, 0, 0}, .alpha_binary = true};
+        for (size_t i = 0; i < k_lane_bytes; ++i)
+        {
+            const auto channel = i % k_channels;
+            res.min[channel]   = std::min(res.min[channel], min_[i]);
+            res.max[channel]   = std::max(res.max[channel], max_[i]);
+            if (channel == PixelAnalysis::k_alpha && non_binary_[i] != 0)
+                res.alpha_binary = false;
+        }
+        return res;
+    }
+
+private:
+    void add_lanes(std::span<const uint8_t> lanes) noexcept
+    {
+        for (size_t i = 0; i < k_lane_bytes; ++i)
+            add_byte(i, lanes[i]);
+    }
+
+    void add_byte(size_t lane, uint8_t value) noexcept
+    {
+        min_[lane] = std::min(min_[lane], value);
+        max_[lane] = std::max(max_[lane], value);
+        // 0 and 255 wrap to 1 and 0
+        non_binary_[lane] |= static_cast<uint8_t>(static_cast<uint8_t>(value + 1) > 1);
+    }
+
+    std::array<uint8_t, k_lane_bytes> min_ = [] {
+        auto res = std::array<uint8_t, k_lane_bytes>{};
+        res.fill(255);
+        return res;
+    }();
+    std::array<uint8_t, k_lane_bytes> max_{};
+    std::array<uint8_t, k_lane_bytes> non_binary_{};
+};
+
+[[nodiscard]] static auto is_rgba8(DXGI_FORMAT format) noexcept -> bool
+{
+    switch (format)
+    {
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        case DXGI_FORMAT_B8G8R8X8_UNORM:
+        case DXGI_FORMAT_B8G8R8X8_UNORM_SRGB: return true;
+        default: return false;
+    }
+}
+
+/// \return `image`, or a copy of it in an 8-bit RGBA format stored in `storage`. nullptr on failure
+[[nodiscard]] static auto as_rgba8(const ScratchImage &image, ScratchImage &storage) -> const ScratchImage *
+{
+    const auto &info = image.GetMetadata();
+    if (is_rgba8(info.format))
+        return &image;
+
+    const auto *source = &image;
+    auto decompressed  = ScratchImage{};
+    if (DirectX::IsCompressed(info.format))
+    {
+        const auto hr = DirectX::Decompress(image.GetImages(),
+                                            image.GetImageCount(),
+                                            info,
+                                            DXGI_FORMAT_UNKNOWN,
+                                            decompressed);
+        if (FAILED(hr))
+            return nullptr;
+        if (is_rgba8(decompressed.GetMetadata().format))
+        {
+            storage = std::move(decompressed);
+            return &storage;
+        }
+        source = &decompressed;
+    }
+
+    const auto hr = DirectX::Convert(source->GetImages(),
+                                     source->GetImageCount(),
+                                     source->GetMetadata(),
+                                     DXGI_FORMAT_R8G8B8A8_UNORM,
+                                     DirectX::TEX_FILTER_DEFAULT,
+                                     DirectX::TEX_THRESHOLD_DEFAULT,
+                                     storage);
+    return FAILED(hr) ? nullptr : &storage;
+}
+
+auto analyze(const ScratchImage &image) noexcept -> PixelAnalysis
+{
+    try
+    {
+        auto storage       = ScratchImage{};
+        const auto *pixels = as_rgba8(image, storage);
+        if (pixels == nullptr)
+            return {};
+
+        auto acc = ChannelAccumulator{};
+        for (const auto &img : std::span(pixels->GetImages(), pixels->GetImageCount()))
+        {
+            const auto row_size = img.width * k_channels;
+            for (size_t y = 0; y < img.height; ++y)
+                // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+                acc.add(std::span<const uint8_t>(img.pixels + y * img.rowPitch, row_size));
+        }
+
+        auto res = acc.result();
+
+        const auto format = pixels->GetMetadata().format;
+        const bool bgra   = format != DXGI_FORMAT_R8G8B8A8_UNORM && format != DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        if (bgra)
+        {
+            std::swap(res.min[0], res.min[2]);
+            std::swap(res.max[0], res.max[2]);
+        }
+        if (format == DXGI_FORMAT_B8G8R8X8_UNORM || format == DXGI_FORMAT_B8G8R8X8_UNORM_SRGB)
+        {
+            // The fourth byte is padding
+            res.min[PixelAnalysis::k_alpha] = 255;
+            res.max[PixelAnalysis::k_alpha] = 255;
+            res.alpha_binary                = true;
+        }
+        return res;
+    }
+    catch (const std::exception &)
+    {
+        return {};
+    }
+}
+} // namespace btu::tex
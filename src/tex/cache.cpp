@@ -0,0 +1,270 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/tex/cache.hpp"
+
+#include "btu/common/filesystem.hpp"
+#include "btu/tex/header.hpp"
+#include "btu/tex/texture.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <random>
+
+namespace btu::tex {
+[[nodiscard]] constexpr auto mix(uint64_t x) noexcept -> uint64_t
+{
+    x ^= x >> 30U;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27U;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31U;
+    return x;
+}
+
+/// 128 bits, so that collisions are not a concern. Not cryptographic: a cache is not attacked
+[[nodiscard]] auto hash128(std::span<const std::byte> data, uint64_t seed) noexcept
+    -> std::pair<uint64_t, uint64_t>
+{
+    constexpr uint64_t k_prime_a = 0x9e3779b97f4a7c15;
+    constexpr uint64_t k_prime_b = 0xc2b2ae3d27d4eb4f;
+
+    auto a = seed ^ k_prime_a;
+    auto b = mix(seed) ^ k_prime_b;
+
+    const auto consume = [&](uint64_t word) {
+        a = std::rotl((a ^ word) * k_prime_a, 31);
+        b = std::rotl((b + word) * k_prime_b, 27) ^ a;
+    };
+
+    size_t offset = 0;
+    for (; offset + sizeof(uint64_t) <= data.size(); offset += sizeof(uint64_t))
+    {
+        uint64_t word = 0;
+        std::memcpy(&word, data.data() + offset, sizeof(word));
+        consume(word);
+    }
+
+    uint64_t tail = 0;
+    if (offset < data.size())
+        std::memcpy(&tail, data.data() + offset, data.size() - offset);
+    consume(tail);
+    consume(data.size());
+
+    return {mix(a ^ std::rotl(b, 17)), mix(b + a)};
+}
+
+[[nodiscard]] auto to_hex(uint64_t value) -> std::string
+{
+    constexpr auto k_digits = std::string_view("0123456789abcdef");
+
+    auto res = std::string(sizeof(value) * 2, '0');
+    for (auto it = res.rbegin(); it != res.rend(); ++it, value >>= 4U)
+        *it = k_digits[value & 0xfU];
+    return res;
+}
+
+OptimizationCache::OptimizationCache(Path dir, uintmax_t max_size)
+    : dir_(std::move(dir))
+    , max_size_(max_size)
+{
+    auto ec = std::error_code{};
+    fs::create_directories(dir_, ec);
+
+    struct Found
+    {
+        fs::file_time_type time;
+        std::string key;
+        uintmax_t size;
+    };
+    auto found = std::vector<Found>{};
+
+    const auto end = fs::recursive_directory_iterator();
+    for (auto it = fs::recursive_directory_iterator(dir_, ec); !ec && it != end; it.increment(ec))
+    {
+        if (!it->is_regular_file(ec) || it->path().extension() != ".dds")
+            continue;
+
+        auto entry_ec   = std::error_code{};
+        const auto size = it->file_size(entry_ec);
+        const auto time = it->last_write_time(entry_ec);
+        if (!entry_ec)
+            found.push_back({time, it->path().stem().string(), size});
+    }
+
+    std::ranges::sort(found, std::greater{}, &Found::time);
+    for (auto &entry : found)
+    {
+        recency_.push_back(entry.key);
+        const auto recency = std::prev(recency_.end());
+        entries_.emplace(std::move(entry.key), Entry{.recency = recency, .size = entry.size});
+        size_ += entry.size;
+    }
+
+    evict();
+}
+
+auto OptimizationCache::make_key(std::span<const std::byte> input, const OptimizationSteps &steps)
+    -> std::string
+{
+    // Anything changing the output for the same input
+    const auto meta = nlohmann::json{
+        {"steps", steps},
+        {"encoder", k_encoder_version},
+        {"directxtex", DIRECTX_TEX_VERSION},
+    }.dump();
+    const auto meta_hash = hash128(std::as_bytes(std::span(meta)), 0).first;
+
+    const auto [high, low] = hash128(input, meta_hash);
+    return to_hex(high) + to_hex(low);
+}
+
+auto OptimizationCache::entry_path(const std::string &key) const -> Path
+{
+    // Spread over subdirectories, large directories are slow on some filesystems
+    return dir_ / key.substr(0, 2) / (key + ".dds");
+}
+
+auto OptimizationCache::find(const std::string &key) -> std::optional<std::vector<std::byte>>
+{
+    const auto path = entry_path(key);
+    {
+        auto lock = std::lock_guard{mutex_};
+        auto it   = entries_.find(key);
+        if (it == entries_.end())
+        {
+            // Maybe added by another process sharing the directory
+            auto ec         = std::error_code{};
+            const auto size = fs::file_size(path, ec);
+            if (ec)
+                return std::nullopt;
+
+            recency_.push_front(key);
+            it = entries_.emplace(key, Entry{.recency = recency_.begin(), .size = size}).first;
+            size_ += size;
+        }
+        else
+            recency_.splice(recency_.begin(), recency_, it->second.recency);
+
+        auto ec = std::error_code{};
+        fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+    }
+
+    // Read without the lock, entries are never modified in place
+    auto content = common::read_file(path);
+    if (!content)
+    {
+        // Removed by another process
+        auto lock = std::lock_guard{mutex_};
+        if (const auto it = entries_.find(key); it != entries_.end())
+        {
+            size_ -= it->second.size;
+            recency_.erase(it->second.recency);
+            entries_.erase(it);
+        }
+        return std::nullopt;
+    }
+    return std::move(*content);
+}
+
+void OptimizationCache::insert(const std::string &key, std::span<const std::byte> output)
+{
+    if (output.size() > max_size_)
+        return;
+
+    const auto path = entry_path(key);
+    auto ec         = std::error_code{};
+    fs::create_directories(path.parent_path(), ec);
+    if (ec)
+        return;
+
+    // The same texture may be inserted by several threads or processes at once. Each writes its own
+    // temporary file, and the last rename wins
+    static thread_local auto rng = std::mt19937_64(std::random_device{}());
+    auto tmp_path                = path;
+    tmp_path += u8"." + common::as_utf8_string(to_hex(rng())) + u8".tmp";
+
+    if (!common::write_file(tmp_path, output))
+    {
+        fs::remove(tmp_path, ec);
+        return;
+    }
+    fs::rename(tmp_path, path, ec);
+    if (ec)
+    {
+        fs::remove(tmp_path, ec);
+        return;
+    }
+
+    auto lock = std::lock_guard{mutex_};
+    if (const auto it = entries_.find(key); it != entries_.end())
+    {
+        size_ -= it->second.size;
+        recency_.splice(recency_.begin(), recency_, it->second.recency);
+        it->second.size = output.size();
+    }
+    else
+    {
+        recency_.push_front(key);
+        entries_.emplace(key, Entry{.recency = recency_.begin(), .size = output.size()});
+    }
+    size_ += output.size();
+
+    evict();
+}
+
+auto OptimizationCache::size() const -> uintmax_t
+{
+    auto lock = std::lock_guard{mutex_};
+    return size_;
+}
+
+void OptimizationCache::evict()
+{
+    while (size_ > max_size_ && !recency_.empty())
+    {
+        const auto &key = recency_.back();
+        auto ec         = std::error_code{};
+        fs::remove(entry_path(key), ec);
+
+        const auto it = entries_.find(key);
+        size_ -= it->second.size;
+        entries_.erase(it);
+        recency_.pop_back();
+    }
+}
+
+auto optimize_cached(Path relative_path,
+                     std::span<std::byte> data,
+                     const Settings &sets,
+                     CompressionDevice &dev,
+                     OptimizationCache &cache,
+                     std::stop_token stop) noexcept -> tl::expected<std::vector<std::byte>, Error>
+{
+    // Cache hits usually do not need to decode the texture at all, see probe
+    auto probed = probe(relative_path, data, sets);
+    if (!probed)
+        return tl::make_unexpected(probed.error());
+
+    try
+    {
+        const auto key = OptimizationCache::make_key(data, probed->steps);
+        if (auto cached = cache.find(key))
+            return std::move(*cached);
+
+        auto res = optimize_probed(std::move(relative_path), data, std::move(*probed), dev, std::move(stop))
+                       .and_then([](Texture &&tex) { return save(tex); });
+        if (res)
+            cache.insert(key, *res);
+        return res;
+    }
+    catch (const std::exception &)
+    {
+        // Allocation failure, or the cache directory could not be listed
+        return tl::make_unexpected(Error(std::make_error_code(std::errc::not_enough_memory)));
+    }
+}
+} // namespace btu::tex
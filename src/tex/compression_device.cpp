@@ -162,6 +162,11 @@ struct DxAdapter
 
 CompressionDevice::CompressionDevice()
 {
+    static const auto shared_pool = std::make_shared<common::ThreadPool>(
+        std::max(common::hardware_concurrency() - 1, 1U));
+    executor_         = common::make_executor(shared_pool);
+    executor_threads_ = shared_pool->get_thread_count();
+
 #ifdef _WIN32
     // NOTE: this code was first implemented as a while loop, which, for some reason, made MSVC stuck on linkage
     for (auto dev = detail::make_dx_adapter(0); dev;
@@ -178,6 +183,32 @@ auto CompressionDevice::list_adapters() const noexcept -> const std::vector<Adap
     return cached_info_;
 }
 
+void CompressionDevice::set_executor(common::Executor executor, size_t threads) noexcept
+{
+    executor_         = std::move(executor);
+    executor_threads_ = threads;
+}
+
+auto CompressionDevice::executor() const noexcept -> const common::Executor &
+{
+    return executor_;
+}
+
+auto CompressionDevice::executor_threads() const noexcept -> size_t
+{
+    return executor_threads_;
+}
+
+void CompressionDevice::set_memory_cap(size_t bytes) noexcept
+{
+    memory_cap_ = bytes;
+}
+
+auto CompressionDevice::memory_cap() const noexcept -> size_t
+{
+    return memory_cap_;
+}
+
 #ifdef _WIN32
 void CompressionDevice::apply(const Callback &callback) noexcept(noexcept(callback))
 {
@@ -63,7 +63,7 @@ auto generate_mipmaps(CrunchTexture &&file) -> ResultCrunch
     return std::move(file);
 }
 
-auto convert(CrunchTexture &&file, const DXGI_FORMAT format) -> ResultCrunch
+auto convert(CrunchTexture &&file, const DXGI_FORMAT format, const EncoderOptions &encoder) -> ResultCrunch
 {
     pixel_format crunch_format{};
     switch (format)
@@ -88,6 +88,9 @@ auto convert(CrunchTexture &&file, const DXGI_FORMAT format) -> ResultCrunch
 
     pack_params.m_perceptual = file.get_texture_type() == TextureType::Diffuse;
 
+    if (encoder.profile == EncoderProfile::Fast)
+        pack_params.m_quality = cCRNDXTQualityFast;
+
     const auto success = file.get().convert(crunch_format, pack_params);
     if (!success)
     {
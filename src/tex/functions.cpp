@@ -1,9 +1,15 @@
 #include <btu/tex/compression_device.hpp>
+#include <btu/tex/detail/bc7.hpp>
+#include <btu/tex/detail/encode.hpp>
 #include <btu/tex/dxtex.hpp>
 #include <btu/tex/error_code.hpp>
 #include <btu/tex/functions.hpp>
 
 #include <algorithm>
+#include <cstring>
+#include <stop_token>
+#include <system_error>
+#include <vector>
 
 namespace btu::tex {
 auto decompress(Texture &&file) -> Result
@@ -54,7 +60,9 @@ auto make_transparent_alpha(Texture &&file) -> Result
 static auto convert_uncompressed(const ScratchImage &image,
                                  ScratchImage &timage,
                                  DXGI_FORMAT format,
-                                 [[maybe_unused]] CompressionDevice &dummy) -> HRESULT
+                                 [[maybe_unused]] CompressionDevice &dummy,
+                                 [[maybe_unused]] const EncoderOptions &encoder,
+                                 [[maybe_unused]] const std::stop_token &stop) -> HRESULT
 {
     const auto *const img = image.GetImages();
     if (img == nullptr)
@@ -70,21 +78,156 @@ static auto convert_uncompressed(const ScratchImage &image,
                    timage);
 }
 
-// The reason for this to be separated in another file is that both libraries define DXGI_FORMAT
-// So there's a conflict
-// Also, we use another library because DirectXTex BC7 CPU encoder is unbearably slow
-auto convert_bc7(const uint8_t *source, uint8_t *dest, uint32_t width, uint32_t height, size_t slice_pitch)
-    -> tl::expected<void, Error>;
+/// DirectXTex encoders have few settings. BC1-BC3 can be dithered, and the GPU BC7 encoder can try more or
+/// fewer modes
+[[nodiscard]] static auto compress_flags(const EncoderOptions &encoder) noexcept
+    -> DirectX::TEX_COMPRESS_FLAGS
+{
+    switch (encoder.profile)
+    {
+        case EncoderProfile::Fast: return DirectX::TEX_COMPRESS_BC7_QUICK;
+        case EncoderProfile::MaxQuality:
+            return static_cast<DirectX::TEX_COMPRESS_FLAGS>(DirectX::TEX_COMPRESS_BC7_USE_3SUBSETS
+                                                            | DirectX::TEX_COMPRESS_DITHER);
+        case EncoderProfile::Balanced:
+        case EncoderProfile::SizeOptimized: return DirectX::TEX_COMPRESS_DEFAULT;
+    }
+    return DirectX::TEX_COMPRESS_DEFAULT;
+}
+
+namespace detail {
+auto encode_tile_rows(DXGI_FORMAT format, size_t width, const EncoderOptions &encoder) noexcept -> size_t
+{
+    constexpr size_t k_block_dim = 4;
+    // Small enough for the threads to finish together and to check `stop` often
+    constexpr size_t k_tile_blocks = 4096;
+
+    if (format == DXGI_FORMAT_BC7_UNORM)
+        return bc7_tile_rows(static_cast<uint32_t>(width), encoder);
+
+    const size_t blocks_x = (width + k_block_dim - 1) / k_block_dim;
+    return std::max<size_t>(1, k_tile_blocks / blocks_x);
+}
+
+auto encode_block_rows(const Image &source,
+                       const Image &dest,
+                       size_t first_row,
+                       size_t rows,
+                       const EncoderOptions &encoder) -> bool
+{
+    constexpr size_t k_block_dim = 4;
+
+    if (dest.format == DXGI_FORMAT_BC7_UNORM)
+    {
+        if (source.format != DXGI_FORMAT_R8G8B8A8_UNORM)
+            return false;
+
+        const auto surface = Bc7Surface{
+            .source           = source.pixels,
+            .source_row_pitch = source.rowPitch,
+            .dest             = dest.pixels,
+            .dest_row_pitch   = dest.rowPitch,
+            .width            = static_cast<uint32_t>(source.width),
+            .height           = static_cast<uint32_t>(source.height),
+        };
+        return encode_bc7_rows(surface,
+                               static_cast<uint32_t>(first_row),
+                               static_cast<uint32_t>(rows),
+                               encoder);
+    }
+
+    const size_t y      = first_row * k_block_dim;
+    const size_t height = std::min(rows * k_block_dim, source.height - y);
+    const auto part     = Image{
+            .width      = source.width,
+            .height     = height,
+            .format     = source.format,
+            .rowPitch   = source.rowPitch,
+            .slicePitch = source.rowPitch * height,
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            .pixels = source.pixels + y * source.rowPitch,
+    };
+
+    ScratchImage encoded;
+    const auto flags = compress_flags(encoder);
+    if (FAILED(Compress(part, dest.format, flags, DirectX::TEX_THRESHOLD_DEFAULT, encoded)))
+        return false;
+
+    // Rows of blocks are contiguous in both images
+    const auto *blocks = encoded.GetImage(0, 0, 0);
+    if (blocks == nullptr || blocks->rowPitch != dest.rowPitch)
+        return false;
+
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    std::memcpy(dest.pixels + first_row * dest.rowPitch, blocks->pixels, blocks->slicePitch);
+    return true;
+}
+} // namespace detail
+
+/// Encodes with DirectXTex, in tiles of block rows shared with the executor of `dev`. DirectXTex itself is
+/// only parallel when built with OpenMP, which is not the case on every platform, and would compete with our
+/// pools
+static auto compress_tiled(const ScratchImage &image,
+                           ScratchImage &timage,
+                           DXGI_FORMAT format,
+                           CompressionDevice &dev,
+                           const EncoderOptions &encoder,
+                           const std::stop_token &stop) -> HRESULT
+{
+    constexpr size_t k_block_dim = 4;
+
+    auto metadata   = image.GetMetadata();
+    metadata.format = format;
+    if (const auto hr = timage.Initialize(metadata); FAILED(hr))
+        return hr;
+
+    struct Tile
+    {
+        const Image *source;
+        const Image *dest;
+        size_t first_row;
+        size_t rows;
+    };
+
+    // Tiles are rows of blocks, from every mip level and array item
+    auto tiles = std::vector<Tile>{};
+    for (size_t i = 0; i < image.GetImageCount(); ++i)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const auto *simg = &image.GetImages()[i];
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const auto *timg = &timage.GetImages()[i];
+
+        const size_t blocks_y      = (simg->height + k_block_dim - 1) / k_block_dim;
+        const size_t rows_per_tile = detail::encode_tile_rows(format, simg->width, encoder);
+        for (size_t row = 0; row < blocks_y; row += rows_per_tile)
+            tiles.push_back({simg, timg, row, std::min(rows_per_tile, blocks_y - row)});
+    }
+
+    const auto encode_tile = [&](size_t index) {
+        if (stop.stop_requested())
+            return false;
+
+        const auto &tile = tiles[index];
+        return detail::encode_block_rows(*tile.source, *tile.dest, tile.first_row, tile.rows, encoder);
+    };
+
+    if (!common::parallel_for(tiles.size(), dev.executor_threads(), dev.executor(), encode_tile))
+        return E_FAIL;
+    return S_OK;
+}
 
 static auto convert_compressed(const ScratchImage &image,
                                ScratchImage &timage,
                                DXGI_FORMAT format,
-                               [[maybe_unused]] CompressionDevice &dev) -> HRESULT
+                               CompressionDevice &dev,
+                               const EncoderOptions &encoder,
+                               const std::stop_token &stop) -> HRESULT
 {
     const auto *const img = image.GetImages();
     if (img == nullptr)
         return E_INVALIDARG;
-    const size_t nimg = image.GetImageCount();
+    [[maybe_unused]] const size_t nimg = image.GetImageCount();
 
     const bool bc6hbc7 = [&]() noexcept {
         switch (format)
@@ -107,7 +250,7 @@ static auto convert_compressed(const ScratchImage &image,
                                nimg,
                                image.GetMetadata(),
                                format,
-                               DirectX::TEX_COMPRESS_DEFAULT,
+                               compress_flags(encoder),
                                DirectX::TEX_THRESHOLD_DEFAULT,
                                timage);
         });
@@ -123,6 +266,7 @@ static auto convert_compressed(const ScratchImage &image,
         if (FAILED(hr))
             return hr;
 
+        auto surfaces = std::vector<detail::Bc7Surface>{};
         for (size_t i = 0; i < image.GetImageCount(); ++i)
         {
             // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
@@ -130,35 +274,29 @@ static auto convert_compressed(const ScratchImage &image,
             // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
             const auto &timg = timage.GetImages()[i];
 
-            const auto res = convert_bc7(simg.pixels,
-                                         timg.pixels,
-                                         static_cast<uint32_t>(simg.width),
-                                         static_cast<uint32_t>(simg.height),
-                                         simg.slicePitch);
-            if (!res)
-                return E_FAIL;
+            surfaces.push_back({
+                .source           = simg.pixels,
+                .source_row_pitch = simg.rowPitch,
+                .dest             = timg.pixels,
+                .dest_row_pitch   = timg.rowPitch,
+                .width            = static_cast<uint32_t>(simg.width),
+                .height           = static_cast<uint32_t>(simg.height),
+            });
         }
+
+        if (!detail::convert_bc7(surfaces, dev, encoder, stop))
+            return E_FAIL;
         return S_OK;
     }
 
-    constexpr auto compress_flags = [] {
-#if _OPENMP
-        return DirectX::TEX_COMPRESS_PARALLEL;
-#else
-        return DirectX::TEX_COMPRESS_DEFAULT;
-#endif
-    }();
-
-    return Compress(img,
-                    nimg,
-                    image.GetMetadata(),
-                    format,
-                    compress_flags,
-                    DirectX::TEX_THRESHOLD_DEFAULT,
-                    timage);
+    return compress_tiled(image, timage, format, dev, encoder, stop);
 }
 
-auto convert(Texture &&file, DXGI_FORMAT format, CompressionDevice &dev) -> Result
+auto convert(Texture &&file,
+             DXGI_FORMAT format,
+             CompressionDevice &dev,
+             const EncoderOptions &encoder,
+             std::stop_token stop) -> Result
 {
     const auto &tex = file.get();
     const auto info = tex.GetMetadata();
@@ -172,8 +310,13 @@ auto convert(Texture &&file, DXGI_FORMAT format, CompressionDevice &dev) -> Resu
 
     const auto f = DirectX::IsCompressed(format) ? convert_compressed : convert_uncompressed;
 
-    if (const auto hr = f(tex, timage, format, dev); FAILED(hr))
+    if (const auto hr = f(tex, timage, format, dev, encoder, stop); FAILED(hr))
+    {
+        // Encoders give up when a stop is requested
+        if (stop.stop_requested())
+            return tl::make_unexpected(Error(std::make_error_code(std::errc::operation_canceled)));
         return tl::make_unexpected(error_from_hresult(hr));
+    }
 
     file.set(std::move(timage));
     return std::move(file);
@@ -233,6 +376,93 @@ auto generate_mipmaps(Texture &&file) -> Result
     return prepare_generate_mipmaps(std::move(file)).and_then(generate_mipmaps_impl);
 }
 
+/// \return The mip chain generated from `image`, in the format of `image`. Its first level is `image`
+static auto generate_tail(const Image &image,
+                          size_t levels,
+                          CompressionDevice &dev,
+                          const EncoderOptions &encoder,
+                          const std::stop_token &stop) -> tl::expected<ScratchImage, Error>
+{
+    const bool compressed = DirectX::IsCompressed(image.format);
+
+    ScratchImage base;
+    const auto hr = compressed ? Decompress(image, DXGI_FORMAT_UNKNOWN, base)
+                               : base.InitializeFromImage(image);
+    if (FAILED(hr))
+        return tl::make_unexpected(error_from_hresult(hr));
+
+    ScratchImage chain;
+    if (const auto mip_hr = GenerateMipMaps(*base.GetImage(0, 0, 0),
+                                            DirectX::TEX_FILTER_SEPARATE_ALPHA,
+                                            levels,
+                                            chain);
+        FAILED(mip_hr))
+        return tl::make_unexpected(error_from_hresult(mip_hr));
+
+    if (!compressed)
+        return chain;
+
+    auto tex = Texture{};
+    tex.set(std::move(chain));
+    return convert(std::move(tex), image.format, dev, encoder, stop).map([](Texture &&res) {
+        return std::move(res.get());
+    });
+}
+
+auto generate_missing_mipmaps(Texture &&file,
+                              CompressionDevice &dev,
+                              const EncoderOptions &encoder,
+                              std::stop_token stop) -> Result
+{
+    const auto &tex   = file.get();
+    const auto &info  = tex.GetMetadata();
+    const size_t mips = optimal_mip_count({.w = info.width, .h = info.height});
+
+    if (info.dimension != DirectX::TEX_DIMENSION_TEXTURE2D)
+        return tl::make_unexpected(Error(TextureErr::BadInput));
+    if (info.mipLevels >= mips)
+        return std::move(file);
+
+    TexMetadata mdata = info;
+    mdata.mipLevels   = mips;
+
+    ScratchImage timage;
+    if (const auto hr = timage.Initialize(mdata); FAILED(hr))
+        return tl::make_unexpected(error_from_hresult(hr));
+
+    const size_t smallest = info.mipLevels - 1;
+    for (size_t item = 0; item < info.arraySize; ++item)
+    {
+        if (stop.stop_requested())
+            return tl::make_unexpected(Error(std::make_error_code(std::errc::operation_canceled)));
+
+        for (size_t mip = 0; mip < info.mipLevels; ++mip)
+        {
+            const auto *src = tex.GetImage(mip, item, 0);
+            const auto *dst = timage.GetImage(mip, item, 0);
+            std::memcpy(dst->pixels, src->pixels, src->slicePitch);
+        }
+
+        auto tail = generate_tail(*tex.GetImage(smallest, item, 0), mips - smallest, dev, encoder, stop);
+        if (!tail)
+            return tl::make_unexpected(tail.error());
+
+        // The first level of the tail is the smallest existing level, which is already copied
+        for (size_t mip = smallest + 1; mip < mips; ++mip)
+        {
+            const auto *src = tail->GetImage(mip - smallest, 0, 0);
+            const auto *dst = timage.GetImage(mip, item, 0);
+            if (src == nullptr || src->slicePitch != dst->slicePitch)
+                return tl::make_unexpected(Error(TextureErr::BadInput));
+
+            std::memcpy(dst->pixels, src->pixels, src->slicePitch);
+        }
+    }
+
+    file.set(std::move(timage));
+    return std::move(file);
+}
+
 auto resize(Texture &&file, Dimension dim) -> Result
 {
     const auto &tex  = file.get();
@@ -251,4 +481,54 @@ auto resize(Texture &&file, Dimension dim) -> Result
     file.set(std::move(timage));
     return std::move(file);
 }
+
+auto mips_to_drop(const TexMetadata &info, Dimension target) noexcept -> std::optional<size_t>
+{
+    // Volume textures also shrink in depth
+    if (info.dimension != DirectX::TEX_DIMENSION_TEXTURE2D)
+        return std::nullopt;
+
+    for (size_t level = 1; level < info.mipLevels; ++level)
+    {
+        const auto dim = Dimension{.w = std::max<size_t>(info.width >> level, 1),
+                                   .h = std::max<size_t>(info.height >> level, 1)};
+        if (dim == target)
+            return level;
+    }
+    return std::nullopt;
+}
+
+auto drop_mips(Texture &&file, size_t count) -> Result
+{
+    const auto &tex  = file.get();
+    const auto &info = tex.GetMetadata();
+
+    if (count == 0 || count >= info.mipLevels || info.dimension != DirectX::TEX_DIMENSION_TEXTURE2D)
+        return tl::make_unexpected(Error(TextureErr::BadInput));
+
+    TexMetadata mdata = info;
+    mdata.width       = std::max<size_t>(info.width >> count, 1);
+    mdata.height      = std::max<size_t>(info.height >> count, 1);
+    mdata.mipLevels   = info.mipLevels - count;
+
+    ScratchImage timage;
+    if (const auto hr = timage.Initialize(mdata); FAILED(hr))
+        return tl::make_unexpected(error_from_hresult(hr));
+
+    for (size_t item = 0; item < info.arraySize; ++item)
+    {
+        for (size_t mip = 0; mip < mdata.mipLevels; ++mip)
+        {
+            const auto *src = tex.GetImage(mip + count, item, 0);
+            const auto *dst = timage.GetImage(mip, item, 0);
+            if (src == nullptr || dst == nullptr || src->slicePitch != dst->slicePitch)
+                return tl::make_unexpected(Error(TextureErr::BadInput));
+
+            std::memcpy(dst->pixels, src->pixels, src->slicePitch);
+        }
+    }
+
+    file.set(std::move(timage));
+    return std::move(file);
+}
 } // namespace btu::tex
@@ -1,41 +1,224 @@
-#if _OPENMP
-#include <omp.h>
-#endif
+#include <bc7enc/bc7enc.h>
 #include <bc7enc/rdo_bc_encoder.h>
 #include <bc7enc/utils.h>
-#include <btu/tex/error_code.hpp>
-#include <tl/expected.hpp>
+#include <btu/tex/detail/bc7.hpp>
 
-namespace btu::tex {
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+#include <vector>
 
-auto convert_bc7(const uint8_t *source, uint8_t *dest, uint32_t width, uint32_t height, size_t slice_pitch)
-    -> tl::expected<void, Error>
+namespace btu::tex::detail {
+[[nodiscard]] static auto make_bc7_params(EncoderProfile profile) noexcept -> bc7enc_compress_block_params
 {
-    rdo_bc::rdo_bc_params rp;
+    static std::once_flag init;
+    std::call_once(init, bc7enc_compress_block_init);
+
+    auto params = bc7enc_compress_block_params{};
+    bc7enc_compress_block_params_init(&params);
+    bc7enc_compress_block_params_init_linear_weights(&params);
+
+    switch (profile)
+    {
+        case EncoderProfile::Fast: params.m_uber_level = 0; return params;
+        case EncoderProfile::MaxQuality: params.m_uber_level = BC7ENC_MAX_UBER_LEVEL; return params;
+        case EncoderProfile::Balanced:
+        case EncoderProfile::SizeOptimized: break;
+    }
+
+    // Half of the uber levels of MaxQuality: most of its quality, in much less time.
+    // Same as rdo_bc::rdo_bc_params::m_bc7enc_reduce_entropy: favors modes that compress better, for a small
+    // loss of quality
+    params.m_uber_level            = BC7ENC_MAX_UBER_LEVEL / 2;
+    params.m_quant_mode6_endpoints = true;
+    params.m_bias_mode1_pbits      = true;
+    params.m_pbit1_weight          = 1.3F;
+    params.m_mode1_error_weight    = 1.5F;
+    params.m_mode5_error_weight    = 1.5F;
+    params.m_mode6_error_weight    = 1.2F;
+    params.m_mode7_error_weight    = 1.5F;
+    return params;
+}
+
+/// Copies the pixels of the block at (`x`, `y`), in pixels. Blocks crossing the edge of the image repeat its
+/// last row and column
+static void read_block(const Bc7Surface &surface, uint32_t x, uint32_t y, uint8_t *out) noexcept
+{
+    constexpr uint32_t k_block_dim = 4;
+    constexpr size_t k_pixel_size  = 4;
+
+    for (uint32_t py = 0; py < k_block_dim; ++py)
+    {
+        const uint32_t sy = std::min(y + py, surface.height - 1);
+        // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const auto *row = surface.source + sy * surface.source_row_pitch;
+        auto *dest      = out + py * k_block_dim * k_pixel_size;
+
+        if (x + k_block_dim <= surface.width)
+        {
+            std::memcpy(dest, row + x * k_pixel_size, k_block_dim * k_pixel_size);
+            continue;
+        }
+        for (uint32_t px = 0; px < k_block_dim; ++px)
+        {
+            const uint32_t sx = std::min(x + px, surface.width - 1);
+            std::memcpy(dest + px * k_pixel_size, row + sx * k_pixel_size, k_pixel_size);
+        }
+        // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+}
 
-    rp.m_rdo_max_threads = 1;
-#if _OPENMP
-    constexpr int min_threads = 128; // no idea why, comes from the original code
-    rp.m_rdo_max_threads      = std::min(std::max(1, omp_get_max_threads()), min_threads);
-#endif
+/// Rate-distortion optimization needs neighbouring blocks, so tiles go through the rdo_bc encoder
+[[nodiscard]] static auto encode_rdo_tile(const Bc7Surface &surface,
+                                          uint32_t first_row,
+                                          uint32_t rows,
+                                          float lambda) -> bool
+{
+    constexpr uint32_t k_block_dim = 4;
+    constexpr size_t k_pixel_size  = 4;
+
+    const uint32_t blocks_x = (surface.width + k_block_dim - 1) / k_block_dim;
+
+    // Whole blocks, as the encoder expects
+    const uint32_t width = blocks_x * k_block_dim;
+    auto image           = utils::image_u8(width, rows * k_block_dim);
+    auto *pixels         = reinterpret_cast<uint8_t *>(image.get_pixels().data());
+
+    constexpr size_t k_block_row_size = k_block_dim * k_pixel_size;
+    auto block                        = std::array<uint8_t, k_block_dim * k_block_row_size>{};
+    for (uint32_t by = 0; by < rows; ++by)
+    {
+        for (uint32_t bx = 0; bx < blocks_x; ++bx)
+        {
+            read_block(surface, bx * k_block_dim, (first_row + by) * k_block_dim, block.data());
+            for (uint32_t py = 0; py < k_block_dim; ++py)
+            {
+                const size_t y = size_t{by} * k_block_dim + py;
+                // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+                auto *dest = pixels + (y * width + bx * k_block_dim) * k_pixel_size;
+                std::memcpy(dest, block.data() + py * k_block_row_size, k_block_row_size);
+                // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            }
+        }
+    }
+
+    rdo_bc::rdo_bc_params rp;
+    rp.m_rdo_max_threads       = 1;
     rp.m_bc7enc_reduce_entropy = true;
+    rp.m_rdo_lambda            = lambda;
 
     rdo_bc::rdo_bc_encoder encoder;
+    if (!encoder.init(image, rp) || !encoder.encode())
+        return false;
 
-    utils::image_u8 image(width, height);
-    memcpy(image.get_pixels().data(), source, slice_pitch);
+    constexpr size_t k_block_size = 16;
+    const size_t row_size         = blocks_x * k_block_size;
 
-    if (!encoder.init(image, rp))
-        return tl::make_unexpected(Error(TextureErr::Unknown));
+    const auto *blocks = static_cast<const uint8_t *>(encoder.get_blocks());
+    for (uint32_t by = 0; by < rows; ++by)
+    {
+        // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        auto *dest = surface.dest + size_t{first_row + by} * surface.dest_row_pitch;
+        std::memcpy(dest, blocks + by * row_size, row_size);
+        // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+    return true;
+}
 
-    if (!encoder.encode())
-        return tl::make_unexpected(Error(TextureErr::Unknown));
+[[nodiscard]] static auto encode_rows(const Bc7Surface &surface,
+                                      uint32_t first_row,
+                                      uint32_t rows,
+                                      const EncoderOptions &encoder,
+                                      const bc7enc_compress_block_params &params) -> bool
+{
+    constexpr uint32_t k_block_dim = 4;
+    constexpr size_t k_block_size  = 16;
+    constexpr size_t k_pixel_size  = 4;
+
+    if (encoder.profile == EncoderProfile::SizeOptimized && encoder.rdo_lambda > 0)
+        return encode_rdo_tile(surface, first_row, rows, encoder.rdo_lambda);
+
+    auto pixels = std::array<uint8_t, k_block_dim * k_block_dim * k_pixel_size>{};
+    for (uint32_t by = first_row; by < first_row + rows; ++by)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        auto *dest = surface.dest + by * surface.dest_row_pitch;
+        for (uint32_t x = 0; x < surface.width; x += k_block_dim)
+        {
+            read_block(surface, x, by * k_block_dim, pixels.data());
+
+            // Written straight to the output image
+            bc7enc_compress_block(dest, pixels.data(), &params);
+            dest += k_block_size; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        }
+    }
+    return true;
+}
 
-    const auto *res_blocks = static_cast<const uint8_t *>(encoder.get_blocks());
-    slice_pitch            = encoder.get_total_blocks_size_in_bytes();
+auto bc7_tile_rows(uint32_t width, const EncoderOptions &encoder) noexcept -> uint32_t
+{
+    constexpr uint32_t k_block_dim = 4;
+
+    const bool rdo = encoder.profile == EncoderProfile::SizeOptimized && encoder.rdo_lambda > 0;
+    // Blocks encoded by a thread between two checks of `stop`. Keeps cancellation latency well under 100 ms,
+    // and tiles small enough for the threads to finish together. Rate-distortion optimization looks for
+    // matches in previous blocks and benefits from larger tiles
+    const uint32_t tile_blocks = rdo ? 4096 : 256;
 
-    std::copy_n(res_blocks, slice_pitch, dest);
+    const uint32_t blocks_x = (width + k_block_dim - 1) / k_block_dim;
+    return std::max(1U, tile_blocks / blocks_x);
+}
 
+auto encode_bc7_rows(const Bc7Surface &surface,
+                     uint32_t first_row,
+                     uint32_t rows,
+                     const EncoderOptions &encoder) -> bool
+{
+    return encode_rows(surface, first_row, rows, encoder, make_bc7_params(encoder.profile));
+}
+
+auto convert_bc7(std::span<const Bc7Surface> surfaces,
+                 CompressionDevice &dev,
+                 const EncoderOptions &encoder,
+                 const std::stop_token &stop) -> ResultError
+{
+    constexpr uint32_t k_block_dim = 4;
+
+    struct Tile
+    {
+        const Bc7Surface *surface;
+        uint32_t first_row;
+        uint32_t rows;
+    };
+
+    // Tiles are rows of blocks, from every mip level and array item
+    auto tiles = std::vector<Tile>{};
+    for (const auto &surface : surfaces)
+    {
+        const uint32_t blocks_y      = (surface.height + k_block_dim - 1) / k_block_dim;
+        const uint32_t rows_per_tile = bc7_tile_rows(surface.width, encoder);
+        for (uint32_t row = 0; row < blocks_y; row += rows_per_tile)
+            tiles.push_back({&surface, row, std::min(rows_per_tile, blocks_y - row)});
+    }
+
+    const auto params = make_bc7_params(encoder.profile);
+
+    const auto encode_tile = [&](size_t index) {
+        if (stop.stop_requested())
+            return false;
+
+        const auto &tile = tiles[index];
+        return encode_rows(*tile.surface, tile.first_row, tile.rows, encoder, params);
+    };
+
+    if (!common::parallel_for(tiles.size(), dev.executor_threads(), dev.executor(), encode_tile))
+    {
+        if (stop.stop_requested())
+            return tl::make_unexpected(Error(std::make_error_code(std::errc::operation_canceled)));
+        return tl::make_unexpected(Error(TextureErr::Unknown));
+    }
     return {};
 }
-} // namespace btu::tex
\ No newline at end of file
+} // namespace btu::tex::detail
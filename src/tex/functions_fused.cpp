@@ -0,0 +1,569 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include <btu/common/threading.hpp>
+#include <btu/tex/compression_device.hpp>
+#include <btu/tex/detail/encode.hpp>
+#include <btu/tex/dxtex.hpp>
+#include <btu/tex/error_code.hpp>
+#include <btu/tex/functions.hpp>
+#include <btu/tex/header.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace btu::tex {
+constexpr size_t k_pixel_size = 4;
+constexpr size_t k_block_dim  = 4;
+constexpr size_t k_alpha      = 3;
+
+/// Format of the working buffer, in which every step is done. Decoding is the only conversion
+[[nodiscard]] static auto working_format(DXGI_FORMAT format) noexcept -> DXGI_FORMAT
+{
+    switch (format)
+    {
+        case DXGI_FORMAT_R8G8B8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8A8_UNORM:
+        case DXGI_FORMAT_B8G8R8X8_UNORM: return format;
+        // Decoded by DirectXTex to R8G8B8A8
+        case DXGI_FORMAT_BC1_UNORM:
+        case DXGI_FORMAT_BC2_UNORM:
+        case DXGI_FORMAT_BC3_UNORM:
+        case DXGI_FORMAT_BC7_UNORM: return DXGI_FORMAT_R8G8B8A8_UNORM;
+        // sRGB would have to be filtered in linear space, and other formats are not 8-bit RGBA once decoded
+        default: return DXGI_FORMAT_UNKNOWN;
+    }
+}
+
+/// \return The power of two dividing both dimensions of `info` to get `target`
+[[nodiscard]] static auto downscale_factor(const TexMetadata &info, Dimension target) noexcept
+    -> std::optional<size_t>
+{
+    if (target.w == 0 || target.h == 0 || info.width % target.w != 0 || info.height % target.h != 0)
+        return std::nullopt;
+
+    const size_t factor = info.width / target.w;
+    if (factor != info.height / target.h || !std::has_single_bit(factor))
+        return std::nullopt;
+    return factor;
+}
+
+auto can_process_fused(const TexMetadata &info, const FusedSteps &steps) noexcept -> bool
+{
+    const auto working = working_format(info.format);
+    if (working == DXGI_FORMAT_UNKNOWN || info.dimension != DirectX::TEX_DIMENSION_TEXTURE2D)
+        return false;
+
+    // Existing levels are only kept by the step by step functions
+    if (info.mipLevels > 1 && !steps.mipmaps)
+        return false;
+    if (steps.add_transparent_alpha && !DirectX::HasAlpha(working))
+        return false;
+    return !steps.resize || downscale_factor(info, *steps.resize).has_value();
+}
+
+/// Rows of one image of the output, processed by a single task
+struct Band
+{
+    size_t item;
+    size_t first_row;
+    size_t rows;
+};
+
+/// Splits the images of `level` in bands of about the same number of pixels. Bands start on a multiple of
+/// `align` rows
+[[nodiscard]] static auto make_bands(const ScratchImage &image, size_t level, size_t align)
+    -> std::vector<Band>
+{
+    // Small enough for the threads to finish together and to check `stop` often
+    constexpr size_t k_band_pixels = 64 * 1024;
+
+    auto res = std::vector<Band>{};
+    for (size_t item = 0; item < image.GetMetadata().arraySize; ++item)
+    {
+        const auto &img = *image.GetImage(level, item, 0);
+        auto rows       = std::max<size_t>(k_band_pixels / img.width, 1);
+        rows            = (rows + align - 1) / align * align;
+        for (size_t row = 0; row < img.height; row += rows)
+            res.push_back({item, row, std::min(rows, img.height - row)});
+    }
+    return res;
+}
+
+/// \return Rows [`first`, `first` + `count`) of `src`, in the working format. Compressed rows are decoded
+/// into `buffer`, `first` must then be a multiple of the block size
+[[nodiscard]] static auto source_rows(const Image &src, size_t first, size_t count, ScratchImage &buffer)
+    -> std::optional<Image>
+{
+    if (!DirectX::IsCompressed(src.format))
+    {
+        return Image{
+            .width      = src.width,
+            .height     = count,
+            .format     = src.format,
+            .rowPitch   = src.rowPitch,
+            .slicePitch = src.rowPitch * count,
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            .pixels = src.pixels + first * src.rowPitch,
+        };
+    }
+
+    // Compressed images are made of rows of blocks
+    const size_t block_rows = (count + k_block_dim - 1) / k_block_dim;
+    const auto part         = Image{
+                .width      = src.width,
+                .height     = count,
+                .format     = src.format,
+                .rowPitch   = src.rowPitch,
+                .slicePitch = src.rowPitch * block_rows,
+                // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+                .pixels = src.pixels + first / k_block_dim * src.rowPitch,
+    };
+    if (FAILED(Decompress(part, working_format(src.format), buffer)))
+        return std::nullopt;
+    return *buffer.GetImage(0, 0, 0);
+}
+
+/// Box filter of `factor` x `factor` pixels, starting at row `y` of `src`
+static void downscale_row(const Image &src, size_t y, size_t factor, uint8_t *out, size_t width) noexcept
+{
+    // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    if (factor == 1)
+    {
+        std::memcpy(out, src.pixels + y * src.rowPitch, width * k_pixel_size);
+        return;
+    }
+
+    const size_t area = factor * factor;
+    for (size_t x = 0; x < width; ++x)
+    {
+        for (size_t c = 0; c < k_pixel_size; ++c)
+        {
+            size_t sum = 0;
+            for (size_t dy = 0; dy < factor; ++dy)
+            {
+                const auto *row = src.pixels + (y + dy) * src.rowPitch + x * factor * k_pixel_size + c;
+                for (size_t dx = 0; dx < factor; ++dx)
+                    sum += row[dx * k_pixel_size];
+            }
+            out[x * k_pixel_size + c] = static_cast<uint8_t>((sum + area / 2) / area);
+        }
+    }
+    // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+}
+
+/// Next mip level of row `y` of `dst`, from `src`. Odd dimensions repeat the last row and column
+static void half_row(const Image &src, const Image &dst, size_t y) noexcept
+{
+    const size_t y0 = std::min(y * 2, src.height - 1);
+    const size_t y1 = std::min(y * 2 + 1, src.height - 1);
+
+    // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    const auto *row0 = src.pixels + y0 * src.rowPitch;
+    const auto *row1 = src.pixels + y1 * src.rowPitch;
+    auto *out        = dst.pixels + y * dst.rowPitch;
+    for (size_t x = 0; x < dst.width; ++x)
+    {
+        const size_t x0 = std::min(x * 2, src.width - 1) * k_pixel_size;
+        const size_t x1 = std::min(x * 2 + 1, src.width - 1) * k_pixel_size;
+        for (size_t c = 0; c < k_pixel_size; ++c)
+        {
+            const unsigned sum        = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+            out[x * k_pixel_size + c] = static_cast<uint8_t>((sum + 2) / 4);
+        }
+    }
+    // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+}
+
+auto process_fused(Texture &&file, const FusedSteps &steps, CompressionDevice &dev, std::stop_token stop)
+    -> Result
+{
+    const auto &tex  = std::as_const(file).get();
+    const auto &info = tex.GetMetadata();
+    if (!can_process_fused(info, steps))
+        return tl::make_unexpected(Error(TextureErr::BadInput));
+
+    const auto target = steps.resize.value_or(Dimension{.w = info.width, .h = info.height});
+    const auto factor = steps.resize ? *downscale_factor(info, target) : size_t{1};
+
+    auto mdata      = info;
+    mdata.width     = target.w;
+    mdata.height    = target.h;
+    mdata.mipLevels = steps.mipmaps ? optimal_mip_count(target) : 1;
+    mdata.format    = working_format(info.format);
+
+    // The only full size allocation: steps are applied in place, and each level is generated from the
+    // previous one in a pass of its own. Only the first pass reads the source
+    ScratchImage timage;
+    if (const auto hr = timage.Initialize(mdata); FAILED(hr))
+        return tl::make_unexpected(error_from_hresult(hr));
+
+    const auto run = [&](const std::vector<Band> &bands, const auto &process) {
+        return common::parallel_for(bands.size(), dev.executor_threads(), dev.executor(), [&](size_t i) {
+            return !stop.stop_requested() && process(bands[i]);
+        });
+    };
+
+    // Decoding, alpha and downscaling, band by band. Source bands start on a block when compressed
+    const auto first_level = [&](const Band &band) {
+        const auto &dst = *timage.GetImage(0, band.item, 0);
+
+        auto buffer     = ScratchImage{};
+        const auto rows = source_rows(*tex.GetImage(0, band.item, 0),
+                                      band.first_row * factor,
+                                      band.rows * factor,
+                                      buffer);
+        if (!rows)
+            return false;
+
+        for (size_t y = 0; y < band.rows; ++y)
+        {
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            auto *out = dst.pixels + (band.first_row + y) * dst.rowPitch;
+            downscale_row(*rows, y * factor, factor, out, dst.width);
+            if (steps.add_transparent_alpha)
+                for (size_t x = 0; x < dst.width; ++x)
+                    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+                    out[x * k_pixel_size + k_alpha] = 0;
+        }
+        return true;
+    };
+    bool ok = run(make_bands(timage, 0, k_block_dim), first_level);
+
+    for (size_t level = 1; ok && level < mdata.mipLevels; ++level)
+    {
+        const auto next_level = [&](const Band &band) {
+            const auto &src = *timage.GetImage(level - 1, band.item, 0);
+            const auto &dst = *timage.GetImage(level, band.item, 0);
+            for (size_t y = band.first_row; y < band.first_row + band.rows; ++y)
+                half_row(src, dst, y);
+            return true;
+        };
+        ok = run(make_bands(timage, level, 1), next_level);
+    }
+
+    if (!ok)
+    {
+        if (stop.stop_requested())
+            return tl::make_unexpected(Error(std::make_error_code(std::errc::operation_canceled)));
+        return tl::make_unexpected(error_from_hresult(E_FAIL));
+    }
+
+    file.set(std::move(timage));
+    return std::move(file);
+}
+
+auto can_process_streamed(const TexMetadata &info, const StreamedSteps &steps) noexcept -> bool
+{
+    switch (steps.format)
+    {
+        case DXGI_FORMAT_BC1_UNORM:
+        case DXGI_FORMAT_BC2_UNORM:
+        case DXGI_FORMAT_BC3_UNORM:
+        case DXGI_FORMAT_BC7_UNORM: break;
+        default: return false;
+    }
+
+    // Levels are then split in bands that are all full
+    const auto target = steps.fused.resize.value_or(Dimension{.w = info.width, .h = info.height});
+    if (target.w < k_block_dim || target.h < k_block_dim || !std::has_single_bit(target.w)
+        || !std::has_single_bit(target.h))
+        return false;
+
+    return can_process_fused(info, steps.fused);
+}
+
+/// Rows of a mip level that are not encoded yet. They are encoded, then halved into the next level, `span`
+/// rows at a time
+struct PendingLevel
+{
+    size_t width;
+    size_t height;
+    /// A multiple of the rows encoded together, or the whole level
+    size_t span;
+    /// Row of the level of the first pending row
+    size_t first_row = 0;
+    size_t filled    = 0;
+    std::vector<uint8_t> pixels;
+
+    /// \return Pending rows [`first`, `first` + `count`)
+    [[nodiscard]] auto rows(size_t first, size_t count) noexcept -> Image
+    {
+        const size_t pitch = width * k_pixel_size;
+        return Image{
+            .width      = width,
+            .height     = count,
+            .format     = DXGI_FORMAT_R8G8B8A8_UNORM,
+            .rowPitch   = pitch,
+            .slicePitch = pitch * count,
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            .pixels = pixels.data() + first * pitch,
+        };
+    }
+};
+
+/// How process_streamed splits a texture, and the memory it needs
+struct StreamLayout
+{
+    size_t helpers;
+    /// Of each level
+    std::vector<size_t> spans;
+    size_t memory;
+};
+
+/// \return The layout with `helpers` threads besides the caller, and bands of `band_rows` rows on the top
+/// level
+[[nodiscard]] static auto make_layout(const TexMetadata &info,
+                                      const TexMetadata &output,
+                                      const StreamedSteps &steps,
+                                      size_t helpers,
+                                      size_t band_rows) -> StreamLayout
+{
+    // Encoders copy their tile at most a few times
+    constexpr size_t k_encoder_copies = 4;
+
+    auto res = StreamLayout{.helpers = helpers, .spans = {}, .memory = compute_data_size(output)};
+    for (size_t level = 0; level < output.mipLevels; ++level)
+    {
+        const size_t width  = std::max<size_t>(output.width >> level, 1);
+        const size_t height = std::max<size_t>(output.height >> level, 1);
+        const size_t tile   = k_block_dim * detail::encode_tile_rows(steps.format, width, steps.encoder);
+
+        // Encoding the same tiles as convert gives the same blocks
+        const size_t span = std::min(height, std::max({band_rows >> level, k_block_dim, tile}));
+        res.spans.push_back(span);
+        res.memory += span * width * k_pixel_size;
+
+        if (level == 0)
+        {
+            // Each thread decodes the source of a row of blocks, and encodes a tile
+            const size_t factor = info.width / output.width;
+            const size_t decode = DirectX::IsCompressed(info.format)
+                                      ? k_block_dim * factor * info.width * k_pixel_size
+                                      : 0;
+            res.memory += (helpers + 1) * (decode + k_encoder_copies * tile * width * k_pixel_size);
+        }
+    }
+    return res;
+}
+
+/// \return The fastest layout fitting in `memory_cap`: with as many threads, then with bands as large as
+/// possible
+[[nodiscard]] static auto choose_layout(const TexMetadata &info,
+                                        const TexMetadata &output,
+                                        const StreamedSteps &steps,
+                                        size_t max_helpers,
+                                        size_t memory_cap) -> std::optional<StreamLayout>
+{
+    for (size_t helpers = max_helpers + 1; helpers-- > 0;)
+    {
+        for (size_t band_rows = output.height; band_rows >= k_block_dim; band_rows /= 2)
+        {
+            auto layout = make_layout(info, output, steps, helpers, band_rows);
+            if (layout.memory <= memory_cap)
+                return layout;
+        }
+    }
+    return std::nullopt;
+}
+
+/// Runs process_streamed on the items of a texture, one after the other
+class Streamer
+{
+public:
+    Streamer(const TexMetadata &info,
+             const StreamedSteps &steps,
+             const StreamLayout &layout,
+             ScratchImage &output,
+             CompressionDevice &dev,
+             const std::stop_token &stop)
+        : steps_(steps)
+        , helpers_(layout.helpers)
+        , working_(working_format(info.format))
+        , output_(output)
+        , dev_(dev)
+        , stop_(stop)
+    {
+        const auto &out = output.GetMetadata();
+        factor_         = info.width / out.width;
+        for (size_t level = 0; level < out.mipLevels; ++level)
+        {
+            const size_t width = std::max<size_t>(out.width >> level, 1);
+            levels_.push_back({
+                .width  = width,
+                .height = std::max<size_t>(out.height >> level, 1),
+                .span   = layout.spans[level],
+                .pixels = std::vector<uint8_t>(layout.spans[level] * width * k_pixel_size),
+            });
+        }
+    }
+
+    [[nodiscard]] auto process(const Image &source, size_t item) -> bool
+    {
+        for (auto &pending : levels_)
+            pending.first_row = 0;
+
+        auto &top = levels_[0];
+        while (top.first_row < top.height)
+        {
+            const auto make_rows = [&](size_t block_row) { return first_level(source, block_row); };
+            if (!run(top.span / k_block_dim, make_rows))
+                return false;
+            top.filled = top.span;
+            if (!flush(0, item))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    template<class F>
+    [[nodiscard]] auto run(size_t count, const F &task) -> bool
+    {
+        return common::parallel_for(count, helpers_, dev_.executor(), [&](size_t i) {
+            return !stop_.stop_requested() && task(i);
+        });
+    }
+
+    /// Rows of the top level are made one row of blocks at a time, so that compressed sources are decoded in
+    /// small buffers
+    [[nodiscard]] auto first_level(const Image &source, size_t block_row) -> bool
+    {
+        auto &pending    = levels_[0];
+        const size_t row = pending.first_row + block_row * k_block_dim;
+
+        auto buffer     = ScratchImage{};
+        const auto rows = source_rows(source, row * factor_, k_block_dim * factor_, buffer);
+        if (!rows)
+            return false;
+
+        for (size_t y = 0; y < k_block_dim; ++y)
+        {
+            const auto dst = pending.rows(block_row * k_block_dim + y, 1);
+            downscale_row(*rows, y * factor_, factor_, dst.pixels, dst.width);
+
+            // NOLINTBEGIN(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            for (size_t x = 0; x < dst.width; ++x)
+            {
+                auto *pixel = dst.pixels + x * k_pixel_size;
+                if (working_ != DXGI_FORMAT_R8G8B8A8_UNORM)
+                    std::swap(pixel[0], pixel[2]);
+                if (working_ == DXGI_FORMAT_B8G8R8X8_UNORM)
+                    pixel[k_alpha] = 255;
+                if (steps_.fused.add_transparent_alpha)
+                    pixel[k_alpha] = 0;
+            }
+            // NOLINTEND(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        }
+        return true;
+    }
+
+    /// Encodes the pending rows of `level`, then halves them into the next level, which is flushed in turn
+    /// once its pending rows are complete
+    // NOLINTNEXTLINE(misc-no-recursion)
+    [[nodiscard]] auto flush(size_t level, size_t item) -> bool
+    {
+        auto &pending   = levels_[level];
+        const auto rows = pending.rows(0, pending.filled);
+        auto dest       = *output_.GetImage(level, item, 0);
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        dest.pixels += pending.first_row / k_block_dim * dest.rowPitch;
+
+        const size_t block_rows = (pending.filled + k_block_dim - 1) / k_block_dim;
+        const size_t tile_rows  = detail::encode_tile_rows(steps_.format, pending.width, steps_.encoder);
+        const auto encode_tile  = [&](size_t tile) {
+            const size_t first = tile * tile_rows;
+            const size_t count = std::min(tile_rows, block_rows - first);
+            return detail::encode_block_rows(rows, dest, first, count, steps_.encoder);
+        };
+        if (!run((block_rows + tile_rows - 1) / tile_rows, encode_tile))
+            return false;
+
+        if (level + 1 < levels_.size())
+        {
+            auto &next = levels_[level + 1];
+            // A single row is halved horizontally only
+            const size_t produced = pending.height == 1 ? 1 : pending.filled / 2;
+            for (size_t done = 0; done < produced;)
+            {
+                const size_t count = std::min(produced - done, next.span - next.filled);
+                const auto src     = pending.rows(done * 2, pending.filled - done * 2);
+                const auto dst     = next.rows(next.filled, count);
+                const auto half    = [&](size_t y) {
+                    half_row(src, dst, y);
+                    return true;
+                };
+                if (!run(count, half))
+                    return false;
+
+                done += count;
+                next.filled += count;
+                if (next.filled == next.span && !flush(level + 1, item))
+                    return false;
+            }
+        }
+
+        pending.first_row += pending.filled;
+        pending.filled = 0;
+        return true;
+    }
+
+    const StreamedSteps &steps_;
+    size_t helpers_;
+    DXGI_FORMAT working_;
+    size_t factor_ = 1;
+    std::vector<PendingLevel> levels_;
+
+    ScratchImage &output_;
+    CompressionDevice &dev_;
+    const std::stop_token &stop_;
+};
+
+auto process_streamed(const TexMetadata &info,
+                      std::span<const Image> images,
+                      const StreamedSteps &steps,
+                      size_t memory_cap,
+                      CompressionDevice &dev,
+                      std::stop_token stop) -> Result
+{
+    if (!can_process_streamed(info, steps) || images.size() != info.arraySize)
+        return tl::make_unexpected(Error(TextureErr::BadInput));
+
+    const auto target = steps.fused.resize.value_or(Dimension{.w = info.width, .h = info.height});
+
+    auto mdata      = info;
+    mdata.width     = target.w;
+    mdata.height    = target.h;
+    mdata.mipLevels = steps.fused.mipmaps ? optimal_mip_count(target) : 1;
+    mdata.format    = steps.format;
+
+    const auto layout = choose_layout(info, mdata, steps, dev.executor_threads(), memory_cap);
+    if (!layout)
+        return tl::make_unexpected(Error(std::make_error_code(std::errc::not_enough_memory)));
+
+    ScratchImage timage;
+    if (const auto hr = timage.Initialize(mdata); FAILED(hr))
+        return tl::make_unexpected(error_from_hresult(hr));
+
+    auto streamer = Streamer(info, steps, *layout, timage, dev, stop);
+    for (size_t item = 0; item < images.size(); ++item)
+    {
+        if (streamer.process(images[item], item))
+            continue;
+
+        if (stop.stop_requested())
+            return tl::make_unexpected(Error(std::make_error_code(std::errc::operation_canceled)));
+        return tl::make_unexpected(error_from_hresult(E_FAIL));
+    }
+
+    auto res = Texture{};
+    res.set(std::move(timage));
+    return res;
+}
+} // namespace btu::tex
@@ -0,0 +1,50 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/tex/header.hpp"
+
+#include <algorithm>
+
+namespace btu::tex {
+auto read_header(Path load_path, std::span<const std::byte> data) noexcept
+    -> tl::expected<TextureHeader, Error>
+{
+    auto res = TextureHeader{.info = {}, .load_path = std::move(load_path)};
+
+    const auto hr = GetMetadataFromDDSMemory(data.data(), data.size(), DirectX::DDS_FLAGS_NONE, res.info);
+    if (FAILED(hr))
+    {
+        // Maybe it's a TGA then?
+        const auto hr2 = GetMetadataFromTGAMemory(data.data(),
+                                                  data.size(),
+                                                  DirectX::TGA_FLAGS_NONE,
+                                                  res.info);
+        if (FAILED(hr2))
+            return tl::make_unexpected(error_from_hresult(hr)); // preserve original error
+    }
+
+    return res;
+}
+
+auto compute_data_size(const TexMetadata &info) noexcept -> size_t
+{
+    size_t size = 0;
+    for (size_t mip = 0; mip < info.mipLevels; ++mip)
+    {
+        size_t row_pitch   = 0;
+        size_t slice_pitch = 0;
+        const auto hr      = DirectX::ComputePitch(info.format,
+                                              std::max<size_t>(info.width >> mip, 1),
+                                              std::max<size_t>(info.height >> mip, 1),
+                                              row_pitch,
+                                              slice_pitch);
+        if (FAILED(hr))
+            return 0;
+
+        size += slice_pitch * std::max<size_t>(info.depth >> mip, 1);
+    }
+    return size * info.arraySize;
+}
+} // namespace btu::tex
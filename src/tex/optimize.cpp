@@ -8,30 +8,100 @@
 #include "btu/tex/compression_device.hpp"
 #include "btu/tex/crunch_functions.hpp"
 #include "btu/tex/functions.hpp"
+#include "btu/tex/header.hpp"
 
 #include <btu/common/algorithms.hpp>
 #include <btu/common/metaprogramming.hpp>
 #include <btu/tex/dxtex.hpp>
 
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <source_location>
+#include <system_error>
+#include <utility>
+#include <vector>
+
 namespace btu::tex {
-auto optimize(Texture &&file, OptimizationSteps sets, CompressionDevice &dev) noexcept -> Result
+/// Returned by optimize when a stop is requested between two steps
+[[nodiscard]] static auto cancelled(std::source_location loc = std::source_location::current())
+    -> tl::unexpected<Error>
 {
-    const auto &info = file.get().GetMetadata();
+    return tl::make_unexpected(Error(std::make_error_code(std::errc::operation_canceled), loc));
+}
+
+auto optimize(Texture &&file, OptimizationSteps sets, CompressionDevice &dev, std::stop_token stop) noexcept
+    -> Result
+{
+    // Fast path: when the target dimensions are one of the existing mip levels, drop the levels above it
+    // instead of resampling. No decoding is needed, even for compressed textures
+    if (sets.resize)
+    {
+        if (const auto count = mips_to_drop(std::as_const(file).get().GetMetadata(), *sets.resize))
+        {
+            auto dropped = drop_mips(std::move(file), *count);
+            if (!dropped)
+                return dropped;
+            file = std::move(dropped).value();
+            sets.resize.reset();
+
+            // The remaining levels form a full chain if the original one was
+            const auto &info = std::as_const(file).get().GetMetadata();
+            sets.mipmaps     = sets.mipmaps && optimal_mip_count(file.get_dimension()) != info.mipLevels;
+
+            const bool done = !sets.add_transparent_alpha && !sets.mipmaps && !sets.convert
+                              && info.format == sets.best_format;
+            if (done)
+                return std::move(file);
+        }
+    }
+
+    // Read only, so that the analysis cached by compute_optimization_steps is kept
+    const auto &info = std::as_const(file).get().GetMetadata();
+
+    // Only mipmaps are missing: the existing levels are kept as they are, compressed or not
+    const bool only_mipmaps = sets.mipmaps && !sets.resize && !sets.add_transparent_alpha && !sets.convert
+                              && info.format == sets.best_format
+                              && info.dimension == DirectX::TEX_DIMENSION_TEXTURE2D;
+    if (only_mipmaps)
+        return generate_missing_mipmaps(std::move(file), dev, sets.encoder, std::move(stop));
+
     // All operations require a decompressed texture.
     const auto must_decompress = DirectX::IsCompressed(info.format);
     // Special case - force conversion if result shouldn't have alpha to get rid of alpha bits that are added by DirectX.
     const auto should_convert = sets.convert || must_decompress || !DirectX::HasAlpha(sets.best_format);
-    auto res                  = Result{std::move(file)};
 
-    if (must_decompress)
-        res = std::move(res).and_then(decompress);
-    if (sets.resize)
+    // Most textures go through all the steps below in a single pass, without full size intermediate images
+    const auto fused_steps = FusedSteps{
+        .resize                = sets.resize,
+        .add_transparent_alpha = sets.add_transparent_alpha,
+        .mipmaps               = sets.mipmaps,
+    };
+    const bool any_step = must_decompress || sets.resize || sets.add_transparent_alpha || sets.mipmaps;
+    const bool fused    = any_step && can_process_fused(info, fused_steps);
+
+    auto res = Result{std::move(file)};
+    if (fused)
         res = std::move(res).and_then(
-            [&](Texture &&tex) { return resize(std::move(tex), sets.resize.value()); });
-    if (sets.add_transparent_alpha)
-        res = std::move(res).and_then(make_transparent_alpha);
-    if (sets.mipmaps)
-        res = std::move(res).and_then(BTU_RESOLVE_OVERLOAD(generate_mipmaps));
+            [&](Texture &&tex) { return process_fused(std::move(tex), fused_steps, dev, stop); });
+    else
+    {
+        if (must_decompress)
+            res = std::move(res).and_then(decompress);
+        if (stop.stop_requested())
+            return cancelled();
+        if (sets.resize)
+            res = std::move(res).and_then(
+                [&](Texture &&tex) { return resize(std::move(tex), sets.resize.value()); });
+        if (stop.stop_requested())
+            return cancelled();
+        if (sets.add_transparent_alpha)
+            res = std::move(res).and_then(make_transparent_alpha);
+        if (sets.mipmaps)
+            res = std::move(res).and_then(BTU_RESOLVE_OVERLOAD(generate_mipmaps));
+    }
+    if (stop.stop_requested())
+        return cancelled();
 
     // We have uncompressed the texture. If it was compressed, it's best to convert it to a better format
     const auto cur_format_is_same_as_best = res && res->get().GetMetadata().format == sets.best_format;
@@ -42,11 +112,13 @@ auto optimize(Texture &&file, OptimizationSteps sets, CompressionDevice &dev) no
         res      = std::move(res)
                   // // safety check: make sure we don't remove the alpha
                   .and_then([&](Texture &&tex) -> Result {
-                      if (!DirectX::HasAlpha(out) && !tex.get().IsAlphaAllOpaque())
+                      if (!DirectX::HasAlpha(out) && !tex.analysis().alpha_all_opaque())
                           return tl::make_unexpected(Error(TextureErr::BadInput));
                       return std::move(tex);
                   })
-                  .and_then([&](Texture &&tex) { return convert(std::move(tex), out, dev); });
+                  .and_then([&](Texture &&tex) {
+                      return convert(std::move(tex), out, dev, sets.encoder, stop);
+                  });
     }
 
     return res;
@@ -54,7 +126,8 @@ auto optimize(Texture &&file, OptimizationSteps sets, CompressionDevice &dev) no
 
 auto optimize(CrunchTexture &&file,
               OptimizationSteps sets,
-              [[maybe_unused]] CompressionDevice &dev) noexcept -> ResultCrunch
+              [[maybe_unused]] CompressionDevice &dev,
+              std::stop_token stop) noexcept -> ResultCrunch
 {
     const auto must_decompress = file.get().is_packed() && (sets.resize || sets.mipmaps);
     const auto should_convert  = sets.convert || must_decompress;
@@ -64,11 +137,15 @@ auto optimize(CrunchTexture &&file,
     if (sets.resize)
         res = std::move(res).and_then(
             [&](CrunchTexture &&tex) { return resize(std::move(tex), sets.resize.value()); });
+    if (stop.stop_requested())
+        return cancelled();
     if (sets.mipmaps)
         res = std::move(res).and_then(BTU_RESOLVE_OVERLOAD(generate_mipmaps));
+    if (stop.stop_requested())
+        return cancelled();
     if (should_convert)
         res = std::move(res).and_then(
-            [&](CrunchTexture &&tex) { return convert(std::move(tex), sets.best_format); });
+            [&](CrunchTexture &&tex) { return convert(std::move(tex), sets.best_format, sets.encoder); });
 
     return res;
 }
@@ -76,15 +153,17 @@ auto optimize(CrunchTexture &&file,
 /// SSE landscape textures uses alpha channel as specularity
 /// Textures with opaque alpha are thus rendered shiny
 /// To fix this, alpha has to be made transparent
-[[nodiscard]] static auto transparent_alpha_required(const Texture &file, const Settings &sets) -> bool
+template<class Tex, class AlphaAllOpaque>
+[[nodiscard]] static auto transparent_alpha_required(const Tex &file,
+                                                     const Settings &sets,
+                                                     AlphaAllOpaque &&alpha_all_opaque) -> bool
 {
-    const auto &tex         = file.get();
     const auto path         = canonize_path(file.get_load_path());
     const bool is_landscape = common::contains(sets.landscape_textures, path);
     if (!is_landscape)
         return false;
 
-    return tex.IsAlphaAllOpaque();
+    return alpha_all_opaque();
 }
 
 [[nodiscard]] static auto is_bad_cubemap(const TexMetadata &info) noexcept -> bool
@@ -99,13 +178,15 @@ auto optimize(CrunchTexture &&file,
     return is_cubemap && uncompressed && bad_alpha;
 }
 
-[[nodiscard]] static auto has_opaque_alpha(const ScratchImage &tex) noexcept -> bool
+template<class AlphaAllOpaque>
+[[nodiscard]] static auto has_opaque_alpha(const TexMetadata &info,
+                                           AlphaAllOpaque &&alpha_all_opaque) noexcept -> bool
 {
     using enum DirectX::TEX_ALPHA_MODE;
 
-    const auto has_alpha  = DirectX::HasAlpha(tex.GetMetadata().format);
-    const auto alpha_mode = tex.GetMetadata().GetAlphaMode();
-    return !has_alpha || alpha_mode == TEX_ALPHA_MODE_OPAQUE || tex.IsAlphaAllOpaque();
+    const auto has_alpha  = DirectX::HasAlpha(info.format);
+    const auto alpha_mode = info.GetAlphaMode();
+    return !has_alpha || alpha_mode == TEX_ALPHA_MODE_OPAQUE || alpha_all_opaque();
 };
 
 template<class Tex>
@@ -132,10 +213,11 @@ template<class Tex>
     }
 }
 
-[[nodiscard]] static auto conversion_required(const Texture &file, const Settings &sets) noexcept -> bool
+template<class Tex>
+[[nodiscard]] static auto conversion_required(const Tex &file,
+                                              const TexMetadata &info,
+                                              const Settings &sets) noexcept -> bool
 {
-    const auto &info = file.get().GetMetadata();
-
     const bool forbidden_format = sets.use_format_whitelist
                                   && !common::contains(sets.allowed_formats, info.format);
 
@@ -160,18 +242,28 @@ template<class Tex>
                       sets.resize);
 }
 
-[[nodiscard]] static auto best_output_format(const Texture &file,
+template<class Tex, class AlphaAllOpaque>
+[[nodiscard]] static auto best_output_format(const Tex &file,
+                                             const TexMetadata &info,
                                              const Settings &sets,
-                                             bool force_alpha) noexcept -> DXGI_FORMAT
+                                             bool force_alpha,
+                                             AlphaAllOpaque &&alpha_all_opaque) noexcept -> DXGI_FORMAT
 {
-    const auto &tex  = file.get();
-    const auto &info = tex.GetMetadata();
-
-    return guess_best_format(info.format,
-                             sets.output_format,
-                             GuessBestFormatArgs{.opaque_alpha     = has_opaque_alpha(tex),
-                                                 .allow_compressed = sets.compress && can_be_compressed(file),
-                                                 .force_alpha      = force_alpha});
+    const bool allow_compressed = sets.compress && can_be_compressed(file);
+    const auto guess            = [&](bool opaque_alpha) {
+        return guess_best_format(info.format,
+                                 sets.output_format,
+                                 GuessBestFormatArgs{.opaque_alpha     = opaque_alpha,
+                                                     .allow_compressed = allow_compressed,
+                                                     .force_alpha      = force_alpha});
+    };
+
+    // The alpha channel may have to be decoded: skip it when the format is the same either way, as with a
+    // single compressed format
+    const auto with_alpha = guess(false);
+    if (with_alpha == guess(true))
+        return with_alpha;
+    return guess(has_opaque_alpha(info, alpha_all_opaque));
 }
 
 [[nodiscard]] static auto best_output_format(const CrunchTexture &file,
@@ -188,15 +280,18 @@ template<class Tex>
                                                  .force_alpha = force_alpha});
 }
 
-auto compute_optimization_steps(const Texture &file, const Settings &sets) noexcept -> OptimizationSteps
+/// Shared by textures and texture headers. `alpha_all_opaque` is only called when needed, as it may have to
+/// scan the pixels
+template<class Tex, class AlphaAllOpaque>
+[[nodiscard]] static auto compute_steps(const Tex &file,
+                                        const TexMetadata &info,
+                                        const Settings &sets,
+                                        AlphaAllOpaque &&alpha_all_opaque) noexcept -> OptimizationSteps
 {
-    const auto &tex  = file.get();
-    const auto &info = tex.GetMetadata();
-
     auto res = OptimizationSteps{};
 
     // Check if conversion is a must.
-    res.convert = conversion_required(file, sets);
+    res.convert = conversion_required(file, info, sets);
 
     // Do not compress the image if already compressed.
     if (sets.compress && !DirectX::IsCompressed(info.format))
@@ -209,7 +304,7 @@ auto compute_optimization_steps(const Texture &file, const Settings &sets) noexc
         res.resize = target_dim.value();
 
     if (sets.game == Game::SSE)
-        if (transparent_alpha_required(file, sets))
+        if (transparent_alpha_required(file, sets, alpha_all_opaque))
             res.add_transparent_alpha = true;
 
     const bool opt_mip = optimal_mip_count(file.get_dimension()) == info.mipLevels;
@@ -218,11 +313,204 @@ auto compute_optimization_steps(const Texture &file, const Settings &sets) noexc
         res.mipmaps = true;
 
     // I prefer to keep steps independent, but this one has to depend on add_transparent_alpha. If we add an alpha, the output format must have alpha
-    res.best_format = best_output_format(file, sets, res.add_transparent_alpha);
+    res.best_format = best_output_format(file, info, sets, res.add_transparent_alpha, alpha_all_opaque);
+    res.encoder     = sets.encoder;
 
     return res;
 }
 
+auto compute_optimization_steps(const Texture &file, const Settings &sets) noexcept -> OptimizationSteps
+{
+    return compute_steps(file, file.get().GetMetadata(), sets, [&file] {
+        return file.analysis().alpha_all_opaque();
+    });
+}
+
+auto compute_optimization_steps(const TextureHeader &header,
+                                const Settings &sets) noexcept -> OptimizationSteps
+{
+    // Pixels are unknown, assume that the alpha channel is used
+    return compute_steps(header, header.info, sets, [] { return false; });
+}
+
+auto TextureProbe::unchanged() const noexcept -> bool
+{
+    return !steps.resize && !steps.mipmaps && !steps.add_transparent_alpha && !steps.convert
+           && steps.best_format == header.info.format;
+}
+
+auto probe(Path relative_path, std::span<std::byte> data, const Settings &sets) noexcept
+    -> tl::expected<TextureProbe, Error>
+{
+    auto header = read_header(relative_path, data);
+    if (!header)
+        return tl::make_unexpected(header.error());
+
+    auto res = TextureProbe{.header = std::move(*header), .steps = {}, .texture = std::nullopt};
+
+    // Several steps may need the pixels, they are decoded at most once
+    bool decoded          = false;
+    bool alpha_all_opaque = false;
+    const auto decode     = [&] {
+        if (std::exchange(decoded, true))
+            return alpha_all_opaque;
+
+        // If decoding fails, so will optimize. Assume that the alpha channel is used, as for headers
+        if (auto tex = load(std::move(relative_path), data))
+        {
+            alpha_all_opaque = tex->analysis().alpha_all_opaque();
+            res.texture      = std::move(*tex);
+        }
+        return alpha_all_opaque;
+    };
+
+    res.steps = compute_steps(res.header, res.header.info, sets, decode);
+    return res;
+}
+
+[[nodiscard]] static auto streamed_steps(const OptimizationSteps &steps) noexcept -> StreamedSteps
+{
+    return StreamedSteps{
+        .fused   = {.resize                = steps.resize,
+                    .add_transparent_alpha = steps.add_transparent_alpha,
+                    .mipmaps               = steps.mipmaps},
+        .format  = steps.best_format,
+        .encoder = steps.encoder,
+    };
+}
+
+auto can_optimize_streamed(const TextureHeader &header, const OptimizationSteps &steps) noexcept -> bool
+{
+    const auto &info = header.info;
+
+    // optimize keeps the levels as they are, see the fast paths at its beginning
+    if (steps.resize && mips_to_drop(info, *steps.resize))
+        return false;
+    const bool only_mipmaps = steps.mipmaps && !steps.resize && !steps.add_transparent_alpha && !steps.convert
+                              && info.format == steps.best_format;
+    if (only_mipmaps)
+        return false;
+    // Or does not encode them
+    if (!steps.convert && !DirectX::IsCompressed(info.format))
+        return false;
+
+    return can_process_streamed(info, streamed_steps(steps));
+}
+
+/// \return The offset of the pixels in the DDS file `data`, if they can be read in place. DirectXTex converts
+/// some legacy formats while loading them
+[[nodiscard]] static auto dds_pixels_offset(std::span<const std::byte> data, const TexMetadata &info) noexcept
+    -> std::optional<size_t>
+{
+    constexpr uint32_t k_dds_magic     = 0x20534444; // "DDS "
+    constexpr uint32_t k_dx10_fourcc   = 0x30315844; // "DX10"
+    constexpr uint32_t k_ddpf_fourcc   = 0x4;
+    constexpr size_t k_legacy_header   = 128;
+    constexpr size_t k_dx10_header     = 20;
+    constexpr size_t k_pf_flags        = 80; // Members of DDS_PIXELFORMAT, from the start of the file
+    constexpr size_t k_pf_fourcc       = 84;
+    constexpr size_t k_pf_rgb_bitcount = 88;
+    constexpr size_t k_pf_alpha_mask   = 104;
+
+    const auto read_u32 = [&data](size_t offset) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < sizeof(value); ++i)
+            value |= std::to_integer<uint32_t>(data[offset + i]) << (8 * i);
+        return value;
+    };
+
+    if (data.size() < k_legacy_header || read_u32(0) != k_dds_magic)
+        return std::nullopt;
+
+    auto offset = k_legacy_header;
+    if ((read_u32(k_pf_flags) & k_ddpf_fourcc) != 0)
+    {
+        if (read_u32(k_pf_fourcc) == k_dx10_fourcc)
+            offset += k_dx10_header;
+        else if (!DirectX::IsCompressed(info.format))
+            return std::nullopt;
+    }
+    else
+    {
+        // 24-bit pixels are expanded, and alpha is made opaque when the file has no alpha mask
+        const bool expanded = read_u32(k_pf_rgb_bitcount) != 32;
+        const bool no_alpha = info.format == DXGI_FORMAT_R8G8B8A8_UNORM && read_u32(k_pf_alpha_mask) == 0;
+        if (expanded || no_alpha)
+            return std::nullopt;
+    }
+
+    if (data.size() < offset + compute_data_size(info))
+        return std::nullopt;
+    return offset;
+}
+
+auto optimize_streamed(Path relative_path,
+                       std::span<std::byte> data,
+                       const OptimizationSteps &steps,
+                       CompressionDevice &dev,
+                       std::stop_token stop) noexcept -> Result
+{
+    try
+    {
+        auto header = read_header(relative_path, data);
+        if (!header)
+            return tl::make_unexpected(header.error());
+
+        const auto &info  = header->info;
+        const auto offset = dds_pixels_offset(data, info);
+        if (!offset || !can_optimize_streamed(*header, steps))
+            return tl::make_unexpected(Error(TextureErr::BadInput));
+
+        auto item_info      = info;
+        item_info.arraySize = 1;
+        const size_t stride = compute_data_size(item_info);
+
+        size_t row_pitch   = 0;
+        size_t slice_pitch = 0;
+        const auto hr = DirectX::ComputePitch(info.format, info.width, info.height, row_pitch, slice_pitch);
+        if (FAILED(hr))
+            return tl::make_unexpected(error_from_hresult(hr));
+
+        // Top levels of the array items, read from `data`
+        auto images = std::vector<Image>{};
+        for (size_t item = 0; item < info.arraySize; ++item)
+        {
+            images.push_back(Image{
+                .width      = info.width,
+                .height     = info.height,
+                .format     = info.format,
+                .rowPitch   = row_pitch,
+                .slicePitch = slice_pitch,
+                .pixels     = reinterpret_cast<uint8_t *>(data.subspan(*offset + item * stride).data()),
+            });
+        }
+
+        const size_t cap = dev.memory_cap() == 0 ? std::numeric_limits<size_t>::max() : dev.memory_cap();
+        auto res = process_streamed(info, images, streamed_steps(steps), cap, dev, std::move(stop));
+        if (res)
+            res->set_load_path(std::move(relative_path));
+        return res;
+    }
+    catch (const std::exception &)
+    {
+        return tl::make_unexpected(Error(std::make_error_code(std::errc::not_enough_memory)));
+    }
+}
+
+auto optimize_probed(Path relative_path,
+                     std::span<std::byte> data,
+                     TextureProbe &&probed,
+                     CompressionDevice &dev,
+                     std::stop_token stop) noexcept -> Result
+{
+    if (!probed.texture && dev.memory_cap() != 0 && can_optimize_streamed(probed.header, probed.steps))
+        return optimize_streamed(std::move(relative_path), data, probed.steps, dev, std::move(stop));
+
+    auto tex = probed.texture ? Result(std::move(*probed.texture)) : load(std::move(relative_path), data);
+    return std::move(tex).and_then(
+        [&](Texture &&loaded) { return optimize(std::move(loaded), probed.steps, dev, std::move(stop)); });
+}
+
 auto compute_optimization_steps(const CrunchTexture &file, const Settings &sets) noexcept -> OptimizationSteps
 {
     const auto &tex = file.get();
@@ -250,6 +538,7 @@ auto compute_optimization_steps(const CrunchTexture &file, const Settings &sets)
         res.convert = true;
 
     res.best_format = best_output_format(file, sets, /*force_alpha=*/false);
+    res.encoder     = sets.encoder;
 
     return res;
 }
@@ -276,6 +565,7 @@ auto Settings::get(Game game) noexcept -> const Settings &
                               .compressed = DXGI_FORMAT_BC3_UNORM,
                               .compressed_without_alpha = DXGI_FORMAT_BC1_UNORM},
             .landscape_textures = {}, // Unknown
+            .encoder = {},
         };
     }();
 
@@ -60,10 +60,12 @@ Texture::Texture()
 void Texture::set(ScratchImage &&tex) noexcept
 {
     tex_ = std::move(tex);
+    analysis_.reset();
 }
 
 auto Texture::get() noexcept -> ScratchImage &
 {
+    analysis_.reset();
     return tex_;
 }
 
@@ -72,6 +74,18 @@ auto Texture::get() const noexcept -> const ScratchImage &
     return tex_;
 }
 
+auto Texture::analysis() const noexcept -> const PixelAnalysis &
+{
+    if (!analysis_)
+        analysis_ = analyze(tex_);
+    return *analysis_;
+}
+
+auto Texture::operator==(const Texture &other) const noexcept -> bool
+{
+    return load_path_ == other.load_path_ && tex_ == other.tex_;
+}
+
 auto Texture::get_images() const noexcept -> std::span<const Image>
 {
     const auto *begin = get().GetImages();
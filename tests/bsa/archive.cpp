@@ -1,5 +1,6 @@
 #include "./utils.hpp"
 
+#include <binary_io/memory_stream.hpp>
 #include <btu/common/filesystem.hpp>
 
 TEST_CASE("Load and save to same location works", "[src]")
@@ -34,3 +35,180 @@ TEST_CASE("set archive version", "[src]")
     REQUIRE(arch.version() == btu::bsa::ArchiveVersion::tes4);
     REQUIRE(file.version() == btu::bsa::ArchiveVersion::tes4);
 }
+
+TEST_CASE("read_file_count", "[src]")
+{
+    const auto path = Path("bsa_load_save") / "in" / "arch.bsa";
+
+    const auto arch = btu::bsa::Archive::read(path);
+    REQUIRE(arch.has_value());
+
+    REQUIRE(btu::bsa::read_file_count(path) == arch->size());
+    REQUIRE_FALSE(btu::bsa::read_file_count("bsa_load_save/does_not_exist.bsa").has_value());
+}
+
+TEST_CASE("read_file_list", "[src]")
+{
+    const auto path = Path("bsa_load_save") / "in" / "arch.bsa";
+
+    auto arch = btu::bsa::Archive::read(path);
+    REQUIRE(arch.has_value());
+
+    const auto list = btu::bsa::read_file_list(path);
+    REQUIRE(list.has_value());
+    REQUIRE(list->size() == arch->size());
+
+    for (const auto &entry : *list)
+    {
+        const auto it = std::ranges::find_if(*arch, [&entry](const auto &pair) {
+            using btu::common::as_utf8, btu::common::to_lower;
+            return to_lower(as_utf8(pair.first)) == to_lower(as_utf8(entry.name));
+        });
+        CHECK(it != arch->end());
+    }
+
+    REQUIRE_FALSE(btu::bsa::read_file_list("bsa_load_save/does_not_exist.bsa").has_value());
+}
+
+TEST_CASE("read_file_start", "[src]")
+{
+    using btu::bsa::ArchiveType, btu::bsa::ArchiveVersion;
+
+    const Path dir = "bsa_read_file_start";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    auto content = std::vector<std::byte>(4096);
+    for (size_t i = 0; i < content.size(); ++i)
+        content[i] = static_cast<std::byte>(i * 7 % 251);
+
+    // Compressed or not, with the encoding of each format
+    for (const auto version : {ArchiveVersion::tes3,
+                               ArchiveVersion::tes4,
+                               ArchiveVersion::tes5,
+                               ArchiveVersion::sse,
+                               ArchiveVersion::fo4})
+    {
+        for (const bool compressed : {false, true})
+        {
+            if (compressed && version == ArchiveVersion::tes3)
+                continue;
+
+            INFO("version: " << static_cast<int>(version) << ", compressed: " << compressed);
+            const auto path = dir / "a.bsa";
+
+            auto arch  = btu::bsa::Archive{version, ArchiveType::Standard};
+            auto data  = content;
+            auto &file = arch.get("meshes/a.nif");
+            REQUIRE(file.read(data));
+            if (compressed)
+                file.compress();
+            REQUIRE(std::move(arch).write(path));
+
+            const auto list = btu::bsa::read_file_list(path);
+            REQUIRE(list.has_value());
+            REQUIRE(list->size() == 1);
+
+            const auto start = btu::bsa::read_file_start(path, list->front(), 148);
+            REQUIRE(start.has_value());
+            CHECK(*start == std::vector(content.begin(), content.begin() + 148));
+
+            const auto all = btu::bsa::read_file_start(path, list->front(), 1'000'000);
+            REQUIRE(all.has_value());
+            CHECK(*all == content);
+        }
+    }
+}
+
+TEST_CASE("rewrite_archive", "[src]")
+{
+    using btu::bsa::ArchiveType, btu::bsa::ArchiveVersion;
+
+    const Path dir = "bsa_rewrite_archive";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    const auto make_content = [](size_t size, size_t seed) {
+        auto res = std::vector<std::byte>(size);
+        for (size_t i = 0; i < res.size(); ++i)
+            res[i] = static_cast<std::byte>(i * seed % 251);
+        return res;
+    };
+    const auto content     = make_content(4096, 7);
+    const auto new_content = make_content(10'000, 3);
+
+    for (const auto version : {ArchiveVersion::tes3,
+                               ArchiveVersion::tes4,
+                               ArchiveVersion::tes5,
+                               ArchiveVersion::sse,
+                               ArchiveVersion::fo4})
+    {
+        for (const bool compressed : {false, true})
+        {
+            if (compressed && version == ArchiveVersion::tes3)
+                continue;
+
+            INFO("version: " << static_cast<int>(version) << ", compressed: " << compressed);
+            const auto source = dir / "a.bsa";
+            const auto dest   = dir / "b.bsa";
+
+            auto arch = btu::bsa::Archive{version, ArchiveType::Standard};
+            for (const auto *name : {"meshes/a.nif", "meshes/b.nif", "textures/c.dds"})
+            {
+                auto data  = content;
+                auto &file = arch.get(name);
+                REQUIRE(file.read(data));
+                if (compressed)
+                    file.compress();
+            }
+            REQUIRE(std::move(arch).write(source));
+
+            const auto replaced = std::vector<btu::bsa::ReplacedEntry>{
+                {"MESHES/B.NIF", [&] { return std::optional(new_content); }},
+            };
+            REQUIRE(btu::bsa::rewrite_archive(source, dest, replaced));
+
+            auto read = btu::bsa::Archive::read(dest);
+            REQUIRE(read.has_value());
+            REQUIRE(read->size() == 3);
+            for (const auto &[name, file] : *read)
+            {
+                auto buffer = binary_io::any_ostream{binary_io::memory_ostream{}};
+                REQUIRE(file.write(buffer));
+                const auto lower    = btu::common::to_lower(btu::common::as_utf8(name));
+                const auto expected = lower.ends_with(u8"b.nif") ? new_content : content;
+                CHECK(buffer.get<binary_io::memory_ostream>().rdbuf() == expected);
+
+                // Replaced entries are compressed like the entries they replace
+                const auto compression = compressed ? btu::bsa::Compression::Yes : btu::bsa::Compression::No;
+                CHECK(file.compressed() == compression);
+            }
+
+            // An entry that is not in the archive would be lost
+            const auto unknown = std::vector<btu::bsa::ReplacedEntry>{
+                {"meshes/d.nif", [&] { return std::optional(new_content); }},
+            };
+            CHECK_FALSE(btu::bsa::rewrite_archive(source, dest, unknown));
+        }
+    }
+
+    CHECK_FALSE(btu::bsa::rewrite_archive(dir / "does_not_exist.bsa", dir / "b.bsa", {}));
+}
+
+TEST_CASE("Archive read and write stop when requested", "[src]")
+{
+    const Path dir = "bsa_load_save";
+
+    auto source = std::stop_source{};
+    source.request_stop();
+
+    CHECK_FALSE(btu::bsa::Archive::read(dir / "in" / "arch.bsa", source.get_token()).has_value());
+
+    auto arch = btu::bsa::Archive::read(dir / "in" / "arch.bsa");
+    REQUIRE(arch.has_value());
+
+    const auto out = dir / "stopped.bsa";
+    btu::fs::remove(out);
+    CHECK_FALSE(std::move(*arch).write(out, source.get_token()));
+    CHECK_FALSE(exists(out));
+}
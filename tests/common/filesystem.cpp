@@ -202,4 +202,46 @@ TEST_CASE("write_file_new", "[src]")
         const auto result = btu::common::write_file_new(file.path(), content);
         CHECK_FALSE(result);
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("replace_file", "[src]")
+{
+    const auto source = FsTempFile("original");
+    const auto link   = FsTempPath();
+    require_expected(btu::common::hard_link(source.path(), link.path()));
+
+    const auto content = std::vector(100, static_cast<std::byte>(' '));
+    require_expected(btu::common::replace_file(link.path(), content));
+
+    CHECK(fs::file_size(link.path()) == content.size());
+    CHECK(fs::file_size(source.path()) == std::string_view("original").size());
+    CHECK_FALSE(fs::exists(link.path().u8string() + u8".btu-tmp"));
+}
+
+TEST_CASE("replace_file keeps permissions", "[src]")
+{
+    const auto file  = FsTempFile("original");
+    const auto perms = fs::perms::owner_read | fs::perms::owner_write;
+    fs::permissions(file.path(), perms);
+
+    require_expected(btu::common::replace_file(file.path(), std::vector(100, static_cast<std::byte>(' '))));
+
+    CHECK(fs::status(file.path()).permissions() == perms);
+}
+
+TEST_CASE("clone_file", "[src]")
+{
+    SECTION("source is a file")
+    {
+        const auto source      = FsTempFile("content");
+        const auto destination = FsTempPath();
+        require_expected(btu::common::clone_file(source.path(), destination.path()));
+        CHECK(btu::common::compare_files(source.path(), destination.path()));
+    }
+    SECTION("destination already exists")
+    {
+        const auto source      = FsTempFile("content");
+        const auto destination = FsTempFile("other");
+        CHECK_FALSE(btu::common::clone_file(source.path(), destination.path()));
+    }
+}
@@ -2,6 +2,8 @@
 
 #include <catch.hpp>
 
+#include <latch>
+
 TEST_CASE("for_each_mt", "[src]")
 {
     using btu::common::for_each_mt;
@@ -55,3 +57,239 @@ TEST_CASE("make_producer_mt", "[src]")
         CHECK(result.size() == input.size());
     }
 }
+
+TEST_CASE("BoundedQueue", "[src]")
+{
+    using btu::common::BoundedQueue;
+
+    SECTION("pop returns the remaining elements after close")
+    {
+        auto queue = BoundedQueue<int>(4);
+        CHECK(queue.push(1));
+        CHECK(queue.push(2));
+        queue.close();
+
+        CHECK_FALSE(queue.push(3));
+        CHECK(queue.pop() == 1);
+        CHECK(queue.pop() == 2);
+        CHECK_FALSE(queue.pop().has_value());
+    }
+
+    SECTION("producers and consumers")
+    {
+        auto queue = BoundedQueue<int>(2);
+        auto sum   = std::atomic_int{0};
+        {
+            auto consumers = std::vector<std::jthread>{};
+            for (int i = 0; i < 4; ++i)
+                consumers.emplace_back([&] {
+                    while (auto value = queue.pop())
+                        sum += *value;
+                });
+
+            for (int i = 1; i <= 100; ++i)
+                REQUIRE(queue.push(i));
+            queue.close();
+        }
+        CHECK(sum == 5050);
+    }
+}
+
+TEST_CASE("MemoryBudget", "[src]")
+{
+    using btu::common::MemoryBudget;
+
+    SECTION("a request larger than the budget is granted when nothing else is reserved")
+    {
+        auto budget = MemoryBudget(10);
+        budget.acquire(100);
+        CHECK(budget.used() == 100);
+        budget.release(100);
+        CHECK(budget.used() == 0);
+    }
+
+    SECTION("never more than the budget is used")
+    {
+        auto budget   = MemoryBudget(10);
+        auto in_use   = std::atomic_int{0};
+        auto max_used = std::atomic_int{0};
+        {
+            auto workers = std::vector<std::jthread>{};
+            for (int i = 0; i < 8; ++i)
+                workers.emplace_back([&] {
+                    for (int j = 0; j < 50; ++j)
+                    {
+                        budget.acquire(4);
+                        const int now = in_use += 4;
+                        int prev      = max_used;
+                        while (prev < now && !max_used.compare_exchange_weak(prev, now))
+                        {
+                        }
+                        in_use -= 4;
+                        budget.release(4);
+                    }
+                });
+        }
+        CHECK(max_used <= 8);
+        CHECK(budget.used() == 0);
+    }
+}
+
+TEST_CASE("WorkerPools", "[src]")
+{
+    using btu::common::WorkerPools;
+    using namespace std::chrono_literals;
+
+    SECTION("runs tasks and returns their result")
+    {
+        const auto threads = std::to_array<size_t>({2, 1});
+        auto pools         = WorkerPools(threads);
+        CHECK(pools.thread_count() == 3);
+
+        auto futs = std::vector<std::future<int>>{};
+        for (int i = 0; i < 10; ++i)
+            futs.push_back(pools.submit_task(static_cast<size_t>(i % 2), [i] { return i; }));
+        for (int i = 0; i < 10; ++i)
+            CHECK(futs[static_cast<size_t>(i)].get() == i);
+
+        CHECK(pools.utilization(0).completed == 5);
+        CHECK(pools.utilization(1).completed == 5);
+    }
+
+    SECTION("a blocked category does not starve the others")
+    {
+        const auto threads = std::to_array<size_t>({1, 1});
+        auto pools         = WorkerPools(threads);
+
+        auto release = std::promise<void>{};
+        auto blocked = pools.submit_task(0, [fut = release.get_future().share()] { fut.wait(); });
+        auto other   = pools.submit_task(1, [] { return 1; });
+
+        REQUIRE(other.wait_for(5s) == std::future_status::ready);
+        CHECK(blocked.wait_for(0s) == std::future_status::timeout);
+
+        release.set_value();
+        blocked.get();
+    }
+
+    SECTION("idle threads are lent")
+    {
+        const auto threads = std::to_array<size_t>({1, 2});
+        auto pools         = WorkerPools(threads);
+
+        auto release  = std::promise<void>{};
+        auto released = release.get_future().share();
+        auto started  = std::latch(2);
+        auto futs     = std::vector<std::future<void>>{};
+        for (int i = 0; i < 2; ++i)
+            futs.push_back(pools.submit_task(0, [&started, released] {
+                started.count_down();
+                released.wait();
+            }));
+
+        // Both run at once, one of them on the thread of the other category
+        started.wait();
+        const auto use = pools.utilization(0);
+        CHECK(use.running == 2);
+        CHECK(use.borrowed == 1);
+
+        release.set_value();
+        for (auto &fut : futs)
+            fut.get();
+    }
+
+    SECTION("a category without threads runs on borrowed ones")
+    {
+        const auto threads = std::to_array<size_t>({1, 0});
+        auto pools         = WorkerPools(threads);
+
+        auto fut = pools.submit_task(1, [] { return 1; });
+        REQUIRE(fut.wait_for(5s) == std::future_status::ready);
+        CHECK(pools.utilization(1).completed == 1);
+    }
+
+    SECTION("each category keeps a thread")
+    {
+        const auto threads = std::to_array<size_t>({1, 1});
+        auto pools         = WorkerPools(threads);
+
+        auto release  = std::promise<void>{};
+        auto released = release.get_future().share();
+        auto started  = std::latch(1);
+        auto futs     = std::vector<std::future<void>>{};
+        futs.push_back(pools.submit_task(0, [&started, released] {
+            started.count_down();
+            released.wait();
+        }));
+        started.wait();
+        futs.push_back(pools.submit_task(0, [released] { released.wait(); }));
+
+        // The only thread of the other category is not lent, so its tasks do not wait for the burst
+        auto other = pools.submit_task(1, [] { return 1; });
+        REQUIRE(other.wait_for(5s) == std::future_status::ready);
+
+        const auto use = pools.utilization(0);
+        CHECK(use.running == 1);
+        CHECK(use.queued == 1);
+
+        release.set_value();
+        for (auto &fut : futs)
+            fut.get();
+    }
+}
+
+TEST_CASE("parallel_for", "[src]")
+{
+    using btu::common::parallel_for;
+
+    const auto threads = std::to_array<size_t>({3});
+    auto pools         = std::make_shared<btu::common::WorkerPools>(threads);
+    const auto exec    = btu::common::make_executor(pools, 0);
+
+    SECTION("calls the task once per index")
+    {
+        auto calls = std::vector<std::atomic_int>(1000);
+        CHECK(parallel_for(calls.size(), 3, exec, [&](size_t i) {
+            ++calls[i];
+            return true;
+        }));
+        CHECK(std::ranges::all_of(calls, [](const auto &n) { return n == 1; }));
+    }
+
+    SECTION("reports failures")
+    {
+        CHECK_FALSE(parallel_for(100, 3, exec, [](size_t i) { return i != 50; }));
+        CHECK_FALSE(parallel_for(100, 3, exec, [](size_t i) {
+            if (i == 50)
+                throw std::runtime_error("failure");
+            return true;
+        }));
+    }
+
+    SECTION("does not wait for a busy executor")
+    {
+        // Every thread runs parallel_for at once, so helpers only start once the work is done
+        auto futs = std::vector<std::future<bool>>{};
+        for (size_t i = 0; i < pools->thread_count() * 2; ++i)
+            futs.push_back(pools->submit_task(0, [&exec] {
+                auto count     = std::atomic_int{0};
+                const auto res = parallel_for(500, 3, exec, [&](size_t) {
+                    ++count;
+                    return true;
+                });
+                return res && count == 500;
+            }));
+        for (auto &fut : futs)
+            CHECK(fut.get());
+    }
+
+    SECTION("without an executor")
+    {
+        auto sum = size_t{0};
+        CHECK(parallel_for(10, 3, btu::common::Executor{}, [&](size_t i) {
+            sum += i;
+            return true;
+        }));
+        CHECK(sum == 45);
+    }
+}
@@ -0,0 +1,128 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/conflicts.hpp"
+
+#include "../utils.hpp"
+#include "btu/modmanager/mod_library.hpp"
+
+#include <atomic>
+#include <fstream>
+
+class CountingTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile /*file*/) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        ++count_;
+        return std::nullopt;
+    }
+
+    [[nodiscard]] auto count() const noexcept -> size_t { return count_; }
+
+private:
+    std::atomic_size_t count_ = 0;
+};
+
+TEST_CASE("FileConflicts", "[src]")
+{
+    // Two copies of the same mod: every file of `a` is overridden by `b`
+    const Path dir = "modfolder";
+    const Path mo2 = dir / "conflicts";
+
+    btu::fs::remove_all(mo2);
+    for (const auto *name : {"a", "b", "disabled"})
+    {
+        btu::fs::create_directories(mo2 / "mods" / name);
+        btu::fs::copy(dir / "input", mo2 / "mods" / name, btu::fs::copy_options::recursive);
+    }
+
+    // Highest priority first
+    std::ofstream(mo2 / "modlist.txt") << "# This file was automatically generated by Mod Organizer.\r\n"
+                                       << "+b\r\n"
+                                       << "-disabled\r\n"
+                                       << "*DLC: Dawnguard\r\n"
+                                       << "+a\r\n"
+                                       << "+missing\r\n";
+
+    const auto load_order = btu::modmanager::read_mo2_load_order(mo2 / "mods", mo2 / "modlist.txt");
+    const auto mods       = require_expected(load_order);
+    REQUIRE(mods == std::vector<Path>{mo2 / "mods" / "a", mo2 / "mods" / "b"});
+
+    const auto conflicts = btu::modmanager::FileConflicts(mods);
+    CHECK(require_expected(conflicts.is_winner(mods[1], "random_file.txt", false)));
+    CHECK_FALSE(require_expected(conflicts.is_winner(mods[0], "random_file.txt", false)));
+    // Files in archives, compared without case
+    CHECK(require_expected(conflicts.is_winner(mods[1], "Textures/BlackSky_e.dds", true)));
+    CHECK_FALSE(require_expected(conflicts.is_winner(mods[0], "textures/blacksky_e.dds", true)));
+    // Not provided by anyone else
+    CHECK(require_expected(conflicts.is_winner(mods[0], "textures/unique.dds", false)));
+
+    // Mods are found by their canonical directory
+    CHECK(require_expected(conflicts.is_winner(btu::fs::absolute(mods[1]) / "", "random_file.txt", false)));
+    CHECK(conflicts.contains(mods[0] / ".." / "a"));
+    CHECK_FALSE(conflicts.is_winner(mo2 / "mods" / "disabled", "random_file.txt", false).has_value());
+
+    const auto report = conflicts.conflicts();
+    CHECK(report.size() == 4);
+    for (const auto &conflict : report)
+    {
+        CHECK(conflict.winner == mods[1]);
+        CHECK(conflict.losers == std::vector<Path>{mods[0]});
+    }
+
+    auto library     = btu::modmanager::ModLibrary(mods, btu::bsa::Settings::get(btu::Game::FO4));
+    auto transformer = CountingTransformer{};
+    REQUIRE(library.transform(transformer, conflicts));
+
+    // Only the files of `b`
+    CHECK(transformer.count() == 4);
+
+    // Conflicts of other mods are rejected before anything is transformed
+    const auto only_a = btu::modmanager::FileConflicts(std::span(mods).first(1));
+    CHECK_FALSE(library.transform(transformer, only_a).has_value());
+    CHECK(transformer.count() == 4);
+}
+
+TEST_CASE("FileConflicts with a loose file overriding the archive of its mod", "[src]")
+{
+    const Path dir = "modfolder";
+    const Path mod = dir / "conflicts_loose" / "mod";
+
+    btu::fs::remove_all(mod);
+    btu::fs::create_directories(mod);
+    btu::fs::copy(dir / "input", mod, btu::fs::copy_options::recursive);
+
+    // Also in an archive of the mod
+    const auto relative_path = Path("textures") / "blacksky_e.dds";
+    btu::fs::create_directories((mod / relative_path).parent_path());
+    std::ofstream(mod / relative_path) << "loose";
+
+    const auto mods      = std::vector{mod};
+    const auto conflicts = btu::modmanager::FileConflicts(mods);
+    CHECK(require_expected(conflicts.is_winner(mod, relative_path, false)));
+    CHECK_FALSE(require_expected(conflicts.is_winner(mod, relative_path, true)));
+
+    const auto report = conflicts.conflicts();
+    const auto it     = std::ranges::find(report,
+                                      std::u8string(u8"textures/blacksky_e.dds"),
+                                      &btu::modmanager::Conflict::relative_path);
+    REQUIRE(it != report.end());
+    CHECK(it->winner == mod);
+    CHECK(it->losers == mods);
+}
+
+TEST_CASE("read_mo2_load_order reports a missing modlist", "[src]")
+{
+    CHECK_FALSE(btu::modmanager::read_mo2_load_order("mods", "does_not_exist/modlist.txt").has_value());
+}
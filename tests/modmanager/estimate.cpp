@@ -0,0 +1,153 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/estimate.hpp"
+
+#include "../utils.hpp"
+
+#include <btu/tex/dxtex.hpp>
+#include <btu/tex/texture.hpp>
+
+TEST_CASE("EncodeRates", "[src]")
+{
+    using btu::modmanager::EncodeRates;
+
+    auto dev         = btu::tex::CompressionDevice{};
+    const auto rates = EncodeRates::measure(dev, ".");
+
+    CHECK(rates.bc7_pixels_per_second > 0);
+    CHECK(rates.bc_pixels_per_second > 0);
+    CHECK(rates.process_pixels_per_second > 0);
+    CHECK(rates.mesh_bytes_per_second > 0);
+    CHECK(rates.io_bytes_per_second > 0);
+
+    // Nothing to read, nothing is written
+    const auto empty = btu::fs::temp_directory_path() / "btu-estimate-empty";
+    btu::fs::create_directories(empty);
+    CHECK(EncodeRates::measure(dev, empty).io_bytes_per_second == 0);
+    CHECK(btu::fs::is_empty(empty));
+    btu::fs::remove_all(empty);
+
+    const auto json = nlohmann::json(rates);
+    const auto back = json.get<EncodeRates>();
+    CHECK(back.bc7_pixels_per_second == rates.bc7_pixels_per_second);
+    CHECK(back.io_bytes_per_second == rates.io_bytes_per_second);
+}
+
+TEST_CASE("estimate", "[src]")
+{
+    using btu::modmanager::ModFolder;
+
+    const auto rates = btu::modmanager::EncodeRates{
+        .bc7_pixels_per_second     = 1e6,
+        .bc_pixels_per_second      = 1e7,
+        .process_pixels_per_second = 1e8,
+        .mesh_bytes_per_second     = 1e7,
+        .io_bytes_per_second       = 1e8,
+    };
+    const auto sets = btu::tex::Settings::get(btu::Game::SSE);
+
+    const auto mod = ModFolder("modfolder/input", btu::bsa::Settings::get(btu::Game::SSE));
+    const auto res = btu::modmanager::estimate(mod, sets, rates);
+
+    CHECK(res.mod_dir == mod.path());
+    CHECK(res.files == mod.size());
+    CHECK(res.changed_files <= res.files);
+    CHECK(res.bytes_read > 0);
+    CHECK(res.io_seconds > 0);
+
+    const auto mods = std::to_array({mod, mod});
+    const auto all  = btu::modmanager::estimate(mods, sets, rates);
+    REQUIRE(all.size() == 2);
+    CHECK(all[1].bytes_read == res.bytes_read);
+}
+
+TEST_CASE("estimate probes archived textures", "[src]")
+{
+    using btu::bsa::ArchiveType, btu::bsa::ArchiveVersion;
+
+    const Path dir = "estimate_archive";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    // Not a texture: its header cannot be read, so it is not counted as changed
+    auto arch    = btu::bsa::Archive{ArchiveVersion::sse, ArchiveType::Standard};
+    auto garbage = std::vector{std::byte{'n'}, std::byte{'o'}, std::byte{'p'}, std::byte{'e'}};
+    auto mesh    = garbage;
+    REQUIRE(arch.get("textures/a.dds").read(garbage));
+    REQUIRE(arch.get("meshes/a.nif").read(mesh));
+    REQUIRE(std::move(arch).write(dir / "a.bsa"));
+
+    const auto rates = btu::modmanager::EncodeRates{
+        .bc7_pixels_per_second     = 1e6,
+        .bc_pixels_per_second      = 1e7,
+        .process_pixels_per_second = 1e8,
+        .mesh_bytes_per_second     = 1e7,
+        .io_bytes_per_second       = 1e8,
+    };
+    const auto mod = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::SSE));
+    const auto res = btu::modmanager::estimate(mod, btu::tex::Settings::get(btu::Game::SSE), rates);
+
+    CHECK(res.files == 2);
+    CHECK(res.changed_files == 1);
+    CHECK(res.bytes_written == btu::fs::file_size(dir / "a.bsa"));
+    CHECK(res.disk_delta == 0);
+}
+
+TEST_CASE("estimate reads the headers of archived textures without extracting them", "[src]")
+{
+    using btu::bsa::ArchiveType, btu::bsa::ArchiveVersion;
+
+    // Uncompressed and without mipmaps: optimizing it changes it
+    auto image = btu::tex::ScratchImage{};
+    REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 256, 256, 1, 1)));
+    auto tex = btu::tex::Texture{};
+    tex.set(std::move(image));
+    const auto texture = require_expected(btu::tex::save(tex));
+
+    const auto rates = btu::modmanager::EncodeRates{
+        .bc7_pixels_per_second     = 1e6,
+        .bc_pixels_per_second      = 1e7,
+        .process_pixels_per_second = 1e8,
+        .mesh_bytes_per_second     = 1e7,
+        .io_bytes_per_second       = 1e8,
+    };
+    const auto &sets = btu::tex::Settings::get(btu::Game::SSE);
+
+    const auto estimate_archive = [&](ArchiveVersion version,
+                                      ArchiveType type,
+                                      const Path &name,
+                                      btu::Game game) {
+        const auto dir = Path("estimate_archive_headers");
+        btu::fs::remove_all(dir);
+        btu::fs::create_directories(dir);
+
+        auto arch  = btu::bsa::Archive{version, type};
+        auto data  = texture;
+        auto &file = arch.get("textures/a.dds");
+        REQUIRE(file.read(data));
+        file.compress();
+        REQUIRE(std::move(arch).write(dir / name));
+
+        const auto mod = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(game));
+        return btu::modmanager::estimate(mod, sets, rates);
+    };
+
+    // The header is the start of the compressed file
+    const auto sse = estimate_archive(ArchiveVersion::sse, ArchiveType::Textures, "a.bsa", btu::Game::SSE);
+    CHECK(sse.files == 1);
+    CHECK(sse.changed_files == 1);
+    CHECK(sse.cpu_seconds > 0);
+    CHECK(sse.disk_delta < 0);
+
+    // The header is in the record of the file
+    const auto fo4 = estimate_archive(ArchiveVersion::fo4,
+                                      ArchiveType::Textures,
+                                      "a - Textures.ba2",
+                                      btu::Game::FO4);
+    CHECK(fo4.files == 1);
+    CHECK(fo4.changed_files == 1);
+    CHECK(fo4.disk_delta == sse.disk_delta);
+}
@@ -7,6 +7,7 @@
 
 #include "../utils.hpp"
 #include "btu/common/filesystem.hpp"
+#include "btu/modmanager/detail/transform.hpp"
 
 #include <binary_io/memory_stream.hpp>
 #include <btu/hkx/anim.hpp>
@@ -85,6 +86,461 @@ TEST_CASE("ModFolder transform", "[src]")
     CHECK(btu::common::compare_directories(dir / "output", dir / "expected"));
 }
 
+TEST_CASE("ModFolder transform with HDD pipeline settings", "[src]")
+{
+    const Path dir = "modfolder_transform";
+    // operate on copy
+    btu::fs::remove_all(dir / "output_hdd");
+    btu::fs::copy(dir / "input", dir / "output_hdd");
+
+    const auto pipeline = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::HDD);
+    CHECK(pipeline.reader_threads == 1);
+    CHECK(pipeline.writer_threads == 1);
+
+    auto mf = btu::modmanager::ModFolder(dir / "output_hdd",
+                                         btu::bsa::Settings::get(btu::Game::SSE),
+                                         false,
+                                         pipeline);
+
+    Transformer transformer;
+    mf.transform(transformer);
+
+    CHECK(btu::common::compare_directories(dir / "output_hdd", dir / "expected"));
+}
+
+TEST_CASE("ModFolder transform with a memory budget smaller than a file", "[src]")
+{
+    const Path dir = "modfolder_transform";
+    // operate on copy
+    btu::fs::remove_all(dir / "output_budget");
+    btu::fs::copy(dir / "input", dir / "output_budget");
+
+    // Files are processed one at a time, but none is held back forever
+    auto pipeline          = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.memory_budget = 1;
+
+    auto mf = btu::modmanager::ModFolder(dir / "output_budget",
+                                         btu::bsa::Settings::get(btu::Game::SSE),
+                                         false,
+                                         pipeline);
+
+    Transformer transformer;
+    mf.transform(transformer);
+
+    CHECK(btu::common::compare_directories(dir / "output_budget", dir / "expected"));
+}
+
+TEST_CASE("estimate_memory", "[src]")
+{
+    using btu::modmanager::detail::estimate_memory;
+
+    // "DDS " magic and the start of a DDS_HEADER describing a 4096x2048 texture
+    auto header          = std::vector<std::byte>(20);
+    const auto write_u32 = [&header](size_t offset, uint32_t value) {
+        for (size_t i = 0; i < sizeof(value); ++i)
+            header[offset + i] = static_cast<std::byte>(value >> (8 * i));
+    };
+    write_u32(0, 0x20534444);
+    write_u32(12, 2048);
+    write_u32(16, 4096);
+
+    const auto from_header = estimate_memory("textures/a.dds", 1024, header);
+    CHECK(from_header > 4096ULL * 2048 * 4);
+    CHECK(from_header > estimate_memory("textures/a.dds", 1024));
+    CHECK(estimate_memory("textures/a.dds", 1024) > estimate_memory("a.txt", 1024));
+}
+
+class BatchTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        FAIL("Archive too large, should not happen in tests");
+        return ArchiveTooLargeAction::Skip;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile /*file*/) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        ++single_files_;
+        return std::nullopt;
+    }
+
+    [[nodiscard]] auto transform_batch(std::span<btu::modmanager::ModFile> files) noexcept
+        -> std::vector<std::optional<std::vector<std::byte>>> override
+    {
+        const auto ext = files.front().relative_path.extension();
+        for (const auto &file : files)
+            CHECK(file.relative_path.extension() == ext);
+
+        batched_files_ += files.size();
+        return std::vector<std::optional<std::vector<std::byte>>>(files.size());
+    }
+
+    [[nodiscard]] auto single_files() const noexcept -> size_t { return single_files_; }
+    [[nodiscard]] auto batched_files() const noexcept -> size_t { return batched_files_; }
+
+private:
+    std::atomic_size_t single_files_  = 0;
+    std::atomic_size_t batched_files_ = 0;
+};
+
+TEST_CASE("ModFolder transform with batches", "[src]")
+{
+    const Path dir = "modfolder";
+
+    auto pipeline            = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.batch_max_files = 8;
+
+    auto mf = btu::modmanager::ModFolder(dir / "input",
+                                         btu::bsa::Settings::get(btu::Game::FO4),
+                                         false,
+                                         pipeline);
+
+    BatchTransformer transformer;
+    mf.transform(transformer);
+
+    // The two textures of the archive are batched, the loose files have different types
+    CHECK(transformer.batched_files() == 2);
+    CHECK(transformer.single_files() == 2);
+}
+
+class LargeOutputTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    static constexpr size_t k_output_size = 1024ULL * 1024;
+
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        FAIL("Archive too large, should not happen in tests");
+        return ArchiveTooLargeAction::Skip;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile /*file*/) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        return std::vector<std::byte>(k_output_size, std::byte{'x'});
+    }
+};
+
+TEST_CASE("ModFolder transform writes large archive entries", "[src]")
+{
+    const Path dir = "modfolder_large_entries";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    const auto sets = btu::bsa::Settings::get(btu::Game::SSE);
+    {
+        auto arch = btu::bsa::Archive{btu::bsa::ArchiveVersion::sse, btu::bsa::ArchiveType::Standard};
+        auto data = std::vector{std::byte{0x00}, std::byte{0x01}, std::byte{0x02}, std::byte{0x03}};
+        REQUIRE(arch.get("meshes/a.nif").read(data));
+        REQUIRE(std::move(arch).write(dir / "arch.bsa"));
+    }
+
+    auto mf = btu::modmanager::ModFolder(dir, sets);
+
+    LargeOutputTransformer transformer;
+    mf.transform(transformer);
+
+    // Only the archive is left, the transformed content was not kept on disk
+    CHECK(std::distance(btu::fs::directory_iterator(dir), btu::fs::directory_iterator()) == 1);
+
+    auto arch = btu::bsa::Archive::read(dir / "arch.bsa");
+    REQUIRE(arch.has_value());
+    REQUIRE(arch->size() == 1);
+
+    auto buffer = binary_io::any_ostream{binary_io::memory_ostream{}};
+    REQUIRE(arch->begin()->second.write(buffer));
+    CHECK(buffer.get<binary_io::memory_ostream>().rdbuf()
+          == std::vector<std::byte>(LargeOutputTransformer::k_output_size, std::byte{'x'}));
+}
+
+class StagedTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    explicit StagedTransformer(bool stop)
+        : stop_(stop)
+    {
+    }
+
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile /*file*/) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        return std::vector{std::byte{'n'}, std::byte{'e'}, std::byte{'w'}};
+    }
+
+    [[nodiscard]] auto stop_requested() const noexcept -> bool override { return stop_; }
+
+private:
+    bool stop_;
+};
+
+TEST_CASE("ModFolder transform_staged", "[src]")
+{
+    const Path dir = "modfolder_staged";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir / "mod" / "textures");
+
+    const auto original = std::vector{std::byte{'o'}, std::byte{'l'}, std::byte{'d'}};
+    REQUIRE(btu::common::write_file(dir / "mod" / "textures" / "a.dds", original));
+    // Shares its content with the mod file. Must never be modified
+    REQUIRE(btu::common::hard_link(dir / "mod" / "textures" / "a.dds", dir / "outside.dds"));
+
+    auto mf = btu::modmanager::ModFolder(dir / "mod", btu::bsa::Settings::get(btu::Game::SSE));
+
+    SECTION("changes are applied on success")
+    {
+        auto transformer = StagedTransformer(false);
+        REQUIRE(mf.transform_staged(transformer));
+
+        CHECK(btu::common::read_file(dir / "mod" / "textures" / "a.dds")
+              == std::vector{std::byte{'n'}, std::byte{'e'}, std::byte{'w'}});
+    }
+    SECTION("the folder is left untouched when stopped")
+    {
+        auto transformer = StagedTransformer(true);
+        const auto res   = mf.transform_staged(transformer);
+        REQUIRE_FALSE(res);
+        CHECK(res.error() == std::errc::operation_canceled);
+
+        CHECK(btu::common::read_file(dir / "mod" / "textures" / "a.dds") == original);
+    }
+
+    CHECK(btu::common::read_file(dir / "outside.dds") == original);
+    CHECK_FALSE(btu::fs::exists(dir / "mod.btu-staging"));
+    CHECK(std::distance(btu::fs::directory_iterator(dir), btu::fs::directory_iterator()) == 2);
+}
+
+TEST_CASE("ModFolder schedules files by category", "[src]")
+{
+    using btu::modmanager::TaskCategory;
+    using btu::modmanager::detail::task_category;
+
+    CHECK(task_category("textures/a.DDS") == TaskCategory::Texture);
+    CHECK(task_category("meshes/a.nif") == TaskCategory::Mesh);
+    CHECK(task_category("meshes/a.hkx") == TaskCategory::Animation);
+    CHECK(task_category("scripts/a.pex") == TaskCategory::Other);
+
+    const Path dir = "modfolder_categories";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    const auto content = std::vector{std::byte{'o'}, std::byte{'l'}, std::byte{'d'}};
+    for (const auto *name : {"a.dds", "b.dds", "c.nif", "d.pex"})
+        REQUIRE(btu::common::write_file(dir / name, content));
+
+    auto pipeline              = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.transform_threads = {.textures = 2, .meshes = 1, .animations = 1, .other = 1};
+    auto mf = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::SSE), false, pipeline);
+
+    auto transformer = StagedTransformer(false);
+    mf.transform(transformer);
+
+    CHECK(mf.utilization(TaskCategory::Texture).threads == 2);
+    CHECK(mf.utilization(TaskCategory::Texture).completed == 2);
+    CHECK(mf.utilization(TaskCategory::Mesh).completed == 1);
+    CHECK(mf.utilization(TaskCategory::Animation).completed == 0);
+    CHECK(mf.utilization(TaskCategory::Other).completed == 1);
+    CHECK(mf.utilization(TaskCategory::Texture).running == 0);
+}
+
+/// Removes each file from the disk before looking at its content
+class RemovingTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    explicit RemovingTransformer(Path dir)
+        : dir_(std::move(dir))
+    {
+    }
+
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile file) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        btu::fs::remove(dir_ / file.relative_path);
+        CHECK(file.content->has_value());
+        return std::nullopt;
+    }
+
+private:
+    Path dir_;
+};
+
+TEST_CASE("ModFolder reads loose files before their task runs", "[src]")
+{
+    const Path dir = "modfolder_read_stage";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    const auto content = std::vector{std::byte{'o'}, std::byte{'l'}, std::byte{'d'}};
+    for (const auto *name : {"a.dds", "b.nif", "c.pex"})
+        REQUIRE(btu::common::write_file(dir / name, content));
+
+    // Tasks get the content in memory, the reader threads already read it from the disk
+    auto mf          = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::SSE));
+    auto transformer = RemovingTransformer(dir);
+    mf.transform(transformer);
+
+    CHECK(std::distance(btu::fs::directory_iterator(dir), btu::fs::directory_iterator()) == 0);
+}
+
+/// Keeps the executor given by the mod folder, as a texture encoder would
+class ExecutorTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile /*file*/) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        return std::nullopt;
+    }
+
+    void set_executor(btu::common::Executor executor, size_t threads) noexcept override
+    {
+        executor_ = std::move(executor);
+        threads_  = threads;
+    }
+
+    [[nodiscard]] auto executor() const noexcept -> const btu::common::Executor & { return executor_; }
+    [[nodiscard]] auto threads() const noexcept -> size_t { return threads_; }
+
+private:
+    btu::common::Executor executor_;
+    size_t threads_ = 0;
+};
+
+TEST_CASE("ModFolder gives its texture threads to the transformer", "[src]")
+{
+    using btu::modmanager::TaskCategory;
+
+    const Path dir = "modfolder_executor";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    auto pipeline              = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.transform_threads = {.textures = 3, .meshes = 1, .animations = 1, .other = 1};
+    auto mf = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::SSE), false, pipeline);
+
+    auto transformer = ExecutorTransformer{};
+    mf.transform(transformer);
+
+    CHECK(transformer.threads() == 3);
+    REQUIRE(transformer.executor());
+
+    // Runs as a texture task
+    auto running = std::promise<size_t>{};
+    transformer.executor()([&] { running.set_value(mf.utilization(TaskCategory::Texture).running); });
+    auto fut = running.get_future();
+    REQUIRE(fut.wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+    CHECK(fut.get() == 1);
+}
+
+/// Records the order in which files start being transformed
+class OrderTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile file) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        started_.wlock()->push_back(file.relative_path);
+        return std::nullopt;
+    }
+
+    [[nodiscard]] auto started() const -> std::vector<Path> { return *started_.rlock(); }
+
+private:
+    btu::common::synchronized<std::vector<Path>> started_;
+};
+
+TEST_CASE("ModFolder starts the costliest files first", "[src]")
+{
+    constexpr size_t k_files = 12;
+
+    const Path dir = "modfolder_order";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+
+    // Numbered by size, so that the name order is the smallest first
+    const auto name = [](size_t i) { return (i < 10 ? "0" : "") + std::to_string(i) + ".dds"; };
+    const auto size = [](size_t i) { return (i + 1) * 1024; };
+    {
+        auto arch = btu::bsa::Archive{btu::bsa::ArchiveVersion::sse, btu::bsa::ArchiveType::Standard};
+        for (size_t i = 0; i < k_files; ++i)
+        {
+            auto data = std::vector(size(i), std::byte{'a'});
+            REQUIRE(btu::common::write_file(dir / ("l" + name(i)), data));
+            REQUIRE(arch.get("textures/a" + name(i)).read(data));
+        }
+        REQUIRE(std::move(arch).write(dir / "arch.bsa"));
+    }
+
+    // A single reader queues the files in order, and all of them are textures
+    auto pipeline              = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.reader_threads    = 1;
+    pipeline.batch_max_files   = 1;
+    pipeline.transform_threads = {.textures = 1, .meshes = 1, .animations = 1, .other = 1};
+    auto mf = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::SSE), false, pipeline);
+
+    auto transformer = OrderTransformer{};
+    mf.transform(transformer);
+
+    auto loose    = std::vector<size_t>{};
+    auto archived = std::vector<size_t>{};
+    for (const auto &path : transformer.started())
+    {
+        const auto stem = path.filename().string();
+        const auto idx  = std::stoul(stem.substr(1, 2));
+        (stem.front() == 'l' ? loose : archived).push_back(idx);
+    }
+    REQUIRE(loose.size() == k_files);
+    REQUIRE(archived.size() == k_files);
+
+    // Idle threads of the other categories take texture tasks too, so tasks queued close to each other
+    // may start in any order
+    constexpr size_t k_slack = 3;
+    for (const auto &started : {loose, archived})
+    {
+        CHECK(started.front() >= k_files - 1 - k_slack);
+        CHECK(started.back() <= k_slack);
+        for (size_t pos = 0; pos < k_files; ++pos)
+        {
+            const auto rank = k_files - 1 - started[pos];
+            CHECK(rank <= pos + k_slack);
+            CHECK(pos <= rank + k_slack);
+        }
+    }
+}
+
 TEST_CASE("ModFolder ignore existing", "[src]")
 {
     const Path dir = "modfolder_ignore_existing";
@@ -105,6 +561,69 @@ TEST_CASE("ModFolder size", "[src]")
     const Path dir = "modfolder";
     auto mf        = btu::modmanager::ModFolder(dir / "input", btu::bsa::Settings::get(btu::Game::FO4));
     CHECK(mf.size() == 4);
+
+    // Archives too large to be processed are skipped, but still counted by stats
+    auto sets     = btu::bsa::Settings::get(btu::Game::FO4);
+    sets.max_size = 1;
+    auto small    = btu::modmanager::ModFolder(dir / "input", sets);
+    CHECK(small.size() == 2);
+    CHECK(small.stats().files() == 4);
+}
+
+TEST_CASE("ModFolder stats", "[src]")
+{
+    const Path dir = "modfolder";
+    auto mf        = btu::modmanager::ModFolder(dir / "input", btu::bsa::Settings::get(btu::Game::FO4));
+
+    const auto stats = mf.stats();
+    CHECK(stats.loose_files == 2);
+    CHECK(stats.archives == 1);
+    CHECK(stats.archived_files == 2);
+    CHECK(stats.files() == mf.size());
+    CHECK(stats.bytes_by_type.at(btu::bsa::FileTypes::Texture) > 0);
+}
+
+TEST_CASE("ModFolder ignores temporary files left over by a crash", "[src]")
+{
+    const Path dir = "modfolder_leftovers";
+    btu::fs::remove_all(dir);
+    btu::fs::copy(Path("modfolder") / "input", dir, btu::fs::copy_options::recursive);
+
+    const auto data = std::vector{std::byte{'a'}};
+    require_expected(btu::common::write_file(dir / "random_file.txt.btu-tmp", data));
+    btu::fs::create_directories(dir / "expected_fo4.ba2.btu-scratch");
+    require_expected(btu::common::write_file(dir / "expected_fo4.ba2.btu-scratch" / "0", data));
+
+    auto mf = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::FO4));
+    CHECK(mf.size() == 4);
+
+    // Removed before transforming
+    const auto staging = Path(dir.u8string() + u8".btu-staging");
+    btu::fs::create_directories(staging);
+
+    Transformer transformer;
+    mf.transform(transformer);
+
+    CHECK_FALSE(btu::fs::exists(dir / "random_file.txt.btu-tmp"));
+    CHECK_FALSE(btu::fs::exists(dir / "expected_fo4.ba2.btu-scratch"));
+    CHECK_FALSE(btu::fs::exists(staging));
+}
+
+TEST_CASE("remove_leftovers restores a folder moved aside by a staged transform", "[src]")
+{
+    const Path dir   = "modfolder_moved_aside";
+    const auto aside = Path(dir.u8string() + u8".btu-old");
+    btu::fs::remove_all(dir);
+    btu::fs::remove_all(aside);
+
+    const auto data = std::vector{std::byte{'a'}};
+    btu::fs::create_directories(aside);
+    require_expected(btu::common::write_file(aside / "a.txt", data));
+
+    btu::modmanager::detail::remove_leftovers(dir);
+
+    CHECK(btu::common::read_file(dir / "a.txt") == data);
+    CHECK_FALSE(btu::fs::exists(aside));
 }
 
 class IteratorWithArchiveTooLarge final : public btu::modmanager::ModFolderIterator
@@ -168,6 +687,79 @@ TEST_CASE("Iteration can be stopped early")
     CHECK_FALSE(iterator.processed_file());
 }
 
+/// Requests a stop through its token while transforming the first file
+class StoppingTransformer final : public btu::modmanager::ModFolderTransformer
+{
+public:
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    [[nodiscard]] auto transform_file(btu::modmanager::ModFile /*file*/) noexcept
+        -> std::optional<std::vector<std::byte>> override
+    {
+        ++calls_;
+        stop_.request_stop();
+        return std::vector{std::byte{'n'}, std::byte{'e'}, std::byte{'w'}};
+    }
+
+    [[nodiscard]] auto stop_token() const noexcept -> std::stop_token override { return stop_.get_token(); }
+
+    [[nodiscard]] auto calls() const noexcept -> size_t { return calls_; }
+
+private:
+    std::stop_source stop_;
+    std::atomic_size_t calls_ = 0;
+};
+
+TEST_CASE("ModFolder transform can be stopped while running", "[src]")
+{
+    const Path dir         = "modfolder_stop";
+    constexpr size_t files = 32;
+    const auto original    = std::vector{std::byte{'o'}, std::byte{'l'}, std::byte{'d'}};
+
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir);
+    for (size_t i = 0; i < files; ++i)
+        REQUIRE(btu::common::write_file(dir / (std::to_string(i) + ".txt"), original));
+
+    auto pipeline              = btu::modmanager::PipelineSettings::get(btu::modmanager::StorageType::SSD);
+    pipeline.transform_threads = {.textures = 1, .meshes = 1, .animations = 1, .other = 1};
+    const auto sets            = btu::bsa::Settings::get(btu::Game::SSE);
+
+    const auto count_changed = [&] {
+        size_t changed = 0;
+        for (size_t i = 0; i < files; ++i)
+            changed += btu::common::read_file(dir / (std::to_string(i) + ".txt")) != original ? 1 : 0;
+        return changed;
+    };
+
+    SECTION("between files")
+    {
+        auto mf          = btu::modmanager::ModFolder(dir, sets, false, pipeline);
+        auto transformer = StoppingTransformer{};
+        mf.transform(transformer);
+
+        // Only the files that were already running when the stop was requested are transformed
+        CHECK(transformer.calls() >= 1);
+        CHECK(transformer.calls() <= pipeline.transform_threads.total());
+        CHECK(count_changed() == transformer.calls());
+    }
+    SECTION("inside a batch")
+    {
+        pipeline.batch_max_files = files;
+        auto mf                  = btu::modmanager::ModFolder(dir, sets, false, pipeline);
+        auto transformer         = StoppingTransformer{};
+        mf.transform(transformer);
+
+        CHECK(transformer.calls() == 1);
+        CHECK(count_changed() == 1);
+    }
+}
+
 // Oops, this happened
 TEST_CASE("ModFolder transform does not remove the archive it just written because of a case difference")
 {
@@ -188,4 +780,51 @@ TEST_CASE("ModFolder transform does not remove the archive it just written becau
     mf.transform(transformer);
 
     CHECK(exists(out / "expected_fo4.ba2"));
-}
\ No newline at end of file
+}
+#ifdef __linux__
+TEST_CASE("ModFolder watch", "[src]")
+{
+    const Path dir = "modfolder_watch";
+    btu::fs::remove_all(dir);
+    btu::fs::create_directories(dir / "textures");
+
+    auto mf = btu::modmanager::ModFolder(dir, btu::bsa::Settings::get(btu::Game::SSE));
+
+    auto processed = btu::common::synchronized<std::vector<Path>>{};
+    auto rounds    = std::atomic_int{0};
+
+    Transformer transformer;
+    auto on_processed = [&](std::span<const Path> files) {
+        auto lock = processed.wlock();
+        lock->insert(lock->end(), files.begin(), files.end());
+        ++rounds;
+    };
+    auto watcher = std::jthread([&](std::stop_token stop) {
+        const auto res = mf.watch(transformer, std::move(stop), std::chrono::milliseconds(50), on_processed);
+        CHECK(res.has_value());
+    });
+
+    // Give the watcher time to register the directories
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const auto data = std::vector{std::byte{'a'}, std::byte{'b'}};
+    require_expected(btu::common::write_file(dir / "textures" / "new.txt", data));
+    // Temporary files of a transform are not part of the mod
+    require_expected(btu::common::write_file(dir / "textures" / "other.txt.btu-tmp", data));
+    btu::fs::create_directories(dir / "a.bsa.btu-scratch");
+    require_expected(btu::common::write_file(dir / "a.bsa.btu-scratch" / "0", data));
+
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (rounds == 0 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    // Our own write must not be processed a second time
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    watcher.request_stop();
+    watcher.join();
+
+    CHECK(rounds == 1);
+    REQUIRE(processed.wlock()->size() == 1);
+    CHECK(processed.wlock()->front().filename() == "new.txt");
+    CHECK(require_expected(btu::common::read_file(dir / "textures" / "new.txt")).back() == std::byte{'0'});
+}
+#endif
@@ -0,0 +1,90 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/mod_library.hpp"
+
+#include "../utils.hpp"
+#include "btu/modmanager/mod_manager.hpp"
+
+#include <atomic>
+#include <mutex>
+
+class CountingIterator final : public btu::modmanager::ModFolderIterator
+{
+public:
+    [[nodiscard]] auto archive_too_large(const Path & /*archive_path*/,
+                                         ArchiveTooLargeState /*state*/) noexcept
+        -> ArchiveTooLargeAction override
+    {
+        return ArchiveTooLargeAction::Process;
+    }
+
+    void process_file(btu::modmanager::ModFile /*file*/) noexcept override { ++count_; }
+
+    [[nodiscard]] auto count() const noexcept -> size_t { return count_; }
+
+private:
+    std::atomic_size_t count_ = 0;
+};
+
+TEST_CASE("list_mods", "[src]")
+{
+    using btu::modmanager::list_mods;
+
+    const Path dir = "mod_manager";
+    CHECK(list_mods(dir / "mo2") == std::vector<Path>{dir / "mo2" / "some_mod"});
+    CHECK(list_mods(dir / "none") == std::vector<Path>{dir / "none"});
+}
+
+TEST_CASE("ModLibrary", "[src]")
+{
+    const Path dir  = "modfolder";
+    const auto mods = std::to_array<Path>({dir / "library" / "a", dir / "library" / "b"});
+
+    btu::fs::remove_all(dir / "library");
+    for (const auto &mod : mods)
+    {
+        btu::fs::create_directories(mod);
+        btu::fs::copy(dir / "input", mod, btu::fs::copy_options::recursive);
+    }
+
+    auto library = btu::modmanager::ModLibrary(mods, btu::bsa::Settings::get(btu::Game::FO4));
+    REQUIRE(library.mods().size() == 2);
+
+    auto done_mutex = std::mutex{};
+    auto done       = std::vector<Path>{};
+
+    auto iterator = CountingIterator{};
+    library.iterate(iterator, [&](const btu::modmanager::ModFolder &mod) {
+        const auto lock = std::lock_guard(done_mutex);
+        done.push_back(mod.path());
+    });
+
+    CHECK(iterator.count() == 8);
+
+    std::ranges::sort(done);
+    CHECK(done == std::vector(mods.begin(), mods.end()));
+}
+
+TEST_CASE("ModLibrary adds a mod given twice once", "[src]")
+{
+    const Path dir = "modfolder";
+    const auto mod = dir / "library_twice" / "a";
+
+    btu::fs::remove_all(dir / "library_twice");
+    btu::fs::create_directories(mod);
+    btu::fs::copy(dir / "input", mod, btu::fs::copy_options::recursive);
+
+    const auto mods = std::to_array<Path>({mod, mod, Path(mod.u8string() + u8"/")});
+    auto library    = btu::modmanager::ModLibrary(mods, btu::bsa::Settings::get(btu::Game::FO4));
+    REQUIRE(library.mods().size() == 1);
+
+    auto done_count = std::atomic_size_t{0};
+    auto iterator   = CountingIterator{};
+    library.iterate(iterator, [&](const btu::modmanager::ModFolder &) { ++done_count; });
+
+    CHECK(iterator.count() == 4);
+    CHECK(done_count == 1);
+}
@@ -0,0 +1,82 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "btu/modmanager/vfs_index.hpp"
+
+#include "../utils.hpp"
+
+TEST_CASE("VfsIndex", "[src]")
+{
+    // Two copies of the same mod: `b` has the highest priority
+    const Path dir  = "modfolder";
+    const auto mods = std::to_array<Path>({dir / "vfs" / "a", dir / "vfs" / "b"});
+
+    btu::fs::remove_all(dir / "vfs");
+    for (const auto &mod : mods)
+    {
+        btu::fs::create_directories(mod);
+        btu::fs::copy(dir / "input", mod, btu::fs::copy_options::recursive);
+    }
+
+    auto index = btu::modmanager::VfsIndex(mods);
+    CHECK(index.size() == 4);
+    CHECK_FALSE(index.find(u8"textures/missing.dds").has_value());
+
+    auto loose = index.find(u8"RANDOM_FILE.TXT");
+    REQUIRE(loose.has_value());
+    CHECK(loose->mod_dir == mods[1]);
+    CHECK(loose->source == mods[1] / "random_file.txt");
+    CHECK_FALSE(loose->in_archive);
+
+    const auto in_archive = index.find(u8"Textures\\BlackSky_e.dds");
+    REQUIRE(in_archive.has_value());
+    CHECK(in_archive->mod_dir == mods[1]);
+    CHECK(in_archive->source == mods[1] / "expected_fo4.ba2");
+    CHECK(in_archive->in_archive);
+
+    SECTION("update")
+    {
+        // The mods are relative paths, the updated file an absolute path
+        btu::fs::remove(mods[1] / "random_file.txt");
+        index.update(btu::fs::absolute(mods[1] / "random_file.txt"));
+
+        loose = index.find(u8"random_file.txt");
+        REQUIRE(loose.has_value());
+        CHECK(loose->mod_dir == mods[0]);
+
+        btu::fs::remove(mods[0] / "random_file.txt");
+        index.update(mods[0] / "random_file.txt");
+        CHECK_FALSE(index.find(u8"random_file.txt").has_value());
+        CHECK(index.size() == 3);
+    }
+
+    SECTION("save and load")
+    {
+        const auto path = dir / "vfs" / "index.bin";
+        require_expected(index.save(path));
+
+        const auto view = require_expected(btu::modmanager::VfsIndexView::open(path));
+        CHECK(view.size() == index.size());
+        CHECK(view.find(u8"random_file.txt")->source == loose->source);
+        CHECK(view.find(u8"TEXTURES/BLACKSKY_E.DDS")->source == in_archive->source);
+        CHECK_FALSE(view.find(u8"textures/missing.dds").has_value());
+
+        auto loaded = require_expected(btu::modmanager::VfsIndex::load(path));
+        CHECK(loaded.size() == index.size());
+
+        // Losers are kept, so the loaded index can still be updated
+        btu::fs::remove(mods[1] / "expected_fo4.ba2");
+        loaded.update(mods[1] / "expected_fo4.ba2");
+        CHECK(loaded.find(u8"textures/blacksky_e.dds")->mod_dir == mods[0]);
+    }
+
+    SECTION("corrupted file")
+    {
+        const auto path = dir / "vfs" / "corrupted.bin";
+        require_expected(btu::common::write_file(path, std::vector<std::byte>(16)));
+        CHECK_FALSE(btu::modmanager::VfsIndexView::open(path).has_value());
+        CHECK_FALSE(btu::modmanager::VfsIndex::load(path).has_value());
+    }
+}
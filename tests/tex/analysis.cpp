@@ -0,0 +1,94 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "./utils.hpp"
+
+#include <btu/tex/analysis.hpp>
+#include <btu/tex/dxtex.hpp>
+#include <btu/tex/functions.hpp>
+
+[[nodiscard]] auto make_image(DXGI_FORMAT format, size_t width, size_t height, std::array<uint8_t, 4> pixel)
+    -> btu::tex::ScratchImage
+{
+    auto image = btu::tex::ScratchImage{};
+    REQUIRE(SUCCEEDED(image.Initialize2D(format, width, height, 1, 1)));
+    for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+        image.GetPixels()[i] = pixel[i % pixel.size()];
+    return image;
+}
+
+TEST_CASE("analyze", "[src]")
+{
+    using btu::tex::analyze;
+
+    SECTION("opaque")
+    {
+        // Odd width, so that rows end in the middle of a lane
+        const auto res = analyze(make_image(DXGI_FORMAT_R8G8B8A8_UNORM, 37, 5, {10, 20, 30, 255}));
+        CHECK(res.min == std::array<uint8_t, 4>{10, 20, 30, 255});
+        CHECK(res.max == std::array<uint8_t, 4>{10, 20, 30, 255});
+        CHECK(res.alpha_all_opaque());
+        CHECK_FALSE(res.alpha_all_transparent());
+        CHECK(res.alpha_binary);
+    }
+    SECTION("channels and binary alpha")
+    {
+        auto image            = make_image(DXGI_FORMAT_R8G8B8A8_UNORM, 64, 64, {10, 20, 30, 255});
+        image.GetPixels()[3]  = 0;
+        image.GetPixels()[4]  = 5;
+        image.GetPixels()[10] = 200;
+
+        auto res = analyze(image);
+        CHECK(res.min == std::array<uint8_t, 4>{5, 20, 30, 0});
+        CHECK(res.max == std::array<uint8_t, 4>{10, 20, 200, 255});
+        CHECK_FALSE(res.alpha_all_opaque());
+        CHECK_FALSE(res.alpha_all_transparent());
+        CHECK(res.alpha_binary);
+
+        image.GetPixels()[image.GetPixelsSize() - 1] = 128;
+        res                                          = analyze(image);
+        CHECK_FALSE(res.alpha_binary);
+    }
+    SECTION("transparent")
+    {
+        const auto res = analyze(make_image(DXGI_FORMAT_R8G8B8A8_UNORM, 16, 16, {10, 20, 30, 0}));
+        CHECK(res.alpha_all_transparent());
+        CHECK(res.alpha_binary);
+    }
+    SECTION("BGRA is reported as RGBA")
+    {
+        const auto res = analyze(make_image(DXGI_FORMAT_B8G8R8A8_UNORM, 16, 16, {10, 20, 30, 40}));
+        CHECK(res.min == std::array<uint8_t, 4>{30, 20, 10, 40});
+    }
+    SECTION("padding of BGRX is not alpha")
+    {
+        const auto res = analyze(make_image(DXGI_FORMAT_B8G8R8X8_UNORM, 16, 16, {10, 20, 30, 40}));
+        CHECK(res.alpha_all_opaque());
+    }
+    SECTION("same as DirectXTex for compressed textures")
+    {
+        auto tex = btu::tex::Texture{};
+        tex.set(make_image(DXGI_FORMAT_R8G8B8A8_UNORM, 64, 64, {10, 20, 30, 255}));
+        tex = require_expected(btu::tex::convert(std::move(tex), DXGI_FORMAT_BC3_UNORM, compression_dev));
+
+        CHECK(analyze(tex.get()).alpha_all_opaque() == tex.get().IsAlphaAllOpaque());
+    }
+}
+
+TEST_CASE("Texture::analysis", "[src]")
+{
+    auto tex = btu::tex::Texture{};
+    tex.set(make_image(DXGI_FORMAT_R8G8B8A8_UNORM, 16, 16, {10, 20, 30, 255}));
+
+    const auto &const_tex = tex;
+    CHECK(const_tex.analysis().alpha_all_opaque());
+
+    // Modifying the pixels forgets the cached analysis
+    tex.get().GetPixels()[3] = 0;
+    CHECK_FALSE(const_tex.analysis().alpha_all_opaque());
+
+    tex.set(make_image(DXGI_FORMAT_R8G8B8A8_UNORM, 16, 16, {10, 20, 30, 255}));
+    CHECK(const_tex.analysis().alpha_all_opaque());
+}
@@ -0,0 +1,105 @@
+/* Copyright (C) 2022 Edgar B
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at https://mozilla.org/MPL/2.0/. */
+
+#include "./utils.hpp"
+
+#include <btu/tex/cache.hpp>
+
+[[nodiscard]] auto bytes(std::string_view str) -> std::vector<std::byte>
+{
+    const auto span = std::as_bytes(std::span(str));
+    return {span.begin(), span.end()};
+}
+
+TEST_CASE("OptimizationCache make_key", "[src]")
+{
+    using btu::tex::OptimizationCache;
+
+    const auto input = bytes("texture");
+    const auto steps = btu::tex::OptimizationSteps{.mipmaps = true};
+
+    const auto key = OptimizationCache::make_key(input, steps);
+    CHECK(key.size() == 32);
+    CHECK(key == OptimizationCache::make_key(input, steps));
+    CHECK(key != OptimizationCache::make_key(bytes("texturf"), steps));
+    CHECK(key != OptimizationCache::make_key(input, btu::tex::OptimizationSteps{}));
+}
+
+TEST_CASE("OptimizationCache", "[src]")
+{
+    using btu::tex::OptimizationCache;
+
+    const auto dir = btu::fs::temp_directory_path() / "btu-optimization-cache";
+    btu::fs::remove_all(dir);
+
+    const auto content = bytes(std::string(100, 'a'));
+    const auto steps   = btu::tex::OptimizationSteps{};
+    const auto key_1   = OptimizationCache::make_key(bytes("1"), steps);
+    const auto key_2   = OptimizationCache::make_key(bytes("2"), steps);
+    const auto key_3   = OptimizationCache::make_key(bytes("3"), steps);
+
+    {
+        auto cache = OptimizationCache(dir, 250);
+        CHECK_FALSE(cache.find(key_1).has_value());
+
+        cache.insert(key_1, content);
+        cache.insert(key_2, content);
+        CHECK(cache.find(key_1) == content);
+        CHECK(cache.size() == 200);
+
+        // Least recently used is evicted
+        cache.insert(key_3, content);
+        CHECK(cache.size() == 200);
+        CHECK(cache.find(key_1).has_value());
+        CHECK_FALSE(cache.find(key_2).has_value());
+
+        // Larger than the whole cache
+        cache.insert(key_2, bytes(std::string(300, 'b')));
+        CHECK_FALSE(cache.find(key_2).has_value());
+        CHECK(cache.size() == 200);
+    }
+
+    SECTION("Entries survive between runs")
+    {
+        auto cache = OptimizationCache(dir, 250);
+        CHECK(cache.size() == 200);
+        CHECK(cache.find(key_3) == content);
+    }
+
+    SECTION("Shrinking the cache evicts entries")
+    {
+        auto cache = OptimizationCache(dir, 150);
+        CHECK(cache.size() == 100);
+    }
+
+    btu::fs::remove_all(dir);
+}
+
+TEST_CASE("optimize_cached", "[src]")
+{
+    const auto dir = btu::fs::temp_directory_path() / "btu-optimize-cached";
+    btu::fs::remove_all(dir);
+
+    auto image = btu::tex::ScratchImage{};
+    REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 64, 64, 1, 1)));
+    std::fill_n(image.GetPixels(), image.GetPixelsSize(), uint8_t{0x7F});
+    auto tex = btu::tex::Texture{};
+    tex.set(std::move(image));
+    auto input = btu::tex::save(tex).value();
+
+    auto sets    = btu::tex::Settings::get(btu::Game::SSE);
+    sets.mipmaps = true;
+    auto cache   = btu::tex::OptimizationCache(dir, 1024 * 1024);
+
+    const auto first = btu::tex::optimize_cached(u8"textures/a.dds", input, sets, compression_dev, cache);
+    REQUIRE(first.has_value());
+    CHECK(cache.size() == first->size());
+
+    const auto second = btu::tex::optimize_cached(u8"textures/b.dds", input, sets, compression_dev, cache);
+    CHECK(second == first);
+    CHECK(cache.size() == first->size());
+
+    btu::fs::remove_all(dir);
+}
@@ -2,8 +2,10 @@
 
 #include <btu/common/filesystem.hpp>
 #include <btu/tex/functions.hpp>
+#include <btu/tex/optimize.hpp>
 
 #include <filesystem>
+#include <limits>
 
 using btu::tex::Dimension, btu::tex::Texture;
 
@@ -73,10 +75,364 @@ TEST_CASE("convert", "[src]")
     }
 }
 
+TEST_CASE("convert encodes in tiles", "[src]")
+{
+    const auto make_source = [] {
+        // Odd sizes, so that some tiles and blocks cross the edges
+        auto image = btu::tex::ScratchImage{};
+        REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 1030, 518, 1, 1)));
+        for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+            image.GetPixels()[i] = static_cast<uint8_t>(i * 13 / 7);
+
+        auto tex = Texture{};
+        tex.set(std::move(image));
+        return require_expected(btu::tex::generate_mipmaps(std::move(tex)));
+    };
+
+    const auto source = make_source();
+    for (const auto format : {DXGI_FORMAT_BC1_UNORM, DXGI_FORMAT_BC3_UNORM, DXGI_FORMAT_BC5_UNORM})
+    {
+        // Blocks are encoded independently, so the result must be the same as DirectXTex's
+        auto expected = btu::tex::ScratchImage{};
+        REQUIRE(SUCCEEDED(DirectX::Compress(source.get().GetImages(),
+                                            source.get().GetImageCount(),
+                                            source.get().GetMetadata(),
+                                            format,
+                                            DirectX::TEX_COMPRESS_DEFAULT,
+                                            DirectX::TEX_THRESHOLD_DEFAULT,
+                                            expected)));
+
+        const auto res = require_expected(btu::tex::convert(make_source(), format, compression_dev));
+        REQUIRE(res.get().GetPixelsSize() == expected.GetPixelsSize());
+        CHECK(std::equal(expected.GetPixels(),
+                         expected.GetPixels() + expected.GetPixelsSize(),
+                         res.get().GetPixels()));
+    }
+}
+
+TEST_CASE("convert shares its tiles with the executor of the device", "[src]")
+{
+    const auto make_source = [] {
+        auto image = btu::tex::ScratchImage{};
+        REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 1030, 518, 1, 1)));
+        for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+            image.GetPixels()[i] = static_cast<uint8_t>(i * 13 / 7);
+
+        auto tex = Texture{};
+        tex.set(std::move(image));
+        return tex;
+    };
+
+    const auto threads = std::to_array<size_t>({2});
+    const auto pools   = std::make_shared<btu::common::WorkerPools>(threads);
+    const auto exec    = btu::common::make_executor(pools, 0);
+
+    auto submitted = std::atomic_size_t{0};
+    auto dev       = btu::tex::CompressionDevice{};
+    dev.set_executor(
+        [&submitted, exec](std::function<void()> task) {
+            ++submitted;
+            exec(std::move(task));
+        },
+        threads[0]);
+
+    for (const auto format : {DXGI_FORMAT_BC7_UNORM, DXGI_FORMAT_BC1_UNORM})
+    {
+        submitted = 0;
+
+        const auto expected = require_expected(btu::tex::convert(make_source(), format, compression_dev));
+        const auto res      = require_expected(btu::tex::convert(make_source(), format, dev));
+        CHECK(submitted > 0);
+
+        REQUIRE(res.get().GetPixelsSize() == expected.get().GetPixelsSize());
+        CHECK(std::equal(expected.get().GetPixels(),
+                         expected.get().GetPixels() + expected.get().GetPixelsSize(),
+                         res.get().GetPixels()));
+    }
+}
+
+TEST_CASE("convert with encoder profiles", "[src]")
+{
+    using btu::tex::EncoderProfile;
+
+    const auto make_source = [] {
+        auto image = btu::tex::ScratchImage{};
+        REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 132, 68, 1, 1)));
+        for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+            image.GetPixels()[i] = static_cast<uint8_t>(i * 13 / 7);
+
+        auto tex = Texture{};
+        tex.set(std::move(image));
+        return tex;
+    };
+
+    const auto encode = [&](DXGI_FORMAT format, EncoderProfile profile) {
+        const auto encoder = btu::tex::EncoderOptions{.profile = profile};
+        auto res = require_expected(btu::tex::convert(make_source(), format, compression_dev, encoder));
+        CHECK(res.get().GetMetadata().format == format);
+        CHECK(res.get().GetMetadata().width == 132);
+        const auto &image = res.get();
+        return std::vector<uint8_t>(image.GetPixels(), image.GetPixels() + image.GetPixelsSize());
+    };
+
+    // Every profile changes the BC7 blocks
+    const auto bc7 = std::vector{encode(DXGI_FORMAT_BC7_UNORM, EncoderProfile::Fast),
+                                 encode(DXGI_FORMAT_BC7_UNORM, EncoderProfile::Balanced),
+                                 encode(DXGI_FORMAT_BC7_UNORM, EncoderProfile::MaxQuality),
+                                 encode(DXGI_FORMAT_BC7_UNORM, EncoderProfile::SizeOptimized)};
+    for (size_t i = 0; i < bc7.size(); ++i)
+        for (size_t j = i + 1; j < bc7.size(); ++j)
+            CHECK(bc7[i] != bc7[j]);
+
+    // BC1 only has dithering, used by MaxQuality
+    const auto bc1_balanced = encode(DXGI_FORMAT_BC1_UNORM, EncoderProfile::Balanced);
+    CHECK(encode(DXGI_FORMAT_BC1_UNORM, EncoderProfile::Fast) == bc1_balanced);
+    CHECK(encode(DXGI_FORMAT_BC1_UNORM, EncoderProfile::MaxQuality) != bc1_balanced);
+    CHECK(encode(DXGI_FORMAT_BC1_UNORM, EncoderProfile::SizeOptimized) == bc1_balanced);
+}
+
 TEST_CASE("generate_mipmaps", "[src]")
 {
     test_expected_dir(u8"generate_mipmaps", btu::tex::generate_mipmaps);
 }
+TEST_CASE("generate_missing_mipmaps", "[src]")
+{
+    auto image = btu::tex::ScratchImage{};
+    REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 64, 32, 1, 1)));
+    for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+        image.GetPixels()[i] = static_cast<uint8_t>(i * 7);
+
+    auto partial = btu::tex::ScratchImage{};
+    REQUIRE(SUCCEEDED(DirectX::GenerateMipMaps(*image.GetImage(0, 0, 0),
+                                               DirectX::TEX_FILTER_DEFAULT,
+                                               3,
+                                               partial)));
+    auto tex = Texture{};
+    tex.set(std::move(partial));
+    auto source = require_expected(btu::tex::convert(std::move(tex), DXGI_FORMAT_BC1_UNORM, compression_dev));
+
+    auto existing = std::vector<std::vector<uint8_t>>{};
+    for (size_t mip = 0; mip < 3; ++mip)
+    {
+        const auto *img = source.get().GetImage(mip, 0, 0);
+        existing.emplace_back(img->pixels, img->pixels + img->slicePitch);
+    }
+
+    auto res = require_expected(btu::tex::generate_missing_mipmaps(std::move(source), compression_dev));
+
+    const auto info = res.get().GetMetadata();
+    CHECK(info.mipLevels == btu::tex::optimal_mip_count({64, 32}));
+    CHECK(info.format == DXGI_FORMAT_BC1_UNORM);
+    for (size_t mip = 0; mip < existing.size(); ++mip)
+    {
+        const auto *img = res.get().GetImage(mip, 0, 0);
+        CHECK(std::equal(existing[mip].begin(), existing[mip].end(), img->pixels));
+    }
+
+    // Complete chains are left as is
+    res = require_expected(btu::tex::generate_missing_mipmaps(std::move(res), compression_dev));
+    CHECK(res.get().GetMetadata().mipLevels == info.mipLevels);
+}
+
+TEST_CASE("drop_mips", "[src]")
+{
+    const auto make_source = [] {
+        auto image = btu::tex::ScratchImage{};
+        REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 64, 32, 1, 1)));
+        for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+            image.GetPixels()[i] = static_cast<uint8_t>(i * 7);
+
+        auto tex = Texture{};
+        tex.set(std::move(image));
+        return require_expected(btu::tex::generate_mipmaps(std::move(tex)).and_then([](Texture &&mipped) {
+            return btu::tex::convert(std::move(mipped), DXGI_FORMAT_BC1_UNORM, compression_dev);
+        }));
+    };
+
+    const auto source = make_source();
+    const auto &info  = source.get().GetMetadata();
+    CHECK(btu::tex::mips_to_drop(info, Dimension{16, 8}) == 2);
+    CHECK(btu::tex::mips_to_drop(info, Dimension{1, 1}) == 6);
+    CHECK(btu::tex::mips_to_drop(info, Dimension{64, 32}) == std::nullopt);
+    CHECK(btu::tex::mips_to_drop(info, Dimension{24, 12}) == std::nullopt);
+
+    const auto check_dropped = [&](const Texture &res) {
+        const auto &res_info = res.get().GetMetadata();
+        CHECK(res.get_dimension() == Dimension{16, 8});
+        CHECK(res_info.mipLevels == info.mipLevels - 2);
+        CHECK(res_info.format == DXGI_FORMAT_BC1_UNORM);
+        for (size_t mip = 0; mip < res_info.mipLevels; ++mip)
+        {
+            const auto *expected = source.get().GetImage(mip + 2, 0, 0);
+            const auto *actual   = res.get().GetImage(mip, 0, 0);
+            REQUIRE(actual->slicePitch == expected->slicePitch);
+            CHECK(std::equal(actual->pixels, actual->pixels + actual->slicePitch, expected->pixels));
+        }
+    };
+
+    SECTION("drop_mips")
+    {
+        check_dropped(require_expected(btu::tex::drop_mips(make_source(), 2)));
+        CHECK_FALSE(btu::tex::drop_mips(make_source(), info.mipLevels).has_value());
+    }
+    SECTION("optimize does not encode again")
+    {
+        const auto steps = btu::tex::OptimizationSteps{
+            .resize      = Dimension{16, 8},
+            .mipmaps     = true,
+            .best_format = DXGI_FORMAT_BC1_UNORM,
+        };
+        check_dropped(require_expected(btu::tex::optimize(make_source(), steps, compression_dev)));
+    }
+}
+
+TEST_CASE("process_fused", "[src]")
+{
+    using btu::tex::FusedSteps;
+
+    const auto make_source = [](DXGI_FORMAT format) {
+        auto image = btu::tex::ScratchImage{};
+        REQUIRE(SUCCEEDED(image.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 256, 128, 1, 1)));
+        // Smooth, so that different filters give close results
+        for (size_t i = 0; i < image.GetPixelsSize(); ++i)
+            image.GetPixels()[i] = static_cast<uint8_t>(i / 4 % 256 / 2 + i % 4 * 32);
+
+        auto tex = Texture{};
+        tex.set(std::move(image));
+        if (format == DXGI_FORMAT_R8G8B8A8_UNORM)
+            return tex;
+        return require_expected(btu::tex::convert(std::move(tex), format, compression_dev));
+    };
+
+    SECTION("same result as each step in a row")
+    {
+        const auto steps = FusedSteps{
+            .resize                = Dimension{64, 32},
+            .add_transparent_alpha = true,
+            .mipmaps               = true,
+        };
+        for (const auto format : {DXGI_FORMAT_R8G8B8A8_UNORM, DXGI_FORMAT_BC3_UNORM, DXGI_FORMAT_BC7_UNORM})
+        {
+            REQUIRE(btu::tex::can_process_fused(make_source(format).get().GetMetadata(), steps));
+
+            auto fused = require_expected(
+                btu::tex::process_fused(make_source(format), steps, compression_dev));
+
+            const auto resize = [](Texture &&tex) { return btu::tex::resize(std::move(tex), {64, 32}); };
+            auto source       = make_source(format);
+            auto expected     = (DirectX::IsCompressed(format) ? btu::tex::decompress(std::move(source))
+                                                               : btu::tex::Result(std::move(source)))
+                                .and_then(resize)
+                                .and_then(btu::tex::make_transparent_alpha)
+                                .and_then(btu::tex::generate_mipmaps);
+            REQUIRE(expected.has_value());
+
+            CHECK(fused.get().GetMetadata().mipLevels == 7);
+            CHECK(fused.analysis().alpha_all_transparent());
+            CHECK(compute_mse(fused, *expected) <= 0.002F);
+        }
+    }
+    SECTION("unsupported")
+    {
+        const auto info = make_source(DXGI_FORMAT_R8G8B8A8_UNORM).get().GetMetadata();
+        CHECK_FALSE(btu::tex::can_process_fused(info, FusedSteps{.resize = Dimension{100, 50}}));
+
+        auto srgb   = info;
+        srgb.format = DXGI_FORMAT_R8G8B8A8_UNORM_SRGB;
+        CHECK_FALSE(btu::tex::can_process_fused(srgb, FusedSteps{.mipmaps = true}));
+
+        // Existing levels would be lost
+        auto mipped      = info;
+        mipped.mipLevels = 3;
+        CHECK_FALSE(btu::tex::can_process_fused(mipped, FusedSteps{}));
+        CHECK(btu::tex::can_process_fused(mipped, FusedSteps{.mipmaps = true}));
+    }
+    SECTION("stops when requested")
+    {
+        auto source = std::stop_source{};
+        source.request_stop();
+
+        const auto steps = FusedSteps{.resize = Dimension{128, 64}, .mipmaps = true};
+        const auto res   = btu::tex::process_fused(make_source(DXGI_FORMAT_BC7_UNORM),
+                                                 steps,
+                                                 compression_dev,
+                                                 source.get_token());
+        REQUIRE_FALSE(res.has_value());
+        CHECK(res.error() == std::errc::operation_canceled);
+    }
+}
+
+TEST_CASE("process_streamed", "[src]")
+{
+    using btu::tex::FusedSteps, btu::tex::StreamedSteps;
+
+    auto source = btu::tex::ScratchImage{};
+    REQUIRE(SUCCEEDED(source.Initialize2D(DXGI_FORMAT_R8G8B8A8_UNORM, 256, 128, 1, 1)));
+    for (size_t i = 0; i < source.GetPixelsSize(); ++i)
+        source.GetPixels()[i] = static_cast<uint8_t>(i / 4 % 256 / 2 + i % 4 * 32);
+
+    const auto &info = source.GetMetadata();
+    const auto top   = std::span(source.GetImage(0, 0, 0), 1);
+
+    const auto steps = StreamedSteps{
+        .fused   = FusedSteps{.resize = Dimension{128, 64}, .add_transparent_alpha = false, .mipmaps = true},
+        .format  = DXGI_FORMAT_BC7_UNORM,
+        .encoder = {},
+    };
+    REQUIRE(btu::tex::can_process_streamed(info, steps));
+
+    SECTION("same bytes as process_fused and convert")
+    {
+        for (const auto format : {DXGI_FORMAT_BC1_UNORM, DXGI_FORMAT_BC3_UNORM, DXGI_FORMAT_BC7_UNORM})
+        {
+            auto copy = btu::tex::ScratchImage{};
+            REQUIRE(SUCCEEDED(copy.InitializeFromImage(top.front())));
+            auto tex = Texture{};
+            tex.set(std::move(copy));
+
+            const auto encode = [&](Texture &&fused) {
+                return btu::tex::convert(std::move(fused), format, compression_dev);
+            };
+            auto expected = btu::tex::process_fused(std::move(tex), steps.fused, compression_dev)
+                                .and_then(encode);
+            REQUIRE(expected.has_value());
+
+            auto format_steps   = steps;
+            format_steps.format = format;
+
+            // Without a cap, then with bands of a few rows and fewer threads
+            for (const size_t cap : {std::numeric_limits<size_t>::max(), size_t{256 * 1024}})
+            {
+                INFO("format: " << format << ", cap: " << cap);
+                auto streamed = require_expected(
+                    btu::tex::process_streamed(info, top, format_steps, cap, compression_dev));
+                CHECK(streamed.get().GetMetadata() == expected->get().GetMetadata());
+                CHECK(pixel_bytes(streamed) == pixel_bytes(*expected));
+            }
+        }
+    }
+    SECTION("memory cap")
+    {
+        // Smaller than the output
+        const auto res = btu::tex::process_streamed(info, top, steps, 1024, compression_dev);
+        REQUIRE_FALSE(res.has_value());
+        CHECK(res.error() == std::errc::not_enough_memory);
+    }
+    SECTION("unsupported")
+    {
+        auto bc5   = steps;
+        bc5.format = DXGI_FORMAT_BC5_UNORM;
+        CHECK_FALSE(btu::tex::can_process_streamed(info, bc5));
+
+        auto not_resized         = steps;
+        not_resized.fused.resize = std::nullopt;
+        auto not_pow2            = info;
+        not_pow2.width           = 384;
+        CHECK(btu::tex::can_process_streamed(info, not_resized));
+        CHECK_FALSE(btu::tex::can_process_streamed(not_pow2, not_resized));
+    }
+}
+
 TEST_CASE("resize", "[src]")
 {
     test_expected_dir(u8"resize", [](auto &&tex) {
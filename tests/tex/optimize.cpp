@@ -6,6 +6,7 @@
 #include "./utils.hpp"
 
 #include <btu/tex/dxtex.hpp>
+#include <btu/tex/header.hpp>
 #include <btu/tex/optimize.hpp>
 #include <btu/tex/texture.hpp>
 
@@ -277,6 +278,154 @@ TEST_CASE("compute_optimization_steps", "[src]")
         CHECK(res.best_format == sets.output_format.compressed);
         CHECK_FALSE(res.convert);
     }
+    SECTION("encoder options are part of the steps")
+    {
+        auto tex     = generate_tex(r8g8b8a8_512_no_mips_meta);
+        auto sets    = compress_whitelist_mips_resize_sets;
+        sets.encoder = btu::tex::EncoderOptions{.profile    = btu::tex::EncoderProfile::SizeOptimized,
+                                                .rdo_lambda = 2.0F};
+
+        const auto res = compute_optimization_steps(tex, sets);
+        CHECK(res.encoder == sets.encoder);
+
+        const auto json = nlohmann::json(res);
+        CHECK(json["encoder"]["profile"] == "size_optimized");
+        CHECK(json.get<btu::tex::OptimizationSteps>().encoder == sets.encoder);
+        CHECK(nlohmann::json(sets).get<btu::tex::Settings>().encoder == sets.encoder);
+    }
+    SECTION("settings and steps saved without encoder options load with the default ones")
+    {
+        auto sets_json = nlohmann::json(compress_whitelist_mips_resize_sets);
+        sets_json.erase("encoder");
+        const auto sets = sets_json.get<btu::tex::Settings>();
+        CHECK(sets.encoder == btu::tex::EncoderOptions{});
+        CHECK(sets.game == compress_whitelist_mips_resize_sets.game);
+
+        auto steps_json = nlohmann::json(btu::tex::OptimizationSteps{.mipmaps = true});
+        steps_json.erase("encoder");
+        const auto steps = steps_json.get<btu::tex::OptimizationSteps>();
+        CHECK(steps == btu::tex::OptimizationSteps{.mipmaps = true});
+    }
+}
+
+TEST_CASE("probe", "[src]")
+{
+    // Same steps as from the decoded texture, but the pixels are only decoded when needed
+    const auto check = [](btu::tex::Texture &&tex, const btu::tex::Settings &sets, bool needs_pixels) {
+        const auto expected = compute_optimization_steps(tex, sets);
+        auto data           = require_expected(btu::tex::save(tex));
+
+        const auto res = btu::tex::probe(tex.get_load_path(), data, sets);
+        REQUIRE(res.has_value());
+        CHECK(res->steps == expected);
+        CHECK(res->texture.has_value() == needs_pixels);
+        if (res->texture)
+            CHECK(*res->texture == tex);
+        return res->unchanged();
+    };
+
+    SECTION("format without alpha")
+    {
+        CHECK(check(generate_tex(bc5_512_no_mips_meta), no_explicit_sets, false));
+        CHECK_FALSE(check(generate_tex(bc5_512_no_mips_meta), compress_whitelist_mips_resize_sets, false));
+    }
+    SECTION("format with alpha")
+    {
+        // The same format with or without alpha, as for SSE: the alpha channel does not matter
+        auto single_format                                   = no_explicit_sets;
+        single_format.output_format.compressed_without_alpha = DXGI_FORMAT_BC7_UNORM;
+        CHECK(check(generate_tex(bc7_512_no_mips_meta), single_format, false));
+
+        // BC5 without alpha: whether the alpha channel is opaque decides the format
+        CHECK(check(generate_tex(bc7_512_no_mips_meta), no_explicit_sets, true));
+        CHECK_FALSE(check(generate_opaque_tex(r8g8b8a8_512_no_mips_meta), no_explicit_sets, true));
+    }
+    SECTION("landscape texture")
+    {
+        CHECK_FALSE(check(generate_landscape_tex(r8g8b8a8_512_no_mips_meta), landscape_sets, true));
+    }
+    SECTION("not a texture")
+    {
+        auto data = std::vector<std::byte>(btu::tex::k_max_header_size);
+        CHECK_FALSE(btu::tex::probe(u8"textures/a.dds", data, no_explicit_sets).has_value());
+    }
+}
+
+TEST_CASE("optimize_streamed", "[src]")
+{
+    // Its own device, so that the cap does not apply to the other tests
+    auto dev = btu::tex::CompressionDevice{};
+    dev.set_memory_cap(4ULL * 1024 * 1024);
+
+    auto tex = generate_tex(r8g8b8a8_512_no_mips_meta);
+    tex.set_load_path(u8"textures/file.dds");
+    auto data = require_expected(btu::tex::save(tex));
+
+    const auto &sets = compress_whitelist_mips_resize_sets;
+    SECTION("same bytes as optimize")
+    {
+        const auto probed = require_expected(btu::tex::probe(tex.get_load_path(), data, sets));
+
+        for (const auto format : {DXGI_FORMAT_BC1_UNORM, DXGI_FORMAT_BC3_UNORM, DXGI_FORMAT_BC7_UNORM})
+        {
+            auto steps        = probed.steps;
+            steps.best_format = format;
+            REQUIRE(btu::tex::can_optimize_streamed(probed.header, steps));
+
+            auto source   = require_expected(btu::tex::load(tex.get_load_path(), data));
+            auto expected = require_expected(optimize(std::move(source), steps, compression_dev));
+
+            // Without a cap, then with a cap splitting the texture in bands
+            for (const size_t cap : {size_t{0}, size_t{1024 * 1024}})
+            {
+                INFO("format: " << format << ", cap: " << cap);
+                dev.set_memory_cap(cap);
+                auto streamed = require_expected(
+                    btu::tex::optimize_streamed(tex.get_load_path(), data, steps, dev));
+
+                CHECK(streamed.get().GetMetadata() == expected.get().GetMetadata());
+                CHECK(streamed.get_load_path() == expected.get_load_path());
+                CHECK(pixel_bytes(streamed) == pixel_bytes(expected));
+            }
+        }
+    }
+    SECTION("optimize_probed streams only with a memory cap")
+    {
+        const auto make_probe = [&] {
+            auto probed = require_expected(btu::tex::probe(tex.get_load_path(), data, sets));
+            // As when no step needs the pixels, which are then streamed
+            probed.texture = std::nullopt;
+            return probed;
+        };
+        const auto steps = make_probe().steps;
+        auto expected    = require_expected(optimize(std::move(tex), steps, compression_dev));
+        const auto path  = expected.get_load_path();
+
+        auto streamed = require_expected(btu::tex::optimize_probed(path, data, make_probe(), dev));
+        CHECK(pixel_bytes(streamed) == pixel_bytes(expected));
+
+        // Too small to stream, but without a cap the texture is decoded at once
+        dev.set_memory_cap(1024);
+        CHECK_FALSE(btu::tex::optimize_probed(path, data, make_probe(), dev).has_value());
+        dev.set_memory_cap(0);
+        auto decoded = require_expected(btu::tex::optimize_probed(path, data, make_probe(), dev));
+        CHECK(pixel_bytes(decoded) == pixel_bytes(expected));
+    }
+    SECTION("memory cap")
+    {
+        const auto probed = require_expected(btu::tex::probe(tex.get_load_path(), data, sets));
+
+        dev.set_memory_cap(1024);
+        const auto res = btu::tex::optimize_streamed(tex.get_load_path(), data, probed.steps, dev);
+        REQUIRE_FALSE(res.has_value());
+        CHECK(res.error() == std::errc::not_enough_memory);
+    }
+    SECTION("not encoded")
+    {
+        const auto probed = require_expected(btu::tex::probe(tex.get_load_path(), data, resize_sets));
+        CHECK_FALSE(btu::tex::can_optimize_streamed(probed.header, probed.steps));
+        CHECK_FALSE(btu::tex::optimize_streamed(tex.get_load_path(), data, probed.steps, dev).has_value());
+    }
 }
 
 TEST_CASE("tex_optimize", "[src]")
@@ -459,6 +608,17 @@ TEST_CASE("tex_optimize", "[src]")
         CHECK_FALSE(res.has_value());
         CHECK(res.error() == btu::tex::TextureErr::BadInput);
     }
+    SECTION("stops when requested")
+    {
+        auto tex   = generate_opaque_tex(r8g8b8a8_512_no_mips_meta);
+        auto steps = compute_optimization_steps(tex, compress_whitelist_mips_resize_sets);
+
+        auto source = std::stop_source{};
+        source.request_stop();
+        const auto res = optimize(std::move(tex), steps, compression_dev, source.get_token());
+        CHECK_FALSE(res.has_value());
+        CHECK(res.error() == std::errc::operation_canceled);
+    }
     SECTION("expected_dir")
     {
         auto sets = compress_whitelist_mips_resize_sets;
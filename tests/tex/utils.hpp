@@ -64,6 +64,13 @@ inline auto compute_mse(const btu::tex::Texture &lhs, const btu::tex::Texture &r
     return total_mse;
 }
 
+/// \return The pixels of every image of `tex`, for exact comparisons
+inline auto pixel_bytes(const btu::tex::Texture &tex) -> std::vector<uint8_t>
+{
+    const auto &image = tex.get();
+    return {image.GetPixels(), image.GetPixels() + image.GetPixelsSize()};
+}
+
 enum class Approve
 {
     Yes,